@@ -46,6 +46,7 @@ LOCAL_SRC_FILES := \
 	$(MY_ROOT)/fitz/obj_print.c \
 	$(MY_ROOT)/fitz/res_colorspace.c \
 	$(MY_ROOT)/fitz/res_font.c \
+	$(MY_ROOT)/fitz/res_image.c \
 	$(MY_ROOT)/fitz/res_path.c \
 	$(MY_ROOT)/fitz/res_pixmap.c \
 	$(MY_ROOT)/fitz/res_shade.c \
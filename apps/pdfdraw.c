@@ -59,6 +59,9 @@ static void usage(void)
 		"\t-A\tdisable accelerated functions\n"
 		"\t-a\tsave alpha channel (only pam and png)\n"
 		"\t-b -\tnumber of bits of antialiasing (0 to 8)\n"
+		"\t-P -\tglyph subpixel positions, horizontal x vertical (default: 5x5)\n"
+		"\t-S -\tsnap glyph matrices to multiples of this many pixels\n"
+		"\t-T -\tnumber of threads for scaling images (needs threads=yes)\n"
 		"\t-g\trender in grayscale\n"
 		"\t-m\tshow timing information\n"
 		"\t-t\tshow text (-tt for xml)\n"
@@ -431,12 +434,15 @@ int main(int argc, char **argv)
 	char *password = "";
 	int grayscale = 0;
 	int accelerate = 1;
+	int hsubpix = 5, vsubpix = 5;
+	float glyphsnap = 0;
+	int scalethreads = 1;
 	pdf_xref *xref;
 	fz_error error;
 	int c;
 	fz_context *ctx;
 
-	while ((c = fz_getopt(argc, argv, "lo:p:r:R:Aab:dgmtx5G:I")) != -1)
+	while ((c = fz_getopt(argc, argv, "lo:p:r:R:Aab:P:S:T:dgmtx5G:I")) != -1)
 	{
 		switch (c)
 		{
@@ -447,6 +453,9 @@ int main(int argc, char **argv)
 		case 'A': accelerate = 0; break;
 		case 'a': savealpha = 1; break;
 		case 'b': alphabits = atoi(fz_optarg); break;
+		case 'P': sscanf(fz_optarg, "%dx%d", &hsubpix, &vsubpix); break;
+		case 'S': glyphsnap = atof(fz_optarg); break;
+		case 'T': scalethreads = atoi(fz_optarg); break;
 		case 'l': showoutline++; break;
 		case 'm': showtime++; break;
 		case 't': showtext++; break;
@@ -477,6 +486,9 @@ int main(int argc, char **argv)
 	}
 
 	fz_set_aa_level(ctx, alphabits);
+	fz_set_glyph_subpixels(ctx, hsubpix, vsubpix);
+	fz_set_glyph_snap(ctx, glyphsnap);
+	fz_set_scale_threads(ctx, scalethreads);
 
 	if (accelerate)
 		fz_accelerate();
@@ -541,6 +553,7 @@ int main(int argc, char **argv)
 			timing.total, timing.count, timing.total / timing.count);
 		printf("fastest page %d: %dms\n", timing.minpage, timing.min);
 		printf("slowest page %d: %dms\n", timing.maxpage, timing.max);
+		fz_debug_glyph_cache(glyphcache);
 	}
 
 	fz_free_glyph_cache(ctx, glyphcache);
@@ -40,6 +40,7 @@ static int isfontdesc(fz_obj *obj)
 static void saveimage(int num)
 {
 	fz_error error;
+	fz_image *image;
 	fz_pixmap *img;
 	fz_obj *ref;
 	char name[1024];
@@ -48,10 +49,15 @@ static void saveimage(int num)
 
 	/* TODO: detect DCTD and save as jpeg */
 
-	error = pdf_load_image(&img, xref, ref);
+	error = pdf_load_image(&image, xref, ref);
 	if (error)
 		die(error);
 
+	img = fz_image_to_pixmap(ctx, image, 0, 0);
+	fz_drop_image(ctx, image);
+	if (!img)
+		die(fz_error_make(ctx, "cannot decode image"));
+
 	if (dorgb && img->colorspace && img->colorspace != fz_device_rgb)
 	{
 		fz_pixmap *temp;
@@ -608,9 +608,6 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 	int dolerp;
 	void (*paintfn)(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color, byte *hp);
 
-	/* grid fit the image */
-	fz_gridfit_matrix(&ctm);
-
 	/* turn on interpolation for upscaled and non-rectilinear transforms */
 	dolerp = 0;
 	if (!fz_is_rectilinear(ctm))
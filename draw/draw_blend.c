@@ -42,6 +42,11 @@ char *fz_blendmode_name(int blendmode)
 
 /* Separable blend modes */
 
+static inline int fz_normal_byte(int b, int s)
+{
+	return s;
+}
+
 static inline int fz_screen_byte(int b, int s)
 {
 	return b + s - fz_mul255(b, s);
@@ -267,109 +272,437 @@ fz_blend_pixel(int dp[3], int bp[3], int sp[3], int blendmode)
 
 /* Blending loops */
 
-void
-fz_blend_separable(byte * restrict bp, byte * restrict sp, int n, int w, int blendmode)
+/* The loops are expanded once per blend mode so that the blend function
+ * is inlined and no per-pixel dispatch is done. */
+
+typedef void (fz_blend_separable_fn)(byte * restrict bp, byte * restrict sp, int n, int w);
+typedef void (fz_blend_separable_nonisolated_fn)(byte * restrict bp, byte * restrict sp, int n, int w, byte * restrict hp, int alpha);
+typedef void (fz_blend_nonseparable_fn)(byte * restrict bp, byte * restrict sp, int w);
+typedef void (fz_blend_nonseparable_nonisolated_fn)(byte * restrict bp, byte * restrict sp, int w, byte * restrict hp, int alpha);
+
+#define BLEND_SEPARABLE(NAME, BLEND) \
+static void \
+NAME(byte * restrict bp, byte * restrict sp, int n, int w) \
+{ \
+	int k; \
+	int n1 = n - 1; \
+	while (w--) \
+	{ \
+		int sa = sp[n1]; \
+		int ba = bp[n1]; \
+		int saba = fz_mul255(sa, ba); \
+ \
+		/* ugh, division to get non-premul components */ \
+		int invsa = sa ? 255 * 256 / sa : 0; \
+		int invba = ba ? 255 * 256 / ba : 0; \
+ \
+		for (k = 0; k < n1; k++) \
+		{ \
+			int sc = (sp[k] * invsa) >> 8; \
+			int bc = (bp[k] * invba) >> 8; \
+			int rc = BLEND(bc, sc); \
+ \
+			bp[k] = fz_mul255(255 - sa, bp[k]) + fz_mul255(255 - ba, sp[k]) + fz_mul255(saba, rc); \
+		} \
+ \
+		bp[k] = ba + sa - saba; \
+ \
+		sp += n; \
+		bp += n; \
+	} \
+}
+
+#define BLEND_SEPARABLE_NONISOLATED(NAME, BLEND) \
+static void \
+NAME(byte * restrict bp, byte * restrict sp, int n, int w, byte * restrict hp, int alpha) \
+{ \
+	int k; \
+	int n1 = n - 1; \
+	while (w--) \
+	{ \
+		int ha = *hp++; \
+		int haa = fz_mul255(ha, alpha); /* ha = shape_alpha */ \
+		/* If haa == 0 then leave everything unchanged */ \
+		if (haa != 0) \
+		{ \
+			int sa = sp[n1]; \
+			int ba = bp[n1]; \
+			int baha = fz_mul255(ba, haa); \
+ \
+			/* ugh, division to get non-premul components */ \
+			int invsa = sa ? 255 * 256 / sa : 0; \
+			int invba = ba ? 255 * 256 / ba : 0; \
+ \
+			/* Calculate result_alpha */ \
+			int ra = bp[n1] = ba - baha + haa; \
+ \
+			/* Because we are a non-isolated group, we need to \
+			 * 'uncomposite' before we blend (recomposite). \
+			 * We assume that normal blending has been done inside \
+			 * the group, so:   ra.rc = (1-ha).bc + ha.sc \
+			 * A bit of rearrangement, and that gives us that: \
+			 *  sc = (ra.rc - bc)/ha + bc \
+			 * Now, the result of the blend was stored in src, so: \
+			 */ \
+			int invha = ha ? 255 * 256 / ha : 0; \
+ \
+			if (ra != 0) for (k = 0; k < n1; k++) \
+			{ \
+				int sc = (sp[k] * invsa) >> 8; \
+				int bc = (bp[k] * invba) >> 8; \
+				int rc; \
+ \
+				/* Uncomposite */ \
+				sc = (((sc-bc)*invha)>>8) + bc; \
+				if (sc < 0) sc = 0; \
+				if (sc > 255) sc = 255; \
+ \
+				rc = BLEND(bc, sc); \
+				rc = fz_mul255(255 - haa, bc) + fz_mul255(fz_mul255(255 - ba, sc), haa) + fz_mul255(baha, rc); \
+				if (rc < 0) rc = 0; \
+				if (rc > 255) rc = 255; \
+				bp[k] = fz_mul255(rc, ra); \
+			} \
+		} \
+ \
+		sp += n; \
+		bp += n; \
+	} \
+}
+
+#define BLEND_NONSEPARABLE(NAME, BLEND) \
+static void \
+NAME(byte * restrict bp, byte * restrict sp, int w) \
+{ \
+	while (w--) \
+	{ \
+		int rr, rg, rb; \
+ \
+		int sa = sp[3]; \
+		int ba = bp[3]; \
+		int saba = fz_mul255(sa, ba); \
+ \
+		/* ugh, division to get non-premul components */ \
+		int invsa = sa ? 255 * 256 / sa : 0; \
+		int invba = ba ? 255 * 256 / ba : 0; \
+ \
+		int sr = (sp[0] * invsa) >> 8; \
+		int sg = (sp[1] * invsa) >> 8; \
+		int sb = (sp[2] * invsa) >> 8; \
+ \
+		int br = (bp[0] * invba) >> 8; \
+		int bg = (bp[1] * invba) >> 8; \
+		int bb = (bp[2] * invba) >> 8; \
+ \
+		BLEND(&rr, &rg, &rb, br, bg, bb, sr, sg, sb); \
+ \
+		bp[0] = fz_mul255(255 - sa, bp[0]) + fz_mul255(255 - ba, sp[0]) + fz_mul255(saba, rr); \
+		bp[1] = fz_mul255(255 - sa, bp[1]) + fz_mul255(255 - ba, sp[1]) + fz_mul255(saba, rg); \
+		bp[2] = fz_mul255(255 - sa, bp[2]) + fz_mul255(255 - ba, sp[2]) + fz_mul255(saba, rb); \
+		bp[3] = ba + sa - saba; \
+ \
+		sp += 4; \
+		bp += 4; \
+	} \
+}
+
+#define BLEND_NONSEPARABLE_NONISOLATED(NAME, BLEND) \
+static void \
+NAME(byte * restrict bp, byte * restrict sp, int w, byte * restrict hp, int alpha) \
+{ \
+	while (w--) \
+	{ \
+		int ha = *hp++; \
+		int haa = fz_mul255(ha, alpha); \
+		if (haa != 0) \
+		{ \
+			int sa = sp[3]; \
+			int ba = bp[3]; \
+			int baha = fz_mul255(ba, haa); \
+ \
+			/* Calculate result_alpha */ \
+			int ra = bp[3] = ba - baha + haa; \
+			if (ra != 0) \
+			{ \
+				/* Because we are a non-isolated group, we \
+				 * need to 'uncomposite' before we blend \
+				 * (recomposite). We assume that normal \
+				 * blending has been done inside the group, \
+				 * so:     ra.rc = (1-ha).bc + ha.sc \
+				 * A bit of rearrangement, and that gives us \
+				 * that:   sc = (ra.rc - bc)/ha + bc \
+				 * Now, the result of the blend was stored in \
+				 * src, so: */ \
+				int invha = ha ? 255 * 256 / ha : 0; \
+ \
+				int rr, rg, rb; \
+ \
+				/* ugh, division to get non-premul components */ \
+				int invsa = sa ? 255 * 256 / sa : 0; \
+				int invba = ba ? 255 * 256 / ba : 0; \
+ \
+				int sr = (sp[0] * invsa) >> 8; \
+				int sg = (sp[1] * invsa) >> 8; \
+				int sb = (sp[2] * invsa) >> 8; \
+ \
+				int br = (bp[0] * invba) >> 8; \
+				int bg = (bp[1] * invba) >> 8; \
+				int bb = (bp[2] * invba) >> 8; \
+ \
+				/* Uncomposite */ \
+				sr = (((sr-br)*invha)>>8) + br; \
+				sg = (((sg-bg)*invha)>>8) + bg; \
+				sb = (((sb-bb)*invha)>>8) + bb; \
+ \
+				BLEND(&rr, &rg, &rb, br, bg, bb, sr, sg, sb); \
+ \
+				rr = fz_mul255(255 - haa, bp[0]) + fz_mul255(fz_mul255(255 - ba, sr), haa) + fz_mul255(baha, rr); \
+				rg = fz_mul255(255 - haa, bp[1]) + fz_mul255(fz_mul255(255 - ba, sg), haa) + fz_mul255(baha, rg); \
+				rb = fz_mul255(255 - haa, bp[2]) + fz_mul255(fz_mul255(255 - ba, sb), haa) + fz_mul255(baha, rb); \
+				bp[0] = fz_mul255(ra, rr); \
+				bp[1] = fz_mul255(ra, rg); \
+				bp[2] = fz_mul255(ra, rb); \
+			} \
+		} \
+ \
+		sp += 4; \
+		bp += 4; \
+	} \
+}
+
+BLEND_SEPARABLE(fz_blend_normal, fz_normal_byte)
+BLEND_SEPARABLE(fz_blend_multiply, fz_mul255)
+BLEND_SEPARABLE(fz_blend_screen, fz_screen_byte)
+BLEND_SEPARABLE(fz_blend_overlay, fz_overlay_byte)
+BLEND_SEPARABLE(fz_blend_darken, fz_darken_byte)
+BLEND_SEPARABLE(fz_blend_lighten, fz_lighten_byte)
+BLEND_SEPARABLE(fz_blend_color_dodge, fz_color_dodge_byte)
+BLEND_SEPARABLE(fz_blend_color_burn, fz_color_burn_byte)
+BLEND_SEPARABLE(fz_blend_hard_light, fz_hard_light_byte)
+BLEND_SEPARABLE(fz_blend_soft_light, fz_soft_light_byte)
+BLEND_SEPARABLE(fz_blend_difference, fz_difference_byte)
+BLEND_SEPARABLE(fz_blend_exclusion, fz_exclusion_byte)
+
+BLEND_SEPARABLE_NONISOLATED(fz_blend_normal_nonisolated, fz_normal_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_multiply_nonisolated, fz_mul255)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_screen_nonisolated, fz_screen_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_overlay_nonisolated, fz_overlay_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_darken_nonisolated, fz_darken_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_lighten_nonisolated, fz_lighten_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_color_dodge_nonisolated, fz_color_dodge_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_color_burn_nonisolated, fz_color_burn_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_hard_light_nonisolated, fz_hard_light_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_soft_light_nonisolated, fz_soft_light_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_difference_nonisolated, fz_difference_byte)
+BLEND_SEPARABLE_NONISOLATED(fz_blend_exclusion_nonisolated, fz_exclusion_byte)
+
+BLEND_NONSEPARABLE(fz_blend_hue, fz_hue_rgb)
+BLEND_NONSEPARABLE(fz_blend_saturation, fz_saturation_rgb)
+BLEND_NONSEPARABLE(fz_blend_color, fz_color_rgb)
+BLEND_NONSEPARABLE(fz_blend_luminosity, fz_luminosity_rgb)
+
+BLEND_NONSEPARABLE_NONISOLATED(fz_blend_hue_nonisolated, fz_hue_rgb)
+BLEND_NONSEPARABLE_NONISOLATED(fz_blend_saturation_nonisolated, fz_saturation_rgb)
+BLEND_NONSEPARABLE_NONISOLATED(fz_blend_color_nonisolated, fz_color_rgb)
+BLEND_NONSEPARABLE_NONISOLATED(fz_blend_luminosity_nonisolated, fz_luminosity_rgb)
+
+/* Indexed by blend mode. Non-separable modes fall back to normal for
+ * pixmaps that are not RGB. */
+
+static fz_blend_separable_fn *fz_blend_separable_table[] =
 {
-	int k;
-	int n1 = n - 1;
-	while (w--)
-	{
-		int sa = sp[n1];
-		int ba = bp[n1];
-		int saba = fz_mul255(sa, ba);
+	fz_blend_normal,
+	fz_blend_multiply,
+	fz_blend_screen,
+	fz_blend_overlay,
+	fz_blend_darken,
+	fz_blend_lighten,
+	fz_blend_color_dodge,
+	fz_blend_color_burn,
+	fz_blend_hard_light,
+	fz_blend_soft_light,
+	fz_blend_difference,
+	fz_blend_exclusion,
+	fz_blend_normal,
+	fz_blend_normal,
+	fz_blend_normal,
+	fz_blend_normal,
+};
 
-		/* ugh, division to get non-premul components */
-		int invsa = sa ? 255 * 256 / sa : 0;
-		int invba = ba ? 255 * 256 / ba : 0;
+static fz_blend_separable_nonisolated_fn *fz_blend_separable_nonisolated_table[] =
+{
+	fz_blend_normal_nonisolated,
+	fz_blend_multiply_nonisolated,
+	fz_blend_screen_nonisolated,
+	fz_blend_overlay_nonisolated,
+	fz_blend_darken_nonisolated,
+	fz_blend_lighten_nonisolated,
+	fz_blend_color_dodge_nonisolated,
+	fz_blend_color_burn_nonisolated,
+	fz_blend_hard_light_nonisolated,
+	fz_blend_soft_light_nonisolated,
+	fz_blend_difference_nonisolated,
+	fz_blend_exclusion_nonisolated,
+	fz_blend_normal_nonisolated,
+	fz_blend_normal_nonisolated,
+	fz_blend_normal_nonisolated,
+	fz_blend_normal_nonisolated,
+};
 
-		for (k = 0; k < n1; k++)
-		{
-			int sc = (sp[k] * invsa) >> 8;
-			int bc = (bp[k] * invba) >> 8;
-			int rc;
+static fz_blend_nonseparable_fn *fz_blend_nonseparable_table[] =
+{
+	fz_blend_hue,
+	fz_blend_saturation,
+	fz_blend_color,
+	fz_blend_luminosity,
+};
 
-			switch (blendmode)
-			{
-			default:
-			case FZ_BLEND_NORMAL: rc = sc; break;
-			case FZ_BLEND_MULTIPLY: rc = fz_mul255(bc, sc); break;
-			case FZ_BLEND_SCREEN: rc = fz_screen_byte(bc, sc); break;
-			case FZ_BLEND_OVERLAY: rc = fz_overlay_byte(bc, sc); break;
-			case FZ_BLEND_DARKEN: rc = fz_darken_byte(bc, sc); break;
-			case FZ_BLEND_LIGHTEN: rc = fz_lighten_byte(bc, sc); break;
-			case FZ_BLEND_COLOR_DODGE: rc = fz_color_dodge_byte(bc, sc); break;
-			case FZ_BLEND_COLOR_BURN: rc = fz_color_burn_byte(bc, sc); break;
-			case FZ_BLEND_HARD_LIGHT: rc = fz_hard_light_byte(bc, sc); break;
-			case FZ_BLEND_SOFT_LIGHT: rc = fz_soft_light_byte(bc, sc); break;
-			case FZ_BLEND_DIFFERENCE: rc = fz_difference_byte(bc, sc); break;
-			case FZ_BLEND_EXCLUSION: rc = fz_exclusion_byte(bc, sc); break;
-			}
+static fz_blend_nonseparable_nonisolated_fn *fz_blend_nonseparable_nonisolated_table[] =
+{
+	fz_blend_hue_nonisolated,
+	fz_blend_saturation_nonisolated,
+	fz_blend_color_nonisolated,
+	fz_blend_luminosity_nonisolated,
+};
 
-			bp[k] = fz_mul255(255 - sa, bp[k]) + fz_mul255(255 - ba, sp[k]) + fz_mul255(saba, rc);
-		}
+/* always surround cpu specific code with HAVE_XXX */
+#ifdef HAVE_SSE2
 
-		bp[k] = ba + sa - saba;
+#include <emmintrin.h>
 
-		sp += n;
-		bp += n;
-	}
-}
+/* SSE2 versions of the most common separable modes for RGBA. Two pixels
+ * are blended at a time in 16 bit lanes; the results are bit for bit
+ * identical to the C loops above. Pixels whose colour exceeds their
+ * alpha cannot be unpremultiplied into 8 bits and take the C path. */
 
-void
-fz_blend_nonseparable(byte * restrict bp, byte * restrict sp, int w, int blendmode)
+static inline __m128i
+fz_mul255_sse2(__m128i a, __m128i b)
 {
-	while (w--)
-	{
-		int rr, rg, rb;
+	__m128i x = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+	x = _mm_add_epi16(x, _mm_srli_epi16(x, 8));
+	return _mm_srli_epi16(x, 8);
+}
 
-		int sa = sp[3];
-		int ba = bp[3];
-		int saba = fz_mul255(sa, ba);
+static inline __m128i
+fz_screen_sse2(__m128i b, __m128i s)
+{
+	return _mm_sub_epi16(_mm_add_epi16(b, s), fz_mul255_sse2(b, s));
+}
 
-		/* ugh, division to get non-premul components */
-		int invsa = sa ? 255 * 256 / sa : 0;
-		int invba = ba ? 255 * 256 / ba : 0;
+static inline __m128i
+fz_overlay_sse2(__m128i b, __m128i s)
+{
+	/* hard light with swapped arguments */
+	__m128i b2 = _mm_slli_epi16(b, 1);
+	__m128i lo = fz_mul255_sse2(s, b2);
+	__m128i hi = fz_screen_sse2(s, _mm_sub_epi16(b2, _mm_set1_epi16(255)));
+	__m128i m = _mm_cmpgt_epi16(b, _mm_set1_epi16(127));
+	return _mm_or_si128(_mm_and_si128(m, hi), _mm_andnot_si128(m, lo));
+}
 
-		int sr = (sp[0] * invsa) >> 8;
-		int sg = (sp[1] * invsa) >> 8;
-		int sb = (sp[2] * invsa) >> 8;
+#define fz_multiply_sse2 fz_mul255_sse2
+#define fz_darken_sse2 _mm_min_epi16
+#define fz_lighten_sse2 _mm_max_epi16
+
+#define BLEND_SEPARABLE_SSE2(NAME, BLEND, FALLBACK) \
+static void \
+NAME(byte * restrict bp, byte * restrict sp, int n, int w) \
+{ \
+	const __m128i zero = _mm_setzero_si128(); \
+	const __m128i c255 = _mm_set1_epi16(255); \
+	const __m128i amask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0); \
+ \
+	for (; w >= 2; w -= 2, sp += 8, bp += 8) \
+	{ \
+		__m128i s, b, sc, bc, sa, ba, saba, rc, r; \
+		int sa0 = sp[3], sa1 = sp[7]; \
+		int ba0 = bp[3], ba1 = bp[7]; \
+		int invsa0 = sa0 ? 255 * 256 / sa0 : 0; \
+		int invsa1 = sa1 ? 255 * 256 / sa1 : 0; \
+		int invba0 = ba0 ? 255 * 256 / ba0 : 0; \
+		int invba1 = ba1 ? 255 * 256 / ba1 : 0; \
+ \
+		s = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)sp), zero); \
+		b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)bp), zero); \
+ \
+		/* (c * inv) >> 8 == ((c << 8) * inv) >> 16 */ \
+		sc = _mm_mulhi_epu16(_mm_slli_epi16(s, 8), \
+			_mm_set_epi16(invsa1, invsa1, invsa1, invsa1, invsa0, invsa0, invsa0, invsa0)); \
+		bc = _mm_mulhi_epu16(_mm_slli_epi16(b, 8), \
+			_mm_set_epi16(invba1, invba1, invba1, invba1, invba0, invba0, invba0, invba0)); \
+ \
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_srli_epi16(_mm_or_si128(sc, bc), 8), zero)) != 0xffff) \
+		{ \
+			FALLBACK(bp, sp, 4, 2); \
+			continue; \
+		} \
+ \
+		rc = BLEND(bc, sc); \
+ \
+		sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff); \
+		ba = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, 0xff), 0xff); \
+		saba = fz_mul255_sse2(sa, ba); \
+ \
+		r = _mm_add_epi16(fz_mul255_sse2(_mm_sub_epi16(c255, sa), b), \
+			_mm_add_epi16(fz_mul255_sse2(_mm_sub_epi16(c255, ba), s), \
+				fz_mul255_sse2(saba, rc))); \
+		r = _mm_or_si128(_mm_andnot_si128(amask, r), \
+			_mm_and_si128(amask, _mm_sub_epi16(_mm_add_epi16(ba, sa), saba))); \
+ \
+		/* truncate to bytes like the C version */ \
+		r = _mm_and_si128(r, c255); \
+		_mm_storel_epi64((__m128i *)bp, _mm_packus_epi16(r, r)); \
+	} \
+ \
+	if (w > 0) \
+		FALLBACK(bp, sp, 4, w); \
+}
 
-		int br = (bp[0] * invba) >> 8;
-		int bg = (bp[1] * invba) >> 8;
-		int bb = (bp[2] * invba) >> 8;
+BLEND_SEPARABLE_SSE2(fz_blend_multiply_sse2, fz_multiply_sse2, fz_blend_multiply)
+BLEND_SEPARABLE_SSE2(fz_blend_screen_sse2, fz_screen_sse2, fz_blend_screen)
+BLEND_SEPARABLE_SSE2(fz_blend_overlay_sse2, fz_overlay_sse2, fz_blend_overlay)
+BLEND_SEPARABLE_SSE2(fz_blend_darken_sse2, fz_darken_sse2, fz_blend_darken)
+BLEND_SEPARABLE_SSE2(fz_blend_lighten_sse2, fz_lighten_sse2, fz_blend_lighten)
 
-		switch (blendmode)
-		{
-		default:
-		case FZ_BLEND_HUE:
-			fz_hue_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-			break;
-		case FZ_BLEND_SATURATION:
-			fz_saturation_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-			break;
-		case FZ_BLEND_COLOR:
-			fz_color_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-			break;
-		case FZ_BLEND_LUMINOSITY:
-			fz_luminosity_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-			break;
-		}
+static fz_blend_separable_fn *fz_blend_separable_rgb_sse2_table[] =
+{
+	NULL,
+	fz_blend_multiply_sse2,
+	fz_blend_screen_sse2,
+	fz_blend_overlay_sse2,
+	fz_blend_darken_sse2,
+	fz_blend_lighten_sse2,
+};
 
-		bp[0] = fz_mul255(255 - sa, bp[0]) + fz_mul255(255 - ba, sp[0]) + fz_mul255(saba, rr);
-		bp[1] = fz_mul255(255 - sa, bp[1]) + fz_mul255(255 - ba, sp[1]) + fz_mul255(saba, rg);
-		bp[2] = fz_mul255(255 - sa, bp[2]) + fz_mul255(255 - ba, sp[2]) + fz_mul255(saba, rb);
-		bp[3] = ba + sa - saba;
+#endif
 
-		sp += 4;
-		bp += 4;
+void
+fz_blend_separable(byte * restrict bp, byte * restrict sp, int n, int w, int blendmode)
+{
+	if (blendmode < 0 || blendmode >= nelem(fz_blend_separable_table))
+		blendmode = FZ_BLEND_NORMAL;
+#ifdef HAVE_SSE2
+	if (n == 4 && blendmode < nelem(fz_blend_separable_rgb_sse2_table) && fz_blend_separable_rgb_sse2_table[blendmode])
+	{
+		fz_blend_separable_rgb_sse2_table[blendmode](bp, sp, n, w);
+		return;
 	}
+#endif
+	fz_blend_separable_table[blendmode](bp, sp, n, w);
+}
+
+void
+fz_blend_nonseparable(byte * restrict bp, byte * restrict sp, int w, int blendmode)
+{
+	if (blendmode < FZ_BLEND_HUE || blendmode > FZ_BLEND_LUMINOSITY)
+		blendmode = FZ_BLEND_HUE;
+	fz_blend_nonseparable_table[blendmode - FZ_BLEND_HUE](bp, sp, w);
 }
 
 static void
 fz_blend_separable_nonisolated(byte * restrict bp, byte * restrict sp, int n, int w, int blendmode, byte * restrict hp, int alpha)
 {
 	int k;
-	int n1 = n - 1;
 
 	if (alpha == 255 && blendmode == 0)
 	{
@@ -394,149 +727,18 @@ fz_blend_separable_nonisolated(byte * restrict bp, byte * restrict sp, int n, in
 		}
 		return;
 	}
-	while (w--)
-	{
-		int ha = *hp++;
-		int haa = fz_mul255(ha, alpha); /* ha = shape_alpha */
-		/* If haa == 0 then leave everything unchanged */
-		if (haa != 0)
-		{
-			int sa = sp[n1];
-			int ba = bp[n1];
-			int baha = fz_mul255(ba, haa);
-
-			/* ugh, division to get non-premul components */
-			int invsa = sa ? 255 * 256 / sa : 0;
-			int invba = ba ? 255 * 256 / ba : 0;
-
-			/* Calculate result_alpha */
-			int ra = bp[n1] = ba - baha + haa;
-
-			/* Because we are a non-isolated group, we need to
-			 * 'uncomposite' before we blend (recomposite).
-			 * We assume that normal blending has been done inside
-			 * the group, so:   ra.rc = (1-ha).bc + ha.sc
-			 * A bit of rearrangement, and that gives us that:
-			 *  sc = (ra.rc - bc)/ha + bc
-			 * Now, the result of the blend was stored in src, so:
-			 */
-			int invha = ha ? 255 * 256 / ha : 0;
-
-			if (ra != 0) for (k = 0; k < n1; k++)
-			{
-				int sc = (sp[k] * invsa) >> 8;
-				int bc = (bp[k] * invba) >> 8;
-				int rc;
 
-				/* Uncomposite */
-				sc = (((sc-bc)*invha)>>8) + bc;
-				if (sc < 0) sc = 0;
-				if (sc > 255) sc = 255;
-
-				switch (blendmode)
-				{
-				default:
-				case FZ_BLEND_NORMAL: rc = sc; break;
-				case FZ_BLEND_MULTIPLY: rc = fz_mul255(bc, sc); break;
-				case FZ_BLEND_SCREEN: rc = fz_screen_byte(bc, sc); break;
-				case FZ_BLEND_OVERLAY: rc = fz_overlay_byte(bc, sc); break;
-				case FZ_BLEND_DARKEN: rc = fz_darken_byte(bc, sc); break;
-				case FZ_BLEND_LIGHTEN: rc = fz_lighten_byte(bc, sc); break;
-				case FZ_BLEND_COLOR_DODGE: rc = fz_color_dodge_byte(bc, sc); break;
-				case FZ_BLEND_COLOR_BURN: rc = fz_color_burn_byte(bc, sc); break;
-				case FZ_BLEND_HARD_LIGHT: rc = fz_hard_light_byte(bc, sc); break;
-				case FZ_BLEND_SOFT_LIGHT: rc = fz_soft_light_byte(bc, sc); break;
-				case FZ_BLEND_DIFFERENCE: rc = fz_difference_byte(bc, sc); break;
-				case FZ_BLEND_EXCLUSION: rc = fz_exclusion_byte(bc, sc); break;
-				}
-				rc = fz_mul255(255 - haa, bc) + fz_mul255(fz_mul255(255 - ba, sc), haa) + fz_mul255(baha, rc);
-				if (rc < 0) rc = 0;
-				if (rc > 255) rc = 255;
-				bp[k] = fz_mul255(rc, ra);
-			}
-		}
-
-		sp += n;
-		bp += n;
-	}
+	if (blendmode < 0 || blendmode >= nelem(fz_blend_separable_nonisolated_table))
+		blendmode = FZ_BLEND_NORMAL;
+	fz_blend_separable_nonisolated_table[blendmode](bp, sp, n, w, hp, alpha);
 }
 
 static void
 fz_blend_nonseparable_nonisolated(byte * restrict bp, byte * restrict sp, int w, int blendmode, byte * restrict hp, int alpha)
 {
-	while (w--)
-	{
-		int ha = *hp++;
-		int haa = fz_mul255(ha, alpha);
-		if (haa != 0)
-		{
-			int sa = sp[3];
-			int ba = bp[3];
-			int baha = fz_mul255(ba, haa);
-
-			/* Calculate result_alpha */
-			int ra = bp[3] = ba - baha + haa;
-			if (ra != 0)
-			{
-				/* Because we are a non-isolated group, we
-				 * need to 'uncomposite' before we blend
-				 * (recomposite). We assume that normal
-				 * blending has been done inside the group,
-				 * so:     ra.rc = (1-ha).bc + ha.sc
-				 * A bit of rearrangement, and that gives us
-				 * that:   sc = (ra.rc - bc)/ha + bc
-				 * Now, the result of the blend was stored in
-				 * src, so: */
-				int invha = ha ? 255 * 256 / ha : 0;
-
-				int rr, rg, rb;
-
-				/* ugh, division to get non-premul components */
-				int invsa = sa ? 255 * 256 / sa : 0;
-				int invba = ba ? 255 * 256 / ba : 0;
-
-				int sr = (sp[0] * invsa) >> 8;
-				int sg = (sp[1] * invsa) >> 8;
-				int sb = (sp[2] * invsa) >> 8;
-
-				int br = (bp[0] * invba) >> 8;
-				int bg = (bp[1] * invba) >> 8;
-				int bb = (bp[2] * invba) >> 8;
-
-				/* Uncomposite */
-				sr = (((sr-br)*invha)>>8) + br;
-				sg = (((sg-bg)*invha)>>8) + bg;
-				sb = (((sb-bb)*invha)>>8) + bb;
-
-				switch (blendmode)
-				{
-				default:
-				case FZ_BLEND_HUE:
-					fz_hue_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-					break;
-				case FZ_BLEND_SATURATION:
-					fz_saturation_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-					break;
-				case FZ_BLEND_COLOR:
-					fz_color_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-					break;
-				case FZ_BLEND_LUMINOSITY:
-					fz_luminosity_rgb(&rr, &rg, &rb, br, bg, bb, sr, sg, sb);
-					break;
-				}
-
-				rr = fz_mul255(255 - haa, bp[0]) + fz_mul255(fz_mul255(255 - ba, sr), haa) + fz_mul255(baha, rr);
-				rg = fz_mul255(255 - haa, bp[1]) + fz_mul255(fz_mul255(255 - ba, sg), haa) + fz_mul255(baha, rg);
-				rb = fz_mul255(255 - haa, bp[2]) + fz_mul255(fz_mul255(255 - ba, sb), haa) + fz_mul255(baha, rb);
-				bp[0] = fz_mul255(ra, rr);
-				bp[1] = fz_mul255(ra, rg);
-				bp[2] = fz_mul255(ra, rb);
-			}
-		}
-
-		sp += 4;
-		bp += 4;
-	}
+	if (blendmode < FZ_BLEND_HUE || blendmode > FZ_BLEND_LUMINOSITY)
+		blendmode = FZ_BLEND_HUE;
+	fz_blend_nonseparable_nonisolated_table[blendmode - FZ_BLEND_HUE](bp, sp, w, hp, alpha);
 }
 
 void
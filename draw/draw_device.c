@@ -1,9 +1,5 @@
 #include "fitz.h"
 
-#define QUANT(x,a) (((int)((x) * (a))) / (a))
-#define HSUBPIX 5.0
-#define VSUBPIX 5.0
-
 #define STACK_SIZE 96
 
 /* Enable the following to attempt to support knockout and/or isolated
@@ -14,6 +10,9 @@
 /* Enable the following to help debug group blending. */
 #undef DUMP_GROUP_BLENDS
 
+/* Enable the following to print pixmap pool statistics. */
+#undef DUMP_PIXMAP_POOL
+
 /* Note #1: At various points in this code (notably when clipping with non
  * rectangular masks), we create a new (empty) destination pixmap. We then
  * render this pixmap, then plot it back into the original destination
@@ -35,6 +34,7 @@ enum {
 };
 
 typedef struct fz_draw_stack_s fz_draw_stack;
+typedef struct fz_draw_pool_s fz_draw_pool;
 
 struct fz_draw_stack_s {
 	fz_bbox scissor;
@@ -49,6 +49,29 @@ struct fz_draw_stack_s {
 	fz_rect area;
 };
 
+/* The sample buffers of the transient pixmaps used for clips, groups,
+ * soft masks and knockouts are recycled through a per device pool rather
+ * than going back to the heap. Buffers are bucketed in quarter power of
+ * two size classes; very large pixmaps bypass the pool. Every user of
+ * these pixmaps clears or copies into them first, so recycled buffers are
+ * handed out as is. */
+
+enum {
+	POOL_MIN_SHIFT = 10,
+	POOL_MAX_SHIFT = 26,
+	POOL_MAX_SIZE = 1 << POOL_MAX_SHIFT,
+	POOL_BUCKETS = 1 + (POOL_MAX_SHIFT - POOL_MIN_SHIFT) * 4,
+	POOL_DEPTH = 4,
+};
+
+struct fz_draw_pool_s {
+	unsigned char *free[POOL_BUCKETS][POOL_DEPTH];
+	int len[POOL_BUCKETS];
+	int size; /* bytes held in the free lists */
+	int hits, misses, discards;
+	int peak;
+};
+
 struct fz_draw_device_s
 {
 	fz_glyph_cache *cache;
@@ -62,9 +85,11 @@ struct fz_draw_device_s
 	int flags;
 	int top;
 	int blendmode;
+	int pending; /* index of the first clip without a dest yet, or -1 */
 	fz_draw_stack *stack;
 	int stack_max;
 	fz_draw_stack init_stack[STACK_SIZE];
+	fz_draw_pool pool;
 };
 
 #ifdef DUMP_GROUP_BLENDS
@@ -113,6 +138,199 @@ static void fz_grow_stack(fz_draw_device *dev)
 	dev->stack_max = max;
 }
 
+static int
+fz_pool_bucket(unsigned int size, unsigned int *class_size)
+{
+	int e = POOL_MIN_SHIFT;
+	int q;
+
+	if (size <= 1u << POOL_MIN_SHIFT)
+	{
+		*class_size = 1u << POOL_MIN_SHIFT;
+		return 0;
+	}
+
+	/* size is in (2^e, 2^(e+1)], split into four classes */
+	while ((2u << e) < size)
+		e++;
+	q = (size - (1u << e) - 1) >> (e - 2);
+	*class_size = (1u << e) + ((q + 1) << (e - 2));
+	return 1 + (e - POOL_MIN_SHIFT) * 4 + q;
+}
+
+static fz_pixmap *
+fz_draw_new_pixmap(fz_context *ctx, fz_draw_device *dev, fz_colorspace *colorspace, fz_bbox bbox)
+{
+	fz_draw_pool *pool = &dev->pool;
+	int n = colorspace ? colorspace->n + 1 : 1;
+	int w = bbox.x1 - bbox.x0;
+	int h = bbox.y1 - bbox.y0;
+	unsigned char *samples;
+	unsigned int class_size;
+	int b;
+
+	if (w <= 0 || h <= 0 || h > POOL_MAX_SIZE / w / n)
+		return fz_new_pixmap_with_rect(ctx, colorspace, bbox);
+
+	b = fz_pool_bucket(w * h * n, &class_size);
+	if (pool->len[b] > 0)
+	{
+		samples = pool->free[b][--pool->len[b]];
+		pool->size -= class_size;
+		pool->hits++;
+	}
+	else
+	{
+		samples = fz_malloc(ctx, class_size);
+		pool->misses++;
+	}
+
+	return fz_new_pixmap_with_rect_and_data(ctx, colorspace, bbox, samples);
+}
+
+static void
+fz_draw_drop_pixmap(fz_context *ctx, fz_draw_device *dev, fz_pixmap *pix)
+{
+	fz_draw_pool *pool = &dev->pool;
+	unsigned int class_size;
+	int b;
+
+	/* pixmaps that own their samples did not come from the pool */
+	if (!pix || pix->free_samples)
+	{
+		fz_drop_pixmap(ctx, pix);
+		return;
+	}
+
+	if (pix->refs > 1)
+	{
+		/* still in use elsewhere; let the last reference free it */
+		fz_pixmap_own_samples(pix);
+		fz_drop_pixmap(ctx, pix);
+		return;
+	}
+
+	b = fz_pool_bucket(pix->w * pix->h * pix->n, &class_size);
+	if (pool->len[b] < POOL_DEPTH && pool->size + class_size <= POOL_MAX_SIZE)
+	{
+		pool->free[b][pool->len[b]++] = pix->samples;
+		pool->size += class_size;
+		if (pool->size > pool->peak)
+			pool->peak = pool->size;
+	}
+	else
+	{
+		fz_free(ctx, pix->samples);
+		pool->discards++;
+	}
+	fz_drop_pixmap(ctx, pix);
+}
+
+static void
+fz_free_draw_pool(fz_context *ctx, fz_draw_pool *pool)
+{
+	int b;
+
+#ifdef DUMP_PIXMAP_POOL
+	printf("pixmap pool: %d hits, %d misses, %d discards, %d bytes peak\n",
+		pool->hits, pool->misses, pool->discards, pool->peak);
+#endif
+	for (b = 0; b < POOL_BUCKETS; b++)
+		while (pool->len[b] > 0)
+			fz_free(ctx, pool->free[b][--pool->len[b]]);
+	pool->size = 0;
+}
+
+/* Clips are pushed with only their mask rendered. The scratch dest (and
+ * shape) that the clipped content is drawn into is only allocated when
+ * something is actually drawn inside the clip; until then the stack entry
+ * has a mask but no saved dest. Clips that are popped while still pending
+ * are discarded without compositing. */
+
+static void
+fz_draw_realize_clips(fz_context *ctx, fz_draw_device *dev)
+{
+	fz_pixmap *dest, *shape;
+	fz_draw_stack *stack;
+	fz_bbox bbox;
+	int i;
+
+	if (dev->pending < 0)
+		return;
+
+	for (i = dev->pending; i < dev->top; i++)
+	{
+		stack = &dev->stack[i];
+		if (stack->mask == NULL)
+		{
+			/* rectangular clip: only the scissor was narrowed */
+			stack->shape = dev->shape;
+			continue;
+		}
+
+		bbox = i + 1 < dev->top ? dev->stack[i + 1].scissor : dev->scissor;
+		dest = fz_draw_new_pixmap(ctx, dev, dev->dest->colorspace, bbox);
+		/* FIXME: See note #1 */
+		fz_clear_pixmap(dest);
+		if (dev->shape)
+		{
+			shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
+			fz_clear_pixmap(shape);
+		}
+		else
+			shape = NULL;
+
+		stack->dest = dev->dest;
+		stack->shape = dev->shape;
+		dev->dest = dest;
+		dev->shape = shape;
+	}
+
+	dev->pending = -1;
+}
+
+static void
+fz_draw_push_clip(fz_context *ctx, fz_draw_device *dev, fz_pixmap *mask, fz_bbox bbox)
+{
+	fz_draw_stack *stack;
+
+	if (dev->top == dev->stack_max)
+		fz_grow_stack(dev);
+
+	stack = &dev->stack[dev->top];
+	stack->scissor = dev->scissor;
+	stack->mask = mask;
+	stack->dest = NULL;
+	stack->shape = dev->shape;
+	/* FIXME: See note #1 */
+	stack->blendmode = dev->blendmode | FZ_BLEND_ISOLATED;
+	if (dev->pending < 0)
+		dev->pending = dev->top;
+	dev->top++;
+
+	dev->scissor = bbox;
+
+	/* shapes are painted while building some clip masks */
+	if (dev->shape)
+		fz_draw_realize_clips(ctx, dev);
+}
+
+static void
+fz_draw_push_scissor(fz_draw_device *dev, fz_bbox bbox)
+{
+	if (dev->top == dev->stack_max)
+		fz_grow_stack(dev);
+
+	dev->stack[dev->top].scissor = dev->scissor;
+	dev->stack[dev->top].mask = NULL;
+	dev->stack[dev->top].dest = NULL;
+	dev->stack[dev->top].shape = dev->shape;
+	dev->stack[dev->top].blendmode = dev->blendmode;
+	dev->top++;
+
+	dev->scissor = bbox;
+}
+
 static void fz_knockout_begin(fz_context *ctx, void *user)
 {
 	fz_draw_device *dev = user;
@@ -128,7 +346,7 @@ static void fz_knockout_begin(fz_context *ctx, void *user)
 
 	bbox = fz_bound_pixmap(dev->dest);
 	bbox = fz_intersect_bbox(bbox, dev->scissor);
-	dest = fz_new_pixmap_with_rect(ctx, dev->dest->colorspace, bbox);
+	dest = fz_draw_new_pixmap(ctx, dev, dev->dest->colorspace, bbox);
 
 	if (isolated)
 	{
@@ -152,7 +370,7 @@ static void fz_knockout_begin(fz_context *ctx, void *user)
 	}
 	else
 	{
-		shape = fz_new_pixmap_with_rect(dev->ctx, NULL, bbox);
+		shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
 		fz_clear_pixmap(shape);
 	}
 	dev->stack[dev->top].blendmode = dev->blendmode;
@@ -213,14 +431,14 @@ static void fz_knockout_end(fz_context *ctx, void *user)
 		else
 			fz_blend_pixmap(dev->dest, group, 255, blendmode, isolated, shape);
 
-		fz_drop_pixmap(ctx, group);
+		fz_draw_drop_pixmap(ctx, dev, group);
 		if (shape != dev->shape)
 		{
 			if (dev->shape)
 			{
 				fz_paint_pixmap(dev->shape, shape, 255);
 			}
-			fz_drop_pixmap(ctx, shape);
+			fz_draw_drop_pixmap(ctx, dev, shape);
 		}
 #ifdef DUMP_GROUP_BLENDS
 		fz_dump_blend(dev->dest, " to get ");
@@ -231,6 +449,32 @@ static void fz_knockout_end(fz_context *ctx, void *user)
 	}
 }
 
+static void
+fz_draw_fill_rect(fz_context *ctx, fz_draw_device *dev, fz_rect r, unsigned char *colorbv, float alpha)
+{
+	unsigned char shapebv;
+	fz_bbox bbox;
+
+	bbox = fz_bound_rect_gel(ctx, r, dev->scissor);
+	if (fz_is_empty_rect(bbox))
+		return;
+
+	fz_draw_realize_clips(ctx, dev);
+
+	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
+		fz_knockout_begin(ctx, dev);
+
+	fz_scan_convert_rect(ctx, r, dev->scissor, dev->dest, colorbv);
+	if (dev->shape)
+	{
+		shapebv = alpha * 255;
+		fz_scan_convert_rect(ctx, r, dev->scissor, dev->shape, &shapebv);
+	}
+
+	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
+		fz_knockout_end(ctx, dev);
+}
+
 static void
 fz_draw_fill_path(fz_context *ctx, void *user, fz_path *path, int even_odd, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
@@ -242,8 +486,19 @@ fz_draw_fill_path(fz_context *ctx, void *user, fz_path *path, int even_odd, fz_m
 	unsigned char colorbv[FZ_MAX_COLORS + 1];
 	float colorfv[FZ_MAX_COLORS];
 	fz_bbox bbox;
+	fz_rect rect;
 	int i;
 
+	if (fz_is_rect_path(path, ctm, &rect))
+	{
+		fz_convert_color(ctx, colorspace, color, model, colorfv);
+		for (i = 0; i < model->n; i++)
+			colorbv[i] = colorfv[i] * 255;
+		colorbv[i] = alpha * 255;
+		fz_draw_fill_rect(ctx, dev, rect, colorbv, alpha);
+		return;
+	}
+
 	fz_reset_gel(dev->gel, dev->scissor);
 	fz_flatten_fill_path(ctx, dev->gel, path, ctm, flatness);
 	fz_sort_gel(dev->gel);
@@ -254,6 +509,8 @@ fz_draw_fill_path(fz_context *ctx, void *user, fz_path *path, int even_odd, fz_m
 	if (fz_is_empty_rect(bbox))
 		return;
 
+	fz_draw_realize_clips(ctx, dev);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 
@@ -277,6 +534,65 @@ fz_draw_fill_path(fz_context *ctx, void *user, fz_path *path, int even_odd, fz_m
 		fz_knockout_end(ctx, dev);
 }
 
+static void
+fz_draw_stroke_hairline(fz_context *ctx, fz_draw_device *dev, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm,
+	float flatness, float linewidth, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_colorspace *model = dev->dest->colorspace;
+	float width = linewidth * fz_matrix_expansion(ctm);
+	unsigned char colorbv[FZ_MAX_COLORS + 1];
+	float colorfv[FZ_MAX_COLORS];
+	float *segs;
+	fz_bbox bbox;
+	fz_rect rect;
+	int i, len;
+
+	segs = fz_flatten_hairline_path(ctx, path, stroke, ctm, flatness, linewidth, dev->scissor, &len);
+	if (len == 0)
+		return;
+
+	rect.x0 = rect.x1 = segs[0];
+	rect.y0 = rect.y1 = segs[1];
+	for (i = 0; i < len * 4; i += 2)
+	{
+		rect.x0 = MIN(rect.x0, segs[i]);
+		rect.y0 = MIN(rect.y0, segs[i + 1]);
+		rect.x1 = MAX(rect.x1, segs[i]);
+		rect.y1 = MAX(rect.y1, segs[i + 1]);
+	}
+	bbox = fz_round_rect(rect);
+	bbox.x0 -= 1;
+	bbox.y0 -= 1;
+	bbox.x1 += 1;
+	bbox.y1 += 1;
+	bbox = fz_intersect_bbox(bbox, dev->scissor);
+
+	if (fz_is_empty_rect(bbox))
+	{
+		fz_free(ctx, segs);
+		return;
+	}
+
+	fz_draw_realize_clips(ctx, dev);
+
+	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
+		fz_knockout_begin(ctx, dev);
+
+	fz_convert_color(ctx, colorspace, color, model, colorfv);
+	for (i = 0; i < model->n; i++)
+		colorbv[i] = colorfv[i] * 255;
+	colorbv[i] = alpha * 255;
+
+	fz_paint_hairlines(ctx, segs, len, width, bbox, dev->dest, colorbv);
+	if (dev->shape)
+		fz_paint_hairlines(ctx, segs, len, width, bbox, dev->shape, NULL);
+
+	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
+		fz_knockout_end(ctx, dev);
+
+	fz_free(ctx, segs);
+}
+
 static void
 fz_draw_stroke_path(fz_context *ctx, void *user, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
@@ -294,6 +610,13 @@ fz_draw_stroke_path(fz_context *ctx, void *user, fz_path *path, fz_stroke_state
 	if (linewidth * expansion < 0.1f)
 		linewidth = 1 / expansion;
 
+	/* the most common strokes in technical drawings */
+	if (linewidth * expansion <= 1 && fz_get_aa_level(ctx) > 0)
+	{
+		fz_draw_stroke_hairline(ctx, dev, path, stroke, ctm, flatness, linewidth, colorspace, color, alpha);
+		return;
+	}
+
 	fz_reset_gel(dev->gel, dev->scissor);
 	if (stroke->dash_len > 0)
 		fz_flatten_dash_path(ctx, dev->gel, path, stroke, ctm, flatness, linewidth);
@@ -307,6 +630,8 @@ fz_draw_stroke_path(fz_context *ctx, void *user, fz_path *path, fz_stroke_state
 	if (fz_is_empty_rect(bbox))
 		return;
 
+	fz_draw_realize_clips(ctx, dev);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 
@@ -337,83 +662,64 @@ static void
 fz_draw_clip_path(fz_context *ctx, void *user, fz_path *path, fz_rect *rect, int even_odd, fz_matrix ctm)
 {
 	fz_draw_device *dev = user;
-	fz_colorspace *model = dev->dest->colorspace;
 	float expansion = fz_matrix_expansion(ctm);
 	float flatness = 0.3f / expansion;
-	fz_pixmap *mask, *dest, *shape;
+	fz_pixmap *mask;
 	fz_bbox bbox;
+	fz_rect prect;
+	int is_rect;
 
 	if (dev->top == dev->stack_max)
 		fz_grow_stack(dev);
 
-	fz_reset_gel(dev->gel, dev->scissor);
-	fz_flatten_fill_path(ctx, dev->gel, path, ctm, flatness);
-	fz_sort_gel(dev->gel);
+	/* rectangular clips only narrow the scissor; no need to flatten */
+	is_rect = fz_is_rect_path(path, ctm, &prect);
+	if (is_rect)
+	{
+		bbox = fz_bound_rect_gel(ctx, prect, dev->scissor);
+	}
+	else
+	{
+		fz_reset_gel(dev->gel, dev->scissor);
+		fz_flatten_fill_path(ctx, dev->gel, path, ctm, flatness);
+		fz_sort_gel(dev->gel);
+		bbox = fz_bound_gel(dev->gel);
+		is_rect = fz_is_rect_gel(dev->gel);
+	}
 
-	bbox = fz_bound_gel(dev->gel);
 	bbox = fz_intersect_bbox(bbox, dev->scissor);
 	if (rect)
 		bbox = fz_intersect_bbox(bbox, fz_round_rect(*rect));
 
-	if (fz_is_empty_rect(bbox) || fz_is_rect_gel(dev->gel))
+	if (fz_is_empty_rect(bbox) || is_rect)
 	{
-		dev->stack[dev->top].scissor = dev->scissor;
-		dev->stack[dev->top].mask = NULL;
-		dev->stack[dev->top].dest = NULL;
-		dev->stack[dev->top].shape = dev->shape;
-		dev->stack[dev->top].blendmode = dev->blendmode;
-		dev->scissor = bbox;
 #ifdef DUMP_GROUP_BLENDS
 		dump_spaces(dev->top, "Clip (rectangular) begin\n");
 #endif
-		dev->top++;
+		fz_draw_push_scissor(dev, bbox);
 		return;
 	}
 
-	mask = fz_new_pixmap_with_rect(ctx, NULL, bbox);
+	mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
 	fz_clear_pixmap(mask);
-	dest = fz_new_pixmap_with_rect(ctx, model, bbox);
-	/* FIXME: See note #1 */
-	fz_clear_pixmap(dest);
-	if (dev->shape)
-	{
-		shape = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-		fz_clear_pixmap(shape);
-	}
-	else
-		shape = NULL;
-
 	fz_scan_convert(dev->gel, even_odd, bbox, mask, NULL);
 
-	dev->stack[dev->top].scissor = dev->scissor;
-	dev->stack[dev->top].mask = mask;
-	dev->stack[dev->top].dest = dev->dest;
-	dev->stack[dev->top].shape = dev->shape;
-	/* FIXME: See note #1 */
-	dev->stack[dev->top].blendmode = dev->blendmode | FZ_BLEND_ISOLATED;
-	dev->scissor = bbox;
-	dev->dest = dest;
-	dev->shape = shape;
 #ifdef DUMP_GROUP_BLENDS
 	dump_spaces(dev->top, "Clip (non-rectangular) begin\n");
 #endif
-	dev->top++;
+	fz_draw_push_clip(ctx, dev, mask, bbox);
 }
 
 static void
 fz_draw_clip_stroke_path(fz_context *ctx, void *user, fz_path *path, fz_rect *rect, fz_stroke_state *stroke, fz_matrix ctm)
 {
 	fz_draw_device *dev = user;
-	fz_colorspace *model = dev->dest->colorspace;
 	float expansion = fz_matrix_expansion(ctm);
 	float flatness = 0.3f / expansion;
 	float linewidth = stroke->linewidth;
-	fz_pixmap *mask, *dest, *shape;
+	fz_pixmap *mask;
 	fz_bbox bbox;
 
-	if (dev->top == dev->stack_max)
-		fz_grow_stack(dev);
-
 	if (linewidth * expansion < 0.1f)
 		linewidth = 1 / expansion;
 
@@ -429,35 +735,20 @@ fz_draw_clip_stroke_path(fz_context *ctx, void *user, fz_path *path, fz_rect *re
 	if (rect)
 		bbox = fz_intersect_bbox(bbox, fz_round_rect(*rect));
 
-	mask = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-	fz_clear_pixmap(mask);
-	dest = fz_new_pixmap_with_rect(ctx, model, bbox);
-	/* FIXME: See note #1 */
-	fz_clear_pixmap(dest);
-	if (dev->shape)
+	if (fz_is_empty_rect(bbox))
 	{
-		shape = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-		fz_clear_pixmap(shape);
+		fz_draw_push_scissor(dev, bbox);
+		return;
 	}
-	else
-		shape = NULL;
 
-	if (!fz_is_empty_rect(bbox))
-		fz_scan_convert(dev->gel, 0, bbox, mask, NULL);
+	mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
+	fz_clear_pixmap(mask);
+	fz_scan_convert(dev->gel, 0, bbox, mask, NULL);
 
-	dev->stack[dev->top].scissor = dev->scissor;
-	dev->stack[dev->top].mask = mask;
-	dev->stack[dev->top].dest = dev->dest;
-	dev->stack[dev->top].shape = dev->shape;
-	/* FIXME: See note #1 */
-	dev->stack[dev->top].blendmode = dev->blendmode | FZ_BLEND_ISOLATED;
-	dev->scissor = bbox;
-	dev->dest = dest;
-	dev->shape = shape;
 #ifdef DUMP_GROUP_BLENDS
 	dump_spaces(dev->top, "Clip (stroke) begin\n");
 #endif
-	dev->top++;
+	fz_draw_push_clip(ctx, dev, mask, bbox);
 }
 
 static void
@@ -496,6 +787,132 @@ draw_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_pixmap *msk,
 	}
 }
 
+static void
+draw_glyph_outline(fz_context *ctx, fz_draw_device *dev, unsigned char *colorbv, fz_pixmap *dst,
+	fz_path *path, fz_matrix trm, fz_bbox scissor)
+{
+	/* outlines this large are smooth enough to flatten to a pixel */
+	float flatness = 1.0f / fz_matrix_expansion(trm);
+	fz_bbox bbox;
+
+	fz_reset_gel(dev->gel, scissor);
+	fz_flatten_fill_path(ctx, dev->gel, path, trm, flatness);
+	fz_sort_gel(dev->gel);
+
+	bbox = fz_bound_gel(dev->gel);
+	bbox = fz_intersect_bbox(bbox, scissor);
+	if (!fz_is_empty_rect(bbox))
+		fz_scan_convert(dev->gel, 0, bbox, dst, colorbv);
+}
+
+/*
+ * Glyphs of a text run are collected and painted together, one scanline
+ * at a time across all the glyphs on it, so that each destination row is
+ * visited once per run instead of once per glyph.
+ */
+
+#define GLYPH_RUN_SIZE 256
+
+typedef struct fz_glyph_span_s
+{
+	fz_pixmap *glyph;
+	int x, y; /* glyph origin */
+	int y0, y1;
+	unsigned char *mp, *dp;
+	int w;
+} fz_glyph_span;
+
+typedef struct fz_glyph_run_s
+{
+	fz_glyph_span items[GLYPH_RUN_SIZE];
+	int len;
+} fz_glyph_run;
+
+static int
+cmp_glyph_span(const void *a_, const void *b_)
+{
+	const fz_glyph_span *a = *(const fz_glyph_span **)a_;
+	const fz_glyph_span *b = *(const fz_glyph_span **)b_;
+	if (a->y0 != b->y0)
+		return a->y0 - b->y0;
+	return a->x - b->x;
+}
+
+static void
+draw_glyph_run(unsigned char *colorbv, fz_pixmap *dst, fz_glyph_run *run, fz_bbox scissor)
+{
+	fz_glyph_span *sorted[GLYPH_RUN_SIZE];
+	fz_glyph_span *active[GLYPH_RUN_SIZE];
+	int stride = dst->w * dst->n;
+	int i, k, len, nactive, next, y;
+
+	len = 0;
+	for (i = 0; i < run->len; i++)
+	{
+		fz_glyph_span *g = &run->items[i];
+		fz_pixmap *msk = g->glyph;
+		fz_bbox bbox = fz_bound_pixmap(msk);
+		bbox.x0 += g->x;
+		bbox.y0 += g->y;
+		bbox.x1 += g->x;
+		bbox.y1 += g->y;
+		bbox = fz_intersect_bbox(bbox, scissor); /* scissor < dst */
+		if (fz_is_empty_rect(bbox))
+			continue;
+		g->y0 = bbox.y0;
+		g->y1 = bbox.y1;
+		g->w = bbox.x1 - bbox.x0;
+		g->mp = msk->samples + ((bbox.y0 - msk->y - g->y) * msk->w + (bbox.x0 - msk->x - g->x));
+		g->dp = dst->samples + ((bbox.y0 - dst->y) * dst->w + (bbox.x0 - dst->x)) * dst->n;
+		sorted[len++] = g;
+	}
+	if (len == 0)
+		return;
+
+	qsort(sorted, len, sizeof(fz_glyph_span *), cmp_glyph_span);
+
+	nactive = 0;
+	next = 0;
+	y = sorted[0]->y0;
+	while (nactive > 0 || next < len)
+	{
+		if (nactive == 0)
+			y = sorted[next]->y0;
+		while (next < len && sorted[next]->y0 == y)
+			active[nactive++] = sorted[next++];
+
+		for (i = 0, k = 0; i < nactive; i++)
+		{
+			fz_glyph_span *g = active[i];
+			if (dst->colorspace)
+				fz_paint_span_with_color(g->dp, g->mp, dst->n, g->w, colorbv);
+			else
+				fz_paint_span(g->dp, g->mp, 1, g->w, 255);
+			g->dp += stride;
+			g->mp += g->glyph->w;
+			if (y + 1 < g->y1)
+				active[k++] = g;
+		}
+		nactive = k;
+		y++;
+	}
+}
+
+static void
+fz_draw_flush_glyph_run(fz_context *ctx, fz_draw_device *dev, fz_glyph_run *run,
+	unsigned char *colorbv, fz_pixmap *dst, fz_bbox scissor)
+{
+	int i;
+
+	draw_glyph_run(colorbv, dst, run, scissor);
+	if (dev->shape)
+		draw_glyph_run(NULL, dev->shape, run, scissor);
+
+	for (i = 0; i < run->len; i++)
+		fz_drop_pixmap(ctx, run->items[i].glyph);
+	run->len = 0;
+}
+
 static void
 fz_draw_fill_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
@@ -503,12 +920,18 @@ fz_draw_fill_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm,
 	fz_draw_device *dev = user;
 	fz_colorspace *model = dev->dest->colorspace;
 	unsigned char colorbv[FZ_MAX_COLORS + 1];
-	unsigned char shapebv;
 	float colorfv[FZ_MAX_COLORS];
 	fz_matrix tm, trm;
 	fz_pixmap *glyph;
+	fz_path *path;
+	fz_glyph_run run;
 	int i, x, y, gid;
 
+	if (fz_is_empty_rect(dev->scissor))
+		return;
+
+	fz_draw_realize_clips(ctx, dev);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 
@@ -516,9 +939,9 @@ fz_draw_fill_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm,
 	for (i = 0; i < model->n; i++)
 		colorbv[i] = colorfv[i] * 255;
 	colorbv[i] = alpha * 255;
-	shapebv = 255;
 
 	tm = text->trm;
+	run.len = 0;
 
 	for (i = 0; i < text->len; i++)
 	{
@@ -529,10 +952,17 @@ fz_draw_fill_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm,
 		tm.e = text->items[i].x;
 		tm.f = text->items[i].y;
 		trm = fz_concat(tm, ctm);
-		x = floorf(trm.e);
-		y = floorf(trm.f);
-		trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-		trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
+
+		path = fz_outline_glyph(ctx, dev->cache, text->font, gid, trm);
+		if (path)
+		{
+			draw_glyph_outline(ctx, dev, colorbv, dev->dest, path, trm, dev->scissor);
+			if (dev->shape)
+				draw_glyph_outline(ctx, dev, NULL, dev->shape, path, trm, dev->scissor);
+			continue;
+		}
+
+		trm = fz_snap_glyph_matrix(ctx, trm, &x, &y);
 
 		glyph = fz_render_glyph(ctx, dev->cache, text->font, gid, trm, model);
 		if (glyph)
@@ -553,19 +983,25 @@ fz_draw_fill_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm,
 			}
 			if (glyph->n == 1)
 			{
-				draw_glyph(colorbv, dev->dest, glyph, x, y, dev->scissor);
-				if (dev->shape)
-					draw_glyph(&shapebv, dev->shape, glyph, x, y, dev->scissor);
+				if (run.len == GLYPH_RUN_SIZE)
+					fz_draw_flush_glyph_run(ctx, dev, &run, colorbv, dev->dest, dev->scissor);
+				run.items[run.len].glyph = glyph;
+				run.items[run.len].x = x;
+				run.items[run.len].y = y;
+				run.len++;
 			}
 			else
 			{
 				fz_matrix ctm = {glyph->w, 0.0, 0.0, -glyph->h, x + glyph->x, y + glyph->y + glyph->h};
+				fz_draw_flush_glyph_run(ctx, dev, &run, colorbv, dev->dest, dev->scissor);
 				fz_paint_image(dev->dest, dev->scissor, dev->shape, glyph, ctm, alpha * 255);
+				fz_drop_pixmap(ctx, glyph);
 			}
-			fz_drop_pixmap(ctx, glyph);
 		}
 	}
 
+	fz_draw_flush_glyph_run(ctx, dev, &run, colorbv, dev->dest, dev->scissor);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_end(ctx, dev);
 }
@@ -582,6 +1018,11 @@ fz_draw_stroke_text(fz_context *ctx, void *user, fz_text *text, fz_stroke_state
 	fz_pixmap *glyph;
 	int i, x, y, gid;
 
+	if (fz_is_empty_rect(dev->scissor))
+		return;
+
+	fz_draw_realize_clips(ctx, dev);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 
@@ -601,10 +1042,7 @@ fz_draw_stroke_text(fz_context *ctx, void *user, fz_text *text, fz_stroke_state
 		tm.e = text->items[i].x;
 		tm.f = text->items[i].y;
 		trm = fz_concat(tm, ctm);
-		x = floorf(trm.e);
-		y = floorf(trm.f);
-		trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-		trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
+		trm = fz_snap_glyph_matrix(ctx, trm, &x, &y);
 
 		glyph = fz_render_stroked_glyph(ctx, dev->cache, text->font, gid, trm, ctm, stroke);
 		if (glyph)
@@ -626,18 +1064,17 @@ fz_draw_clip_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm, int
 	fz_draw_device *dev = user;
 	fz_colorspace *model = dev->dest->colorspace;
 	fz_bbox bbox;
-	fz_pixmap *mask, *dest, *shape;
+	fz_pixmap *mask;
 	fz_matrix tm, trm;
 	fz_pixmap *glyph;
+	fz_path *path;
+	fz_glyph_run run;
 	int i, x, y, gid;
 
 	/* If accumulate == 0 then this text object is guaranteed complete */
 	/* If accumulate == 1 then this text object is the first (or only) in a sequence */
 	/* If accumulate == 2 then this text object is a continuation */
 
-	if (dev->top == dev->stack_max)
-		fz_grow_stack(dev);
-
 	if (accumulate == 0)
 	{
 		/* make the mask the exact size needed */
@@ -652,41 +1089,27 @@ fz_draw_clip_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm, int
 
 	if (accumulate == 0 || accumulate == 1)
 	{
-		mask = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-		fz_clear_pixmap(mask);
-		dest = fz_new_pixmap_with_rect(ctx, model, bbox);
-		/* FIXME: See note #1 */
-		fz_clear_pixmap(dest);
-		if (dev->shape)
-		{
-			shape = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-			fz_clear_pixmap(shape);
-		}
-		else
-			shape = NULL;
-
-		dev->stack[dev->top].scissor = dev->scissor;
-		dev->stack[dev->top].mask = mask;
-		dev->stack[dev->top].dest = dev->dest;
-		dev->stack[dev->top].shape = dev->shape;
-		/* FIXME: See note #1 */
-		dev->stack[dev->top].blendmode = dev->blendmode | FZ_BLEND_ISOLATED;
-		dev->scissor = bbox;
-		dev->dest = dest;
-		dev->shape = shape;
 #ifdef DUMP_GROUP_BLENDS
 		dump_spaces(dev->top, "Clip (text) begin\n");
 #endif
-		dev->top++;
+		if (fz_is_empty_rect(bbox))
+		{
+			fz_draw_push_scissor(dev, bbox);
+			return;
+		}
+		mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
+		fz_clear_pixmap(mask);
+		fz_draw_push_clip(ctx, dev, mask, bbox);
 	}
 	else
 	{
 		mask = dev->stack[dev->top-1].mask;
 	}
 
-	if (!fz_is_empty_rect(bbox))
+	if (mask && !fz_is_empty_rect(bbox))
 	{
 		tm = text->trm;
+		run.len = 0;
 
 		for (i = 0; i < text->len; i++)
 		{
@@ -697,20 +1120,31 @@ fz_draw_clip_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm, int
 			tm.e = text->items[i].x;
 			tm.f = text->items[i].y;
 			trm = fz_concat(tm, ctm);
-			x = floorf(trm.e);
-			y = floorf(trm.f);
-			trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-			trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
+
+			path = fz_outline_glyph(ctx, dev->cache, text->font, gid, trm);
+			if (path)
+			{
+				draw_glyph_outline(ctx, dev, NULL, mask, path, trm, bbox);
+				if (dev->shape)
+					draw_glyph_outline(ctx, dev, NULL, dev->shape, path, trm, bbox);
+				continue;
+			}
+
+			trm = fz_snap_glyph_matrix(ctx, trm, &x, &y);
 
 			glyph = fz_render_glyph(ctx, dev->cache, text->font, gid, trm, model);
 			if (glyph)
 			{
-				draw_glyph(NULL, mask, glyph, x, y, bbox);
-				if (dev->shape)
-					draw_glyph(NULL, dev->shape, glyph, x, y, bbox);
-				fz_drop_pixmap(ctx, glyph);
+				if (run.len == GLYPH_RUN_SIZE)
+					fz_draw_flush_glyph_run(ctx, dev, &run, NULL, mask, bbox);
+				run.items[run.len].glyph = glyph;
+				run.items[run.len].x = x;
+				run.items[run.len].y = y;
+				run.len++;
 			}
 		}
+
+		fz_draw_flush_glyph_run(ctx, dev, &run, NULL, mask, bbox);
 	}
 }
 
@@ -718,73 +1152,49 @@ static void
 fz_draw_clip_stroke_text(fz_context *ctx, void *user, fz_text *text, fz_stroke_state *stroke, fz_matrix ctm)
 {
 	fz_draw_device *dev = user;
-	fz_colorspace *model = dev->dest->colorspace;
 	fz_bbox bbox;
-	fz_pixmap *mask, *dest, *shape;
+	fz_pixmap *mask;
 	fz_matrix tm, trm;
 	fz_pixmap *glyph;
 	int i, x, y, gid;
 
-	if (dev->top == dev->stack_max)
-		fz_grow_stack(dev);
-
 	/* make the mask the exact size needed */
 	bbox = fz_round_rect(fz_bound_text(text, ctm));
 	bbox = fz_intersect_bbox(bbox, dev->scissor);
 
-	mask = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-	fz_clear_pixmap(mask);
-	dest = fz_new_pixmap_with_rect(ctx, model, bbox);
-	/* FIXME: See note #1 */
-	fz_clear_pixmap(dest);
-	if (dev->shape)
-	{
-		shape = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-		fz_clear_pixmap(shape);
-	}
-	else
-		shape = dev->shape;
-
-	dev->stack[dev->top].scissor = dev->scissor;
-	dev->stack[dev->top].mask = mask;
-	dev->stack[dev->top].dest = dev->dest;
-	dev->stack[dev->top].shape = dev->shape;
-	/* FIXME: See note #1 */
-	dev->stack[dev->top].blendmode = dev->blendmode | FZ_BLEND_ISOLATED;
-	dev->scissor = bbox;
-	dev->dest = dest;
-	dev->shape = shape;
 #ifdef DUMP_GROUP_BLENDS
 	dump_spaces(dev->top, "Clip (stroke text) begin\n");
 #endif
-	dev->top++;
-
-	if (!fz_is_empty_rect(bbox))
+	if (fz_is_empty_rect(bbox))
 	{
-		tm = text->trm;
+		fz_draw_push_scissor(dev, bbox);
+		return;
+	}
 
-		for (i = 0; i < text->len; i++)
-		{
-			gid = text->items[i].gid;
-			if (gid < 0)
-				continue;
+	mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
+	fz_clear_pixmap(mask);
+	fz_draw_push_clip(ctx, dev, mask, bbox);
 
-			tm.e = text->items[i].x;
-			tm.f = text->items[i].y;
-			trm = fz_concat(tm, ctm);
-			x = floorf(trm.e);
-			y = floorf(trm.f);
-			trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-			trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
+	tm = text->trm;
 
-			glyph = fz_render_stroked_glyph(ctx, dev->cache, text->font, gid, trm, ctm, stroke);
-			if (glyph)
-			{
-				draw_glyph(NULL, mask, glyph, x, y, bbox);
-				if (dev->shape)
-					draw_glyph(NULL, dev->shape, glyph, x, y, bbox);
-				fz_drop_pixmap(ctx, glyph);
-			}
+	for (i = 0; i < text->len; i++)
+	{
+		gid = text->items[i].gid;
+		if (gid < 0)
+			continue;
+
+		tm.e = text->items[i].x;
+		tm.f = text->items[i].y;
+		trm = fz_concat(tm, ctm);
+		trm = fz_snap_glyph_matrix(ctx, trm, &x, &y);
+
+		glyph = fz_render_stroked_glyph(ctx, dev->cache, text->font, gid, trm, ctm, stroke);
+		if (glyph)
+		{
+			draw_glyph(NULL, mask, glyph, x, y, bbox);
+			if (dev->shape)
+				draw_glyph(NULL, dev->shape, glyph, x, y, bbox);
+			fz_drop_pixmap(ctx, glyph);
 		}
 	}
 }
@@ -799,7 +1209,7 @@ fz_draw_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ctm,
 {
 	fz_draw_device *dev = user;
 	fz_colorspace *model = dev->dest->colorspace;
-	fz_pixmap *dest = dev->dest;
+	fz_pixmap *dest;
 	fz_rect bounds;
 	fz_bbox bbox, scissor;
 	float colorfv[FZ_MAX_COLORS];
@@ -820,9 +1230,12 @@ fz_draw_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ctm,
 		return;
 	}
 
+	fz_draw_realize_clips(ctx, dev);
+
+	dest = dev->dest;
 	if (alpha < 1)
 	{
-		dest = fz_new_pixmap_with_rect(ctx, dev->dest->colorspace, bbox);
+		dest = fz_draw_new_pixmap(ctx, dev, dev->dest->colorspace, bbox);
 		fz_clear_pixmap(dest);
 	}
 
@@ -868,7 +1281,7 @@ fz_draw_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ctm,
 	if (alpha < 1)
 	{
 		fz_paint_pixmap(dev->dest, dest, alpha * 255);
-		fz_drop_pixmap(ctx, dest);
+		fz_draw_drop_pixmap(ctx, dev, dest);
 	}
 
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
@@ -876,23 +1289,26 @@ fz_draw_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ctm,
 }
 
 static fz_pixmap *
-fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_matrix *ctm, int x, int y, int dx, int dy, int gridfit)
+fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_colorspace *colorspace, fz_matrix *ctm, int x, int y, int dx, int dy, int gridfit, int cacheable)
 {
 	fz_pixmap *scaled;
+	int ix, iy;
 
+	/* The scaled pixmaps are shared through the scale cache, so only the
+	 * ctm may carry the position at which they are drawn. */
 	if (ctm->a != 0 && ctm->b == 0 && ctm->c == 0 && ctm->d != 0)
 	{
 		/* Unrotated or X-flip or Y-flip or XY-flip */
 		fz_matrix m = *ctm;
 		if (gridfit)
 			fz_gridfit_matrix(&m);
-		scaled = fz_scale_pixmap(ctx, image, m.e, m.f, m.a, m.d);
+		scaled = fz_scale_pixmap_cached(ctx, image, colorspace, m.e, m.f, m.a, m.d, &ix, &iy, cacheable);
 		if (scaled == NULL)
 			return NULL;
 		ctm->a = scaled->w;
 		ctm->d = scaled->h;
-		ctm->e = scaled->x;
-		ctm->f = scaled->y;
+		ctm->e = scaled->x + ix;
+		ctm->f = scaled->y + iy;
 		return scaled;
 	}
 
@@ -902,35 +1318,106 @@ fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_matrix *ctm, int x, in
 		fz_matrix m = *ctm;
 		if (gridfit)
 			fz_gridfit_matrix(&m);
-		scaled = fz_scale_pixmap(ctx, image, m.f, m.e, m.b, m.c);
+		scaled = fz_scale_pixmap_cached(ctx, image, colorspace, m.f, m.e, m.b, m.c, &ix, &iy, cacheable);
 		if (scaled == NULL)
 			return NULL;
 		ctm->b = scaled->w;
 		ctm->c = scaled->h;
-		ctm->f = scaled->x;
-		ctm->e = scaled->y;
+		ctm->f = scaled->x + ix;
+		ctm->e = scaled->y + iy;
 		return scaled;
 	}
 
 	/* Downscale, non rectilinear case */
 	if (dx > 0 && dy > 0)
 	{
-		scaled = fz_scale_pixmap(ctx, image, 0, 0, (float)dx, (float)dy);
+		scaled = fz_scale_converted_pixmap(ctx, image, colorspace, 0, 0, (float)dx, (float)dy);
 		return scaled;
 	}
 
 	return NULL;
 }
 
+/*
+ * Only whole images kept for reuse by their image or the image cache are
+ * worth caching scaled copies of. Converted copies and subareas made for
+ * one draw are never drawn again, and would only push useful entries out
+ * of the cache.
+ */
+static int
+fz_draw_is_cached_image(fz_pixmap *pixmap, int partial)
+{
+	return pixmap->cached && !partial;
+}
+
+/*
+ * Decode the image, or only the part of it that shows through the clip
+ * when that is much smaller. The ctm is adjusted to place a pixmap that
+ * covers only part of the image; it is grid fitted for the whole image
+ * first, as that must not be done again for the part.
+ */
+static fz_pixmap *
+fz_draw_image_pixmap(fz_context *ctx, fz_image *image, fz_matrix *ctm, fz_bbox clip, int dx, int dy, int *partial)
+{
+	fz_pixmap *pixmap;
+	fz_bbox subarea;
+	fz_matrix m;
+	fz_rect r;
+	int mx, my;
+
+	*partial = 0;
+
+	if (dx < 1 || dy < 1)
+		return fz_image_to_pixmap(ctx, image, dx, dy);
+
+	/* the clip in image pixels, with room for the scaling filter */
+	m = fz_concat(fz_scale(1.0f / image->w, -1.0f / image->h), fz_translate(0, 1));
+	m = fz_concat(m, *ctm);
+	r.x0 = clip.x0;
+	r.y0 = clip.y0;
+	r.x1 = clip.x1;
+	r.y1 = clip.y1;
+	r = fz_transform_rect(fz_invert_matrix(m), r);
+	mx = image->w / dx * 2 + 2;
+	my = image->h / dy * 2 + 2;
+	r.x0 = CLAMP(r.x0 - mx, 0, image->w);
+	r.y0 = CLAMP(r.y0 - my, 0, image->h);
+	r.x1 = CLAMP(r.x1 + mx, 0, image->w);
+	r.y1 = CLAMP(r.y1 + my, 0, image->h);
+
+	if ((r.x1 - r.x0) * (r.y1 - r.y0) * 2 > (float)image->w * image->h)
+		return fz_image_to_pixmap(ctx, image, dx, dy);
+
+	subarea = fz_round_rect(r);
+	if (subarea.x0 >= subarea.x1 || subarea.y0 >= subarea.y1)
+	{
+		subarea.x0 = subarea.y0 = 0;
+		subarea.x1 = subarea.y1 = 1;
+	}
+
+	pixmap = fz_image_to_pixmap_subarea(ctx, image, &subarea, dx, dy);
+	if (pixmap && (subarea.x0 != 0 || subarea.y0 != 0 || subarea.x1 != image->w || subarea.y1 != image->h))
+	{
+		*partial = 1;
+		fz_gridfit_matrix(ctm);
+		m = fz_scale((float)(subarea.x1 - subarea.x0) / image->w, (float)(subarea.y1 - subarea.y0) / image->h);
+		m = fz_concat(m, fz_translate((float)subarea.x0 / image->w, 1 - (float)subarea.y1 / image->h));
+		*ctm = fz_concat(m, *ctm);
+	}
+	return pixmap;
+}
+
 static void
-fz_draw_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm, float alpha)
+fz_draw_fill_image(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm, float alpha)
 {
 	fz_draw_device *dev = user;
 	fz_colorspace *model = dev->dest->colorspace;
+	fz_pixmap *pixmap, *orig_pixmap;
 	fz_pixmap *converted = NULL;
 	fz_pixmap *scaled = NULL;
+	fz_colorspace *target;
 	int after;
-	int dx, dy;
+	int dx, dy, partial;
 
 	if (!model)
 	{
@@ -941,6 +1428,20 @@ fz_draw_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
 	if (image->w == 0 || image->h == 0)
 		return;
 
+	if (fz_is_empty_rect(dev->scissor))
+		return;
+
+	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+	orig_pixmap = pixmap = fz_draw_image_pixmap(ctx, image, &ctm, dev->scissor, dx, dy, &partial);
+	if (!pixmap)
+	{
+		fz_warn(ctx, "cannot decode image");
+		return;
+	}
+
+	fz_draw_realize_clips(ctx, dev);
+
 	/* convert images with more components (cmyk->rgb) before scaling */
 	/* convert images with fewer components (gray->rgb after scaling */
 	/* convert images with expensive colorspace transforms after scaling */
@@ -949,94 +1450,122 @@ fz_draw_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
 		fz_knockout_begin(ctx, dev);
 
 	after = 0;
-	if (image->colorspace == fz_device_gray)
+	if (pixmap->colorspace == fz_device_gray)
 		after = 1;
 
-	if (image->colorspace != model && !after)
+	/* when downscaling with a fast converter, convert each row as it is
+	 * scaled instead of converting the whole image first */
+	target = NULL;
+	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+	if (pixmap->colorspace != model && !after)
 	{
-		converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(image));
-		fz_convert_pixmap(ctx, image, converted);
-		image = converted;
+		if (dx < pixmap->w && dy < pixmap->h && fz_find_fast_converter(pixmap->colorspace, model))
+			target = model;
+		else
+		{
+			converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(pixmap));
+			fz_convert_pixmap(ctx, pixmap, converted);
+			pixmap = converted;
+		}
 	}
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-	if (dx < image->w && dy < image->h)
+	if (dx < pixmap->w && dy < pixmap->h)
 	{
-		int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-		scaled = fz_transform_pixmap(ctx, image, &ctm, dev->dest->x, dev->dest->y, dx, dy, gridfit);
+		int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3) && !partial;
+		scaled = fz_transform_pixmap(ctx, pixmap, target, &ctm, dev->dest->x, dev->dest->y, dx, dy, gridfit,
+			fz_draw_is_cached_image(pixmap, partial));
 		if (scaled == NULL)
 		{
 			if (dx < 1)
 				dx = 1;
 			if (dy < 1)
 				dy = 1;
-			scaled = fz_scale_pixmap(ctx, image, image->x, image->y, dx, dy);
+			scaled = fz_scale_converted_pixmap(ctx, pixmap, target, pixmap->x, pixmap->y, dx, dy);
 		}
 		if (scaled != NULL)
-			image = scaled;
+			pixmap = scaled;
 	}
 
-	if (image->colorspace != model)
+	if (pixmap->colorspace != model)
 	{
-		if ((image->colorspace == fz_device_gray && model == fz_device_rgb) ||
-			(image->colorspace == fz_device_gray && model == fz_device_bgr))
+		if ((pixmap->colorspace == fz_device_gray && model == fz_device_rgb) ||
+			(pixmap->colorspace == fz_device_gray && model == fz_device_bgr))
 		{
 			/* We have special case rendering code for gray -> rgb/bgr */
 		}
 		else
 		{
-			converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(image));
-			fz_convert_pixmap(ctx, image, converted);
-			image = converted;
+			converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(pixmap));
+			fz_convert_pixmap(ctx, pixmap, converted);
+			pixmap = converted;
 		}
 	}
 
-	fz_paint_image(dev->dest, dev->scissor, dev->shape, image, ctm, alpha * 255);
+	if (!partial)
+		fz_gridfit_matrix(&ctm);
+	fz_paint_image(dev->dest, dev->scissor, dev->shape, pixmap, ctm, alpha * 255);
 
 	if (scaled)
 		fz_drop_pixmap(ctx, scaled);
 	if (converted)
 		fz_drop_pixmap(ctx, converted);
+	fz_drop_pixmap(ctx, orig_pixmap);
 
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_end(ctx, dev);
 }
 
 static void
-fz_draw_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
+fz_draw_fill_image_mask(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
 	fz_draw_device *dev = user;
 	fz_colorspace *model = dev->dest->colorspace;
 	unsigned char colorbv[FZ_MAX_COLORS + 1];
 	float colorfv[FZ_MAX_COLORS];
+	fz_pixmap *pixmap, *orig_pixmap;
 	fz_pixmap *scaled = NULL;
-	int dx, dy;
+	int dx, dy, partial;
 	int i;
 
 	if (image->w == 0 || image->h == 0)
 		return;
 
+	if (fz_is_empty_rect(dev->scissor))
+		return;
+
+	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+	orig_pixmap = pixmap = fz_draw_image_pixmap(ctx, image, &ctm, dev->scissor, dx, dy, &partial);
+	if (!pixmap)
+	{
+		fz_warn(ctx, "cannot decode image mask");
+		return;
+	}
+
+	fz_draw_realize_clips(ctx, dev);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 
 	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
 	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-	if (dx < image->w && dy < image->h)
+	if (dx < pixmap->w && dy < pixmap->h)
 	{
-		int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-		scaled = fz_transform_pixmap(ctx, image, &ctm, dev->dest->x, dev->dest->y, dx, dy, gridfit);
+		int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3) && !partial;
+		scaled = fz_transform_pixmap(ctx, pixmap, NULL, &ctm, dev->dest->x, dev->dest->y, dx, dy, gridfit,
+			fz_draw_is_cached_image(pixmap, partial));
 		if (scaled == NULL)
 		{
 			if (dx < 1)
 				dx = 1;
 			if (dy < 1)
 				dy = 1;
-			scaled = fz_scale_pixmap(ctx, image, image->x, image->y, dx, dy);
+			scaled = fz_scale_pixmap(ctx, pixmap, pixmap->x, pixmap->y, dx, dy);
 		}
 		if (scaled != NULL)
-			image = scaled;
+			pixmap = scaled;
 	}
 
 	fz_convert_color(ctx, colorspace, color, model, colorfv);
@@ -1044,27 +1573,27 @@ fz_draw_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix
 		colorbv[i] = colorfv[i] * 255;
 	colorbv[i] = alpha * 255;
 
-	fz_paint_image_with_color(dev->dest, dev->scissor, dev->shape, image, ctm, colorbv);
+	if (!partial)
+		fz_gridfit_matrix(&ctm);
+	fz_paint_image_with_color(dev->dest, dev->scissor, dev->shape, pixmap, ctm, colorbv);
 
 	if (scaled)
 		fz_drop_pixmap(ctx, scaled);
+	fz_drop_pixmap(ctx, orig_pixmap);
 
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 }
 
 static void
-fz_draw_clip_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_rect *rect, fz_matrix ctm)
+fz_draw_clip_image_mask(fz_context *ctx, void *user, fz_image *image, fz_rect *rect, fz_matrix ctm)
 {
 	fz_draw_device *dev = user;
-	fz_colorspace *model = dev->dest->colorspace;
 	fz_bbox bbox;
-	fz_pixmap *mask, *dest, *shape;
+	fz_pixmap *mask;
+	fz_pixmap *pixmap, *orig_pixmap;
 	fz_pixmap *scaled = NULL;
-	int dx, dy;
-
-	if (dev->top == dev->stack_max)
-		fz_grow_stack(dev);
+	int dx, dy, partial;
 
 #ifdef DUMP_GROUP_BLENDS
 	dump_spaces(dev->top, "Clip (image mask) begin\n");
@@ -1072,12 +1601,7 @@ fz_draw_clip_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_rect *
 
 	if (image->w == 0 || image->h == 0)
 	{
-		dev->stack[dev->top].scissor = dev->scissor;
-		dev->stack[dev->top].mask = NULL;
-		dev->stack[dev->top].dest = NULL;
-		dev->stack[dev->top].blendmode = dev->blendmode;
-		dev->scissor = fz_empty_bbox;
-		dev->top++;
+		fz_draw_push_scissor(dev, fz_empty_bbox);
 		return;
 	}
 
@@ -1086,52 +1610,53 @@ fz_draw_clip_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_rect *
 	if (rect)
 		bbox = fz_intersect_bbox(bbox, fz_round_rect(*rect));
 
-	mask = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-	fz_clear_pixmap(mask);
-	dest = fz_new_pixmap_with_rect(ctx, model, bbox);
-	/* FIXME: See note #1 */
-	fz_clear_pixmap(dest);
-	if (dev->shape)
+	if (fz_is_empty_rect(bbox))
 	{
-		shape = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-		fz_clear_pixmap(shape);
+		fz_draw_push_scissor(dev, bbox);
+		return;
 	}
-	else
-		shape = NULL;
 
 	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
 	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-	if (dx < image->w && dy < image->h)
+	orig_pixmap = pixmap = fz_draw_image_pixmap(ctx, image, &ctm, bbox, dx, dy, &partial);
+	if (!pixmap)
+	{
+		fz_warn(ctx, "cannot decode image mask");
+		fz_draw_push_scissor(dev, fz_empty_bbox);
+		return;
+	}
+
+	mask = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
+	fz_clear_pixmap(mask);
+
+	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
+	if (dx < pixmap->w && dy < pixmap->h)
 	{
-		int gridfit = !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-		scaled = fz_transform_pixmap(ctx, image, &ctm, dev->dest->x, dev->dest->y, dx, dy, gridfit);
+		int gridfit = !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3) && !partial;
+		scaled = fz_transform_pixmap(ctx, pixmap, NULL, &ctm, dev->dest->x, dev->dest->y, dx, dy, gridfit,
+			fz_draw_is_cached_image(pixmap, partial));
 		if (scaled == NULL)
 		{
 			if (dx < 1)
 				dx = 1;
 			if (dy < 1)
 				dy = 1;
-			scaled = fz_scale_pixmap(ctx, image, image->x, image->y, dx, dy);
+			scaled = fz_scale_pixmap(ctx, pixmap, pixmap->x, pixmap->y, dx, dy);
 		}
 		if (scaled != NULL)
-			image = scaled;
+			pixmap = scaled;
 	}
 
-	fz_paint_image(mask, bbox, dev->shape, image, ctm, 255);
+	if (!partial)
+		fz_gridfit_matrix(&ctm);
+	fz_paint_image(mask, bbox, dev->shape, pixmap, ctm, 255);
 
 	if (scaled)
 		fz_drop_pixmap(ctx, scaled);
+	fz_drop_pixmap(ctx, orig_pixmap);
 
-	dev->stack[dev->top].scissor = dev->scissor;
-	dev->stack[dev->top].mask = mask;
-	dev->stack[dev->top].dest = dev->dest;
-	dev->stack[dev->top].shape = dev->shape;
-	/* FIXME: See note #1 */
-	dev->stack[dev->top].blendmode = dev->blendmode | FZ_BLEND_ISOLATED;
-	dev->scissor = bbox;
-	dev->dest = dest;
-	dev->shape = shape;
-	dev->top++;
+	fz_draw_push_clip(ctx, dev, mask, bbox);
 }
 
 static void
@@ -1152,9 +1677,20 @@ fz_draw_pop_clip(fz_context *ctx, void *user)
 		 * resolved to a rectangle earlier. In this case, we will
 		 * have a dest, and the shape will be unchanged.
 		 */
-		if (mask)
+		if (mask && !dest)
+		{
+			/* Nothing was drawn inside the clip, so there is
+			 * nothing to composite. */
+#ifdef DUMP_GROUP_BLENDS
+			dump_spaces(dev->top, "Clip End (empty)\n");
+#endif
+			assert(shape == dev->shape);
+			if (dev->pending == dev->top)
+				dev->pending = -1;
+			fz_draw_drop_pixmap(ctx, dev, mask);
+		}
+		else if (mask)
 		{
-			assert(dest);
 
 #ifdef DUMP_GROUP_BLENDS
 			dump_spaces(dev->top, "");
@@ -1171,11 +1707,11 @@ fz_draw_pop_clip(fz_context *ctx, void *user)
 			{
 				assert(shape != dev->shape);
 				fz_paint_pixmap_with_mask(shape, dev->shape, mask);
-				fz_drop_pixmap(ctx, dev->shape);
+				fz_draw_drop_pixmap(ctx, dev, dev->shape);
 				dev->shape = shape;
 			}
-			fz_drop_pixmap(ctx, mask);
-			fz_drop_pixmap(ctx, dev->dest);
+			fz_draw_drop_pixmap(ctx, dev, mask);
+			fz_draw_drop_pixmap(ctx, dev, dev->dest);
 			dev->dest = dest;
 #ifdef DUMP_GROUP_BLENDS
 			fz_dump_blend(dev->dest, " to get ");
@@ -1200,15 +1736,18 @@ fz_draw_begin_mask(fz_context *ctx, void *user, fz_rect rect, int luminosity, fz
 {
 	fz_draw_device *dev = user;
 	fz_pixmap *dest;
-	fz_pixmap *shape = dev->shape;
+	fz_pixmap *shape;
 	fz_bbox bbox;
 
 	if (dev->top == dev->stack_max)
 		fz_grow_stack(dev);
 
+	fz_draw_realize_clips(ctx, dev);
+
+	shape = dev->shape;
 	bbox = fz_round_rect(rect);
 	bbox = fz_intersect_bbox(bbox, dev->scissor);
-	dest = fz_new_pixmap_with_rect(ctx, fz_device_gray, bbox);
+	dest = fz_draw_new_pixmap(ctx, dev, fz_device_gray, bbox);
 	if (dev->shape)
 	{
 		/* FIXME: If we ever want to support AIS true, then we
@@ -1258,13 +1797,10 @@ fz_draw_end_mask(fz_context *ctx, void *user)
 	fz_draw_device *dev = user;
 	fz_pixmap *mask = dev->dest;
 	fz_pixmap *maskshape = dev->shape;
-	fz_pixmap *temp, *dest;
+	fz_pixmap *temp;
 	fz_bbox bbox;
 	int luminosity;
 
-	if (dev->top == dev->stack_max)
-		fz_grow_stack(dev);
-
 	if (dev->top > 0)
 	{
 		/* pop soft mask buffer */
@@ -1276,35 +1812,16 @@ fz_draw_end_mask(fz_context *ctx, void *user)
 
 		/* convert to alpha mask */
 		temp = fz_alpha_from_gray(ctx, mask, luminosity);
-		fz_drop_pixmap(ctx, mask);
-		fz_drop_pixmap(ctx, maskshape);
+		fz_draw_drop_pixmap(ctx, dev, mask);
+		fz_draw_drop_pixmap(ctx, dev, maskshape);
 
-		/* create new dest scratch buffer */
+		/* push soft mask as clip mask; the dest scratch buffer (and
+		 * the shape to be masked when we pop) are created on demand */
 		bbox = fz_bound_pixmap(temp);
-		dest = fz_new_pixmap_with_rect(ctx, dev->dest->colorspace, bbox);
-		/* FIXME: See note #1 */
-		fz_clear_pixmap(dest);
-
-		/* push soft mask as clip mask */
-		dev->stack[dev->top].scissor = dev->scissor;
-		dev->stack[dev->top].mask = temp;
-		dev->stack[dev->top].dest = dev->dest;
-		/* FIXME: See note #1 */
-		dev->stack[dev->top].blendmode = dev->blendmode | FZ_BLEND_ISOLATED;
-		/* If we have a shape, then it'll need to be masked with the
-		 * clip mask when we pop. So create a new shape now. */
-		if (dev->shape)
-		{
-			dev->stack[dev->top].shape = dev->shape;
-			dev->shape = fz_new_pixmap_with_rect(ctx, NULL, bbox);
-			fz_clear_pixmap(dev->shape);
-		}
-		dev->scissor = bbox;
-		dev->dest = dest;
 #ifdef DUMP_GROUP_BLENDS
 		dump_spaces(dev->top, "Mask -> Clip\n");
 #endif
-		dev->top++;
+		fz_draw_push_clip(ctx, dev, temp, bbox);
 	}
 }
 
@@ -1322,12 +1839,14 @@ fz_draw_begin_group(fz_context *ctx, void *user, fz_rect rect, int isolated, int
 		return;
 	}
 
+	fz_draw_realize_clips(ctx, dev);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 
 	bbox = fz_round_rect(rect);
 	bbox = fz_intersect_bbox(bbox, dev->scissor);
-	dest = fz_new_pixmap_with_rect(ctx, model, bbox);
+	dest = fz_draw_new_pixmap(ctx, dev, model, bbox);
 
 #ifndef ATTEMPT_KNOCKOUT_AND_ISOLATED
 	knockout = 0;
@@ -1351,7 +1870,7 @@ fz_draw_begin_group(fz_context *ctx, void *user, fz_rect rect, int isolated, int
 	}
 	else
 	{
-		shape = fz_new_pixmap_with_rect(ctx, NULL, bbox);
+		shape = fz_draw_new_pixmap(ctx, dev, NULL, bbox);
 		fz_clear_pixmap(shape);
 	}
 
@@ -1414,14 +1933,14 @@ fz_draw_end_group(fz_context *ctx, void *user)
 		else
 			fz_blend_pixmap(dev->dest, group, alpha * 255, blendmode, isolated, shape);
 
-		fz_drop_pixmap(ctx, group);
+		fz_draw_drop_pixmap(ctx, dev, group);
 		if (shape != dev->shape)
 		{
 			if (dev->shape)
 			{
 				fz_paint_pixmap(dev->shape, shape, alpha * 255);
 			}
-			fz_drop_pixmap(ctx, shape);
+			fz_draw_drop_pixmap(ctx, dev, shape);
 		}
 #ifdef DUMP_GROUP_BLENDS
 		fz_dump_blend(dev->dest, " to get ");
@@ -1449,6 +1968,8 @@ fz_draw_begin_tile(fz_context *ctx, void *user, fz_rect area, fz_rect view, floa
 	if (dev->top == dev->stack_max)
 		fz_grow_stack(dev);
 
+	fz_draw_realize_clips(ctx, dev);
+
 	if (dev->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_begin(ctx, dev);
 
@@ -1553,6 +2074,7 @@ fz_draw_free_user(fz_context *ctx, void *user)
 		fz_warn(ctx, "items left on stack in draw device: %d", dev->top);
 	if (dev->stack != &dev->init_stack[0])
 		fz_free(ctx, dev->stack);
+	fz_free_draw_pool(ctx, &dev->pool);
 	fz_free_gel(dev->gel);
 	fz_free(ctx, dev);
 }
@@ -1567,11 +2089,13 @@ fz_new_draw_device(fz_context *ctx, fz_glyph_cache *cache, fz_pixmap *dest)
 	ddev->dest = dest;
 	ddev->shape = NULL;
 	ddev->top = 0;
+	ddev->pending = -1;
 	ddev->blendmode = 0;
 	ddev->flags = 0;
 	ddev->stack = &ddev->init_stack[0];
 	ddev->stack_max = STACK_SIZE;
 	ddev->ctx = ctx;
+	memset(&ddev->pool, 0, sizeof ddev->pool);
 
 	ddev->scissor.x0 = dest->x;
 	ddev->scissor.y0 = dest->y;
@@ -196,6 +196,19 @@ fz_bound_gel(fz_gel *gel)
 	return bbox;
 }
 
+fz_bbox
+fz_get_gel_clip(fz_gel *gel)
+{
+	fz_bbox bbox;
+	if (gel->clip.x0 > gel->clip.x1)
+		return fz_infinite_bbox;
+	bbox.x0 = gel->clip.x0 / FZ_AA_HSCALE(gel->ctx);
+	bbox.y0 = gel->clip.y0 / FZ_AA_VSCALE(gel->ctx);
+	bbox.x1 = gel->clip.x1 / FZ_AA_HSCALE(gel->ctx);
+	bbox.y1 = gel->clip.y1 / FZ_AA_VSCALE(gel->ctx);
+	return bbox;
+}
+
 enum { INSIDE, OUTSIDE, LEAVE, ENTER };
 
 #define clip_lerp_y(v,m,x0,y0,x1,y1,t) clip_lerp_x(v,m,y0,x0,y1,x1,t)
@@ -742,3 +755,312 @@ fz_scan_convert(fz_gel *gel, int eofill, fz_bbox clip,
 	else
 		fz_scan_convert_sharp(gel, eofill, clip, dst, color);
 }
+
+/*
+ * Hairlines, no more than a pixel wide, bypass the edge list too. Each
+ * segment is walked along its major axis one pixel at a time, and covers
+ * the pixels across it by the length of the band it sweeps through them,
+ * as the scan converter would find for the outline of the segment. The
+ * coverage goes into a mask, where overlapping segments keep the larger
+ * value rather than adding up, and only the touched part of each row of
+ * the mask is painted.
+ */
+
+static inline void
+plot_hairline(unsigned char *mask, int *span, int w, int x, int y, float cov)
+{
+	int v = cov * 255 + 0.5f;
+	if (v > mask[y * w + x])
+	{
+		mask[y * w + x] = v;
+		if (x < span[y * 2])
+			span[y * 2] = x;
+		if (x + 1 > span[y * 2 + 1])
+			span[y * 2 + 1] = x + 1;
+	}
+}
+
+static void
+fz_hairline(unsigned char *mask, int *span, int w, int h, float x0, float y0, float x1, float y1, float width)
+{
+	int steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+	float u0, v0, u1, v1, du, dv, slope, half, ua, ub, t;
+	int umax, vmax, c, r;
+
+	/* u along the major axis, v across it */
+	if (steep)
+	{
+		u0 = y0; v0 = x0; u1 = y1; v1 = x1;
+		umax = h; vmax = w;
+	}
+	else
+	{
+		u0 = x0; v0 = y0; u1 = x1; v1 = y1;
+		umax = w; vmax = h;
+	}
+	if (u0 > u1)
+	{
+		t = u0; u0 = u1; u1 = t;
+		t = v0; v0 = v1; v1 = t;
+	}
+
+	du = u1 - u0;
+	dv = v1 - v0;
+	if (du <= 0)
+		return;
+	slope = dv / du;
+	half = width * sqrtf(du * du + dv * dv) / du * 0.5f;
+
+	ua = MAX(u0, 0);
+	ub = MIN(u1, umax);
+	if (slope != 0)
+	{
+		float uc = u0 + (-1 - half - v0) / slope;
+		float ud = u0 + (vmax + 1 + half - v0) / slope;
+		ua = MAX(ua, MIN(uc, ud));
+		ub = MIN(ub, MAX(uc, ud));
+	}
+	else if (v0 + half < 0 || v0 - half > vmax)
+		return;
+	if (ua >= ub)
+		return;
+
+	for (c = floorf(ua); c < ub; c++)
+	{
+		float s0 = MAX(ua, c);
+		float s1 = MIN(ub, c + 1);
+		float vc = v0 + ((s0 + s1) * 0.5f - u0) * slope;
+		float b0 = vc - half;
+		float b1 = vc + half;
+
+		if (s1 <= s0)
+			continue;
+
+		for (r = floorf(b0); r < b1; r++)
+		{
+			float cov = (MIN(b1, r + 1) - MAX(b0, r)) * (s1 - s0);
+			if (r < 0 || r >= vmax || cov <= 0)
+				continue;
+			if (steep)
+				plot_hairline(mask, span, w, r, c, cov);
+			else
+				plot_hairline(mask, span, w, c, r, cov);
+		}
+	}
+}
+
+/*
+ * The mask covers a band of rows at a time, so that its size does not
+ * grow with the stroke. Segments are sorted by their top and only those
+ * crossing the current band are walked through it.
+ */
+
+#define HAIRLINE_BAND_SIZE (64 * 1024)
+
+typedef struct fz_hairline_seg_s
+{
+	float y0, y1;
+	float *seg;
+} fz_hairline_seg;
+
+static int
+cmp_hairline_seg(const void *a, const void *b)
+{
+	const fz_hairline_seg *sa = a;
+	const fz_hairline_seg *sb = b;
+	return sa->y0 < sb->y0 ? -1 : sa->y0 > sb->y0 ? 1 : 0;
+}
+
+void
+fz_paint_hairlines(fz_context *ctx, float *segs, int len, float width, fz_bbox clip, fz_pixmap *dst, unsigned char *color)
+{
+	fz_hairline_seg *sorted, **active;
+	unsigned char *mask, *dp;
+	int *span;
+	int w, h, bh, i, y, by, next, nactive;
+
+	clip.x0 = MAX(clip.x0, dst->x);
+	clip.y0 = MAX(clip.y0, dst->y);
+	clip.x1 = MIN(clip.x1, dst->x + dst->w);
+	clip.y1 = MIN(clip.y1, dst->y + dst->h);
+	w = clip.x1 - clip.x0;
+	h = clip.y1 - clip.y0;
+	if (w <= 0 || h <= 0 || len == 0)
+		return;
+
+	bh = CLAMP(HAIRLINE_BAND_SIZE / w, 1, h);
+
+	sorted = fz_calloc(ctx, len, sizeof(fz_hairline_seg));
+	active = fz_calloc(ctx, len, sizeof(fz_hairline_seg *));
+	for (i = 0; i < len; i++, segs += 4)
+	{
+		/* widened by more than the half width of a hairline */
+		sorted[i].y0 = MIN(segs[1], segs[3]) - clip.y0 - 2;
+		sorted[i].y1 = MAX(segs[1], segs[3]) - clip.y0 + 2;
+		sorted[i].seg = segs;
+	}
+	qsort(sorted, len, sizeof(fz_hairline_seg), cmp_hairline_seg);
+
+	mask = fz_calloc(ctx, w * bh, 1);
+	span = fz_calloc(ctx, bh * 2, sizeof(int));
+
+	next = nactive = 0;
+	for (by = 0; by < h; by += bh)
+	{
+		int rows = MIN(bh, h - by);
+
+		for (i = 0; i < nactive; )
+		{
+			if (active[i]->y1 < by)
+				active[i] = active[--nactive];
+			else
+				i++;
+		}
+		while (next < len && sorted[next].y0 < by + rows)
+		{
+			if (sorted[next].y1 >= by)
+				active[nactive++] = &sorted[next];
+			next++;
+		}
+		if (nactive == 0)
+			continue;
+
+		for (y = 0; y < rows; y++)
+		{
+			span[y * 2] = w;
+			span[y * 2 + 1] = 0;
+		}
+
+		for (i = 0; i < nactive; i++)
+		{
+			float *seg = active[i]->seg;
+			fz_hairline(mask, span, w, rows,
+				seg[0] - clip.x0, seg[1] - clip.y0 - by,
+				seg[2] - clip.x0, seg[3] - clip.y0 - by, width);
+		}
+
+		for (y = 0; y < rows; y++)
+		{
+			int x0 = span[y * 2];
+			int x1 = span[y * 2 + 1];
+			if (x0 >= x1)
+				continue;
+			dp = dst->samples + ((clip.y0 + by + y - dst->y) * dst->w + (clip.x0 + x0 - dst->x)) * dst->n;
+			if (color)
+				fz_paint_span_with_color(dp, mask + y * w + x0, dst->n, x1 - x0, color);
+			else
+				fz_paint_span(dp, mask + y * w + x0, 1, x1 - x0, 255);
+			memset(mask + y * w + x0, 0, x1 - x0);
+		}
+	}
+
+	fz_free(ctx, span);
+	fz_free(ctx, mask);
+	fz_free(ctx, active);
+	fz_free(ctx, sorted);
+}
+
+/*
+ * Axis-aligned rectangles bypass the edge list. The coverage of each pixel
+ * is computed directly on the same sub-pixel grid that the anti-aliased
+ * scan converter would use, so the results are identical.
+ */
+
+static void
+rect_to_grid(fz_context *ctx, fz_rect r, fz_bbox clip, fz_bbox *g)
+{
+	int hs = FZ_AA_HSCALE(ctx);
+	int vs = FZ_AA_VSCALE(ctx);
+
+	r.x0 = CLAMP(r.x0, clip.x0, clip.x1);
+	r.y0 = CLAMP(r.y0, clip.y0, clip.y1);
+	r.x1 = CLAMP(r.x1, clip.x0, clip.x1);
+	r.y1 = CLAMP(r.y1, clip.y0, clip.y1);
+
+	g->x0 = floorf(r.x0 * hs);
+	g->y0 = floorf(r.y0 * vs);
+	g->x1 = floorf(r.x1 * hs);
+	g->y1 = floorf(r.y1 * vs);
+}
+
+fz_bbox
+fz_bound_rect_gel(fz_context *ctx, fz_rect r, fz_bbox clip)
+{
+	fz_bbox g, bbox;
+
+	rect_to_grid(ctx, r, clip, &g);
+	if (g.x0 == g.x1 || g.y0 == g.y1)
+		return fz_empty_bbox;
+
+	bbox.x0 = fz_idiv(g.x0, FZ_AA_HSCALE(ctx));
+	bbox.y0 = fz_idiv(g.y0, FZ_AA_VSCALE(ctx));
+	bbox.x1 = fz_idiv(g.x1, FZ_AA_HSCALE(ctx)) + 1;
+	bbox.y1 = fz_idiv(g.y1, FZ_AA_VSCALE(ctx)) + 1;
+	return fz_intersect_bbox(bbox, clip);
+}
+
+static inline int
+grid_coverage(int a, int b, int x, int scale)
+{
+	int c = MIN(b, (x + 1) * scale) - MAX(a, x * scale);
+	return c < 0 ? 0 : c;
+}
+
+void
+fz_scan_convert_rect(fz_context *ctx, fz_rect r, fz_bbox clip,
+	fz_pixmap *dst, unsigned char *color)
+{
+	int hs = FZ_AA_HSCALE(ctx);
+	int vs = FZ_AA_VSCALE(ctx);
+	unsigned char *dp, *mp;
+	int *hcov;
+	fz_bbox g, bbox;
+	int x, y, w, n, l, m, vcov;
+
+	bbox = fz_bound_rect_gel(ctx, r, clip);
+	if (fz_is_empty_rect(bbox))
+		return;
+
+	rect_to_grid(ctx, r, clip, &g);
+	w = bbox.x1 - bbox.x0;
+	n = dst->n;
+
+	hcov = fz_malloc(ctx, w * sizeof(int));
+	mp = fz_malloc(ctx, w);
+
+	for (x = 0; x < w; x++)
+		hcov[x] = grid_coverage(g.x0, g.x1, bbox.x0 + x, hs);
+
+	/* l and m delimit the fully covered columns */
+	for (l = 0; l < w && hcov[l] != hs; l++)
+		;
+	for (m = w; m > l && hcov[m - 1] != hs; m--)
+		;
+
+	for (y = bbox.y0; y < bbox.y1; y++)
+	{
+		dp = dst->samples + ((y - dst->y) * dst->w + (bbox.x0 - dst->x)) * n;
+		vcov = grid_coverage(g.y0, g.y1, y, vs);
+		for (x = 0; x < w; x++)
+			mp[x] = AA_SCALE(ctx, hcov[x] * vcov);
+
+		if (vcov == vs && m > l)
+		{
+			if (l > 0)
+				blit_aa(dst, bbox.x0, y, mp, l, color);
+			if (color)
+				fz_paint_solid_color(dp + l * n, n, m - l, color);
+			else
+				fz_paint_solid_alpha(dp + l * n, m - l, 255);
+			if (w > m)
+				blit_aa(dst, bbox.x0 + m, y, mp + m, w - m, color);
+		}
+		else if (vcov > 0)
+		{
+			blit_aa(dst, bbox.x0, y, mp, w, color);
+		}
+	}
+
+	fz_free(ctx, mp);
+	fz_free(ctx, hcov);
+}
@@ -4,22 +4,47 @@
 #define MAX_FONT_SIZE 3000
 #define MAX_GLYPH_SIZE 256
 #define MAX_CACHE_SIZE (1024*1024)
+#define MAX_OUTLINE_CACHE_SIZE (512*1024)
+#define GLYPH_FRONT_SIZE 256
 
 typedef struct fz_glyph_key_s fz_glyph_key;
+typedef struct fz_outline_key_s fz_outline_key;
+
+struct fz_glyph_key_s
+{
+	fz_font *font;
+	int a, b;
+	int c, d;
+	unsigned short gid;
+	unsigned char e, f;
+};
+
+/*
+ * The front cache is a small direct mapped table in front of the hash
+ * table, so that runs of text in one font and size find their glyphs
+ * without hashing. It borrows the pixmaps of the hash table and is
+ * cleared whenever that is evicted.
+ */
+typedef struct fz_glyph_front_s
+{
+	fz_glyph_key key;
+	fz_pixmap *val;
+} fz_glyph_front;
 
 struct fz_glyph_cache_s
 {
 	fz_hash_table *hash;
 	int total;
+	fz_hash_table *outlines;
+	int outline_total;
+	fz_glyph_front front[GLYPH_FRONT_SIZE];
+	int front_hits, hits, misses, uncached, evictions;
 };
 
-struct fz_glyph_key_s
+struct fz_outline_key_s
 {
 	fz_font *font;
-	int a, b;
-	int c, d;
-	unsigned short gid;
-	unsigned char e, f;
+	int gid;
 };
 
 fz_glyph_cache *
@@ -30,6 +55,11 @@ fz_new_glyph_cache(fz_context *ctx)
 	cache = fz_malloc(ctx, sizeof(fz_glyph_cache));
 	cache->hash = fz_new_hash_table(ctx, 509, sizeof(fz_glyph_key));
 	cache->total = 0;
+	cache->outlines = fz_new_hash_table(ctx, 61, sizeof(fz_outline_key));
+	cache->outline_total = 0;
+	memset(cache->front, 0, sizeof cache->front);
+	cache->front_hits = cache->hits = cache->misses = 0;
+	cache->uncached = cache->evictions = 0;
 
 	return cache;
 }
@@ -51,16 +81,43 @@ fz_evict_glyph_cache(fz_context *ctx, fz_glyph_cache *cache)
 			fz_drop_pixmap(ctx, pixmap);
 	}
 
+	if (cache->total > 0)
+		cache->evictions++;
 	cache->total = 0;
+	memset(cache->front, 0, sizeof cache->front);
 
 	fz_empty_hash(cache->hash);
 }
 
+static void
+fz_evict_outline_cache(fz_context *ctx, fz_glyph_cache *cache)
+{
+	fz_outline_key *key;
+	fz_path *path;
+	int i;
+
+	for (i = 0; i < fz_hash_len(cache->outlines); i++)
+	{
+		key = fz_hash_get_key(cache->outlines, i);
+		if (key->font)
+			fz_drop_font(ctx, key->font);
+		path = fz_hash_get_val(cache->outlines, i);
+		if (path)
+			fz_free_path(path);
+	}
+
+	cache->outline_total = 0;
+
+	fz_empty_hash(cache->outlines);
+}
+
 void
 fz_free_glyph_cache(fz_context *ctx, fz_glyph_cache *cache)
 {
 	fz_evict_glyph_cache(ctx, cache);
 	fz_free_hash(ctx, cache->hash);
+	fz_evict_outline_cache(ctx, cache);
+	fz_free_hash(ctx, cache->outlines);
 	fz_free(ctx, cache);
 }
 
@@ -72,16 +129,148 @@ fz_render_stroked_glyph(fz_context *ctx, fz_glyph_cache *cache, fz_font *font, i
 	return fz_render_glyph(ctx, cache, font, gid, trm, NULL);
 }
 
+/*
+ * Glyphs too large to be kept as bitmaps are filled from their outlines
+ * instead. Returns NULL if the glyph should be rendered with
+ * fz_render_glyph. The outline is in glyph space, to be drawn with trm,
+ * and is owned by the cache: it stays valid until the next call.
+ */
+fz_path *
+fz_outline_glyph(fz_context *ctx, fz_glyph_cache *cache, fz_font *font, int gid, fz_matrix trm)
+{
+	fz_outline_key key;
+	fz_path *path;
+	int size;
+
+	if (!font->ft_face || fabsf(trm.a * trm.d - trm.b * trm.c) <= MAX_GLYPH_SIZE * MAX_GLYPH_SIZE)
+		return NULL;
+
+	memset(&key, 0, sizeof key);
+	key.font = font;
+	key.gid = gid;
+
+	path = fz_hash_find(cache->outlines, &key);
+	if (path)
+		return path;
+
+	path = fz_outline_ft_glyph(ctx, font, gid);
+	if (!path)
+		return NULL;
+
+	size = path->cmd_len + path->coord_len * sizeof(float);
+	if (cache->outline_total + size > MAX_OUTLINE_CACHE_SIZE)
+		fz_evict_outline_cache(ctx, cache);
+	fz_keep_font(font);
+	fz_hash_insert(ctx, cache->outlines, &key, path);
+	cache->outline_total += size;
+
+	return path;
+}
+
+void
+fz_set_glyph_subpixels(fz_context *ctx, int hsubpix, int vsubpix)
+{
+	ctx->fz_glyph_hsubpix = CLAMP(hsubpix, 1, 16);
+	ctx->fz_glyph_vsubpix = CLAMP(vsubpix, 1, 16);
+}
+
+void
+fz_get_glyph_subpixels(fz_context *ctx, int *hsubpix, int *vsubpix)
+{
+	*hsubpix = ctx->fz_glyph_hsubpix;
+	*vsubpix = ctx->fz_glyph_vsubpix;
+}
+
+void
+fz_set_glyph_snap(fz_context *ctx, float snap)
+{
+	ctx->fz_glyph_snap = MAX(snap, 0);
+}
+
+float
+fz_get_glyph_snap(fz_context *ctx)
+{
+	return ctx->fz_glyph_snap;
+}
+
+fz_matrix
+fz_snap_glyph_matrix(fz_context *ctx, fz_matrix trm, int *x, int *y)
+{
+	double hsub = ctx->fz_glyph_hsubpix;
+	double vsub = ctx->fz_glyph_vsubpix;
+	float snap = ctx->fz_glyph_snap;
+
+	*x = floorf(trm.e);
+	*y = floorf(trm.f);
+	trm.e = ((int)((trm.e - floorf(trm.e)) * hsub)) / hsub;
+	trm.f = ((int)((trm.f - floorf(trm.f)) * vsub)) / vsub;
+
+	if (snap > 0)
+	{
+		float a = floorf(trm.a / snap + 0.5f) * snap;
+		float b = floorf(trm.b / snap + 0.5f) * snap;
+		float c = floorf(trm.c / snap + 0.5f) * snap;
+		float d = floorf(trm.d / snap + 0.5f) * snap;
+		/* Keep the exact matrix rather than collapse the glyph */
+		if (a * d - b * c != 0)
+		{
+			trm.a = a;
+			trm.b = b;
+			trm.c = c;
+			trm.d = d;
+		}
+	}
+
+	return trm;
+}
+
+void
+fz_debug_glyph_cache(fz_glyph_cache *cache)
+{
+	int lookups = cache->front_hits + cache->hits + cache->misses;
+	printf("glyph cache: %d lookups, %d hits (%d in front), %d misses, %d too large to keep\n",
+		lookups, cache->front_hits + cache->hits, cache->front_hits, cache->misses, cache->uncached);
+	printf("glyph cache: %d bytes, %d evictions, hit rate %.1f%%\n",
+		cache->total, cache->evictions,
+		lookups ? 100.0 * (cache->front_hits + cache->hits) / lookups : 0.0);
+}
+
+static inline int
+fz_glyph_front_index(fz_font *font, int gid, int e, int f)
+{
+	unsigned int h = (unsigned int)((size_t)font >> 4);
+	return (h * 31 + gid * 7 + e * 3 + f) & (GLYPH_FRONT_SIZE - 1);
+}
+
 fz_pixmap *
 fz_render_glyph(fz_context *ctx, fz_glyph_cache *cache, fz_font *font, int gid, fz_matrix ctm, fz_colorspace *model)
 {
 	fz_glyph_key key;
+	fz_glyph_front *front;
 	fz_pixmap *val;
-	float size = fz_matrix_expansion(ctm);
+	float size;
+	int a, b, c, d, e, f;
+
+	a = ctm.a * 65536;
+	b = ctm.b * 65536;
+	c = ctm.c * 65536;
+	d = ctm.d * 65536;
+	e = (unsigned char)((ctm.e - floorf(ctm.e)) * 256);
+	f = (unsigned char)((ctm.f - floorf(ctm.f)) * 256);
+
+	front = &cache->front[fz_glyph_front_index(font, gid, e, f)];
+	if (front->val && front->key.font == font && front->key.gid == gid &&
+		front->key.a == a && front->key.b == b && front->key.c == c && front->key.d == d &&
+		front->key.e == e && front->key.f == f)
+	{
+		cache->front_hits++;
+		return fz_keep_pixmap(front->val);
+	}
 
+	size = fz_matrix_expansion(ctm);
 	if (size > MAX_FONT_SIZE)
 	{
-		/* TODO: this case should be handled by rendering glyph as a path fill */
+		/* the draw device fills large FreeType glyphs with fz_outline_glyph */
 		fz_warn(ctx, "font size too large (%g), not rendering glyph", size);
 		return NULL;
 	}
@@ -89,16 +278,23 @@ fz_render_glyph(fz_context *ctx, fz_glyph_cache *cache, fz_font *font, int gid,
 	memset(&key, 0, sizeof key);
 	key.font = font;
 	key.gid = gid;
-	key.a = ctm.a * 65536;
-	key.b = ctm.b * 65536;
-	key.c = ctm.c * 65536;
-	key.d = ctm.d * 65536;
-	key.e = (ctm.e - floorf(ctm.e)) * 256;
-	key.f = (ctm.f - floorf(ctm.f)) * 256;
+	key.a = a;
+	key.b = b;
+	key.c = c;
+	key.d = d;
+	key.e = e;
+	key.f = f;
 
 	val = fz_hash_find(cache->hash, &key);
 	if (val)
+	{
+		cache->hits++;
+		front->key = key;
+		front->val = val;
 		return fz_keep_pixmap(val);
+	}
+
+	cache->misses++;
 
 	ctm.e = floorf(ctm.e) + key.e / 256.0f;
 	ctm.f = floorf(ctm.f) + key.f / 256.0f;
@@ -126,8 +322,11 @@ fz_render_glyph(fz_context *ctx, fz_glyph_cache *cache, fz_font *font, int gid,
 			fz_keep_font(key.font);
 			fz_hash_insert(ctx, cache->hash, &key, val);
 			cache->total += val->w * val->h;
+			front->key = key;
+			front->val = val;
 			return fz_keep_pixmap(val);
 		}
+		cache->uncached++;
 		return val;
 	}
 
@@ -1,5 +1,9 @@
 #include "fitz.h"
 
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 /*
  * polygon clipping
  */
@@ -302,181 +306,320 @@ fz_paint_triangle(fz_pixmap *pix, float *av, float *bv, float *cv, int n, fz_bbo
 	}
 }
 
-static void
-fz_paint_quad(fz_pixmap *pix,
-		fz_point p0, fz_point p1, fz_point p2, fz_point p3,
-		float c0, float c1, float c2, float c3,
-		int n, fz_bbox bbox)
-{
-	float v[4][3];
-
-	v[0][0] = p0.x;
-	v[0][1] = p0.y;
-	v[0][2] = c0;
-
-	v[1][0] = p1.x;
-	v[1][1] = p1.y;
-	v[1][2] = c1;
-
-	v[2][0] = p2.x;
-	v[2][1] = p2.y;
-	v[2][2] = c2;
-
-	v[3][0] = p3.x;
-	v[3][1] = p3.y;
-	v[3][2] = c3;
-
-	fz_paint_triangle(pix, v[0], v[2], v[3], n, bbox);
-	fz_paint_triangle(pix, v[0], v[3], v[1], n, bbox);
-}
-
 /*
  * linear, radial and mesh painting
  */
 
-#define HUGENUM 32000 /* how far to extend axial/radial shadings */
-#define RADSEGS 32 /* how many segments to generate for radial meshes */
-
-static fz_point
-fz_point_on_circle(fz_point p, float r, float theta)
-{
-	p.x = p.x + cosf(theta) * r;
-	p.y = p.y + sinf(theta) * r;
+/*
+ * Axial and radial shadings are evaluated at the centre of every pixel.
+ * A span of pixels at a time is first filled with the gradient parameter,
+ * scaled to 0..255, and a coverage byte, and then mapped through the
+ * premultiplied color lookup table straight into the destination.
+ */
 
-	return p;
-}
+enum { SPAN = 256 };
 
 static void
-fz_paint_linear(fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
+fz_shade_span(unsigned char * restrict dp, unsigned char * restrict sp, int w, int n,
+	unsigned char clut[256][FZ_MAX_COLORS])
 {
-	fz_point p0, p1;
-	fz_point v0, v1, v2, v3;
-	fz_point e0, e1;
-	float theta;
-
-	p0.x = shade->mesh[0];
-	p0.y = shade->mesh[1];
-	p0 = fz_transform_point(ctm, p0);
-
-	p1.x = shade->mesh[3];
-	p1.y = shade->mesh[4];
-	p1 = fz_transform_point(ctm, p1);
-
-	theta = atan2f(p1.y - p0.y, p1.x - p0.x);
-	theta += (float)M_PI * 0.5f;
-
-	v0 = fz_point_on_circle(p0, HUGENUM, theta);
-	v1 = fz_point_on_circle(p1, HUGENUM, theta);
-	v2 = fz_point_on_circle(p0, -HUGENUM, theta);
-	v3 = fz_point_on_circle(p1, -HUGENUM, theta);
-
-	fz_paint_quad(dest, v0, v1, v2, v3, 0, 255, 0, 255, 3, bbox);
-
-	if (shade->extend[0])
+	if (n == 4)
 	{
-		e0.x = v0.x - (p1.x - p0.x) * HUGENUM;
-		e0.y = v0.y - (p1.y - p0.y) * HUGENUM;
-
-		e1.x = v2.x - (p1.x - p0.x) * HUGENUM;
-		e1.y = v2.y - (p1.y - p0.y) * HUGENUM;
-
-		fz_paint_quad(dest, e0, e1, v0, v2, 0, 0, 0, 0, 3, bbox);
+		for (; w > 0; w--, sp += 2, dp += 4)
+		{
+			if (sp[1])
+				memcpy(dp, clut[sp[0]], 4);
+			else
+				memset(dp, 0, 4);
+		}
 	}
-
-	if (shade->extend[1])
+	else
 	{
-		e0.x = v1.x + (p1.x - p0.x) * HUGENUM;
-		e0.y = v1.y + (p1.y - p0.y) * HUGENUM;
+		for (; w > 0; w--, sp += 2, dp += n)
+		{
+			if (sp[1])
+				memcpy(dp, clut[sp[0]], n);
+			else
+				memset(dp, 0, n);
+		}
+	}
+}
 
-		e1.x = v3.x + (p1.x - p0.x) * HUGENUM;
-		e1.y = v3.y + (p1.y - p0.y) * HUGENUM;
+static inline void
+fz_paint_linear_span(unsigned char * restrict p, int w, float t0, float dt, int ext0, int ext1)
+{
+	int x = 0;
+
+#ifdef HAVE_SSE2
+	__m128 zero = _mm_setzero_ps();
+	__m128 top = _mm_set1_ps(255);
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 ones = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	__m128 e0 = ext0 ? ones : zero;
+	__m128 e1 = ext1 ? ones : zero;
+	__m128 vt0 = _mm_set1_ps(t0);
+	__m128 vdt = _mm_set1_ps(dt);
+	__m128 offs = _mm_set_ps(3, 2, 1, 0);
+	for (; x + 16 <= w; x += 16)
+	{
+		__m128i v[4], a[4], vb, ab;
+		int i;
+		for (i = 0; i < 4; i++)
+		{
+			__m128 xs = _mm_add_ps(_mm_set1_ps((float)(x + i * 4)), offs);
+			__m128 t = _mm_add_ps(vt0, _mm_mul_ps(xs, vdt));
+			__m128 m = _mm_and_ps(_mm_or_ps(_mm_cmpge_ps(t, zero), e0), _mm_or_ps(_mm_cmple_ps(t, top), e1));
+			t = _mm_min_ps(_mm_max_ps(t, zero), top);
+			v[i] = _mm_cvttps_epi32(_mm_add_ps(t, half));
+			a[i] = _mm_castps_si128(m);
+		}
+		vb = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+		ab = _mm_packs_epi16(_mm_packs_epi32(a[0], a[1]), _mm_packs_epi32(a[2], a[3]));
+		_mm_storeu_si128((__m128i *)(p + x * 2), _mm_unpacklo_epi8(vb, ab));
+		_mm_storeu_si128((__m128i *)(p + x * 2 + 16), _mm_unpackhi_epi8(vb, ab));
+	}
+#endif
 
-		fz_paint_quad(dest, e0, e1, v1, v3, 255, 255, 255, 255, 3, bbox);
+	for (; x < w; x++)
+	{
+		float t = t0 + (float)x * dt;
+		int covered = (t >= 0 || ext0) && (t <= 255 || ext1);
+		t = t < 0 ? 0 : t > 255 ? 255 : t;
+		p[x * 2] = covered ? (int)(t + 0.5f) : 0;
+		p[x * 2 + 1] = covered ? 255 : 0;
 	}
 }
 
 static void
-fz_paint_annulus(fz_matrix ctm,
-		fz_point p0, float r0, float c0,
-		fz_point p1, float r1, float c1,
-		fz_pixmap *dest, fz_bbox bbox)
+fz_paint_linear(fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox,
+	unsigned char clut[256][FZ_MAX_COLORS])
 {
-	fz_point t0, t1, t2, t3, b0, b1, b2, b3;
-	float theta, step;
-	int i;
+	unsigned char span[SPAN * 2];
+	fz_matrix inv;
+	float x0, y0, dx, dy, len2;
+	float ta, tb, tc;
+	int x, y;
 
-	theta = atan2f(p1.y - p0.y, p1.x - p0.x);
-	step = (float)M_PI * 2 / RADSEGS;
+	if (ctm.a * ctm.d - ctm.b * ctm.c == 0)
+		return;
+	inv = fz_invert_matrix(ctm);
+
+	x0 = shade->mesh[0];
+	y0 = shade->mesh[1];
+	dx = shade->mesh[3] - x0;
+	dy = shade->mesh[4] - y0;
+	len2 = dx * dx + dy * dy;
+	if (len2 == 0)
+		return;
 
-	for (i = 0; i < RADSEGS / 2; i++)
-	{
-		t0 = fz_point_on_circle(p0, r0, theta + i * step);
-		t1 = fz_point_on_circle(p0, r0, theta + i * step + step);
-		t2 = fz_point_on_circle(p1, r1, theta + i * step);
-		t3 = fz_point_on_circle(p1, r1, theta + i * step + step);
-		b0 = fz_point_on_circle(p0, r0, theta - i * step);
-		b1 = fz_point_on_circle(p0, r0, theta - i * step - step);
-		b2 = fz_point_on_circle(p1, r1, theta - i * step);
-		b3 = fz_point_on_circle(p1, r1, theta - i * step - step);
+	/* the parameter is an affine function of the device position */
+	ta = (inv.a * dx + inv.b * dy) * 255 / len2;
+	tb = (inv.c * dx + inv.d * dy) * 255 / len2;
+	tc = ((inv.e - x0) * dx + (inv.f - y0) * dy) * 255 / len2;
 
-		t0 = fz_transform_point(ctm, t0);
-		t1 = fz_transform_point(ctm, t1);
-		t2 = fz_transform_point(ctm, t2);
-		t3 = fz_transform_point(ctm, t3);
-		b0 = fz_transform_point(ctm, b0);
-		b1 = fz_transform_point(ctm, b1);
-		b2 = fz_transform_point(ctm, b2);
-		b3 = fz_transform_point(ctm, b3);
+	bbox = fz_intersect_bbox(bbox, fz_bound_pixmap(dest));
 
-		fz_paint_quad(dest, t0, t1, t2, t3, c0, c0, c1, c1, 3, bbox);
-		fz_paint_quad(dest, b0, b1, b2, b3, c0, c0, c1, c1, 3, bbox);
+	for (y = bbox.y0; y < bbox.y1; y++)
+	{
+		unsigned char *dp = dest->samples + ((y - dest->y) * dest->w + (bbox.x0 - dest->x)) * dest->n;
+		for (x = bbox.x0; x < bbox.x1; x += SPAN)
+		{
+			int w = MIN(SPAN, bbox.x1 - x);
+			float t0 = (x + 0.5f) * ta + (y + 0.5f) * tb + tc;
+			fz_paint_linear_span(span, w, t0, ta, shade->extend[0], shade->extend[1]);
+			fz_shade_span(dp, span, w, dest->n, clut);
+			dp += w * dest->n;
+		}
 	}
 }
 
-static void
-fz_paint_radial(fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
+/*
+ * A radial shading paints the circles between the two given ones, and
+ * the last circle painted over a point decides its color. Find the
+ * largest s where the point lies on the circle with centre p0 + s * dp
+ * and radius r0 + s * dr by solving a * s^2 - 2 * b * s + c = 0.
+ */
+static inline int
+fz_radial_param(float a, float b, float c, float r0, float dr, int ext0, int ext1, float *sp)
 {
-	fz_point p0, p1;
-	float r0, r1;
-	fz_point e;
-	float er, rs;
+	float s[2], q, disc;
+	int i, n;
 
-	p0.x = shade->mesh[0];
-	p0.y = shade->mesh[1];
-	r0 = shade->mesh[2];
+	disc = b * b - a * c;
+	if (disc < 0)
+		return 0;
+	q = b < 0 ? b - sqrtf(disc) : b + sqrtf(disc);
 
-	p1.x = shade->mesh[3];
-	p1.y = shade->mesh[4];
-	r1 = shade->mesh[5];
+	if (a == 0)
+	{
+		if (q == 0)
+			return 0;
+		s[0] = c / q;
+		n = 1;
+	}
+	else if (q == 0)
+	{
+		s[0] = 0;
+		n = 1;
+	}
+	else
+	{
+		s[0] = q / a;
+		s[1] = c / q;
+		if (s[1] > s[0])
+		{
+			float swp = s[0]; s[0] = s[1]; s[1] = swp;
+		}
+		n = 2;
+	}
 
-	if (shade->extend[0])
+	for (i = 0; i < n; i++)
 	{
-		if (r0 < r1)
-			rs = r0 / (r0 - r1);
+		if (r0 + s[i] * dr < 0)
+			continue;
+		if (s[i] < 0)
+		{
+			if (!ext0)
+				continue;
+			*sp = 0;
+		}
+		else if (s[i] > 1)
+		{
+			if (!ext1)
+				continue;
+			*sp = 1;
+		}
 		else
-			rs = -HUGENUM;
+			*sp = s[i];
+		return 1;
+	}
 
-		e.x = p0.x + (p1.x - p0.x) * rs;
-		e.y = p0.y + (p1.y - p0.y) * rs;
-		er = r0 + (r1 - r0) * rs;
+	return 0;
+}
 
-		fz_paint_annulus(ctm, e, er, 0, p0, r0, 0, dest, bbox);
+#ifdef HAVE_SSE2
+/* Four pixels at a time of the above, for circles that give two roots */
+static int
+fz_paint_radial_sse(unsigned char *span, int w, float sx0, float sy0, float ia, float ib,
+	float a, float dx, float dy, float r0, float dr, int ext0, int ext1)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1);
+	__m128 ones = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	__m128 e0 = ext0 ? ones : zero;
+	__m128 e1 = ext1 ? ones : zero;
+	__m128 va = _mm_set1_ps(a);
+	__m128 vdx = _mm_set1_ps(dx);
+	__m128 vdy = _mm_set1_ps(dy);
+	__m128 vr0 = _mm_set1_ps(r0);
+	__m128 vdr = _mm_set1_ps(dr);
+	__m128 r0dr = _mm_set1_ps(r0 * dr);
+	__m128 r0r0 = _mm_set1_ps(r0 * r0);
+	__m128 offs = _mm_set_ps(3, 2, 1, 0);
+	int i;
+
+	for (i = 0; i + 4 <= w; i += 4)
+	{
+		__m128 xs = _mm_add_ps(_mm_set1_ps((float)i), offs);
+		__m128 sx = _mm_add_ps(_mm_set1_ps(sx0), _mm_mul_ps(xs, _mm_set1_ps(ia)));
+		__m128 sy = _mm_add_ps(_mm_set1_ps(sy0), _mm_mul_ps(xs, _mm_set1_ps(ib)));
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, vdx), _mm_mul_ps(sy, vdy)), r0dr);
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), r0r0);
+		__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+		__m128 ok = _mm_cmpge_ps(disc, zero);
+		__m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+		__m128 neg = _mm_cmplt_ps(b, zero);
+		__m128 q = _mm_or_ps(_mm_and_ps(neg, _mm_sub_ps(b, sq)), _mm_andnot_ps(neg, _mm_add_ps(b, sq)));
+		__m128 qz = _mm_cmpeq_ps(q, zero);
+		__m128 s0 = _mm_andnot_ps(qz, _mm_div_ps(q, va));
+		__m128 s1 = _mm_andnot_ps(qz, _mm_div_ps(c, _mm_or_ps(q, _mm_and_ps(qz, one))));
+		__m128 hi = _mm_max_ps(s0, s1);
+		__m128 lo = _mm_min_ps(s0, s1);
+		__m128 vhi = _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(vr0, _mm_mul_ps(hi, vdr)), zero),
+			_mm_and_ps(_mm_or_ps(_mm_cmpge_ps(hi, zero), e0), _mm_or_ps(_mm_cmple_ps(hi, one), e1)));
+		__m128 vlo = _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(vr0, _mm_mul_ps(lo, vdr)), zero),
+			_mm_and_ps(_mm_or_ps(_mm_cmpge_ps(lo, zero), e0), _mm_or_ps(_mm_cmple_ps(lo, one), e1)));
+		__m128 s = _mm_or_ps(_mm_and_ps(vhi, hi), _mm_andnot_ps(vhi, lo));
+		__m128 m = _mm_and_ps(ok, _mm_or_ps(vhi, vlo));
+		union { __m128i v; int i[4]; } val, cov;
+		int k;
+		s = _mm_min_ps(_mm_max_ps(s, zero), one);
+		val.v = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(s, _mm_set1_ps(255)), _mm_set1_ps(0.5f)));
+		cov.v = _mm_castps_si128(m);
+		for (k = 0; k < 4; k++)
+		{
+			span[(i + k) * 2] = cov.i[k] ? val.i[k] : 0;
+			span[(i + k) * 2 + 1] = cov.i[k] ? 255 : 0;
+		}
 	}
 
-	fz_paint_annulus(ctm, p0, r0, 0, p1, r1, 255, dest, bbox);
+	return i;
+}
+#endif
 
-	if (shade->extend[1])
-	{
-		if (r0 > r1)
-			rs = r1 / (r1 - r0);
-		else
-			rs = -HUGENUM;
+static void
+fz_paint_radial(fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox,
+	unsigned char clut[256][FZ_MAX_COLORS])
+{
+	unsigned char span[SPAN * 2];
+	fz_matrix inv;
+	float x0, y0, r0, dx, dy, dr, a;
+	int ext0 = shade->extend[0];
+	int ext1 = shade->extend[1];
+	int x, y, i;
+
+	if (ctm.a * ctm.d - ctm.b * ctm.c == 0)
+		return;
+	inv = fz_invert_matrix(ctm);
+
+	x0 = shade->mesh[0];
+	y0 = shade->mesh[1];
+	r0 = shade->mesh[2];
+	dx = shade->mesh[3] - x0;
+	dy = shade->mesh[4] - y0;
+	dr = shade->mesh[5] - r0;
+	a = dx * dx + dy * dy - dr * dr;
 
-		e.x = p1.x + (p0.x - p1.x) * rs;
-		e.y = p1.y + (p0.y - p1.y) * rs;
-		er = r1 + (r0 - r1) * rs;
+	bbox = fz_intersect_bbox(bbox, fz_bound_pixmap(dest));
 
-		fz_paint_annulus(ctm, p1, r1, 255, e, er, 255, dest, bbox);
+	for (y = bbox.y0; y < bbox.y1; y++)
+	{
+		unsigned char *dp = dest->samples + ((y - dest->y) * dest->w + (bbox.x0 - dest->x)) * dest->n;
+		for (x = bbox.x0; x < bbox.x1; x += SPAN)
+		{
+			int w = MIN(SPAN, bbox.x1 - x);
+			float px = x + 0.5f;
+			float py = y + 0.5f;
+			/* position relative to the first centre, in shading space */
+			float sx0 = px * inv.a + py * inv.c + inv.e - x0;
+			float sy0 = px * inv.b + py * inv.d + inv.f - y0;
+
+			i = 0;
+#ifdef HAVE_SSE2
+			if (a != 0)
+				i = fz_paint_radial_sse(span, w, sx0, sy0, inv.a, inv.b, a, dx, dy, r0, dr, ext0, ext1);
+#endif
+			for (; i < w; i++)
+			{
+				float sx = sx0 + i * inv.a;
+				float sy = sy0 + i * inv.b;
+				float b = sx * dx + sy * dy + r0 * dr;
+				float c = sx * sx + sy * sy - r0 * r0;
+				float s;
+				if (fz_radial_param(a, b, c, r0, dr, ext0, ext1, &s))
+				{
+					span[i * 2] = (int)(s * 255 + 0.5f);
+					span[i * 2 + 1] = 255;
+				}
+				else
+				{
+					span[i * 2] = 0;
+					span[i * 2 + 1] = 0;
+				}
+			}
+			fz_shade_span(dp, span, w, dest->n, clut);
+			dp += w * dest->n;
+		}
 	}
 }
 
@@ -519,12 +662,299 @@ fz_paint_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest,
 	}
 }
 
+/*
+ * Patch meshes are subdivided in device space until each piece is flat
+ * enough, and its colors close enough to linear, to be drawn as two
+ * triangles, so the amount of work follows the size of the output. All
+ * patches are split the same number of times, which keeps the pieces on
+ * either side of a shared edge from leaving cracks between them.
+ */
+
+#define PATCH_FLATNESS 0.3f /* in pixels */
+#define PATCH_COLOR_ERROR 2.0f /* in units of 1/255 */
+#define PATCH_MIN_SIZE 2.0f /* in pixels */
+#define PATCH_MAX_DEPTH 6 /* in each direction */
+
+typedef struct fz_tensor_patch_s fz_tensor_patch;
+
+struct fz_tensor_patch_s
+{
+	fz_point pole[4][4];
+	float color[4][FZ_MAX_COLORS];
+};
+
+static inline void
+midcolor(float *c, float *c1, float *c2, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		c[i] = (c1[i] + c2[i]) * 0.5f;
+}
+
+/*
+ * Split the bezier curve given by pole[0]..pole[3] at its midpoint with
+ * de Casteljau's algorithm into q0[0]..q0[3] and q1[0]..q1[3]. The
+ * indices are multiplied by polestep, which is 1 for the curves along a
+ * row of the patch and 4 for those along a column.
+ */
+static void
+split_curve(fz_point *pole, fz_point *q0, fz_point *q1, int polestep)
+{
+	float x12 = (pole[1 * polestep].x + pole[2 * polestep].x) * 0.5f;
+	float y12 = (pole[1 * polestep].y + pole[2 * polestep].y) * 0.5f;
+
+	q0[1 * polestep].x = (pole[0 * polestep].x + pole[1 * polestep].x) * 0.5f;
+	q0[1 * polestep].y = (pole[0 * polestep].y + pole[1 * polestep].y) * 0.5f;
+	q1[2 * polestep].x = (pole[2 * polestep].x + pole[3 * polestep].x) * 0.5f;
+	q1[2 * polestep].y = (pole[2 * polestep].y + pole[3 * polestep].y) * 0.5f;
+
+	q0[2 * polestep].x = (q0[1 * polestep].x + x12) * 0.5f;
+	q0[2 * polestep].y = (q0[1 * polestep].y + y12) * 0.5f;
+	q1[1 * polestep].x = (x12 + q1[2 * polestep].x) * 0.5f;
+	q1[1 * polestep].y = (y12 + q1[2 * polestep].y) * 0.5f;
+
+	q0[3 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
+	q0[3 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
+	q1[0 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
+	q1[0 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
+
+	q0[0 * polestep].x = pole[0 * polestep].x;
+	q0[0 * polestep].y = pole[0 * polestep].y;
+	q1[3 * polestep].x = pole[3 * polestep].x;
+	q1[3 * polestep].y = pole[3 * polestep].y;
+}
+
+/* Split the columns, giving two patches of half the height */
+static void
+split_stripe(fz_tensor_patch *p, fz_tensor_patch *s0, fz_tensor_patch *s1, int n)
+{
+	split_curve(&p->pole[0][0], &s0->pole[0][0], &s1->pole[0][0], 4);
+	split_curve(&p->pole[0][1], &s0->pole[0][1], &s1->pole[0][1], 4);
+	split_curve(&p->pole[0][2], &s0->pole[0][2], &s1->pole[0][2], 4);
+	split_curve(&p->pole[0][3], &s0->pole[0][3], &s1->pole[0][3], 4);
+
+	memcpy(s0->color[0], p->color[0], n * sizeof(float));
+	memcpy(s0->color[1], p->color[1], n * sizeof(float));
+	midcolor(s0->color[2], p->color[1], p->color[2], n);
+	midcolor(s0->color[3], p->color[0], p->color[3], n);
+
+	memcpy(s1->color[0], s0->color[3], n * sizeof(float));
+	memcpy(s1->color[1], s0->color[2], n * sizeof(float));
+	memcpy(s1->color[2], p->color[2], n * sizeof(float));
+	memcpy(s1->color[3], p->color[3], n * sizeof(float));
+}
+
+/* Split the rows, giving two patches of half the width */
+static void
+split_patch(fz_tensor_patch *p, fz_tensor_patch *s0, fz_tensor_patch *s1, int n)
+{
+	split_curve(p->pole[0], s0->pole[0], s1->pole[0], 1);
+	split_curve(p->pole[1], s0->pole[1], s1->pole[1], 1);
+	split_curve(p->pole[2], s0->pole[2], s1->pole[2], 1);
+	split_curve(p->pole[3], s0->pole[3], s1->pole[3], 1);
+
+	memcpy(s0->color[0], p->color[0], n * sizeof(float));
+	midcolor(s0->color[1], p->color[0], p->color[1], n);
+	midcolor(s0->color[2], p->color[2], p->color[3], n);
+	memcpy(s0->color[3], p->color[3], n * sizeof(float));
+
+	memcpy(s1->color[0], s0->color[1], n * sizeof(float));
+	memcpy(s1->color[1], p->color[1], n * sizeof(float));
+	memcpy(s1->color[2], p->color[2], n * sizeof(float));
+	memcpy(s1->color[3], s0->color[2], n * sizeof(float));
+}
+
+/* How far the inner control points are from evenly spaced on the chord */
+static inline float
+curve_error(fz_point a, fz_point b, fz_point c, fz_point d)
+{
+	float ex = fabsf(3 * b.x - 2 * a.x - d.x);
+	float ey = fabsf(3 * b.y - 2 * a.y - d.y);
+	float fx = fabsf(3 * c.x - a.x - 2 * d.x);
+	float fy = fabsf(3 * c.y - a.y - 2 * d.y);
+	return MAX(MAX(ex, ey), MAX(fx, fy)) / 3;
+}
+
+static int
+fz_cull_patch(fz_tensor_patch *p, fz_bbox bbox, float *w, float *h)
+{
+	float x0, y0, x1, y1;
+	int i, k;
+
+	x0 = x1 = p->pole[0][0].x;
+	y0 = y1 = p->pole[0][0].y;
+	for (i = 0; i < 4; i++)
+	{
+		for (k = 0; k < 4; k++)
+		{
+			x0 = MIN(x0, p->pole[i][k].x);
+			y0 = MIN(y0, p->pole[i][k].y);
+			x1 = MAX(x1, p->pole[i][k].x);
+			y1 = MAX(y1, p->pole[i][k].y);
+		}
+	}
+	if (w)
+	{
+		/* the length of the sides, across the rows and down the columns */
+		*w = MAX(fabsf(p->pole[0][3].x - p->pole[0][0].x), fabsf(p->pole[0][3].y - p->pole[0][0].y));
+		*h = MAX(fabsf(p->pole[3][0].x - p->pole[0][0].x), fabsf(p->pole[3][0].y - p->pole[0][0].y));
+	}
+	return x1 < bbox.x0 || y1 < bbox.y0 || x0 > bbox.x1 || y0 > bbox.y1;
+}
+
+/*
+ * Find how many times the rows and the columns of a patch must be split.
+ * The curve errors shrink by four with every split across them, while
+ * the twist and color errors halve with a split either way.
+ */
+static void
+fz_patch_depth(fz_tensor_patch *p, int n, float w, float h, int *rowdepth, int *coldepth)
+{
+	float rowerr = 0, colerr = 0, twist, colorerr = 0;
+	int i, k, r = 0, c = 0;
+
+	for (i = 0; i < 4; i++)
+	{
+		rowerr = MAX(rowerr, curve_error(p->pole[i][0], p->pole[i][1], p->pole[i][2], p->pole[i][3]));
+		colerr = MAX(colerr, curve_error(p->pole[0][i], p->pole[1][i], p->pole[2][i], p->pole[3][i]));
+	}
+
+	/* how far the patch is from a parallelogram with linear colors */
+	twist = MAX(fabsf(p->pole[0][0].x - p->pole[0][3].x + p->pole[3][3].x - p->pole[3][0].x),
+		fabsf(p->pole[0][0].y - p->pole[0][3].y + p->pole[3][3].y - p->pole[3][0].y)) / 4;
+	for (k = 0; k < n; k++)
+		colorerr = MAX(colorerr, fabsf(p->color[0][k] - p->color[1][k] + p->color[2][k] - p->color[3][k]) * 255 / 4);
+	twist = MAX(twist, colorerr * PATCH_FLATNESS / PATCH_COLOR_ERROR);
+
+	while (r < PATCH_MAX_DEPTH || c < PATCH_MAX_DEPTH)
+	{
+		int canrow = r < PATCH_MAX_DEPTH && w > PATCH_MIN_SIZE;
+		int cancol = c < PATCH_MAX_DEPTH && h > PATCH_MIN_SIZE;
+		if (canrow && rowerr > PATCH_FLATNESS && rowerr >= colerr)
+			rowerr /= 4, twist /= 2, w /= 2, r++;
+		else if (cancol && colerr > PATCH_FLATNESS)
+			colerr /= 4, twist /= 2, h /= 2, c++;
+		else if (canrow && rowerr > PATCH_FLATNESS)
+			rowerr /= 4, twist /= 2, w /= 2, r++;
+		else if (twist > PATCH_FLATNESS && (canrow || cancol))
+		{
+			if (canrow && (w >= h || !cancol))
+				w /= 2, r++;
+			else
+				h /= 2, c++;
+			twist /= 2;
+		}
+		else
+			break;
+	}
+
+	*rowdepth = r;
+	*coldepth = c;
+}
+
+static void
+fz_paint_tensor_patch(fz_context *ctx, fz_shade *shade, fz_tensor_patch *p, int rowdepth, int coldepth,
+	fz_pixmap *dest, fz_bbox bbox)
+{
+	fz_tensor_patch s0, s1;
+	float tri[4][MAXN];
+	int n = shade->use_function ? 1 : shade->colorspace->n;
+	int i, k;
+
+	if (fz_cull_patch(p, bbox, NULL, NULL))
+		return;
+
+	if (rowdepth > 0 || coldepth > 0)
+	{
+		if (rowdepth > 0)
+		{
+			split_patch(p, &s0, &s1, n);
+			rowdepth--;
+		}
+		else
+		{
+			split_stripe(p, &s0, &s1, n);
+			coldepth--;
+		}
+		fz_paint_tensor_patch(ctx, shade, &s0, rowdepth, coldepth, dest, bbox);
+		fz_paint_tensor_patch(ctx, shade, &s1, rowdepth, coldepth, dest, bbox);
+		return;
+	}
+
+	for (i = 0; i < 4; i++)
+	{
+		static const int corner[4][2] = { { 0, 0 }, { 0, 3 }, { 3, 3 }, { 3, 0 } };
+		tri[i][0] = p->pole[corner[i][0]][corner[i][1]].x;
+		tri[i][1] = p->pole[corner[i][0]][corner[i][1]].y;
+		if (shade->use_function)
+			tri[i][2] = p->color[i][0] * 255;
+		else
+		{
+			fz_convert_color(ctx, shade->colorspace, p->color[i], dest->colorspace, tri[i] + 2);
+			for (k = 0; k < dest->colorspace->n; k++)
+				tri[i][k + 2] *= 255;
+		}
+	}
+
+	n = shade->use_function ? 3 : 2 + dest->colorspace->n;
+	fz_paint_triangle(dest, tri[0], tri[1], tri[3], n, bbox);
+	fz_paint_triangle(dest, tri[1], tri[3], tri[2], n, bbox);
+}
+
+static void
+fz_load_patch(fz_tensor_patch *patch, float *v, int n, fz_matrix ctm)
+{
+	int i, k;
+
+	for (i = 0; i < 4; i++)
+	{
+		for (k = 0; k < 4; k++)
+		{
+			fz_point p;
+			p.x = v[(i * 4 + k) * 2];
+			p.y = v[(i * 4 + k) * 2 + 1];
+			patch->pole[i][k] = fz_transform_point(ctm, p);
+		}
+	}
+	for (i = 0; i < 4; i++)
+		memcpy(patch->color[i], v + 32 + i * n, n * sizeof(float));
+}
+
+static void
+fz_paint_patches(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
+{
+	fz_tensor_patch patch;
+	int n = shade->use_function ? 1 : shade->colorspace->n;
+	int size = 32 + 4 * n;
+	int rowdepth = 0, coldepth = 0;
+	float *v, *end = shade->mesh + shade->mesh_len;
+
+	for (v = shade->mesh; v + size <= end; v += size)
+	{
+		float w, h;
+		int r, c;
+		fz_load_patch(&patch, v, n, ctm);
+		if (fz_cull_patch(&patch, bbox, &w, &h))
+			continue;
+		fz_patch_depth(&patch, n, w, h, &r, &c);
+		rowdepth = MAX(rowdepth, r);
+		coldepth = MAX(coldepth, c);
+	}
+
+	for (v = shade->mesh; v + size <= end; v += size)
+	{
+		fz_load_patch(&patch, v, n, ctm);
+		fz_paint_tensor_patch(ctx, shade, &patch, rowdepth, coldepth, dest, bbox);
+	}
+}
+
 void
 fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
 {
 	unsigned char clut[256][FZ_MAX_COLORS];
 	fz_pixmap *temp, *conv;
 	float color[FZ_MAX_COLORS];
+	float value[FZ_MAX_COLORS + 1];
 	int i, k;
 
 	ctm = fz_concat(shade->matrix, ctm);
@@ -533,12 +963,35 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest,
 	{
 		for (i = 0; i < 256; i++)
 		{
-			fz_convert_color(ctx, shade->colorspace, shade->function[i], dest->colorspace, color);
+			fz_shade_function_value(shade->function, i, value);
+			fz_convert_color(ctx, shade->colorspace, value, dest->colorspace, color);
 			for (k = 0; k < dest->colorspace->n; k++)
 				clut[i][k] = color[k] * 255;
-			clut[i][k] = shade->function[i][shade->colorspace->n] * 255;
+			clut[i][k] = value[shade->colorspace->n] * 255;
 		}
 		conv = fz_new_pixmap_with_rect(ctx, dest->colorspace, bbox);
+	}
+
+	/* axial and radial shadings always have a function */
+	if (shade->type == FZ_LINEAR || shade->type == FZ_RADIAL)
+	{
+		if (!shade->use_function)
+			return;
+		for (i = 0; i < 256; i++)
+			for (k = 0; k < conv->n - 1; k++)
+				clut[i][k] = fz_mul255(clut[i][k], clut[i][conv->n - 1]);
+		fz_clear_pixmap(conv);
+		if (shade->type == FZ_LINEAR)
+			fz_paint_linear(shade, ctm, conv, bbox, clut);
+		else
+			fz_paint_radial(shade, ctm, conv, bbox, clut);
+		fz_paint_pixmap(dest, conv, 255);
+		fz_drop_pixmap(ctx, conv);
+		return;
+	}
+
+	if (shade->use_function)
+	{
 		temp = fz_new_pixmap_with_rect(ctx, fz_device_gray, bbox);
 		fz_clear_pixmap(temp);
 	}
@@ -547,12 +1000,10 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest,
 		temp = dest;
 	}
 
-	switch (shade->type)
-	{
-	case FZ_LINEAR: fz_paint_linear(shade, ctm, temp, bbox); break;
-	case FZ_RADIAL: fz_paint_radial(shade, ctm, temp, bbox); break;
-	case FZ_MESH: fz_paint_mesh(ctx, shade, ctm, temp, bbox); break;
-	}
+	if (shade->type == FZ_PATCH)
+		fz_paint_patches(ctx, shade, ctm, temp, bbox);
+	else
+		fz_paint_mesh(ctx, shade, ctm, temp, bbox);
 
 	if (shade->use_function)
 	{
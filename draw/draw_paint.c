@@ -154,9 +154,98 @@ fz_paint_span_with_color_N(byte * restrict dp, byte * restrict mp, int n, int w,
 	}
 }
 
+/* An opaque color over mostly empty or solid masks, such as glyphs:
+ * skip the uncovered pixels and store the color over the covered ones. */
+
+static inline void
+fz_paint_span_with_solid_color_2(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	int g = color[0];
+	while (w--)
+	{
+		int ma = *mp++;
+		if (ma == 255)
+		{
+			dp[0] = g;
+			dp[1] = 255;
+		}
+		else if (ma != 0)
+		{
+			ma = FZ_EXPAND(ma);
+			dp[0] = FZ_BLEND(g, dp[0], ma);
+			dp[1] = FZ_BLEND(255, dp[1], ma);
+		}
+		dp += 2;
+	}
+}
+
+static inline void
+fz_paint_span_with_solid_color_4(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	int r = color[0];
+	int g = color[1];
+	int b = color[2];
+	while (w--)
+	{
+		int ma = *mp++;
+		if (ma == 255)
+		{
+			dp[0] = r;
+			dp[1] = g;
+			dp[2] = b;
+			dp[3] = 255;
+		}
+		else if (ma != 0)
+		{
+			ma = FZ_EXPAND(ma);
+			dp[0] = FZ_BLEND(r, dp[0], ma);
+			dp[1] = FZ_BLEND(g, dp[1], ma);
+			dp[2] = FZ_BLEND(b, dp[2], ma);
+			dp[3] = FZ_BLEND(255, dp[3], ma);
+		}
+		dp += 4;
+	}
+}
+
+static inline void
+fz_paint_span_with_solid_color_N(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
+{
+	int n1 = n - 1;
+	int k;
+	while (w--)
+	{
+		int ma = *mp++;
+		if (ma == 255)
+		{
+			for (k = 0; k < n1; k++)
+				dp[k] = color[k];
+			dp[k] = 255;
+		}
+		else if (ma != 0)
+		{
+			ma = FZ_EXPAND(ma);
+			for (k = 0; k < n1; k++)
+				dp[k] = FZ_BLEND(color[k], dp[k], ma);
+			dp[k] = FZ_BLEND(255, dp[k], ma);
+		}
+		dp += n;
+	}
+}
+
 void
 fz_paint_span_with_color(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
 {
+	if (color[n - 1] == 255)
+	{
+		switch (n)
+		{
+		case 2: fz_paint_span_with_solid_color_2(dp, mp, w, color); break;
+		case 4: fz_paint_span_with_solid_color_4(dp, mp, w, color); break;
+		default: fz_paint_span_with_solid_color_N(dp, mp, n, w, color); break;
+		}
+		return;
+	}
+
 	switch (n)
 	{
 	case 2: fz_paint_span_with_color_2(dp, mp, w, color); break;
@@ -4,18 +4,67 @@
 
 enum { BUTT = 0, ROUND = 1, SQUARE = 2, TRIANGLE = 3, MITER = 0, BEVEL = 2 };
 
+/*
+ * Flattened segments go either straight into the gel, or are recorded
+ * in device space for the path cache below and for hairlines. Hairlines
+ * record the center lines of the stroke rather than its outline.
+ */
+struct flat_sink
+{
+	fz_gel *gel;
+	fz_context *ctx;
+	int record;
+	int hairline;
+	fz_bbox clip; /* dashes wholly outside it may be skipped */
+	int len, cap;
+	float *segs;
+};
+
+static void
+fz_init_sink(struct flat_sink *out, fz_context *ctx, fz_gel *gel)
+{
+	memset(out, 0, sizeof *out);
+	out->ctx = ctx;
+	out->gel = gel;
+	out->record = !gel;
+	out->clip = gel ? fz_get_gel_clip(gel) : fz_infinite_bbox;
+}
+
+static void
+emit(struct flat_sink *out, float x0, float y0, float x1, float y1)
+{
+	float *p;
+
+	if (!out->record)
+	{
+		fz_insert_gel(out->gel, x0, y0, x1, y1);
+		return;
+	}
+
+	if (out->len == out->cap)
+	{
+		out->cap = out->cap ? out->cap * 2 : 64;
+		out->segs = fz_realloc(out->ctx, out->segs, out->cap * 4 * sizeof(float));
+	}
+	p = out->segs + out->len++ * 4;
+	p[0] = x0;
+	p[1] = y0;
+	p[2] = x1;
+	p[3] = y1;
+}
+
 static void
-line(fz_gel *gel, fz_matrix *ctm, float x0, float y0, float x1, float y1)
+line(struct flat_sink *out, fz_matrix *ctm, float x0, float y0, float x1, float y1)
 {
 	float tx0 = ctm->a * x0 + ctm->c * y0 + ctm->e;
 	float ty0 = ctm->b * x0 + ctm->d * y0 + ctm->f;
 	float tx1 = ctm->a * x1 + ctm->c * y1 + ctm->e;
 	float ty1 = ctm->b * x1 + ctm->d * y1 + ctm->f;
-	fz_insert_gel(gel, tx0, ty0, tx1, ty1);
+	emit(out, tx0, ty0, tx1, ty1);
 }
 
 static void
-bezier(fz_gel *gel, fz_matrix *ctm, float flatness,
+bezier(struct flat_sink *out, fz_matrix *ctm, float flatness,
 	float xa, float ya,
 	float xb, float yb,
 	float xc, float yc,
@@ -36,7 +85,7 @@ bezier(fz_gel *gel, fz_matrix *ctm, float flatness,
 	dmax = MAX(dmax, ABS(yd - yc));
 	if (dmax < flatness || depth >= MAX_DEPTH)
 	{
-		line(gel, ctm, xa, ya, xd, yd);
+		line(out, ctm, xa, ya, xd, yd);
 		return;
 	}
 
@@ -64,56 +113,56 @@ bezier(fz_gel *gel, fz_matrix *ctm, float flatness,
 
 	xabcd *= 0.125f; yabcd *= 0.125f;
 
-	bezier(gel, ctm, flatness, xa, ya, xab, yab, xabc, yabc, xabcd, yabcd, depth + 1);
-	bezier(gel, ctm, flatness, xabcd, yabcd, xbcd, ybcd, xcd, ycd, xd, yd, depth + 1);
+	bezier(out, ctm, flatness, xa, ya, xab, yab, xabc, yabc, xabcd, yabcd, depth + 1);
+	bezier(out, ctm, flatness, xabcd, yabcd, xbcd, ybcd, xcd, ycd, xd, yd, depth + 1);
 }
 
-void
-fz_flatten_fill_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_matrix ctm, float flatness)
+static void
+fz_flatten_fill_imp(fz_context *ctx, struct flat_sink *out, fz_path *path, fz_matrix ctm, float flatness)
 {
 	float x1, y1, x2, y2, x3, y3;
 	float cx = 0;
 	float cy = 0;
 	float bx = 0;
 	float by = 0;
-	int i = 0;
+	int i, k = 0;
 
-	while (i < path->len)
+	for (i = 0; i < path->cmd_len; i++)
 	{
-		switch (path->items[i++].k)
+		switch (path->cmds[i])
 		{
 		case FZ_MOVETO:
 			/* implicit closepath before moveto */
 			if (i && (cx != bx || cy != by))
-				line(gel, &ctm, cx, cy, bx, by);
-			x1 = path->items[i++].v;
-			y1 = path->items[i++].v;
+				line(out, &ctm, cx, cy, bx, by);
+			x1 = path->coords[k++];
+			y1 = path->coords[k++];
 			cx = bx = x1;
 			cy = by = y1;
 			break;
 
 		case FZ_LINETO:
-			x1 = path->items[i++].v;
-			y1 = path->items[i++].v;
-			line(gel, &ctm, cx, cy, x1, y1);
+			x1 = path->coords[k++];
+			y1 = path->coords[k++];
+			line(out, &ctm, cx, cy, x1, y1);
 			cx = x1;
 			cy = y1;
 			break;
 
 		case FZ_CURVETO:
-			x1 = path->items[i++].v;
-			y1 = path->items[i++].v;
-			x2 = path->items[i++].v;
-			y2 = path->items[i++].v;
-			x3 = path->items[i++].v;
-			y3 = path->items[i++].v;
-			bezier(gel, &ctm, flatness, cx, cy, x1, y1, x2, y2, x3, y3, 0);
+			x1 = path->coords[k++];
+			y1 = path->coords[k++];
+			x2 = path->coords[k++];
+			y2 = path->coords[k++];
+			x3 = path->coords[k++];
+			y3 = path->coords[k++];
+			bezier(out, &ctm, flatness, cx, cy, x1, y1, x2, y2, x3, y3, 0);
 			cx = x3;
 			cy = y3;
 			break;
 
 		case FZ_CLOSE_PATH:
-			line(gel, &ctm, cx, cy, bx, by);
+			line(out, &ctm, cx, cy, bx, by);
 			cx = bx;
 			cy = by;
 			break;
@@ -121,14 +170,15 @@ fz_flatten_fill_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_matrix ctm,
 	}
 
 	if (i && (cx != bx || cy != by))
-		line(gel, &ctm, cx, cy, bx, by);
+		line(out, &ctm, cx, cy, bx, by);
 }
 
 struct sctx
 {
-	fz_gel *gel;
+	struct flat_sink *out;
 	fz_matrix *ctm;
 	float flatness;
+	int hairline;
 
 	int linejoin;
 	float linewidth;
@@ -145,6 +195,17 @@ struct sctx
 	int offset;
 	float phase;
 	fz_point cur;
+
+	/* the pattern, repeated twice if it has an odd number of entries */
+	int dash_count;
+	float dash_period;
+	float dash_start[64];
+	int toggle0, offset0;
+	float phase0;
+
+	/* device space area outside of which dashes are skipped */
+	int skip;
+	fz_rect clip;
 };
 
 static void
@@ -154,7 +215,7 @@ fz_add_line(struct sctx *s, float x0, float y0, float x1, float y1)
 	float ty0 = s->ctm->b * x0 + s->ctm->d * y0 + s->ctm->f;
 	float tx1 = s->ctm->a * x1 + s->ctm->c * y1 + s->ctm->e;
 	float ty1 = s->ctm->b * x1 + s->ctm->d * y1 + s->ctm->f;
-	fz_insert_gel(s->gel, tx0, ty0, tx1, ty1);
+	emit(s->out, tx0, ty0, tx1, ty1);
 }
 
 static void
@@ -204,15 +265,100 @@ fz_add_arc(struct sctx *s,
 static void
 fz_add_line_stroke(struct sctx *s, fz_point a, fz_point b)
 {
-	float dx = b.x - a.x;
-	float dy = b.y - a.y;
-	float scale = s->linewidth / sqrtf(dx * dx + dy * dy);
-	float dlx = dy * scale;
-	float dly = -dx * scale;
+	float dx, dy, scale, dlx, dly;
+
+	if (s->hairline)
+	{
+		fz_add_line(s, a.x, a.y, b.x, b.y);
+		return;
+	}
+
+	dx = b.x - a.x;
+	dy = b.y - a.y;
+	scale = s->linewidth / sqrtf(dx * dx + dy * dy);
+	dlx = dy * scale;
+	dly = -dx * scale;
 	fz_add_line(s, a.x - dlx, a.y - dly, b.x - dlx, b.y - dly);
 	fz_add_line(s, b.x + dlx, b.y + dly, a.x + dlx, a.y + dly);
 }
 
+/*
+ * Hairline segments already meet at a join, so only what a join adds
+ * beyond the half width around the point is drawn: a line along the
+ * outer bisector, ending half a width short of the join's furthest
+ * point. Round and bevel joins reach no further than that, miters do.
+ */
+static void
+fz_add_hairline_join(struct sctx *s, fz_point a, fz_point b, fz_point c)
+{
+	float linewidth = s->linewidth;
+	float dx0, dy0, dx1, dy1, len0, len1;
+	float mx, my, mr, cosine, scale;
+
+	if (s->linejoin != MITER)
+		return;
+
+	dx0 = b.x - a.x;
+	dy0 = b.y - a.y;
+	dx1 = c.x - b.x;
+	dy1 = c.y - b.y;
+	len0 = sqrtf(dx0 * dx0 + dy0 * dy0);
+	len1 = sqrtf(dx1 * dx1 + dy1 * dy1);
+	if (len0 < FLT_EPSILON || len1 < FLT_EPSILON)
+		return;
+	dx0 /= len0;
+	dy0 /= len0;
+	dx1 /= len1;
+	dy1 /= len1;
+
+	/* the cosine of half the turn; the miter is linewidth / cosine long */
+	cosine = sqrtf((dx0 + dx1) * (dx0 + dx1) + (dy0 + dy1) * (dy0 + dy1)) * 0.5f;
+	if (cosine * s->miterlimit < 1)
+		return;
+
+	mx = dx0 - dx1;
+	my = dy0 - dy1;
+	mr = sqrtf(mx * mx + my * my);
+	if (mr < FLT_EPSILON)
+		return;
+
+	scale = (linewidth / cosine - linewidth) / mr;
+	fz_add_line(s, b.x, b.y, b.x + mx * scale, b.y + my * scale);
+}
+
+/*
+ * A hairline cap continues the line by the length that covers as much
+ * as the cap would: the half width for a square, a quarter of pi times
+ * it for a round cap and half of it for a triangle. Overlapping hairlines
+ * do not add up, so the continuation starts two pixels back along the
+ * line to cover the pixel the line ends in by itself.
+ */
+static void
+fz_add_hairline_cap(struct sctx *s, fz_point a, fz_point b, int linecap)
+{
+	fz_matrix *ctm = s->ctm;
+	float dx = b.x - a.x;
+	float dy = b.y - a.y;
+	float len = sqrtf(dx * dx + dy * dy);
+	float tdx, tdy, back, scale;
+
+	if (linecap == BUTT || len < FLT_EPSILON)
+		return;
+
+	if (linecap == ROUND)
+		scale = s->linewidth * (float)M_PI * 0.25f / len;
+	else if (linecap == TRIANGLE)
+		scale = s->linewidth * 0.5f / len;
+	else
+		scale = s->linewidth / len;
+
+	tdx = ctm->a * dx + ctm->c * dy;
+	tdy = ctm->b * dx + ctm->d * dy;
+	back = MIN(1, 2 / sqrtf(tdx * tdx + tdy * tdy));
+
+	fz_add_line(s, b.x - dx * back, b.y - dy * back, b.x + dx * scale, b.y + dy * scale);
+}
+
 static void
 fz_add_line_join(struct sctx *s, fz_point a, fz_point b, fz_point c)
 {
@@ -228,6 +374,12 @@ fz_add_line_join(struct sctx *s, fz_point a, fz_point b, fz_point c)
 	float scale;
 	float cross;
 
+	if (s->hairline)
+	{
+		fz_add_hairline_join(s, a, b, c);
+		return;
+	}
+
 	dx0 = b.x - a.x;
 	dy0 = b.y - a.y;
 
@@ -306,13 +458,19 @@ fz_add_line_cap(struct sctx *s, fz_point a, fz_point b, int linecap)
 {
 	float flatness = s->flatness;
 	float linewidth = s->linewidth;
+	float dx, dy, scale, dlx, dly;
 
-	float dx = b.x - a.x;
-	float dy = b.y - a.y;
+	if (s->hairline)
+	{
+		fz_add_hairline_cap(s, a, b, linecap);
+		return;
+	}
 
-	float scale = linewidth / sqrtf(dx * dx + dy * dy);
-	float dlx = dy * scale;
-	float dly = -dx * scale;
+	dx = b.x - a.x;
+	dy = b.y - a.y;
+	scale = linewidth / sqrtf(dx * dx + dy * dy);
+	dlx = dy * scale;
+	dly = -dx * scale;
 
 	if (linecap == BUTT)
 		fz_add_line(s, b.x - dlx, b.y - dly, b.x + dlx, b.y + dly);
@@ -366,6 +524,13 @@ fz_add_line_dot(struct sctx *s, fz_point a)
 	float oy = a.y;
 	int i;
 
+	/* a square dot, as long as the line is wide */
+	if (s->hairline)
+	{
+		fz_add_line(s, a.x - linewidth, a.y, a.x + linewidth, a.y);
+		return;
+	}
+
 	for (i = 1; i < n; i++)
 	{
 		float theta = (float)M_PI * 2 * i / n;
@@ -512,16 +677,17 @@ fz_stroke_bezier(struct sctx *s,
 	fz_stroke_bezier(s, xabcd, yabcd, xbcd, ybcd, xcd, ycd, xd, yd, depth + 1);
 }
 
-void
-fz_flatten_stroke_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
+static void
+fz_flatten_stroke_imp(fz_context *ctx, struct flat_sink *out, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
 {
 	struct sctx s;
 	fz_point p0, p1, p2, p3;
-	int i;
+	int i, k = 0;
 
-	s.gel = gel;
+	s.out = out;
 	s.ctm = &ctm;
 	s.flatness = flatness;
+	s.hairline = out->hairline;
 
 	s.linejoin = stroke->linejoin;
 	s.linewidth = linewidth * 0.5f; /* hairlines use a different value from the path value */
@@ -539,9 +705,7 @@ fz_flatten_stroke_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_st
 
 	s.cap = stroke->start_cap;
 
-	i = 0;
-
-	if (path->len > 0 && path->items[0].k != FZ_MOVETO)
+	if (path->cmd_len > 0 && path->cmds[0] != FZ_MOVETO)
 	{
 		fz_warn(ctx, "assert: path must begin with moveto");
 		return;
@@ -549,32 +713,32 @@ fz_flatten_stroke_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_st
 
 	p0.x = p0.y = 0;
 
-	while (i < path->len)
+	for (i = 0; i < path->cmd_len; i++)
 	{
-		switch (path->items[i++].k)
+		switch (path->cmds[i])
 		{
 		case FZ_MOVETO:
-			p1.x = path->items[i++].v;
-			p1.y = path->items[i++].v;
+			p1.x = path->coords[k++];
+			p1.y = path->coords[k++];
 			fz_stroke_flush(&s, stroke->start_cap, stroke->end_cap);
 			fz_stroke_moveto(&s, p1);
 			p0 = p1;
 			break;
 
 		case FZ_LINETO:
-			p1.x = path->items[i++].v;
-			p1.y = path->items[i++].v;
+			p1.x = path->coords[k++];
+			p1.y = path->coords[k++];
 			fz_stroke_lineto(&s, p1);
 			p0 = p1;
 			break;
 
 		case FZ_CURVETO:
-			p1.x = path->items[i++].v;
-			p1.y = path->items[i++].v;
-			p2.x = path->items[i++].v;
-			p2.y = path->items[i++].v;
-			p3.x = path->items[i++].v;
-			p3.y = path->items[i++].v;
+			p1.x = path->coords[k++];
+			p1.y = path->coords[k++];
+			p2.x = path->coords[k++];
+			p2.y = path->coords[k++];
+			p3.x = path->coords[k++];
+			p3.y = path->coords[k++];
 			fz_stroke_bezier(&s, p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, p3.x, p3.y, 0);
 			p0 = p3;
 			break;
@@ -588,22 +752,43 @@ fz_flatten_stroke_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_st
 	fz_stroke_flush(&s, stroke->start_cap, stroke->end_cap);
 }
 
+/* Set the dash state to a distance pos into the pattern. */
 static void
-fz_dash_moveto(struct sctx *s, fz_point a, int start_cap, int end_cap)
+fz_dash_seek(struct sctx *s, float pos)
 {
-	s->toggle = 1;
-	s->offset = 0;
-	s->phase = s->dash_phase;
+	int j = 0;
 
-	while (s->phase >= s->dash_list[s->offset])
+	pos = fmodf(pos, s->dash_period);
+	if (pos < 0)
+		pos += s->dash_period;
+
+	while (j + 1 < s->dash_count && pos >= s->dash_list[j % s->dash_len])
 	{
-		s->toggle = !s->toggle;
-		s->phase -= s->dash_list[s->offset];
-		s->offset ++;
-		if (s->offset == s->dash_len)
-			s->offset = 0;
+		pos -= s->dash_list[j % s->dash_len];
+		j++;
 	}
 
+	s->offset = j % s->dash_len;
+	s->toggle = !(j & 1);
+	s->phase = pos;
+}
+
+static float
+fz_dash_pos(struct sctx *s)
+{
+	int j = s->offset;
+	if (s->toggle == (j & 1))
+		j += s->dash_len;
+	return s->dash_start[j] + s->phase;
+}
+
+static void
+fz_dash_moveto(struct sctx *s, fz_point a, int start_cap, int end_cap)
+{
+	s->toggle = s->toggle0;
+	s->offset = s->offset0;
+	s->phase = s->phase0;
+
 	s->cur = a;
 
 	if (s->toggle)
@@ -615,7 +800,7 @@ fz_dash_moveto(struct sctx *s, fz_point a, int start_cap, int end_cap)
 }
 
 static void
-fz_dash_lineto(struct sctx *s, fz_point b, int dash_cap)
+fz_dash_walk(struct sctx *s, fz_point b, int dash_cap)
 {
 	float dx, dy;
 	float total, used, ratio;
@@ -663,6 +848,98 @@ fz_dash_lineto(struct sctx *s, fz_point b, int dash_cap)
 	}
 }
 
+/* Move along len units of the path to b without drawing the dashes on
+ * the way, which cannot be seen. */
+static void
+fz_dash_skip(struct sctx *s, fz_point b, float len, int dash_cap)
+{
+	fz_dash_seek(s, fz_dash_pos(s) + len);
+
+	s->cur = b;
+
+	if (s->toggle)
+	{
+		fz_stroke_flush(s, s->cap, dash_cap);
+		s->cap = dash_cap;
+		fz_stroke_moveto(s, b);
+	}
+}
+
+/* The part of the line from a to b inside r, as fractions of its length. */
+static int
+fz_clip_line(fz_rect r, fz_point a, fz_point b, float *t0, float *t1)
+{
+	float p[4], q[4];
+	float u0 = 0, u1 = 1;
+	int i;
+
+	p[0] = a.x - b.x; q[0] = a.x - r.x0;
+	p[1] = b.x - a.x; q[1] = r.x1 - a.x;
+	p[2] = a.y - b.y; q[2] = a.y - r.y0;
+	p[3] = b.y - a.y; q[3] = r.y1 - a.y;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (p[i] == 0)
+		{
+			if (q[i] < 0)
+				return 0;
+		}
+		else
+		{
+			float t = q[i] / p[i];
+			if (p[i] < 0)
+				u0 = MAX(u0, t);
+			else
+				u1 = MIN(u1, t);
+		}
+	}
+
+	*t0 = u0;
+	*t1 = u1;
+	return u0 < u1;
+}
+
+static void
+fz_dash_lineto(struct sctx *s, fz_point b, int dash_cap)
+{
+	fz_point a = s->cur;
+	float dx = b.x - a.x;
+	float dy = b.y - a.y;
+	float total, t0, t1;
+	fz_point m;
+
+	/* long lines, zoomed in, mostly run outside the clip */
+	if (s->skip)
+	{
+		total = sqrtf(dx * dx + dy * dy);
+		if (total > s->dash_period)
+		{
+			if (!fz_clip_line(s->clip, fz_transform_point(*s->ctm, a), fz_transform_point(*s->ctm, b), &t0, &t1))
+			{
+				fz_dash_skip(s, b, total, dash_cap);
+				return;
+			}
+			if (t0 > 0)
+			{
+				m.x = a.x + t0 * dx;
+				m.y = a.y + t0 * dy;
+				fz_dash_skip(s, m, t0 * total, dash_cap);
+			}
+			if (t1 < 1)
+			{
+				m.x = a.x + t1 * dx;
+				m.y = a.y + t1 * dy;
+				fz_dash_walk(s, m, dash_cap);
+				fz_dash_skip(s, b, (1 - t1) * total, dash_cap);
+				return;
+			}
+		}
+	}
+
+	fz_dash_walk(s, b, dash_cap);
+}
+
 static void
 fz_dash_bezier(struct sctx *s,
 	float xa, float ya,
@@ -721,17 +998,18 @@ fz_dash_bezier(struct sctx *s,
 	fz_dash_bezier(s, xabcd, yabcd, xbcd, ybcd, xcd, ycd, xd, yd, depth + 1, dash_cap);
 }
 
-void
-fz_flatten_dash_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
+static void
+fz_flatten_dash_imp(fz_context *ctx, struct flat_sink *out, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
 {
 	struct sctx s;
 	fz_point p0, p1, p2, p3, beg;
 	float phase_len;
-	int i;
+	int i, k = 0;
 
-	s.gel = gel;
+	s.out = out;
 	s.ctm = &ctm;
 	s.flatness = flatness;
+	s.hairline = out->hairline;
 
 	s.linejoin = stroke->linejoin;
 	s.linewidth = linewidth * 0.5f;
@@ -749,7 +1027,7 @@ fz_flatten_dash_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_stat
 
 	s.cap = stroke->start_cap;
 
-	if (path->len > 0 && path->items[0].k != FZ_MOVETO)
+	if (path->cmd_len > 0 && path->cmds[0] != FZ_MOVETO)
 	{
 		fz_warn(ctx, "assert: path must begin with moveto");
 		return;
@@ -760,38 +1038,63 @@ fz_flatten_dash_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_stat
 		phase_len += stroke->dash_list[i];
 	if (phase_len < 0.01f || phase_len < stroke->linewidth * 0.5f)
 	{
-		fz_flatten_stroke_path(ctx, gel, path, stroke, ctm, flatness, linewidth);
+		fz_flatten_stroke_imp(ctx, out, path, stroke, ctm, flatness, linewidth);
 		return;
 	}
 
+	/* every subpath starts in the same place in the pattern */
+	s.dash_count = stroke->dash_len & 1 ? stroke->dash_len * 2 : stroke->dash_len;
+	s.dash_period = 0;
+	for (i = 0; i < s.dash_count; i++)
+	{
+		s.dash_start[i] = s.dash_period;
+		s.dash_period += stroke->dash_list[i % stroke->dash_len];
+	}
+	fz_dash_seek(&s, stroke->dash_phase);
+	s.toggle0 = s.toggle;
+	s.offset0 = s.offset;
+	s.phase0 = s.phase;
+
+	s.skip = 0;
+	if (!fz_is_infinite_rect(out->clip))
+	{
+		/* far enough out that no join or cap reaches back in */
+		float stretch = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b + ctm.c * ctm.c + ctm.d * ctm.d);
+		float margin = stretch * s.linewidth * MAX(s.miterlimit, 2) + 2;
+		s.clip.x0 = out->clip.x0 - margin;
+		s.clip.y0 = out->clip.y0 - margin;
+		s.clip.x1 = out->clip.x1 + margin;
+		s.clip.y1 = out->clip.y1 + margin;
+		s.skip = 1;
+	}
+
 	p0.x = p0.y = 0;
-	i = 0;
 
-	while (i < path->len)
+	for (i = 0; i < path->cmd_len; i++)
 	{
-		switch (path->items[i++].k)
+		switch (path->cmds[i])
 		{
 		case FZ_MOVETO:
-			p1.x = path->items[i++].v;
-			p1.y = path->items[i++].v;
+			p1.x = path->coords[k++];
+			p1.y = path->coords[k++];
 			fz_dash_moveto(&s, p1, stroke->start_cap, stroke->end_cap);
 			beg = p0 = p1;
 			break;
 
 		case FZ_LINETO:
-			p1.x = path->items[i++].v;
-			p1.y = path->items[i++].v;
+			p1.x = path->coords[k++];
+			p1.y = path->coords[k++];
 			fz_dash_lineto(&s, p1, stroke->dash_cap);
 			p0 = p1;
 			break;
 
 		case FZ_CURVETO:
-			p1.x = path->items[i++].v;
-			p1.y = path->items[i++].v;
-			p2.x = path->items[i++].v;
-			p2.y = path->items[i++].v;
-			p3.x = path->items[i++].v;
-			p3.y = path->items[i++].v;
+			p1.x = path->coords[k++];
+			p1.y = path->coords[k++];
+			p2.x = path->coords[k++];
+			p2.y = path->coords[k++];
+			p3.x = path->coords[k++];
+			p3.y = path->coords[k++];
 			fz_dash_bezier(&s, p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, p3.x, p3.y, 0, stroke->dash_cap);
 			p0 = p3;
 			break;
@@ -805,3 +1108,340 @@ fz_flatten_dash_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_stat
 
 	fz_stroke_flush(&s, s.cap, stroke->end_cap);
 }
+
+/*
+ * Cache of flattened paths, kept in the context so that it survives
+ * across devices and display list runs. The segments are recorded without
+ * the translation of the ctm, so a path drawn again at the same scale and
+ * rotation, such as a symbol drawn many times from a form or a page drawn
+ * tile by tile, is only offset and inserted into the gel. Entries are
+ * keyed by the contents of the path rather than the path object, which is
+ * rebuilt whenever a content stream runs. A path is recorded the second
+ * time it is seen, so that paths drawn only once cost just a hash.
+ */
+
+#define MAX_PATH_CACHE_SIZE (8<<20)
+#define MAX_CACHED_PATH_SIZE (1<<20)
+
+enum { FLAT_FILL, FLAT_STROKE, FLAT_DASH, FLAT_HAIRLINE, FLAT_HAIRDASH };
+
+typedef struct fz_path_key_s fz_path_key;
+typedef struct fz_flat_path_s fz_flat_path;
+
+struct fz_path_cache
+{
+	fz_hash_table *hash;
+	int total;
+};
+
+struct fz_path_key_s
+{
+	unsigned hash; /* of the path and stroke state */
+	int len;
+	int kind;
+	float a, b, c, d;
+	float flatness;
+	float linewidth;
+};
+
+struct fz_flat_path_s
+{
+	int ncmds;
+	unsigned char *cmds; /* NULL until the path is recorded */
+	float *coords;
+	fz_stroke_state stroke;
+	int len; /* number of segments, or -1 if too large to keep */
+	float *segs;
+};
+
+void
+fz_new_path_cache(fz_context *ctx)
+{
+	fz_path_cache *cache;
+
+	cache = fz_malloc(ctx, sizeof(fz_path_cache));
+	cache->hash = fz_new_hash_table(ctx, 61, sizeof(fz_path_key));
+	cache->total = 0;
+
+	ctx->path_cache = cache;
+}
+
+static void
+fz_evict_path_cache(fz_context *ctx, fz_path_cache *cache)
+{
+	fz_flat_path *flat;
+	int i;
+
+	for (i = 0; i < fz_hash_len(cache->hash); i++)
+	{
+		flat = fz_hash_get_val(cache->hash, i);
+		if (flat)
+		{
+			fz_free(ctx, flat->cmds);
+			fz_free(ctx, flat->coords);
+			fz_free(ctx, flat->segs);
+			fz_free(ctx, flat);
+		}
+	}
+
+	cache->total = 0;
+
+	fz_empty_hash(cache->hash);
+}
+
+void
+fz_free_path_cache(fz_context *ctx)
+{
+	fz_path_cache *cache = ctx->path_cache;
+
+	if (!cache)
+		return;
+	fz_evict_path_cache(ctx, cache);
+	fz_free_hash(ctx, cache->hash);
+	fz_free(ctx, cache);
+	ctx->path_cache = NULL;
+}
+
+static unsigned
+fz_hash_path(fz_path *path, fz_stroke_state *stroke)
+{
+	unsigned h = 0, v;
+	int i;
+
+	for (i = 0; i < path->cmd_len; i++)
+		h = h * 31 + path->cmds[i];
+	for (i = 0; i < path->coord_len; i++)
+	{
+		memcpy(&v, &path->coords[i], sizeof v);
+		h = h * 31 + v;
+	}
+
+	if (stroke)
+	{
+		h = h * 31 + stroke->start_cap;
+		h = h * 31 + stroke->dash_cap;
+		h = h * 31 + stroke->end_cap;
+		h = h * 31 + stroke->linejoin;
+		h = h * 31 + stroke->dash_len;
+	}
+
+	return h;
+}
+
+static int
+fz_same_stroke(fz_stroke_state *a, fz_stroke_state *b)
+{
+	return a->start_cap == b->start_cap && a->dash_cap == b->dash_cap && a->end_cap == b->end_cap &&
+		a->linejoin == b->linejoin && a->linewidth == b->linewidth && a->miterlimit == b->miterlimit &&
+		a->dash_phase == b->dash_phase && a->dash_len == b->dash_len &&
+		!memcmp(a->dash_list, b->dash_list, a->dash_len * sizeof(float));
+}
+
+static int
+fz_path_has_curves(fz_path *path)
+{
+	int i;
+
+	for (i = 0; i < path->cmd_len; i++)
+		if (path->cmds[i] == FZ_CURVETO)
+			return 1;
+
+	return 0;
+}
+
+/* Returns the recorded segments for the path, or NULL to flatten it
+ * directly. stroke is NULL for fills. */
+static fz_flat_path *
+fz_find_flat_path(fz_context *ctx, int kind, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
+{
+	fz_path_cache *cache = ctx->path_cache;
+	fz_flat_path *flat;
+	fz_path_key key;
+	struct flat_sink out;
+	int size;
+
+	if (!cache || path->cmd_len == 0)
+		return NULL;
+
+	memset(&key, 0, sizeof key);
+	key.hash = fz_hash_path(path, stroke);
+	key.len = path->coord_len;
+	key.kind = kind;
+	key.a = ctm.a;
+	key.b = ctm.b;
+	key.c = ctm.c;
+	key.d = ctm.d;
+	key.flatness = flatness;
+	key.linewidth = linewidth;
+
+	flat = fz_hash_find(cache->hash, &key);
+	if (!flat)
+	{
+		if (cache->total + (int)sizeof(fz_flat_path) > MAX_PATH_CACHE_SIZE)
+			fz_evict_path_cache(ctx, cache);
+		flat = fz_malloc(ctx, sizeof(fz_flat_path));
+		memset(flat, 0, sizeof(fz_flat_path));
+		fz_hash_insert(ctx, cache->hash, &key, flat);
+		cache->total += sizeof(fz_flat_path);
+		return NULL;
+	}
+
+	if (flat->cmds)
+	{
+		if (flat->ncmds != path->cmd_len || memcmp(flat->cmds, path->cmds, path->cmd_len))
+			return NULL;
+		if (memcmp(flat->coords, path->coords, path->coord_len * sizeof(float)))
+			return NULL;
+		if (stroke && !fz_same_stroke(&flat->stroke, stroke))
+			return NULL;
+		return flat;
+	}
+
+	if (flat->len < 0)
+		return NULL;
+
+	fz_init_sink(&out, ctx, NULL);
+	out.hairline = kind == FLAT_HAIRLINE || kind == FLAT_HAIRDASH;
+	ctm.e = 0;
+	ctm.f = 0;
+	if (kind == FLAT_FILL)
+		fz_flatten_fill_imp(ctx, &out, path, ctm, flatness);
+	else if (kind == FLAT_DASH || kind == FLAT_HAIRDASH)
+		fz_flatten_dash_imp(ctx, &out, path, stroke, ctm, flatness, linewidth);
+	else
+		fz_flatten_stroke_imp(ctx, &out, path, stroke, ctm, flatness, linewidth);
+
+	size = out.len * 4 * sizeof(float) + path->cmd_len + path->coord_len * sizeof(float);
+	if (size > MAX_CACHED_PATH_SIZE)
+	{
+		fz_free(ctx, out.segs);
+		flat->len = -1;
+		return NULL;
+	}
+
+	if (cache->total + size > MAX_PATH_CACHE_SIZE)
+	{
+		fz_evict_path_cache(ctx, cache);
+		flat = fz_malloc(ctx, sizeof(fz_flat_path));
+		memset(flat, 0, sizeof(fz_flat_path));
+		fz_hash_insert(ctx, cache->hash, &key, flat);
+		cache->total += sizeof(fz_flat_path);
+	}
+
+	flat->ncmds = path->cmd_len;
+	flat->cmds = fz_calloc(ctx, path->cmd_len, sizeof(unsigned char));
+	memcpy(flat->cmds, path->cmds, path->cmd_len);
+	flat->coords = fz_calloc(ctx, path->coord_len, sizeof(float));
+	memcpy(flat->coords, path->coords, path->coord_len * sizeof(float));
+	if (stroke)
+		flat->stroke = *stroke;
+	flat->len = out.len;
+	flat->segs = out.segs;
+	cache->total += size;
+
+	return flat;
+}
+
+static void
+fz_replay_flat_path(fz_gel *gel, fz_flat_path *flat, float e, float f)
+{
+	float *p = flat->segs;
+	int i;
+
+	for (i = 0; i < flat->len; i++, p += 4)
+		fz_insert_gel(gel, p[0] + e, p[1] + f, p[2] + e, p[3] + f);
+}
+
+void
+fz_flatten_fill_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_matrix ctm, float flatness)
+{
+	struct flat_sink out;
+	fz_flat_path *flat = NULL;
+
+	/* polygons are as quick to flatten as to replay */
+	if (fz_path_has_curves(path))
+		flat = fz_find_flat_path(ctx, FLAT_FILL, path, NULL, ctm, flatness, 0);
+	if (flat)
+	{
+		fz_replay_flat_path(gel, flat, ctm.e, ctm.f);
+		return;
+	}
+
+	fz_init_sink(&out, ctx, gel);
+	fz_flatten_fill_imp(ctx, &out, path, ctm, flatness);
+}
+
+void
+fz_flatten_stroke_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
+{
+	struct flat_sink out;
+	fz_flat_path *flat;
+
+	flat = fz_find_flat_path(ctx, FLAT_STROKE, path, stroke, ctm, flatness, linewidth);
+	if (flat)
+	{
+		fz_replay_flat_path(gel, flat, ctm.e, ctm.f);
+		return;
+	}
+
+	fz_init_sink(&out, ctx, gel);
+	fz_flatten_stroke_imp(ctx, &out, path, stroke, ctm, flatness, linewidth);
+}
+
+void
+fz_flatten_dash_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth)
+{
+	struct flat_sink out;
+	fz_flat_path *flat;
+
+	flat = fz_find_flat_path(ctx, FLAT_DASH, path, stroke, ctm, flatness, linewidth);
+	if (flat)
+	{
+		fz_replay_flat_path(gel, flat, ctm.e, ctm.f);
+		return;
+	}
+
+	fz_init_sink(&out, ctx, gel);
+	fz_flatten_dash_imp(ctx, &out, path, stroke, ctm, flatness, linewidth);
+}
+
+/*
+ * Returns the center lines of a hairline stroke in device space, as an
+ * array of x0 y0 x1 y1 for each of *len segments. Joins and caps are drawn
+ * as short extra segments. Dashes wholly outside clip may be left out.
+ */
+float *
+fz_flatten_hairline_path(fz_context *ctx, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth, fz_bbox clip, int *len)
+{
+	int kind = stroke->dash_len > 0 ? FLAT_HAIRDASH : FLAT_HAIRLINE;
+	struct flat_sink out;
+	fz_flat_path *flat;
+	float *segs;
+	int i;
+
+	flat = fz_find_flat_path(ctx, kind, path, stroke, ctm, flatness, linewidth);
+	if (flat)
+	{
+		*len = flat->len;
+		if (flat->len == 0)
+			return NULL;
+		segs = fz_calloc(ctx, flat->len * 4, sizeof(float));
+		for (i = 0; i < flat->len * 4; i += 2)
+		{
+			segs[i] = flat->segs[i] + ctm.e;
+			segs[i + 1] = flat->segs[i + 1] + ctm.f;
+		}
+		return segs;
+	}
+
+	fz_init_sink(&out, ctx, NULL);
+	out.hairline = 1;
+	out.clip = clip;
+	if (kind == FLAT_HAIRDASH)
+		fz_flatten_dash_imp(ctx, &out, path, stroke, ctm, flatness, linewidth);
+	else
+		fz_flatten_stroke_imp(ctx, &out, path, stroke, ctm, flatness, linewidth);
+
+	*len = out.len;
+	return out.segs;
+}
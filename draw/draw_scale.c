@@ -1038,6 +1038,233 @@ scale_row_from_temp(unsigned char *dst, int *src, fz_weights *weights, int width
 	}
 }
 #endif
+#ifdef HAVE_SSE2
+
+#include <emmintrin.h>
+
+/* SSE2 versions of the row and column scalers. The arithmetic is the same
+ * integer arithmetic as above, so the results are identical. The row
+ * scalers use 16 bit multiplies, so they may only be used when every
+ * weight fits in 16 bits (see weights_fit_16). */
+
+static int
+weights_fit_16(fz_weights *weights)
+{
+	int *contrib = &weights->index[weights->index[0]];
+	int i, len;
+
+	for (i = weights->count; i > 0; i--)
+	{
+		contrib++; /* Skip min */
+		len = *contrib++;
+		while (len-- > 0)
+		{
+			if (*contrib < -32768 || *contrib > 32767)
+				return 0;
+			contrib++;
+		}
+	}
+	return 1;
+}
+
+static void
+scale_row_to_temp1_sse2(int *dst, unsigned char *src, fz_weights *weights)
+{
+	int *contrib = &weights->index[weights->index[0]];
+	__m128i zero = _mm_setzero_si128();
+	int len, i, step;
+	unsigned char *min;
+
+	assert(weights->n == 1);
+	if (weights->flip)
+	{
+		dst += weights->count-1;
+		step = -1;
+	}
+	else
+		step = 1;
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = zero;
+		int val;
+		min = &src[*contrib++];
+		len = *contrib++;
+		while (len >= 8)
+		{
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)min), zero);
+			__m128i w = _mm_packs_epi32(_mm_loadu_si128((__m128i *)contrib), _mm_loadu_si128((__m128i *)(contrib+4)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+			min += 8;
+			contrib += 8;
+			len -= 8;
+		}
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+		val = _mm_cvtsi128_si32(acc);
+		while (len-- > 0)
+			val += *min++ * *contrib++;
+		*dst = val;
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp2_sse2(int *dst, unsigned char *src, fz_weights *weights)
+{
+	int *contrib = &weights->index[weights->index[0]];
+	__m128i zero = _mm_setzero_si128();
+	int len, i, step;
+	unsigned char *min;
+
+	assert(weights->n == 2);
+	if (weights->flip)
+	{
+		dst += 2*(weights->count-1);
+		step = -2;
+	}
+	else
+		step = 2;
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = zero;
+		int c1, c2;
+		min = &src[2 * *contrib++];
+		len = *contrib++;
+		while (len >= 4)
+		{
+			/* g0 a0 g1 a1 g2 a2 g3 a3 -> g0 g1 a0 a1 g2 g3 a2 a3 */
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)min), zero);
+			__m128i w = _mm_loadu_si128((__m128i *)contrib);
+			p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3,1,2,0));
+			p = _mm_shufflehi_epi16(p, _MM_SHUFFLE(3,1,2,0));
+			w = _mm_packs_epi32(w, w);
+			w = _mm_unpacklo_epi32(w, w);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+			min += 8;
+			contrib += 4;
+			len -= 4;
+		}
+		acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+		c1 = _mm_cvtsi128_si32(acc);
+		c2 = _mm_cvtsi128_si32(_mm_srli_si128(acc, 4));
+		while (len-- > 0)
+		{
+			c1 += *min++ * *contrib;
+			c2 += *min++ * *contrib++;
+		}
+		dst[0] = c1;
+		dst[1] = c2;
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp4_sse2(int *dst, unsigned char *src, fz_weights *weights)
+{
+	int *contrib = &weights->index[weights->index[0]];
+	__m128i zero = _mm_setzero_si128();
+	int len, i, step;
+	unsigned char *min;
+
+	assert(weights->n == 4);
+	if (weights->flip)
+	{
+		dst += 4*(weights->count-1);
+		step = -4;
+	}
+	else
+		step = 4;
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = zero;
+		min = &src[4 * *contrib++];
+		len = *contrib++;
+		while (len >= 2)
+		{
+			/* r0 g0 b0 a0 r1 g1 b1 a1 -> r0 r1 g0 g1 b0 b1 a0 a1 */
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)min), zero);
+			__m128i w = _mm_set1_epi32((int)(((unsigned)contrib[1] << 16) | (contrib[0] & 0xffff)));
+			p = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+			min += 8;
+			contrib += 2;
+			len -= 2;
+		}
+		if (len > 0)
+		{
+			int v;
+			__m128i p;
+			memcpy(&v, min, 4);
+			p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+			p = _mm_unpacklo_epi16(p, zero);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_set1_epi32(*contrib++ & 0xffff)));
+		}
+		_mm_storeu_si128((__m128i *)dst, acc);
+		dst += step;
+	}
+}
+
+static inline __m128i
+fz_mullo_epi32_sse2(__m128i a, __m128i w)
+{
+	/* w holds the same value in every lane */
+	__m128i even = _mm_mul_epu32(a, w);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), w);
+	even = _mm_and_si128(even, _mm_set_epi32(0, -1, 0, -1));
+	return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+static void
+scale_row_from_temp_sse2(unsigned char *dst, int *src, fz_weights *weights, int width, int row)
+{
+	int *contrib = &weights->index[weights->index[row]];
+	__m128i round = _mm_set1_epi32(1<<15);
+	int len, x;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	for (x=width; x >= 8; x -= 8)
+	{
+		int *min = src;
+		__m128i acc0 = round;
+		__m128i acc1 = round;
+		int k;
+
+		for (k = 0; k < len; k++)
+		{
+			__m128i w = _mm_set1_epi32(contrib[k]);
+			acc0 = _mm_add_epi32(acc0, fz_mullo_epi32_sse2(_mm_loadu_si128((__m128i *)min), w));
+			acc1 = _mm_add_epi32(acc1, fz_mullo_epi32_sse2(_mm_loadu_si128((__m128i *)(min+4)), w));
+			min += width;
+		}
+		acc0 = _mm_packs_epi32(_mm_srai_epi32(acc0, 16), _mm_srai_epi32(acc1, 16));
+		_mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(acc0, acc0));
+		dst += 8;
+		src += 8;
+	}
+	for (; x > 0; x--)
+	{
+		int *min = src;
+		int val = 0;
+		int len2 = len;
+		int *contrib2 = contrib;
+
+		while (len2-- > 0)
+		{
+			val += *min * *contrib2++;
+			min += width;
+		}
+		val = (val+(1<<15))>>16;
+		if (val < 0)
+			val = 0;
+		else if (val > 255)
+			val = 255;
+		*dst++ = val;
+		src++;
+	}
+}
+
+#endif /* HAVE_SSE2 */
 
 #ifdef SINGLE_PIXEL_SPECIALS
 static void
@@ -1206,17 +1433,173 @@ scale_single_col(unsigned char *dst, unsigned char *src, fz_weights *weights, in
 }
 #endif /* SINGLE_PIXEL_SPECIALS */
 
+/* The vertical pass can be split into bands of destination rows. Each
+ * band has its own ring of horizontally scaled rows, and rescales the
+ * source rows it shares with the band above, so bands are independent.
+ * Source rows can be converted to another colorspace just before they
+ * are scaled, so the converted image never exists in full. */
+
+typedef struct fz_scale_band_s fz_scale_band;
+
+struct fz_scale_band_s
+{
+	fz_context *ctx;
+	fz_pixmap *src;
+	fz_pixmap *dst;
+	fz_weights *rows;
+	fz_weights *cols;
+	int *temp;
+	int temp_span;
+	int flip_y;
+	int row0, row1;
+	fz_sample_converter *convert;
+	unsigned char *converted;
+	void (*row_scale)(int *dst, unsigned char *src, fz_weights *weights);
+	void (*col_scale)(unsigned char *dst, int *src, fz_weights *weights, int width, int row);
+};
+
+#define MAX_SCALE_THREADS 16
+#define MIN_SCALE_BAND_SIZE (64<<10)
+
+static void
+scale_band(fz_scale_band *band)
+{
+	fz_pixmap *src = band->src;
+	fz_pixmap *output = band->dst;
+	fz_weights *contrib_rows = band->rows;
+	int temp_span = band->temp_span;
+	int temp_rows = contrib_rows->max_len;
+	int *temp = band->temp;
+	int flip_y = band->flip_y;
+	int row, max_row;
+
+	max_row = contrib_rows->index[contrib_rows->index[band->row0]];
+	for (row = band->row0; row < band->row1; row++)
+	{
+		/*
+		Which source rows do we need to have scaled into the
+		temporary buffer in order to be able to do the final
+		scale?
+		*/
+		int row_index = contrib_rows->index[row];
+		int row_min = contrib_rows->index[row_index++];
+		int row_len = contrib_rows->index[row_index++];
+		while (max_row < row_min+row_len)
+		{
+			/* Scale another row */
+			unsigned char *src_row = &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->w*src->n];
+			assert(max_row < src->h);
+			if (band->convert)
+			{
+				band->convert(band->ctx, src_row, band->converted, src->w);
+				src_row = band->converted;
+			}
+			DBUG(("scaling row %d to temp\n", max_row));
+			(*band->row_scale)(&temp[temp_span*(max_row % temp_rows)], src_row, band->cols);
+			max_row++;
+		}
+
+		DBUG(("scaling row %d from temp\n", row));
+		(*band->col_scale)(&output->samples[row*output->w*output->n], temp, contrib_rows, temp_span, row);
+	}
+}
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+
+static void *
+scale_band_thread(void *arg)
+{
+	scale_band(arg);
+	return NULL;
+}
+
+static void
+scale_bands(fz_scale_band *bands, int nbands)
+{
+	pthread_t threads[MAX_SCALE_THREADS];
+	int started[MAX_SCALE_THREADS];
+	int i;
+
+	for (i = 1; i < nbands; i++)
+		started[i] = pthread_create(&threads[i], NULL, scale_band_thread, &bands[i]) == 0;
+	scale_band(&bands[0]);
+	for (i = 1; i < nbands; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			scale_band(&bands[i]);
+	}
+}
+#else
+static void
+scale_bands(fz_scale_band *bands, int nbands)
+{
+	int i;
+
+	for (i = 0; i < nbands; i++)
+		scale_band(&bands[i]);
+}
+#endif
+
+int
+fz_get_scale_threads(fz_context *ctx)
+{
+	return ctx->fz_scale_threads;
+}
+
+void
+fz_set_scale_threads(fz_context *ctx, int threads)
+{
+	if (threads < 1)
+		threads = 1;
+	if (threads > MAX_SCALE_THREADS)
+		threads = MAX_SCALE_THREADS;
+	ctx->fz_scale_threads = threads;
+}
+
 fz_pixmap *
 fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h)
+{
+	return fz_scale_converted_pixmap(ctx, src, NULL, x, y, w, h);
+}
+
+/*
+ * Scale and convert to colorspace at the same time. The result stays in
+ * the colorspace of src if there is no fast conversion between the two.
+ */
+fz_pixmap *
+fz_scale_converted_pixmap(fz_context *ctx, fz_pixmap *src, fz_colorspace *colorspace, float x, float y, float w, float h)
 {
 	fz_scale_filter *filter = &fz_scale_filter_simple;
 	fz_weights *contrib_rows = NULL;
 	fz_weights *contrib_cols = NULL;
 	fz_pixmap *output = NULL;
-	int *temp = NULL;
-	int max_row, temp_span, temp_rows, row;
+	fz_sample_converter *convert = NULL;
+	int temp_span, temp_rows;
 	int dst_w_int, dst_h_int, dst_x_int, dst_y_int;
 	int flip_x, flip_y;
+	int n = src->n;
+
+	if (colorspace && src->colorspace && colorspace != src->colorspace)
+		convert = fz_find_fast_converter(src->colorspace, colorspace);
+	if (convert)
+	{
+		n = colorspace->n + 1;
+
+		/* the single row and column scalers work on the source directly */
+		if (src->w == 1 || src->h == 1)
+		{
+			fz_pixmap *converted = fz_new_pixmap(ctx, colorspace, src->w, src->h);
+			fz_convert_pixmap(ctx, src, converted);
+			output = fz_scale_pixmap(ctx, converted, x, y, w, h);
+			fz_drop_pixmap(ctx, converted);
+			return output;
+		}
+	}
+	else
+		colorspace = src->colorspace;
 
 	DBUG(("Scale: (%d,%d) to (%g,%g) at (%g,%g)\n",src->w,src->h,w,h,x,y));
 
@@ -1289,7 +1672,7 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 	else
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
-		contrib_cols = make_weights(ctx, src->w, x, w, filter, 0, dst_w_int, src->n, flip_x);
+		contrib_cols = make_weights(ctx, src->w, x, w, filter, 0, dst_w_int, n, flip_x);
 		if (contrib_cols == NULL)
 			goto cleanup;
 	}
@@ -1301,14 +1684,14 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 	else
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
-		contrib_rows = make_weights(ctx, src->h, y, h, filter, 1, dst_h_int, src->n, flip_y);
+		contrib_rows = make_weights(ctx, src->h, y, h, filter, 1, dst_h_int, n, flip_y);
 		if (contrib_rows == NULL)
 			goto cleanup;
 	}
 
 	assert(contrib_cols == NULL || contrib_cols->count == dst_w_int);
 	assert(contrib_rows == NULL || contrib_rows->count == dst_h_int);
-	output = fz_new_pixmap(ctx, src->colorspace, dst_w_int, dst_h_int);
+	output = fz_new_pixmap(ctx, colorspace, dst_w_int, dst_h_int);
 	output->x = dst_x_int;
 	output->y = dst_y_int;
 
@@ -1336,54 +1719,94 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 	else
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
-		void (*row_scale)(int *dst, unsigned char *src, fz_weights *weights);
+		fz_scale_band bands[MAX_SCALE_THREADS];
+		int nbands, i;
 
-		temp_span = contrib_cols->count * src->n;
+		temp_span = contrib_cols->count * n;
 		temp_rows = contrib_rows->max_len;
 		if (temp_span <= 0 || temp_rows > INT_MAX / temp_span)
 			goto cleanup;
-		temp = fz_calloc(ctx, temp_span*temp_rows, sizeof(int));
-		if (temp == NULL)
-			goto cleanup;
-		switch (src->n)
+
+		bands[0].ctx = ctx;
+		bands[0].src = src;
+		bands[0].dst = output;
+		bands[0].rows = contrib_rows;
+		bands[0].cols = contrib_cols;
+		bands[0].temp_span = temp_span;
+		bands[0].flip_y = flip_y;
+		bands[0].convert = convert;
+		bands[0].converted = NULL;
+		switch (n)
 		{
 		default:
-			row_scale = scale_row_to_temp;
+			bands[0].row_scale = scale_row_to_temp;
 			break;
 		case 1: /* Image mask case */
-			row_scale = scale_row_to_temp1;
+			bands[0].row_scale = scale_row_to_temp1;
 			break;
 		case 2: /* Greyscale with alpha case */
-			row_scale = scale_row_to_temp2;
+			bands[0].row_scale = scale_row_to_temp2;
 			break;
 		case 4: /* RGBA */
-			row_scale = scale_row_to_temp4;
+			bands[0].row_scale = scale_row_to_temp4;
 			break;
 		}
-		max_row = 0;
-		for (row = 0; row < contrib_rows->count; row++)
+		bands[0].col_scale = scale_row_from_temp;
+#ifdef HAVE_SSE2
+		if (weights_fit_16(contrib_cols))
+		{
+			if (n == 1)
+				bands[0].row_scale = scale_row_to_temp1_sse2;
+			else if (n == 2)
+				bands[0].row_scale = scale_row_to_temp2_sse2;
+			else if (n == 4)
+				bands[0].row_scale = scale_row_to_temp4_sse2;
+		}
+		bands[0].col_scale = scale_row_from_temp_sse2;
+#endif
+
+		nbands = 1;
+		if (ctx->fz_scale_threads > 1)
+		{
+			nbands = output->w * output->n * output->h / MIN_SCALE_BAND_SIZE;
+			nbands = MIN(nbands, ctx->fz_scale_threads);
+			nbands = MIN(nbands, output->h);
+			if (nbands < 1)
+				nbands = 1;
+		}
+
+		/* the bands must not build the tables of the converter themselves */
+		if (convert)
+			fz_prepare_fast_converter(ctx, convert);
+
+		for (i = 0; i < nbands; i++)
 		{
-			/*
-			Which source rows do we need to have scaled into the
-			temporary buffer in order to be able to do the final
-			scale?
-			*/
-			int row_index = contrib_rows->index[row];
-			int row_min = contrib_rows->index[row_index++];
-			int row_len = contrib_rows->index[row_index++];
-			while (max_row < row_min+row_len)
+			bands[i] = bands[0];
+			bands[i].row0 = output->h * i / nbands;
+			bands[i].row1 = output->h * (i + 1) / nbands;
+			bands[i].temp = fz_calloc(ctx, temp_span*temp_rows, sizeof(int));
+			if (convert)
+				bands[i].converted = fz_malloc(ctx, src->w * n);
+			if (bands[i].temp == NULL || (convert && bands[i].converted == NULL))
 			{
-				/* Scale another row */
-				assert(max_row < src->h);
-				DBUG(("scaling row %d to temp\n", max_row));
-				(*row_scale)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->w*src->n], contrib_cols);
-				max_row++;
+				fz_free(ctx, bands[i].temp);
+				fz_free(ctx, bands[i].converted);
+				while (i-- > 0)
+				{
+					fz_free(ctx, bands[i].temp);
+					fz_free(ctx, bands[i].converted);
+				}
+				goto cleanup;
 			}
+		}
 
-			DBUG(("scaling row %d from temp\n", row));
-			scale_row_from_temp(&output->samples[row*output->w*output->n], temp, contrib_rows, temp_span, row);
+		scale_bands(bands, nbands);
+
+		for (i = 0; i < nbands; i++)
+		{
+			fz_free(ctx, bands[i].temp);
+			fz_free(ctx, bands[i].converted);
 		}
-		fz_free(ctx, temp);
 	}
 
 cleanup:
@@ -1391,3 +1814,127 @@ cleanup:
 	fz_free(ctx, contrib_cols);
 	return output;
 }
+
+/*
+ * Cache of scaled pixmaps, kept in the context so that it survives across
+ * devices and display list runs. Entries are keyed by the source pixmap
+ * and the sub pixel placement and size of the result. The sub pixel
+ * offsets are quantised to 1/256 of a pixel, so that an image drawn at
+ * the same size in different places scales only once.
+ */
+
+#define MAX_SCALE_CACHE_SIZE (32<<20)
+#define MAX_SCALED_SIZE (4<<20)
+
+typedef struct fz_scale_key_s fz_scale_key;
+
+struct fz_scale_cache
+{
+	fz_hash_table *hash;
+	int total;
+};
+
+struct fz_scale_key_s
+{
+	fz_pixmap *src;
+	fz_colorspace *colorspace;
+	float x, y;
+	float w, h;
+};
+
+void
+fz_new_scale_cache(fz_context *ctx)
+{
+	fz_scale_cache *cache;
+
+	cache = fz_malloc(ctx, sizeof(fz_scale_cache));
+	cache->hash = fz_new_hash_table(ctx, 61, sizeof(fz_scale_key));
+	cache->total = 0;
+
+	ctx->scale_cache = cache;
+}
+
+static void
+fz_evict_scale_cache(fz_context *ctx, fz_scale_cache *cache)
+{
+	fz_scale_key *key;
+	fz_pixmap *pixmap;
+	int i;
+
+	for (i = 0; i < fz_hash_len(cache->hash); i++)
+	{
+		key = fz_hash_get_key(cache->hash, i);
+		if (key->src)
+			fz_drop_pixmap(ctx, key->src);
+		pixmap = fz_hash_get_val(cache->hash, i);
+		if (pixmap)
+			fz_drop_pixmap(ctx, pixmap);
+	}
+
+	cache->total = 0;
+
+	fz_empty_hash(cache->hash);
+}
+
+void
+fz_free_scale_cache(fz_context *ctx)
+{
+	fz_scale_cache *cache = ctx->scale_cache;
+
+	if (!cache)
+		return;
+	fz_evict_scale_cache(ctx, cache);
+	fz_free_hash(ctx, cache->hash);
+	fz_free(ctx, cache);
+	ctx->scale_cache = NULL;
+}
+
+/* Returns a new reference to a scaled copy of src positioned relative to
+ * (*ix,*iy), the whole pixel part of (x,y). The copy is only cached if
+ * cacheable is set, which callers should do only for sources that are
+ * kept elsewhere and so may be drawn again. */
+fz_pixmap *
+fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, fz_colorspace *colorspace, float x, float y, float w, float h, int *ix, int *iy, int cacheable)
+{
+	fz_scale_cache *cache = ctx->scale_cache;
+	fz_scale_key key;
+	fz_pixmap *val;
+	int size;
+
+	*ix = floorf(x);
+	*iy = floorf(y);
+
+	memset(&key, 0, sizeof key);
+	key.src = src;
+	key.colorspace = colorspace;
+	key.x = (int)((x - *ix) * 256) / 256.0f;
+	key.y = (int)((y - *iy) * 256) / 256.0f;
+	key.w = w;
+	key.h = h;
+
+	if (!cache || !cacheable)
+		return fz_scale_converted_pixmap(ctx, src, colorspace, key.x, key.y, w, h);
+
+	val = fz_hash_find(cache->hash, &key);
+	if (val)
+		return fz_keep_pixmap(val);
+
+	val = fz_scale_converted_pixmap(ctx, src, colorspace, key.x, key.y, w, h);
+	if (!val)
+		return NULL;
+
+	size = val->w * val->h * val->n;
+	if (size <= MAX_SCALED_SIZE)
+	{
+		/* the source is kept alive by the cache, so count it as well */
+		size += src->w * src->h * src->n;
+		if (cache->total + size > MAX_SCALE_CACHE_SIZE)
+			fz_evict_scale_cache(ctx, cache);
+		fz_keep_pixmap(src);
+		fz_hash_insert(ctx, cache->hash, &key, val);
+		cache->total += size;
+		return fz_keep_pixmap(val);
+	}
+
+	return val;
+}
@@ -1,71 +1,263 @@
 #include "fitz.h"
 
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 /* Unpack image samples and optionally pad pixels with opaque alpha */
 
 #define get1(buf,x) ((buf[x >> 3] >> ( 7 - (x & 7) ) ) & 1 )
 #define get2(buf,x) ((buf[x >> 2] >> ( ( 3 - (x & 3) ) << 1 ) ) & 3 )
 #define get4(buf,x) ((buf[x >> 1] >> ( ( 1 - (x & 1) ) << 2 ) ) & 15 )
-#define get8(buf,x) (buf[x])
-#define get16(buf,x) (buf[x << 1])
 
-static unsigned char get1_tab_1[256][8];
-static unsigned char get1_tab_1p[256][16];
-static unsigned char get1_tab_255[256][8];
-static unsigned char get1_tab_255p[256][16];
+/*
+ * Every sample goes through a table that maps its raw value straight to
+ * the value stored in the pixmap, with the scale and decode array already
+ * applied. Samples narrower than a byte are expanded a whole byte at a
+ * time through a second table built from the first.
+ */
+
+static int
+fz_unpack_max_value(int depth)
+{
+	return depth < 8 ? (1 << depth) - 1 : 255;
+}
 
 static void
-init_get1_tables(void)
+fz_make_unpack_table(unsigned char *lut, int depth, int scale)
 {
-	static int once = 0;
-	unsigned char bits[1];
-	int i, k, x;
+	int v, max = fz_unpack_max_value(depth);
 
-	/* TODO: mutex lock here */
+	for (v = 0; v <= max; v++)
+		lut[v] = depth < 8 ? v * scale : v;
+}
 
-	if (once)
-		return;
+/* Apply a decode array to the tables. Returns 0 if none changes. */
+static int
+fz_decode_tables(unsigned char lut[][256], int n, int top, float *decode)
+{
+	int k, v, needed = 0;
 
-	for (i = 0; i < 256; i++)
+	for (k = 0; k < n; k++)
 	{
-		bits[0] = i;
-		for (k = 0; k < 8; k++)
+		int min = decode[k * 2] * 255;
+		int max = decode[k * 2 + 1] * 255;
+		int mul = max - min;
+		if (min == 0 && max == 255)
+			continue;
+		needed = 1;
+		for (v = 0; v <= top; v++)
 		{
-			x = get1(bits, k);
+			/* cf. http://code.google.com/p/sumatrapdf/issues/detail?id=1650 */
+			int value = min + fz_mul255(lut[k][v], mul);
+			lut[k][v] = CLAMP(value, 0, 255);
+		}
+	}
 
-			get1_tab_1[i][k] = x;
-			get1_tab_1p[i][k * 2] = x;
-			get1_tab_1p[i][k * 2 + 1] = 255;
+	return needed;
+}
 
-			get1_tab_255[i][k] = x * 255;
-			get1_tab_255p[i][k * 2] = x * 255;
-			get1_tab_255p[i][k * 2 + 1] = 255;
+static int
+fz_decode_indexed_tables(unsigned char lut[][256], int n, int top, float *decode, int maxval)
+{
+	int k, v, needed = 0;
+
+	for (k = 0; k < n; k++)
+	{
+		int min = decode[k * 2] * 256;
+		int max = decode[k * 2 + 1] * 256;
+		int mul = (max - min) / maxval;
+		if (min == 0 && max == maxval * 256)
+			continue;
+		needed = 1;
+		for (v = 0; v <= top; v++)
+		{
+			/* cf. http://code.google.com/p/sumatrapdf/issues/detail?id=1650 */
+			/* TODO: this doesn't always result in the same values as for Adobe Reader */
+			int value = (min + (((lut[k][v] << 8) * mul) >> 8)) >> 8;
+			lut[k][v] = CLAMP(value, 0, 255);
 		}
 	}
 
-	once = 1;
+	return needed;
 }
 
-void
-fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int scale)
+/* Expand one row of 8 bit samples into pixels with an opaque alpha */
+static void
+fz_pad_row_8(unsigned char * restrict dp, unsigned char * restrict sp, int n, int w)
 {
+	int x = 0, k;
+
+	if (n == 1)
+	{
+#ifdef HAVE_SSE2
+		__m128i ff = _mm_set1_epi8(-1);
+		for (; x + 16 <= w; x += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(sp + x));
+			_mm_storeu_si128((__m128i *)(dp + x * 2), _mm_unpacklo_epi8(v, ff));
+			_mm_storeu_si128((__m128i *)(dp + x * 2 + 16), _mm_unpackhi_epi8(v, ff));
+		}
+#endif
+		for (; x < w; x++)
+		{
+			dp[x * 2] = sp[x];
+			dp[x * 2 + 1] = 255;
+		}
+	}
+	else if (n == 3)
+	{
+		/* copy four bytes at a time and overwrite the fourth with alpha */
+		for (; x + 1 < w; x++)
+		{
+			memcpy(dp, sp, 4);
+			dp[3] = 255;
+			dp += 4;
+			sp += 3;
+		}
+		if (x < w)
+		{
+			dp[0] = sp[0];
+			dp[1] = sp[1];
+			dp[2] = sp[2];
+			dp[3] = 255;
+		}
+	}
+	else if (n == 4)
+	{
+		for (; x < w; x++)
+		{
+			memcpy(dp, sp, 4);
+			dp[4] = 255;
+			dp += 5;
+			sp += 4;
+		}
+	}
+	else
+	{
+		for (; x < w; x++)
+		{
+			for (k = 0; k < n; k++)
+				*dp++ = *sp++;
+			*dp++ = 255;
+		}
+	}
+}
+
+/* Map one row of 8 or 16 bit samples through the tables. step is the
+ * size of a sample in bytes; only the high byte of 16 bit samples is
+ * used. */
+static void
+fz_unpack_row_lut(unsigned char * restrict dp, unsigned char * restrict sp, int n, int w, int pad, int step,
+	unsigned char lut[][256], int nlut)
+{
+	unsigned char *t = lut[0];
+	int x, k;
+
+	if (n == 1 && pad)
+	{
+		for (x = 0; x < w; x++)
+		{
+			dp[0] = t[*sp];
+			dp[1] = 255;
+			dp += 2;
+			sp += step;
+		}
+	}
+	else if (n == 1)
+	{
+		for (x = 0; x < w; x++)
+		{
+			*dp++ = t[*sp];
+			sp += step;
+		}
+	}
+	else if (n == 3 || n == 4)
+	{
+		unsigned char *t1 = lut[nlut > 1 ? 1 : 0];
+		unsigned char *t2 = lut[nlut > 1 ? 2 : 0];
+		unsigned char *t3 = lut[nlut > 3 ? 3 : 0];
+		int dn = pad ? n + 1 : n;
+		for (x = 0; x < w; x++)
+		{
+			dp[0] = t[sp[0]];
+			dp[1] = t1[sp[step]];
+			dp[2] = t2[sp[step * 2]];
+			if (n == 4)
+				dp[3] = t3[sp[step * 3]];
+			if (pad)
+				dp[n] = 255;
+			dp += dn;
+			sp += step * n;
+		}
+	}
+	else if (nlut == 1)
+	{
+		for (x = 0; x < w; x++)
+		{
+			for (k = 0; k < n; k++)
+			{
+				*dp++ = t[*sp];
+				sp += step;
+			}
+			if (pad)
+				*dp++ = 255;
+		}
+	}
+	else
+	{
+		for (x = 0; x < w; x++)
+		{
+			for (k = 0; k < n; k++)
+			{
+				*dp++ = lut[k][*sp];
+				sp += step;
+			}
+			if (pad)
+				*dp++ = 255;
+		}
+	}
+}
+
+/*
+ * lut holds one table per component, or a single table for all of them
+ * if nlut is 1. identity is set when the tables map each 8 bit sample to
+ * itself.
+ */
+static void
+fz_unpack_tile_imp(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride,
+	unsigned char lut[][256], int nlut, int identity)
+{
+	unsigned char bytetab[256][16];
 	int pad, x, y, k;
 	int w = dst->w;
+	int per = 0, len = 0;
 
 	pad = 0;
 	if (dst->n > n)
 		pad = 255;
 	dst->has_alpha = !pad; /* SumatraPDF: allow optimizing non-alpha pixmaps */
 
-	if (depth == 1)
-		init_get1_tables();
-
-	if (scale == 0)
+	/* whole bytes of samples narrower than a byte */
+	if (n == 1 && (depth == 1 || depth == 2 || depth == 4))
 	{
-		switch (depth)
+		int mask = (1 << depth) - 1;
+		int i, b;
+		per = 8 / depth;
+		len = pad ? per * 2 : per;
+		for (b = 0; b < 256; b++)
 		{
-		case 1: scale = 255; break;
-		case 2: scale = 85; break;
-		case 4: scale = 17; break;
+			for (i = 0; i < per; i++)
+			{
+				int v = (b >> (8 - depth * (i + 1))) & mask;
+				if (pad)
+				{
+					bytetab[b][i * 2] = lut[0][v];
+					bytetab[b][i * 2 + 1] = 255;
+				}
+				else
+					bytetab[b][i] = lut[0][v];
+			}
 		}
 	}
 
@@ -76,73 +268,42 @@ fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, i
 
 		/* Specialized loops */
 
-		if (n == 1 && depth == 1 && scale == 1 && !pad)
+		if (per)
 		{
-			int w3 = w >> 3;
-			for (x = 0; x < w3; x++)
+			int wb = w / per;
+			if (len == 16)
 			{
-				memcpy(dp, get1_tab_1[*sp++], 8);
-				dp += 8;
+				for (x = 0; x < wb; x++, dp += 16)
+					memcpy(dp, bytetab[*sp++], 16);
 			}
-			x = x << 3;
-			if (x < w)
-				memcpy(dp, get1_tab_1[*sp], w - x);
-		}
-
-		else if (n == 1 && depth == 1 && scale == 255 && !pad)
-		{
-			int w3 = w >> 3;
-			for (x = 0; x < w3; x++)
+			else if (len == 8)
 			{
-				memcpy(dp, get1_tab_255[*sp++], 8);
-				dp += 8;
+				for (x = 0; x < wb; x++, dp += 8)
+					memcpy(dp, bytetab[*sp++], 8);
 			}
-			x = x << 3;
-			if (x < w)
-				memcpy(dp, get1_tab_255[*sp], w - x);
-		}
-
-		else if (n == 1 && depth == 1 && scale == 1 && pad)
-		{
-			int w3 = w >> 3;
-			for (x = 0; x < w3; x++)
+			else
 			{
-				memcpy(dp, get1_tab_1p[*sp++], 16);
-				dp += 16;
+				for (x = 0; x < wb; x++, dp += len)
+					memcpy(dp, bytetab[*sp++], len);
 			}
-			x = x << 3;
-			if (x < w)
-				memcpy(dp, get1_tab_1p[*sp], (w - x) << 1);
+			x = w - wb * per;
+			if (x > 0)
+				memcpy(dp, bytetab[*sp], pad ? x * 2 : x);
 		}
 
-		else if (n == 1 && depth == 1 && scale == 255 && pad)
+		else if (depth == 8 && identity && !pad)
 		{
-			int w3 = w >> 3;
-			for (x = 0; x < w3; x++)
-			{
-				memcpy(dp, get1_tab_255p[*sp++], 16);
-				dp += 16;
-			}
-			x = x << 3;
-			if (x < w)
-				memcpy(dp, get1_tab_255p[*sp], (w - x) << 1);
+			memcpy(dp, sp, w * n);
 		}
 
-		else if (depth == 8 && !pad)
+		else if (depth == 8 && identity && pad)
 		{
-			int len = w * n;
-			while (len--)
-				*dp++ = *sp++;
+			fz_pad_row_8(dp, sp, n, w);
 		}
 
-		else if (depth == 8 && pad)
+		else if (depth == 8 || depth == 16)
 		{
-			for (x = 0; x < w; x++)
-			{
-				for (k = 0; k < n; k++)
-					*dp++ = *sp++;
-				*dp++ = 255;
-			}
+			fz_unpack_row_lut(dp, sp, n, w, pad, depth / 8, lut, nlut);
 		}
 
 		else
@@ -152,13 +313,12 @@ fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, i
 			{
 				for (k = 0; k < n; k++)
 				{
+					unsigned char *t = lut[nlut > 1 ? k : 0];
 					switch (depth)
 					{
-					case 1: *dp++ = get1(sp, b) * scale; break;
-					case 2: *dp++ = get2(sp, b) * scale; break;
-					case 4: *dp++ = get4(sp, b) * scale; break;
-					case 8: *dp++ = get8(sp, b); break;
-					case 16: *dp++ = get16(sp, b); break;
+					case 1: *dp++ = t[get1(sp, b)]; break;
+					case 2: *dp++ = t[get2(sp, b)]; break;
+					case 4: *dp++ = t[get4(sp, b)]; break;
 					}
 					b++;
 				}
@@ -169,77 +329,98 @@ fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, i
 	}
 }
 
-/* Apply decode array */
+static int
+fz_default_unpack_scale(int depth)
+{
+	switch (depth)
+	{
+	case 1: return 255;
+	case 2: return 85;
+	case 4: return 17;
+	}
+	return 1;
+}
 
 void
-fz_decode_indexed_tile(fz_pixmap *pix, float *decode, int maxval)
+fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int scale)
+{
+	unsigned char lut[1][256];
+
+	if (scale == 0)
+		scale = fz_default_unpack_scale(depth);
+
+	fz_make_unpack_table(lut[0], depth, scale);
+	fz_unpack_tile_imp(dst, src, n, depth, stride, lut, 1, 1);
+}
+
+/*
+ * Unpack and apply the decode array in one pass, with the same results
+ * as fz_unpack_tile followed by fz_decode_tile, or by
+ * fz_decode_indexed_tile for indexed images. n must not be larger
+ * than FZ_MAX_COLORS.
+ */
+void
+fz_unpack_tile_with_decode(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int indexed, float *decode)
+{
+	unsigned char lut[FZ_MAX_COLORS][256];
+	int max = fz_unpack_max_value(depth);
+	int nd = MIN(n, MAX(1, dst->n - 1));
+	int k, needed;
+
+	fz_make_unpack_table(lut[0], depth, indexed ? 1 : fz_default_unpack_scale(depth));
+	for (k = 1; k < n; k++)
+		memcpy(lut[k], lut[0], max + 1);
+
+	/* the decode array does not apply to alpha samples */
+	if (indexed)
+		needed = fz_decode_indexed_tables(lut, nd, max, decode, max);
+	else
+		needed = fz_decode_tables(lut, nd, max, decode);
+
+	fz_unpack_tile_imp(dst, src, n, depth, stride, lut, needed ? n : 1, !needed);
+}
+
+/* Apply decode array */
+
+static void
+fz_apply_decode_tables(fz_pixmap *pix, unsigned char lut[][256], int n)
 {
-	int add[FZ_MAX_COLORS];
-	int mul[FZ_MAX_COLORS];
 	unsigned char *p = pix->samples;
 	int len = pix->w * pix->h;
-	int n = pix->n - 1;
-	int needed;
 	int k;
 
-	needed = 0;
-	for (k = 0; k < n; k++)
-	{
-		int min = decode[k * 2] * 256;
-		int max = decode[k * 2 + 1] * 256;
-		add[k] = min;
-		mul[k] = (max - min) / maxval;
-		needed |= min != 0 || max != maxval * 256;
-	}
-
-	if (!needed)
-		return;
-
 	while (len--)
 	{
 		for (k = 0; k < n; k++)
-		{
-			/* cf. http://code.google.com/p/sumatrapdf/issues/detail?id=1650 */
-			/* TODO: this doesn't always result in the same values as for Adobe Reader */
-			int value = (add[k] + (((p[k] << 8) * mul[k]) >> 8)) >> 8;
-			p[k] = CLAMP(value, 0, 255);
-		}
-		p += n + 1;
+			p[k] = lut[k][p[k]];
+		p += pix->n;
 	}
 }
 
+void
+fz_decode_indexed_tile(fz_pixmap *pix, float *decode, int maxval)
+{
+	unsigned char lut[FZ_MAX_COLORS][256];
+	int n = pix->n - 1;
+	int k;
+
+	for (k = 0; k < n; k++)
+		fz_make_unpack_table(lut[k], 8, 1);
+
+	if (fz_decode_indexed_tables(lut, n, 255, decode, maxval))
+		fz_apply_decode_tables(pix, lut, n);
+}
+
 void
 fz_decode_tile(fz_pixmap *pix, float *decode)
 {
-	int add[FZ_MAX_COLORS];
-	int mul[FZ_MAX_COLORS];
-	unsigned char *p = pix->samples;
-	int len = pix->w * pix->h;
+	unsigned char lut[FZ_MAX_COLORS][256];
 	int n = MAX(1, pix->n - 1);
-	int needed;
 	int k;
 
-	needed = 0;
 	for (k = 0; k < n; k++)
-	{
-		int min = decode[k * 2] * 255;
-		int max = decode[k * 2 + 1] * 255;
-		add[k] = min;
-		mul[k] = max - min;
-		needed |= min != 0 || max != 255;
-	}
-
-	if (!needed)
-		return;
+		fz_make_unpack_table(lut[k], 8, 1);
 
-	while (len--)
-	{
-		for (k = 0; k < n; k++)
-		{
-			/* cf. http://code.google.com/p/sumatrapdf/issues/detail?id=1650 */
-			int value = add[k] + fz_mul255(p[k], mul[k]);
-			p[k] = CLAMP(value, 0, 255);
-		}
-		p += pix->n;
-	}
+	if (fz_decode_tables(lut, n, 255, decode))
+		fz_apply_decode_tables(pix, lut, n);
 }
@@ -6,6 +6,10 @@ void fz_context_fin(fz_context *ctx)
 	assert(ctx != NULL);
 
 	/* Other finalisation calls go here (in reverse order) */
+	fz_free_cmyk_lut(ctx);
+	fz_free_path_cache(ctx);
+	fz_free_image_cache(ctx);
+	fz_free_scale_cache(ctx);
 #ifndef SKIP_FONT_CONTEXT
 	fz_free_font_context(ctx);
 #endif
@@ -52,6 +56,14 @@ fz_context *fz_context_init(fz_alloc_context *alloc)
 	ctx->fz_aa_level = 8;
 #endif
 
+	fz_new_scale_cache(ctx);
+	fz_new_image_cache(ctx);
+	fz_new_path_cache(ctx);
+	ctx->fz_scale_threads = 1;
+	ctx->fz_glyph_hsubpix = 5;
+	ctx->fz_glyph_vsubpix = 5;
+	ctx->fz_glyph_snap = 0;
+
 	/* New initialisation calls for context entries go here */
 	return ctx;
   cleanup:
@@ -91,6 +103,15 @@ fz_context *fz_context_clone(fz_context *ctx)
 	clone->fz_aa_level = ctx->fz_aa_level;
 #endif
 
+	fz_new_scale_cache(clone);
+	fz_new_image_cache(clone);
+	fz_new_path_cache(clone);
+	clone->fz_scale_threads = ctx->fz_scale_threads;
+	clone->fz_glyph_hsubpix = ctx->fz_glyph_hsubpix;
+	clone->fz_glyph_vsubpix = ctx->fz_glyph_vsubpix;
+	clone->fz_glyph_snap = ctx->fz_glyph_snap;
+	clone->fz_exact_cmyk = ctx->fz_exact_cmyk;
+
 	/* Other initialisations go here; either a copy (probably refcounted)
 	 * or a new initialisation. */
 	return clone;
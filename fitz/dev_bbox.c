@@ -47,7 +47,7 @@ fz_bbox_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ctm,
 }
 
 static void
-fz_bbox_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm, float alpha)
+fz_bbox_fill_image(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm, float alpha)
 {
 	fz_bbox *result = user;
 	fz_bbox bbox = fz_round_rect(fz_transform_rect(ctm, fz_unit_rect));
@@ -55,7 +55,7 @@ fz_bbox_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
 }
 
 static void
-fz_bbox_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
+fz_bbox_fill_image_mask(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
 	fz_bbox_fill_image(ctx, user, image, ctm, alpha);
@@ -715,39 +715,42 @@ gdiplus_get_brush(fz_context *ctx, void *user, fz_colorspace *colorspace, float
 static GraphicsPath *
 gdiplus_get_path(fz_path *path, fz_matrix ctm, int evenodd=1)
 {
-	PointF *points = new PointF[path->len / 2];
-	BYTE *types = new BYTE[path->len / 2];
+	// a close path may add a point of its own for the following segment
+	int max = path->coord_len / 2 + path->cmd_len;
+	PointF *points = new PointF[max];
+	BYTE *types = new BYTE[max];
 	PointF origin;
 	int len = 0;
+	float *c = path->coords;
 	
-	for (int i = 0; i < path->len; )
+	for (int i = 0; i < path->cmd_len; )
 	{
-		switch (path->items[i++].k)
+		switch (path->cmds[i++])
 		{
 		case FZ_MOVETO:
-			points[len].X = path->items[i++].v; points[len].Y = path->items[i++].v;
+			points[len].X = *c++; points[len].Y = *c++;
 			origin = points[len];
 			// empty paths seem to confuse GDI+, so filter them out
-			if (i < path->len && path->items[i].k == FZ_CLOSE_PATH)
+			if (i < path->cmd_len && path->cmds[i] == FZ_CLOSE_PATH)
 				i++;
-			else if (i < path->len && path->items[i].k != FZ_MOVETO)
+			else if (i < path->cmd_len && path->cmds[i] != FZ_MOVETO)
 				types[len++] = PathPointTypeStart;
 			break;
 		case FZ_LINETO:
-			points[len].X = path->items[i++].v; points[len].Y = path->items[i++].v;
+			points[len].X = *c++; points[len].Y = *c++;
 			types[len++] = PathPointTypeLine;
 			break;
 		case FZ_CURVETO:
-			points[len].X = path->items[i++].v; points[len].Y = path->items[i++].v;
+			points[len].X = *c++; points[len].Y = *c++;
 			types[len++] = PathPointTypeBezier;
-			points[len].X = path->items[i++].v; points[len].Y = path->items[i++].v;
+			points[len].X = *c++; points[len].Y = *c++;
 			types[len++] = PathPointTypeBezier;
-			points[len].X = path->items[i++].v; points[len].Y = path->items[i++].v;
+			points[len].X = *c++; points[len].Y = *c++;
 			types[len++] = PathPointTypeBezier;
 			break;
 		case FZ_CLOSE_PATH:
 			types[len - 1] = types[len - 1] | PathPointTypeCloseSubpath;
-			if (i < path->len && (path->items[i].k != FZ_MOVETO && path->items[i].k != FZ_CLOSE_PATH))
+			if (i < path->cmd_len && (path->cmds[i] != FZ_MOVETO && path->cmds[i] != FZ_CLOSE_PATH))
 			{
 				points[len] = origin;
 				types[len++] = PathPointTypeStart;
@@ -755,7 +758,7 @@ gdiplus_get_path(fz_path *path, fz_matrix ctm, int evenodd=1)
 			break;
 		}
 	}
-	assert(len <= path->len / 2);
+	assert(len <= max);
 	
 	// clipping intermittently fails for overly large regions (cf. pathscan.c::fz_insertgel)
 	fz_rect BBOX_BOUNDS = { -(1<<20), -(1<<20) , (1<<20), (1<<20) };
@@ -903,7 +906,7 @@ fz_gdiplus_clip_path(fz_context *ctx, void *user, fz_path *path, fz_rect *rect,
 	GraphicsPath *gpath = gdiplus_get_path(path, ctm, evenodd);
 	
 	// TODO: clipping non-rectangular areas doesn't result in anti-aliased edges
-	if (path->len > 0)
+	if (path->cmd_len > 0)
 		((userData *)user)->pushClip(gpath);
 	else
 		((userData *)user)->pushClip(&Region(Rect()));
@@ -919,7 +922,7 @@ fz_gdiplus_clip_stroke_path(fz_context *ctx, void *user, fz_path *path, fz_rect
 	Pen *pen = gdiplus_get_pen(&SolidBrush(Color()), ctm, stroke);
 	gpath->Widen(pen);
 	
-	if (path->len > 0)
+	if (path->cmd_len > 0)
 		((userData *)user)->pushClip(gpath);
 	else
 		((userData *)user)->pushClip(&Region(Rect()));
@@ -945,13 +948,13 @@ extern "C" static int conic_to(const FT_Vector *ctrl, const FT_Vector *to, void
 	FT_Vector from, ctrl1, ctrl2;
 	fz_path *path = (fz_path *)user;
 	
-	assert(path->len > 0);
-	if (path->len == 0)
+	assert(path->coord_len > 0);
+	if (path->coord_len == 0)
 		fz_moveto(path, 0, 0);
 	
 	// cf. http://fontforge.sourceforge.net/bezier.html
-	from.x = path->items[path->len - 2].v;
-	from.y = path->items[path->len - 1].v;
+	from.x = path->coords[path->coord_len - 2];
+	from.y = path->coords[path->coord_len - 1];
 	ctrl1.x = from.x + 2.0/3 * (ctrl->x - from.x);
 	ctrl1.y = from.y + 2.0/3 * (ctrl->y - from.y);
 	ctrl2.x = ctrl1.x + 1.0/3 * (to->x - from.x);
@@ -1042,7 +1045,7 @@ gdiplus_render_text(userData *user, fz_text *text, fz_matrix ctm, Brush *brush,
 	
 	FT_Face face = (FT_Face)text->font->ft_face;
 	FT_UShort charSize = CLAMP(face->units_per_EM, 1000, 65536);
-	FT_Set_Char_Size(face, charSize, charSize, 72, 72);
+	fz_set_ft_char_size(user->ctx, text->font, charSize);
 	FT_Set_Transform(face, NULL, NULL);
 	
 	for (int i = 0; i < text->len; i++)
@@ -1082,7 +1085,7 @@ gdiplus_run_text(userData *user, fz_text *text, fz_matrix ctm, Brush *brush)
 	
 	FT_Face face = (FT_Face)text->font->ft_face;
 	FT_UShort charSize = CLAMP(face->units_per_EM, 1000, 65536);
-	FT_Set_Char_Size(face, charSize, charSize, 72, 72);
+	fz_set_ft_char_size(user->ctx, text->font, charSize);
 	FT_Set_Transform(face, NULL, NULL);
 	
 	const StringFormat *format = StringFormat::GenericTypographic();
@@ -1263,15 +1266,23 @@ fz_gdiplus_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ct
 }
 
 extern "C" static void
-fz_gdiplus_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm, float alpha)
+fz_gdiplus_fill_image(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm, float alpha)
 {
-	((userData *)user)->drawPixmap(image, ctm, alpha);
+	fz_pixmap *pixmap = fz_image_to_pixmap(ctx, image, 0, 0);
+	if (!pixmap)
+		return;
+	((userData *)user)->drawPixmap(pixmap, ctm, alpha);
+	fz_drop_pixmap(ctx, pixmap);
 }
 
 extern "C" static void
-fz_gdiplus_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
+fz_gdiplus_fill_image_mask(fz_context *ctx, void *user, fz_image *mask, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
+	fz_pixmap *image = fz_image_to_pixmap(ctx, mask, 0, 0);
+	if (!image)
+		return;
+
 	float rgb[3];
 	if (!((userData *)user)->t3color)
 		fz_convert_color(((userData *)user)->ctx, colorspace, color, fz_device_rgb, rgb);
@@ -1280,7 +1291,10 @@ fz_gdiplus_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_mat
 	
 	fz_pixmap *img2 = fz_new_pixmap_with_limit(((userData *)user)->ctx, fz_device_rgb, image->w, image->h);
 	if (!img2)
+	{
+		fz_drop_pixmap(ctx, image);
 		return;
+	}
 	img2->x = image->x; img2->y = image->y;
 	
 	for (int i = 0; i < img2->w * img2->h; i++)
@@ -1295,12 +1309,16 @@ fz_gdiplus_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_mat
 	((userData *)user)->drawPixmap(img2, ctm, alpha);
 	
 	fz_drop_pixmap(((userData *)user)->ctx, img2);
+	fz_drop_pixmap(ctx, image);
 }
 
 extern "C" static void
-fz_gdiplus_clip_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_rect *rect, fz_matrix ctm)
+fz_gdiplus_clip_image_mask(fz_context *ctx, void *user, fz_image *image, fz_rect *rect, fz_matrix ctm)
 {
-	((userData *)user)->pushClipMask(image, ctm);
+	fz_pixmap *pixmap = fz_image_to_pixmap(ctx, image, 0, 0);
+	((userData *)user)->pushClipMask(pixmap, ctm);
+	if (pixmap)
+		fz_drop_pixmap(ctx, pixmap);
 }
 
 extern "C" static void
@@ -37,7 +37,7 @@ struct fz_display_node_s
 		fz_path *path;
 		fz_text *text;
 		fz_shade *shade;
-		fz_pixmap *image;
+		fz_image *image;
 		int blendmode;
 	} item;
 	fz_stroke_state *stroke;
@@ -104,6 +104,39 @@ fz_clone_stroke_state(fz_context *ctx, fz_stroke_state *stroke)
 	return newstroke;
 }
 
+static fz_rect
+fz_pop_display_rect(fz_display_list *list)
+{
+	fz_rect *update;
+
+	list->top--;
+	update = list->stack[list->top].update;
+	if (list->tiled != 0)
+		return fz_infinite_rect;
+
+	/* cf. http://bugs.ghostscript.com/show_bug.cgi?id=692346 */
+	/* empty groups must stay empty to be culled */
+	if (!fz_is_infinite_rect(list->stack[list->top].rect) && !fz_is_empty_rect(list->stack[list->top].rect))
+	{
+		/* add some fuzz at the edges, as especially glyph rects
+		 * are sometimes not actually completely bounding the glyph */
+		list->stack[list->top].rect.x0 -= 20;
+		list->stack[list->top].rect.y0 -= 20;
+		list->stack[list->top].rect.x1 += 20;
+		list->stack[list->top].rect.y1 += 20;
+	}
+	if (update != NULL)
+	{
+		*update = fz_intersect_rect(*update, list->stack[list->top].rect);
+		return *update;
+	}
+	return list->stack[list->top].rect;
+}
+
+/* Clips, groups and masks are shrunk to the bounds of what is drawn
+ * inside them once they are closed, so that the rendering devices only
+ * allocate and compose the area that is actually painted. */
+
 static void
 fz_append_display_node(fz_display_list *list, fz_display_node *node)
 {
@@ -119,7 +152,25 @@ fz_append_display_node(fz_display_list *list, fz_display_node *node)
 		}
 		list->top++;
 		break;
+	case FZ_CMD_BEGIN_MASK:
+	case FZ_CMD_BEGIN_GROUP:
+		/* the mask or group content is not part of the parent's
+		 * bounds until the group is closed */
+		if (list->top < STACK_SIZE)
+		{
+			list->stack[list->top].update = &node->rect;
+			list->stack[list->top].rect = fz_empty_rect;
+		}
+		list->top++;
+		break;
 	case FZ_CMD_END_MASK:
+		/* the mask content is never painted itself, only the
+		 * content it masks up to the matching pop */
+		if (list->top > STACK_SIZE)
+			list->top--;
+		else if (list->top > 0)
+			fz_pop_display_rect(list);
+		/* fallthrough */
 	case FZ_CMD_CLIP_TEXT:
 	case FZ_CMD_CLIP_STROKE_TEXT:
 		if (list->top < STACK_SIZE)
@@ -140,7 +191,6 @@ fz_append_display_node(fz_display_list *list, fz_display_node *node)
 		list->tiled--;
 		break;
 	case FZ_CMD_END_GROUP:
-		break;
 	case FZ_CMD_POP_CLIP:
 		if (list->top > STACK_SIZE)
 		{
@@ -149,31 +199,7 @@ fz_append_display_node(fz_display_list *list, fz_display_node *node)
 		}
 		else if (list->top > 0)
 		{
-			fz_rect *update;
-			list->top--;
-			update = list->stack[list->top].update;
-			if (list->tiled == 0)
-			{
-				/* cf. http://bugs.ghostscript.com/show_bug.cgi?id=692346 */
-				if (!fz_is_infinite_rect(list->stack[list->top].rect))
-				{
-					/* add some fuzz at the edges, as especially glyph rects
-					 * are sometimes not actually completely bounding the glyph */
-					list->stack[list->top].rect.x0 -= 20;
-					list->stack[list->top].rect.y0 -= 20;
-					list->stack[list->top].rect.x1 += 20;
-					list->stack[list->top].rect.y1 += 20;
-				}
-				if (update != NULL)
-				{
-					*update = fz_intersect_rect(*update, list->stack[list->top].rect);
-					node->rect = *update;
-				}
-				else
-					node->rect = list->stack[list->top].rect;
-			}
-			else
-				node->rect = fz_infinite_rect;
+			node->rect = fz_pop_display_rect(list);
 		}
 		/* fallthrough */
 	default:
@@ -217,7 +243,7 @@ fz_free_display_node(fz_context *ctx, fz_display_node *node)
 	case FZ_CMD_FILL_IMAGE:
 	case FZ_CMD_FILL_IMAGE_MASK:
 	case FZ_CMD_CLIP_IMAGE_MASK:
-		fz_drop_pixmap(ctx, node->item.image);
+		fz_drop_image(ctx, node->item.image);
 		break;
 	case FZ_CMD_POP_CLIP:
 	case FZ_CMD_BEGIN_MASK:
@@ -362,35 +388,35 @@ fz_list_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ctm,
 }
 
 static void
-fz_list_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm, float alpha)
+fz_list_fill_image(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm, float alpha)
 {
 	fz_display_node *node;
 	node = fz_new_display_node(ctx, FZ_CMD_FILL_IMAGE, ctm, NULL, NULL, alpha);
 	node->rect = fz_transform_rect(ctm, fz_unit_rect);
-	node->item.image = fz_keep_pixmap(image);
+	node->item.image = fz_keep_image(image);
 	fz_append_display_node(user, node);
 }
 
 static void
-fz_list_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
+fz_list_fill_image_mask(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
 	fz_display_node *node;
 	node = fz_new_display_node(ctx, FZ_CMD_FILL_IMAGE_MASK, ctm, colorspace, color, alpha);
 	node->rect = fz_transform_rect(ctm, fz_unit_rect);
-	node->item.image = fz_keep_pixmap(image);
+	node->item.image = fz_keep_image(image);
 	fz_append_display_node(user, node);
 }
 
 static void
-fz_list_clip_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_rect *rect, fz_matrix ctm)
+fz_list_clip_image_mask(fz_context *ctx, void *user, fz_image *image, fz_rect *rect, fz_matrix ctm)
 {
 	fz_display_node *node;
 	node = fz_new_display_node(ctx, FZ_CMD_CLIP_IMAGE_MASK, ctm, NULL, NULL, 0);
 	node->rect = fz_transform_rect(ctm, fz_unit_rect);
 	if (rect != NULL)
 		node->rect = fz_intersect_rect(node->rect, *rect);
-	node->item.image = fz_keep_pixmap(image);
+	node->item.image = fz_keep_image(image);
 	fz_append_display_node(user, node);
 }
 
@@ -398,10 +424,19 @@ static void
 fz_list_begin_mask(fz_context *ctx, void *user, fz_rect rect, int luminosity, fz_colorspace *colorspace, float *color)
 {
 	fz_display_node *node;
+	fz_display_list *list = user;
+	float bc = 0;
 	node = fz_new_display_node(ctx, FZ_CMD_BEGIN_MASK, fz_identity, colorspace, color, 0);
 	node->rect = rect;
 	node->flag = luminosity;
-	fz_append_display_node(user, node);
+	fz_append_display_node(list, node);
+
+	/* a luminosity mask with a non-black backdrop is not empty outside
+	 * of its content, so it must keep its full area */
+	if (luminosity && colorspace && color)
+		fz_convert_color(ctx, colorspace, color, fz_device_gray, &bc);
+	if (bc != 0 && list->top <= STACK_SIZE)
+		list->stack[list->top-1].update = NULL;
 }
 
 static void
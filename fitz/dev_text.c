@@ -423,7 +423,7 @@ fz_text_extract_span(fz_context *ctx, fz_text_span **last, fz_text *text, fz_mat
 
 	if (font->ft_face)
 	{
-		err = FT_Set_Char_Size(font->ft_face, 64, 64, 72, 72);
+		err = fz_set_ft_char_size(ctx, font, 64);
 		if (err)
 			fz_warn(ctx, "freetype set character size: %s", ft_error_string(err));
 		ascender = (float)face->ascender / face->units_per_EM;
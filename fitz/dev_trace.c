@@ -30,33 +30,33 @@ static void
 fz_trace_path(fz_path *path, int indent)
 {
 	float x, y;
-	int i = 0;
+	int i, k = 0;
 	int n;
-	while (i < path->len)
+	for (i = 0; i < path->cmd_len; i++)
 	{
 		for (n = 0; n < indent; n++)
 			putchar(' ');
-		switch (path->items[i++].k)
+		switch (path->cmds[i])
 		{
 		case FZ_MOVETO:
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("<moveto x=\"%g\" y=\"%g\" />\n", x, y);
 			break;
 		case FZ_LINETO:
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("<lineto x=\"%g\" y=\"%g\" />\n", x, y);
 			break;
 		case FZ_CURVETO:
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("<curveto x1=\"%g\" y1=\"%g\" ", x, y);
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("x2=\"%g\" y2=\"%g\" ", x, y);
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("x3=\"%g\" y3=\"%g\" />\n", x, y);
 			break;
 		case FZ_CLOSE_PATH:
@@ -197,7 +197,7 @@ fz_trace_ignore_text(fz_context *ctx, void *user, fz_text *text, fz_matrix ctm)
 }
 
 static void
-fz_trace_fill_image(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm, float alpha)
+fz_trace_fill_image(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm, float alpha)
 {
 	printf("<fill_image alpha=\"%g\" ", alpha);
 	fz_trace_matrix(ctm);
@@ -213,7 +213,7 @@ fz_trace_fill_shade(fz_context *ctx, void *user, fz_shade *shade, fz_matrix ctm,
 }
 
 static void
-fz_trace_fill_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_matrix ctm,
+fz_trace_fill_image_mask(fz_context *ctx, void *user, fz_image *image, fz_matrix ctm,
 fz_colorspace *colorspace, float *color, float alpha)
 {
 	printf("<fill_image_mask ");
@@ -223,7 +223,7 @@ fz_colorspace *colorspace, float *color, float alpha)
 }
 
 static void
-fz_trace_clip_image_mask(fz_context *ctx, void *user, fz_pixmap *image, fz_rect *rect, fz_matrix ctm)
+fz_trace_clip_image_mask(fz_context *ctx, void *user, fz_image *image, fz_rect *rect, fz_matrix ctm)
 {
 	printf("<clip_image_mask ");
 	fz_trace_matrix(ctm);
@@ -10,6 +10,7 @@ struct fz_dctd_s
 	fz_stream *chain;
 	fz_context *ctx;
 	int color_transform;
+	int l2factor;
 	int init;
 	int stride;
 	unsigned char *scanline;
@@ -113,6 +114,10 @@ read_dctd(fz_stream *stm, unsigned char *buf, int len)
 		cinfo->dct_method = JDCT_FASTEST;
 		cinfo->do_fancy_upsampling = FALSE;
 
+		/* let the IDCT do the downsampling */
+		cinfo->scale_num = 1;
+		cinfo->scale_denom = 1 << state->l2factor;
+
 		/* default value if ColorTransform is not set */
 		if (state->color_transform == -1)
 		{
@@ -191,7 +196,8 @@ close_dctd(fz_stream *stm)
 		goto skip;
 	}
 
-	if (state->init)
+	/* the reader may stop early when it only needs the top rows */
+	if (state->init && state->cinfo.output_scanline == state->cinfo.output_height)
 		jpeg_finish_decompress(&state->cinfo);
 
 skip:
@@ -202,8 +208,12 @@ skip:
 	fz_free(stm->ctx, state);
 }
 
+/*
+ * Decode at 1/2^l2factor of the full size, in each direction. The output
+ * is ceil(w/2^l2factor) by ceil(h/2^l2factor). l2factor must be 0 to 3.
+ */
 fz_stream *
-fz_open_dctd(fz_stream *chain, fz_obj *params)
+fz_open_resized_dctd(fz_stream *chain, fz_obj *params, int l2factor)
 {
 	fz_dctd *state;
 	fz_obj *obj;
@@ -211,7 +221,9 @@ fz_open_dctd(fz_stream *chain, fz_obj *params)
 	state = fz_malloc(chain->ctx, sizeof(fz_dctd));
 	memset(state, 0, sizeof(fz_dctd));
 	state->chain = chain;
+	state->ctx = chain->ctx;
 	state->color_transform = -1; /* unset */
+	state->l2factor = CLAMP(l2factor, 0, 3);
 	state->init = 0;
 
 	obj = fz_dict_gets(chain->ctx, params, "ColorTransform");
@@ -220,3 +232,9 @@ fz_open_dctd(fz_stream *chain, fz_obj *params)
 
 	return fz_new_stream(chain->ctx, state, read_dctd, close_dctd);
 }
+
+fz_stream *
+fz_open_dctd(fz_stream *chain, fz_obj *params)
+{
+	return fz_open_resized_dctd(chain, params, 0);
+}
@@ -68,6 +68,10 @@ typedef struct fz_alloc_context fz_alloc_context;
 typedef struct fz_context fz_context;
 
 typedef struct fz_font_context fz_font_context;
+typedef struct fz_scale_cache fz_scale_cache;
+typedef struct fz_image_cache fz_image_cache;
+typedef struct fz_path_cache fz_path_cache;
+typedef struct fz_cmyk_lut fz_cmyk_lut;
 
 /*
  * Variadic macros, inline and restrict keywords
@@ -105,6 +109,15 @@ typedef struct fz_font_context fz_font_context;
 
 #endif
 
+/*
+ * CPU specific code is surrounded with HAVE_XXX. SSE2 is part of every
+ * x86-64 target, so enable it automatically there.
+ */
+
+#if !defined(HAVE_SSE2) && !defined(NO_SSE2) && (defined(__SSE2__) || defined(_M_X64))
+#define HAVE_SSE2
+#endif
+
 /*
  * GCC can do type checking of printf strings
  */
@@ -458,6 +471,7 @@ struct fz_buffer_s
 };
 
 fz_buffer *fz_new_buffer(fz_context *ctx, int size);
+fz_buffer *fz_new_buffer_from_data(fz_context *ctx, unsigned char *data, int size);
 fz_buffer *fz_keep_buffer(fz_buffer *buf);
 void fz_drop_buffer(fz_context *ctx, fz_buffer *buf);
 
@@ -599,6 +613,7 @@ fz_stream *fz_open_a85d(fz_stream *chain);
 fz_stream *fz_open_ahxd(fz_stream *chain);
 fz_stream *fz_open_rld(fz_stream *chain);
 fz_stream *fz_open_dctd(fz_stream *chain, fz_obj *param);
+fz_stream *fz_open_resized_dctd(fz_stream *chain, fz_obj *param, int l2factor);
 fz_stream *fz_open_faxd(fz_stream *chain, fz_obj *param);
 fz_stream *fz_open_flated(fz_stream *chain);
 fz_stream *fz_open_lzwd(fz_stream *chain, fz_obj *param);
@@ -622,6 +637,7 @@ char *fz_blendmode_name(int blendmode);
 
 typedef struct fz_pixmap_s fz_pixmap;
 typedef struct fz_colorspace_s fz_colorspace;
+typedef struct fz_color_table_s fz_color_table;
 
 struct fz_pixmap_s
 {
@@ -634,6 +650,7 @@ struct fz_pixmap_s
 	unsigned char *samples;
 	int free_samples;
 	int has_alpha; /* SumatraPDF: allow optimizing non-alpha pixmaps */
+	int cached; /* kept by an image or the image cache for reuse */
 };
 
 /* will return NULL if soft limit is exceeded */
@@ -642,6 +659,7 @@ fz_pixmap *fz_new_pixmap_with_limit(fz_context *ctx, fz_colorspace *colorspace,
 fz_pixmap *fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, int w, int h, unsigned char *samples);
 fz_pixmap *fz_new_pixmap_with_rect(fz_context *ctx, fz_colorspace *, fz_bbox bbox);
 fz_pixmap *fz_new_pixmap_with_rect_and_data(fz_context *ctx, fz_colorspace *, fz_bbox bbox, unsigned char *samples);
+void fz_pixmap_own_samples(fz_pixmap *pix);
 fz_pixmap *fz_new_pixmap(fz_context *ctx, fz_colorspace *, int w, int h);
 fz_pixmap *fz_keep_pixmap(fz_pixmap *pix);
 void fz_drop_pixmap(fz_context *ctx, fz_pixmap *pix);
@@ -656,7 +674,20 @@ fz_bbox fz_bound_pixmap(fz_pixmap *pix);
 void fz_invert_pixmap(fz_pixmap *pix);
 void fz_gamma_pixmap(fz_pixmap *pix, float gamma);
 
+void fz_subsample_pixmap(fz_context *ctx, fz_pixmap *pix, int factor);
 fz_pixmap *fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h);
+fz_pixmap *fz_scale_converted_pixmap(fz_context *ctx, fz_pixmap *src, fz_colorspace *colorspace, float x, float y, float w, float h);
+fz_pixmap *fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, fz_colorspace *colorspace, float x, float y, float w, float h, int *ix, int *iy, int cacheable);
+void fz_new_scale_cache(fz_context *ctx);
+void fz_free_scale_cache(fz_context *ctx);
+
+/*
+ * The vertical pass of the image scaler can be split across threads when
+ * built with HAVE_PTHREADS (make threads=yes). Defaults to 1; ignored
+ * otherwise.
+ */
+int fz_get_scale_threads(fz_context *ctx);
+void fz_set_scale_threads(fz_context *ctx, int threads);
 
 fz_error fz_write_pnm(fz_context *ctx, fz_pixmap *pixmap, char *filename);
 fz_error fz_write_pam(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha);
@@ -664,6 +695,39 @@ fz_error fz_write_png(fz_context *ctx, fz_pixmap *pixmap, char *filename, int sa
 
 fz_error fz_load_jpx_image(fz_context *ctx, fz_pixmap **imgp, unsigned char *data, int size, fz_colorspace *dcs);
 
+/*
+ * Images keep their samples in whatever compact form the loader chose,
+ * and are decoded when drawn, at a power of two fraction of their full
+ * size that still covers the size they are drawn at. Decoded pixmaps
+ * are kept in a budgeted cache in the context.
+ *
+ * A subarea, in image pixels, asks for only part of the image. On return
+ * it holds the area that the pixmap actually covers, which may be larger.
+ */
+
+typedef struct fz_image_s fz_image;
+
+struct fz_image_s
+{
+	int refs;
+	int cached; /* how many of the refs are held by image caches */
+	int w, h;
+	int xres, yres;
+	fz_colorspace *colorspace; /* NULL for image masks */
+	fz_image *mask; /* explicit soft/image mask */
+	fz_pixmap *tile; /* already decoded */
+	fz_pixmap *(*get_pixmap)(fz_context *ctx, fz_image *image, fz_bbox *subarea, int l2factor);
+	void (*free_image)(fz_context *ctx, fz_image *image);
+};
+
+fz_image *fz_new_image_from_pixmap(fz_context *ctx, fz_pixmap *pixmap);
+fz_image *fz_keep_image(fz_image *image);
+void fz_drop_image(fz_context *ctx, fz_image *image);
+fz_pixmap *fz_image_to_pixmap(fz_context *ctx, fz_image *image, int w, int h);
+fz_pixmap *fz_image_to_pixmap_subarea(fz_context *ctx, fz_image *image, fz_bbox *subarea, int w, int h);
+void fz_new_image_cache(fz_context *ctx);
+void fz_free_image_cache(fz_context *ctx);
+
 /*
  * Bitmaps have 1 component per bit. Only used for creating halftoned versions
  * of contone buffers, and saving out. Samples are stored msb first, akin to
@@ -725,6 +789,7 @@ struct fz_colorspace_s
 	void (*from_rgb)(fz_context *ctx, fz_colorspace *, float *rgb, float *dst);
 	void (*free_data)(fz_context *ctx, fz_colorspace *);
 	void *data;
+	fz_color_table *tables; /* sampled conversions for pixmaps */
 };
 
 fz_colorspace *fz_new_colorspace(fz_context *ctx, char *name, int n);
@@ -732,8 +797,20 @@ fz_colorspace *fz_keep_colorspace(fz_colorspace *colorspace);
 void fz_drop_colorspace(fz_context *ctx, fz_colorspace *colorspace);
 
 void fz_convert_color(fz_context *ctx, fz_colorspace *srcs, float *srcv, fz_colorspace *dsts, float *dstv);
+
+typedef void (fz_sample_converter)(fz_context *ctx, unsigned char *src, unsigned char *dst, int count);
+fz_sample_converter *fz_find_fast_converter(fz_colorspace *srcs, fz_colorspace *dsts);
+void fz_prepare_fast_converter(fz_context *ctx, fz_sample_converter *convert);
 void fz_convert_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst);
 
+/*
+ * CMYK pixmaps are converted to RGB by interpolating in a table. Set exact
+ * to convert each pixel on its own instead, e.g. to check the results.
+ */
+int fz_get_exact_cmyk(fz_context *ctx);
+void fz_set_exact_cmyk(fz_context *ctx, int exact);
+void fz_free_cmyk_lut(fz_context *ctx);
+
 fz_colorspace *fz_find_device_colorspace(fz_context *ctx, char *name);
 
 /*
@@ -784,8 +861,16 @@ void fz_free_font_context(fz_context *ctx);
 fz_font *fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix);
 
 fz_error fz_new_font_from_memory(fz_context *ctx, fz_font **fontp, unsigned char *data, int len, int index);
+fz_error fz_new_font_from_buffer(fz_context *ctx, fz_font **fontp, fz_buffer *buf, int index);
 fz_error fz_new_font_from_file(fz_context *ctx, fz_font **fontp, char *path, int index);
 
+/*
+ * FreeType faces are shared between fonts loaded from the same font
+ * program, so set their character size with this instead of
+ * FT_Set_Char_Size. Returns a FreeType error code.
+ */
+int fz_set_ft_char_size(fz_context *ctx, fz_font *font, int size);
+
 fz_font *fz_keep_font(fz_font *font);
 void fz_drop_font(fz_context *ctx, fz_font *font);
 
@@ -804,8 +889,6 @@ void fz_set_font_bbox(fz_font *font, float xmin, float ymin, float xmax, float y
 typedef struct fz_path_s fz_path;
 typedef struct fz_stroke_state_s fz_stroke_state;
 
-typedef union fz_path_item_s fz_path_item;
-
 typedef enum fz_path_item_kind_e
 {
 	FZ_MOVETO,
@@ -814,16 +897,17 @@ typedef enum fz_path_item_kind_e
 	FZ_CLOSE_PATH
 } fz_path_item_kind;
 
-union fz_path_item_s
-{
-	fz_path_item_kind k;
-	float v;
-};
-
+/*
+ * One byte per command, and the coordinates of all the commands packed
+ * in order into a separate array: two for a moveto or lineto, six for a
+ * curveto and none for a closepath.
+ */
 struct fz_path_s
 {
-	int len, cap;
-	fz_path_item *items;
+	int cmd_len, cmd_cap;
+	unsigned char *cmds;
+	int coord_len, coord_cap;
+	float *coords;
 	fz_context *ctx;
 };
 
@@ -852,6 +936,7 @@ void fz_transform_path(fz_path *path, fz_matrix transform);
 fz_path *fz_clone_path(fz_path *old);
 
 fz_rect fz_bound_path(fz_path *path, fz_stroke_state *stroke, fz_matrix ctm);
+int fz_is_rect_path(fz_path *path, fz_matrix ctm, fz_rect *rect);
 void fz_debug_path(fz_path *, int indent);
 
 /*
@@ -893,7 +978,9 @@ fz_rect fz_bound_text(fz_text *text, fz_matrix ctm);
 fz_text *fz_clone_text(fz_context *ctx, fz_text *old);
 
 /*
- * The shading code uses gouraud shaded triangle meshes.
+ * The shading code uses gouraud shaded triangle meshes. Patch meshes
+ * are kept as patches and subdivided when drawn, as finely as the
+ * output resolution needs.
  */
 
 enum
@@ -901,8 +988,31 @@ enum
 	FZ_LINEAR,
 	FZ_RADIAL,
 	FZ_MESH,
+	FZ_PATCH,
+};
+
+/*
+ * A shading function sampled at 256 points, with an alpha value as the
+ * last component. Each component is stored in 16 bits over its own range.
+ * Shadings using the same function can share one table.
+ */
+
+typedef struct fz_shade_function_s fz_shade_function;
+
+struct fz_shade_function_s
+{
+	int refs;
+	int n;
+	float min[FZ_MAX_COLORS + 1];
+	float scale[FZ_MAX_COLORS + 1];
+	unsigned short *samples;
 };
 
+fz_shade_function *fz_new_shade_function(fz_context *ctx, float *values, int n);
+fz_shade_function *fz_keep_shade_function(fz_shade_function *func);
+void fz_drop_shade_function(fz_context *ctx, fz_shade_function *func);
+void fz_shade_function_value(fz_shade_function *func, int i, float *value);
+
 typedef struct fz_shade_s fz_shade;
 
 struct fz_shade_s
@@ -917,14 +1027,15 @@ struct fz_shade_s
 	float background[FZ_MAX_COLORS];
 
 	int use_function;
-	float function[256][FZ_MAX_COLORS + 1];
+	fz_shade_function *function;
 
-	int type; /* linear, radial, mesh */
+	int type; /* linear, radial, mesh, patch */
 	int extend[2];
 
 	int mesh_len;
 	int mesh_cap;
 	float *mesh; /* [x y 0], [x y r], [x y t] or [x y c1 ... cn] */
+	/* patches are 16 control points [x y] by rows, then 4 corner colors [t] or [c1 ... cn] */
 };
 
 fz_shade *fz_keep_shade(fz_shade *shade);
@@ -944,8 +1055,25 @@ fz_glyph_cache *fz_new_glyph_cache(fz_context *ctx);
 fz_pixmap *fz_render_ft_glyph(fz_context *ctx, fz_font *font, int cid, fz_matrix trm);
 fz_pixmap *fz_render_t3_glyph(fz_context *ctx, fz_font *font, int cid, fz_matrix trm, fz_colorspace *model);
 fz_pixmap *fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, fz_stroke_state *state);
+fz_path *fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid);
 fz_pixmap *fz_render_glyph(fz_context *ctx, fz_glyph_cache*, fz_font*, int, fz_matrix, fz_colorspace *model);
 fz_pixmap *fz_render_stroked_glyph(fz_context *ctx, fz_glyph_cache*, fz_font*, int, fz_matrix, fz_matrix, fz_stroke_state *stroke);
+fz_path *fz_outline_glyph(fz_context *ctx, fz_glyph_cache *cache, fz_font *font, int gid, fz_matrix trm);
+void fz_debug_glyph_cache(fz_glyph_cache *cache);
+
+/*
+ * Glyph origins are rounded down to one of hsubpix by vsubpix positions
+ * within a pixel (1 to 16 each, default 5 by 5), and the rest of the
+ * glyph matrix to the nearest multiple of snap device pixels (default 0,
+ * no snapping). Coarser settings let more glyphs share a cache entry.
+ * fz_snap_glyph_matrix applies them, returning the whole pixel part of
+ * the origin in x and y and the glyph matrix for fz_render_glyph.
+ */
+void fz_set_glyph_subpixels(fz_context *ctx, int hsubpix, int vsubpix);
+void fz_get_glyph_subpixels(fz_context *ctx, int *hsubpix, int *vsubpix);
+void fz_set_glyph_snap(fz_context *ctx, float snap);
+float fz_get_glyph_snap(fz_context *ctx);
+fz_matrix fz_snap_glyph_matrix(fz_context *ctx, fz_matrix trm, int *x, int *y);
 void fz_free_glyph_cache(fz_context *ctx, fz_glyph_cache *);
 
 /*
@@ -962,14 +1090,22 @@ void fz_insert_gel(fz_gel *gel, float x0, float y0, float x1, float y1);
 void fz_reset_gel(fz_gel *gel, fz_bbox clip);
 void fz_sort_gel(fz_gel *gel);
 fz_bbox fz_bound_gel(fz_gel *gel);
+fz_bbox fz_get_gel_clip(fz_gel *gel);
 void fz_free_gel(fz_gel *gel);
 int fz_is_rect_gel(fz_gel *gel);
 
 void fz_scan_convert(fz_gel *gel, int eofill, fz_bbox clip, fz_pixmap *pix, unsigned char *colorbv);
 
+fz_bbox fz_bound_rect_gel(fz_context *ctx, fz_rect rect, fz_bbox clip);
+void fz_scan_convert_rect(fz_context *ctx, fz_rect rect, fz_bbox clip, fz_pixmap *pix, unsigned char *colorbv);
+
 void fz_flatten_fill_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_matrix ctm, float flatness);
 void fz_flatten_stroke_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth);
 void fz_flatten_dash_path(fz_context *ctx, fz_gel *gel, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth);
+float *fz_flatten_hairline_path(fz_context *ctx, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm, float flatness, float linewidth, fz_bbox clip, int *len);
+void fz_paint_hairlines(fz_context *ctx, float *segs, int len, float width, fz_bbox clip, fz_pixmap *dst, unsigned char *color);
+void fz_new_path_cache(fz_context *ctx);
+void fz_free_path_cache(fz_context *ctx);
 
 /*
  * The device interface.
@@ -1009,9 +1145,9 @@ struct fz_device_s
 	void (*ignore_text)(fz_context *ctx, void *, fz_text *, fz_matrix);
 
 	void (*fill_shade)(fz_context *ctx, void *, fz_shade *shd, fz_matrix ctm, float alpha);
-	void (*fill_image)(fz_context *ctx, void *, fz_pixmap *img, fz_matrix ctm, float alpha);
-	void (*fill_image_mask)(fz_context *ctx, void *, fz_pixmap *img, fz_matrix ctm, fz_colorspace *, float *color, float alpha);
-	void (*clip_image_mask)(fz_context *ctx, void *, fz_pixmap *img, fz_rect *rect, fz_matrix ctm);
+	void (*fill_image)(fz_context *ctx, void *, fz_image *img, fz_matrix ctm, float alpha);
+	void (*fill_image_mask)(fz_context *ctx, void *, fz_image *img, fz_matrix ctm, fz_colorspace *, float *color, float alpha);
+	void (*clip_image_mask)(fz_context *ctx, void *, fz_image *img, fz_rect *rect, fz_matrix ctm);
 
 	void (*pop_clip)(fz_context *ctx, void *);
 
@@ -1035,9 +1171,9 @@ void fz_clip_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke,
 void fz_ignore_text(fz_device *dev, fz_text *text, fz_matrix ctm);
 void fz_pop_clip(fz_device *dev);
 void fz_fill_shade(fz_device *dev, fz_shade *shade, fz_matrix ctm, float alpha);
-void fz_fill_image(fz_device *dev, fz_pixmap *image, fz_matrix ctm, float alpha);
-void fz_fill_image_mask(fz_device *dev, fz_pixmap *image, fz_matrix ctm, fz_colorspace *colorspace, float *color, float alpha);
-void fz_clip_image_mask(fz_device *dev, fz_pixmap *image, fz_rect *rect, fz_matrix ctm);
+void fz_fill_image(fz_device *dev, fz_image *image, fz_matrix ctm, float alpha);
+void fz_fill_image_mask(fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *colorspace, float *color, float alpha);
+void fz_clip_image_mask(fz_device *dev, fz_image *image, fz_rect *rect, fz_matrix ctm);
 void fz_begin_mask(fz_device *dev, fz_rect area, int luminosity, fz_colorspace *colorspace, float *bc);
 void fz_end_mask(fz_device *dev);
 void fz_begin_group(fz_device *dev, fz_rect area, int isolated, int knockout, int blendmode, float alpha);
@@ -1134,6 +1270,7 @@ void fz_accelerate_arch(void);
 void fz_decode_tile(fz_pixmap *pix, float *decode);
 void fz_decode_indexed_tile(fz_pixmap *pix, float *decode, int maxval);
 void fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int scale);
+void fz_unpack_tile_with_decode(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int indexed, float *decode);
 
 void fz_paint_solid_alpha(unsigned char * restrict dp, int w, int alpha);
 void fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned char *color);
@@ -1219,6 +1356,27 @@ struct fz_context
 
 	/* Font context */
 	fz_font_context *ft;
+
+	/* Scaled image cache */
+	fz_scale_cache *scale_cache;
+
+	/* Decoded image cache */
+	fz_image_cache *image_cache;
+
+	/* Flattened path cache */
+	fz_path_cache *path_cache;
+
+	/* Number of threads used by the image scaler */
+	int fz_scale_threads;
+
+	/* Glyph subpixel positions and matrix snapping */
+	int fz_glyph_hsubpix;
+	int fz_glyph_vsubpix;
+	float fz_glyph_snap;
+
+	/* CMYK to RGB conversion table */
+	fz_cmyk_lut *cmyk_lut;
+	int fz_exact_cmyk;
 };
 
 fz_context *fz_context_init(fz_alloc_context *alloc);
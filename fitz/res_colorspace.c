@@ -1,7 +1,13 @@
 #include "fitz.h"
 
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 #define SLOWCMYK
 
+static void fz_free_color_tables(fz_context *ctx, fz_color_table *table);
+
 fz_colorspace *
 fz_new_colorspace(fz_context *ctx, char *name, int n)
 {
@@ -13,6 +19,7 @@ fz_new_colorspace(fz_context *ctx, char *name, int n)
 	cs->from_rgb = NULL;
 	cs->free_data = NULL;
 	cs->data = NULL;
+	cs->tables = NULL;
 	return cs;
 }
 
@@ -34,6 +41,7 @@ fz_drop_colorspace(fz_context *ctx, fz_colorspace *cs)
 	{
 		if (cs->free_data && cs->data)
 			cs->free_data(ctx, cs);
+		fz_free_color_tables(ctx, cs->tables);
 		fz_free(ctx, cs);
 	}
 }
@@ -179,11 +187,8 @@ fz_find_device_colorspace(fz_context *ctx, char *name)
 
 /* Fast pixmap color conversions */
 
-static void fast_gray_to_rgb(fz_pixmap *src, fz_pixmap *dst)
+static void fast_gray_to_rgb(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		d[0] = s[0];
@@ -195,11 +200,8 @@ static void fast_gray_to_rgb(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-static void fast_gray_to_cmyk(fz_pixmap *src, fz_pixmap *dst)
+static void fast_gray_to_cmyk(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		d[0] = 0;
@@ -212,11 +214,8 @@ static void fast_gray_to_cmyk(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-static void fast_rgb_to_gray(fz_pixmap *src, fz_pixmap *dst)
+static void fast_rgb_to_gray(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		d[0] = ((s[0]+1) * 77 + (s[1]+1) * 150 + (s[2]+1) * 28) >> 8;
@@ -226,11 +225,8 @@ static void fast_rgb_to_gray(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-static void fast_bgr_to_gray(fz_pixmap *src, fz_pixmap *dst)
+static void fast_bgr_to_gray(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		d[0] = ((s[0]+1) * 28 + (s[1]+1) * 150 + (s[2]+1) * 77) >> 8;
@@ -240,11 +236,8 @@ static void fast_bgr_to_gray(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-static void fast_rgb_to_cmyk(fz_pixmap *src, fz_pixmap *dst)
+static void fast_rgb_to_cmyk(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		unsigned char c = 255 - s[0];
@@ -261,11 +254,8 @@ static void fast_rgb_to_cmyk(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-static void fast_bgr_to_cmyk(fz_pixmap *src, fz_pixmap *dst)
+static void fast_bgr_to_cmyk(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		unsigned char c = 255 - s[2];
@@ -282,11 +272,8 @@ static void fast_bgr_to_cmyk(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-static void fast_cmyk_to_gray(fz_pixmap *src, fz_pixmap *dst)
+static void fast_cmyk_to_gray(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		unsigned char c = fz_mul255(s[0], 77);
@@ -299,67 +286,256 @@ static void fast_cmyk_to_gray(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-static void fast_cmyk_to_rgb(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
+#ifdef SLOWCMYK
+
+/*
+ * Converting each pixel with cmyk_to_rgb is slow, so pixmaps are converted
+ * through a table of the exact conversion on a grid of 17^4 points, which
+ * is interpolated between the five corners of the simplex around each
+ * color. The table is built the first time it is needed; use
+ * fz_set_exact_cmyk to convert every pixel exactly instead.
+ */
+
+#define CMYK_GRID 17
+#define CMYK_SHIFT 15 /* table entries are 255 << 7 at most */
+
+struct fz_cmyk_lut
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
-	while (n--)
+	/* r, g, b, 0 for each grid point */
+	short table[CMYK_GRID * CMYK_GRID * CMYK_GRID * CMYK_GRID * 4];
+	/* for each sample value, the offset of the grid cell in each
+	 * dimension (in shorts) and the position within it (0 to 256) */
+	int offset[4][256];
+	int frac[256];
+	/* distance between grid points in each dimension */
+	int stride[4];
+};
+
+static fz_cmyk_lut *
+fz_new_cmyk_lut(fz_context *ctx)
+{
+	fz_cmyk_lut *lut = fz_malloc(ctx, sizeof(fz_cmyk_lut));
+	float cmyk[4], rgb[3];
+	short *p = lut->table;
+	int c, m, y, k, i, v;
+
+	for (c = 0; c < CMYK_GRID; c++)
+	for (m = 0; m < CMYK_GRID; m++)
+	for (y = 0; y < CMYK_GRID; y++)
+	for (k = 0; k < CMYK_GRID; k++)
 	{
-#ifdef SLOWCMYK
-		float cmyk[4], rgb[3];
-		cmyk[0] = s[0] / 255.0f;
-		cmyk[1] = s[1] / 255.0f;
-		cmyk[2] = s[2] / 255.0f;
-		cmyk[3] = s[3] / 255.0f;
+		cmyk[0] = c / (CMYK_GRID - 1.0f);
+		cmyk[1] = m / (CMYK_GRID - 1.0f);
+		cmyk[2] = y / (CMYK_GRID - 1.0f);
+		cmyk[3] = k / (CMYK_GRID - 1.0f);
 		cmyk_to_rgb(ctx, NULL, cmyk, rgb);
-		d[0] = rgb[0] * 255;
-		d[1] = rgb[1] * 255;
-		d[2] = rgb[2] * 255;
+		p[0] = rgb[0] * (255 << 7) + 0.5f;
+		p[1] = rgb[1] * (255 << 7) + 0.5f;
+		p[2] = rgb[2] * (255 << 7) + 0.5f;
+		p[3] = 0;
+		p += 4;
+	}
+
+	lut->stride[3] = 4;
+	for (i = 2; i >= 0; i--)
+		lut->stride[i] = lut->stride[i + 1] * CMYK_GRID;
+
+	for (v = 0; v < 256; v++)
+	{
+		int pos = v * (CMYK_GRID - 1);
+		int cell = pos / 255;
+		int frac = ((pos - cell * 255) * 256 + 127) / 255;
+		/* keep the last cell for the maximum so that its far corner exists */
+		if (cell == CMYK_GRID - 1)
+		{
+			cell--;
+			frac = 256;
+		}
+		lut->frac[v] = frac;
+		for (i = 0; i < 4; i++)
+			lut->offset[i][v] = cell * lut->stride[i];
+	}
+
+	return lut;
+}
+
+void
+fz_free_cmyk_lut(fz_context *ctx)
+{
+	fz_free(ctx, ctx->cmyk_lut);
+	ctx->cmyk_lut = NULL;
+}
+
+#define CMYK_SWAP(a, b) \
+	if (f[a] < f[b]) { t = f[a]; f[a] = f[b]; f[b] = t; t = o[a]; o[a] = o[b]; o[b] = t; }
+
+/* Interpolate one color; out gets r, g, b and one unused value, all << CMYK_SHIFT */
+static inline void
+fz_lookup_cmyk(fz_cmyk_lut *lut, unsigned char *s, int *out)
+{
+	short *p0, *p1, *p2, *p3, *p4;
+	int f[4], o[4], t;
+
+	f[0] = lut->frac[s[0]];
+	f[1] = lut->frac[s[1]];
+	f[2] = lut->frac[s[2]];
+	f[3] = lut->frac[s[3]];
+	o[0] = lut->stride[0];
+	o[1] = lut->stride[1];
+	o[2] = lut->stride[2];
+	o[3] = lut->stride[3];
+
+	/* walk the corners in order of decreasing fraction */
+	CMYK_SWAP(0, 1);
+	CMYK_SWAP(2, 3);
+	CMYK_SWAP(0, 2);
+	CMYK_SWAP(1, 3);
+	CMYK_SWAP(1, 2);
+
+	p0 = lut->table + lut->offset[0][s[0]] + lut->offset[1][s[1]] + lut->offset[2][s[2]] + lut->offset[3][s[3]];
+	p1 = p0 + o[0];
+	p2 = p1 + o[1];
+	p3 = p2 + o[2];
+	p4 = p3 + o[3];
+
+#ifdef HAVE_SSE2
+	{
+		/* pair up corners and weights for pmaddwd */
+		__m128i a = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i *)p0), _mm_loadl_epi64((__m128i *)p1));
+		__m128i b = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i *)p2), _mm_loadl_epi64((__m128i *)p3));
+		__m128i c = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i *)p4), _mm_setzero_si128());
+		__m128i wa = _mm_set1_epi32((256 - f[0]) | ((f[0] - f[1]) << 16));
+		__m128i wb = _mm_set1_epi32((f[1] - f[2]) | ((f[2] - f[3]) << 16));
+		__m128i wc = _mm_set1_epi32(f[3]);
+		__m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(a, wa), _mm_madd_epi16(b, wb)), _mm_madd_epi16(c, wc));
+		_mm_storeu_si128((__m128i *)out, sum);
+	}
 #else
+	{
+		int w0 = 256 - f[0], w1 = f[0] - f[1], w2 = f[1] - f[2], w3 = f[2] - f[3], w4 = f[3];
+		out[0] = p0[0] * w0 + p1[0] * w1 + p2[0] * w2 + p3[0] * w3 + p4[0] * w4;
+		out[1] = p0[1] * w0 + p1[1] * w1 + p2[1] * w2 + p3[1] * w3 + p4[1] * w4;
+		out[2] = p0[2] * w0 + p1[2] * w1 + p2[2] * w2 + p3[2] * w3 + p4[2] * w4;
+	}
+#endif
+}
+
+#undef CMYK_SWAP
+
+static void
+fz_convert_cmyk_row(fz_context *ctx, unsigned char *s, unsigned char *d, int n, int r, int b)
+{
+	fz_cmyk_lut *lut;
+	unsigned int last = 0;
+	int rgb[4];
+
+	if (ctx->fz_exact_cmyk)
+	{
+		while (n--)
+		{
+			float cmyk[4], frgb[3];
+			cmyk[0] = s[0] / 255.0f;
+			cmyk[1] = s[1] / 255.0f;
+			cmyk[2] = s[2] / 255.0f;
+			cmyk[3] = s[3] / 255.0f;
+			cmyk_to_rgb(ctx, NULL, cmyk, frgb);
+			d[r] = frgb[0] * 255;
+			d[1] = frgb[1] * 255;
+			d[b] = frgb[2] * 255;
+			d[3] = s[4];
+			s += 5;
+			d += 4;
+		}
+		return;
+	}
+
+	if (!ctx->cmyk_lut)
+		ctx->cmyk_lut = fz_new_cmyk_lut(ctx);
+	lut = ctx->cmyk_lut;
+
+	/* runs of the same color are common */
+	if (n > 0)
+	{
+		fz_lookup_cmyk(lut, s, rgb);
+		last = s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int)s[3] << 24);
+	}
+
+	while (n--)
+	{
+		unsigned int cmyk = s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int)s[3] << 24);
+		if (cmyk != last)
+		{
+			fz_lookup_cmyk(lut, s, rgb);
+			last = cmyk;
+		}
+		d[r] = rgb[0] >> CMYK_SHIFT;
+		d[1] = rgb[1] >> CMYK_SHIFT;
+		d[b] = rgb[2] >> CMYK_SHIFT;
+		d[3] = s[4];
+		s += 5;
+		d += 4;
+	}
+}
+
+static void fast_cmyk_to_rgb(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
+{
+	fz_convert_cmyk_row(ctx, s, d, n, 0, 2);
+}
+
+static void fast_cmyk_to_bgr(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
+{
+	fz_convert_cmyk_row(ctx, s, d, n, 2, 0);
+}
+
+#else
+
+void
+fz_free_cmyk_lut(fz_context *ctx)
+{
+}
+
+static void fast_cmyk_to_rgb(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
+{
+	while (n--)
+	{
 		d[0] = 255 - MIN(s[0] + s[3], 255);
 		d[1] = 255 - MIN(s[1] + s[3], 255);
 		d[2] = 255 - MIN(s[2] + s[3], 255);
-#endif
 		d[3] = s[4];
 		s += 5;
 		d += 4;
 	}
 }
 
-static void fast_cmyk_to_bgr(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
+static void fast_cmyk_to_bgr(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
-#ifdef SLOWCMYK
-		float cmyk[4], rgb[3];
-		cmyk[0] = s[0] / 255.0f;
-		cmyk[1] = s[1] / 255.0f;
-		cmyk[2] = s[2] / 255.0f;
-		cmyk[3] = s[3] / 255.0f;
-		cmyk_to_rgb(ctx, NULL, cmyk, rgb);
-		d[0] = rgb[2] * 255;
-		d[1] = rgb[1] * 255;
-		d[2] = rgb[0] * 255;
-#else
 		d[0] = 255 - MIN(s[2] + s[3], 255);
 		d[1] = 255 - MIN(s[1] + s[3], 255);
 		d[2] = 255 - MIN(s[0] + s[3], 255);
-#endif
 		d[3] = s[4];
 		s += 5;
 		d += 4;
 	}
 }
 
-static void fast_rgb_to_bgr(fz_pixmap *src, fz_pixmap *dst)
+#endif
+
+int
+fz_get_exact_cmyk(fz_context *ctx)
+{
+	return ctx->fz_exact_cmyk;
+}
+
+void
+fz_set_exact_cmyk(fz_context *ctx, int exact)
+{
+	ctx->fz_exact_cmyk = !!exact;
+}
+
+static void fast_rgb_to_bgr(fz_context *ctx, unsigned char *s, unsigned char *d, int n)
 {
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
 	while (n--)
 	{
 		d[0] = s[2];
@@ -371,13 +547,269 @@ static void fast_rgb_to_bgr(fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
+/*
+ * Pixmaps in colorspaces without a fast converter are converted through
+ * tables sampled from the colorspace, which are kept with it for each
+ * destination. Colorspaces with one component get an exact table of all
+ * 256 values; those with two to four are interpolated between the points
+ * of a grid. Lab is not, as its conversion clips and bends too sharply
+ * near the edge of the RGB gamut. The static colorspaces are shared
+ * between contexts, so their tables are only used for a single pixmap.
+ */
+
+#define COLOR_TABLE_MAX 4
+
+struct fz_color_table_s
+{
+	fz_colorspace *ds;
+	int srcn, dstn;
+	int grid; /* points along each dimension */
+	int stride[COLOR_TABLE_MAX]; /* in samples */
+	unsigned char *lookup; /* for srcn == 1 */
+	unsigned short *table; /* dstn values << 8 at each point */
+	fz_color_table *next;
+};
+
+static int
+fz_color_table_grid(int srcn)
+{
+	switch (srcn)
+	{
+	case 1: return 256;
+	case 2: return 65;
+	case 3: return 33;
+	case 4: return 17;
+	}
+	return 0;
+}
+
+/* v is a sample value from 0 to 255, not always a whole one */
+static void
+fz_sample_to_float(fz_colorspace *ss, float v, int k, float *srcv)
+{
+	/* Lab components are not scaled to 0..1 */
+	if (ss->n == 3 && !strcmp(ss->name, "Lab"))
+		srcv[k] = k == 0 ? v / 255.0f * 100 : v - 128.0f;
+	else
+		srcv[k] = v / 255.0f;
+}
+
+static fz_color_table *
+fz_new_color_table(fz_context *ctx, fz_colorspace *ss, fz_colorspace *ds)
+{
+	fz_color_table *table;
+	float srcv[FZ_MAX_COLORS];
+	float dstv[FZ_MAX_COLORS];
+	int pos[COLOR_TABLE_MAX];
+	int grid = fz_color_table_grid(ss->n);
+	int i, k, count;
+
+	table = fz_malloc(ctx, sizeof(fz_color_table));
+	memset(table, 0, sizeof(fz_color_table));
+	table->ds = ds;
+	table->srcn = ss->n;
+	table->dstn = ds->n;
+	table->grid = grid;
+
+	if (ss->n == 1)
+	{
+		table->lookup = fz_malloc(ctx, 256 * ds->n);
+		for (i = 0; i < 256; i++)
+		{
+			fz_sample_to_float(ss, i, 0, srcv);
+			fz_convert_color(ctx, ss, srcv, ds, dstv);
+			for (k = 0; k < ds->n; k++)
+				table->lookup[i * ds->n + k] = dstv[k] * 255;
+		}
+		return table;
+	}
+
+	table->stride[ss->n - 1] = ds->n;
+	for (k = ss->n - 2; k >= 0; k--)
+		table->stride[k] = table->stride[k + 1] * grid;
+	count = table->stride[0] * grid / ds->n;
+
+	table->table = fz_calloc(ctx, count, ds->n * sizeof(unsigned short));
+	memset(pos, 0, sizeof pos);
+	for (i = 0; i < count; i++)
+	{
+		unsigned short *p = table->table + i * ds->n;
+		for (k = 0; k < ss->n; k++)
+			fz_sample_to_float(ss, pos[k] * 255.0f / (grid - 1), k, srcv);
+		fz_convert_color(ctx, ss, srcv, ds, dstv);
+		for (k = 0; k < ds->n; k++)
+			p[k] = CLAMP(dstv[k], 0, 1) * (255 << 8) + 0.5f;
+
+		/* next grid point, last component fastest */
+		for (k = ss->n - 1; k >= 0 && ++pos[k] == grid; k--)
+			pos[k] = 0;
+	}
+
+	return table;
+}
+
+static void
+fz_free_color_tables(fz_context *ctx, fz_color_table *table)
+{
+	while (table)
+	{
+		fz_color_table *next = table->next;
+		fz_free(ctx, table->lookup);
+		fz_free(ctx, table->table);
+		fz_free(ctx, table);
+		table = next;
+	}
+}
+
+/*
+ * Returns the table for converting count pixels from ss to ds, or NULL if
+ * they are better converted one by one. *owned is set if the caller must
+ * free the table.
+ */
+static fz_color_table *
+fz_find_color_table(fz_context *ctx, fz_colorspace *ss, fz_colorspace *ds, int count, int *owned)
+{
+	fz_color_table *table;
+	int nodes, k;
+
+	*owned = 0;
+	if (ss->n > COLOR_TABLE_MAX)
+		return NULL;
+	if (ss->n > 1 && !strcmp(ss->name, "Lab"))
+		return NULL;
+
+	fz_synchronize_begin();
+	for (table = ss->tables; table; table = table->next)
+		if (table->ds == ds)
+			break;
+	fz_synchronize_end();
+	if (table)
+		return table;
+
+	/* only sample when there are more pixels than points */
+	nodes = 1;
+	for (k = 0; k < ss->n; k++)
+		nodes *= fz_color_table_grid(ss->n);
+	if (count < nodes)
+		return NULL;
+
+	table = fz_new_color_table(ctx, ss, ds);
+	if (ss->refs < 0)
+	{
+		*owned = 1;
+		return table;
+	}
+
+	fz_synchronize_begin();
+	table->next = ss->tables;
+	ss->tables = table;
+	fz_synchronize_end();
+	return table;
+}
+
+static void
+fz_convert_pixmap_with_table(fz_color_table *table, fz_pixmap *src, fz_pixmap *dst)
+{
+	int srcn = table->srcn;
+	int dstn = table->dstn;
+	int grid = table->grid;
+	int count = src->w * src->h;
+	unsigned char *s = src->samples;
+	unsigned char *d = dst->samples;
+	unsigned char *last = NULL;
+	int cell[256], frac[256];
+	float scale;
+	int v, k, i, j;
+
+	if (srcn == 1)
+	{
+		unsigned char *lookup = table->lookup;
+		while (count--)
+		{
+			unsigned char *p = lookup + *s++ * dstn;
+			for (k = 0; k < dstn; k++)
+				*d++ = p[k];
+			*d++ = *s++;
+		}
+		return;
+	}
+
+	/* the weights of the corners add up to 256^srcn */
+	scale = 1.0f / 256;
+	for (k = 0; k < srcn; k++)
+		scale /= 256;
+
+	/* cell and position within it (0 to 256) of each sample value */
+	for (v = 0; v < 256; v++)
+	{
+		int pos = v * (grid - 1);
+		cell[v] = pos / 255;
+		frac[v] = ((pos - cell[v] * 255) * 256 + 127) / 255;
+		if (cell[v] == grid - 1)
+		{
+			cell[v]--;
+			frac[v] = 256;
+		}
+	}
+
+	while (count--)
+	{
+		/* runs of the same color are common */
+		if (last && !memcmp(s, last, srcn))
+		{
+			memcpy(d, d - dstn - 1, dstn);
+		}
+		else
+		{
+			float acc[FZ_MAX_COLORS];
+			unsigned short *base = table->table;
+			for (k = 0; k < dstn; k++)
+				acc[k] = 0;
+			for (k = 0; k < srcn; k++)
+				base += cell[s[k]] * table->stride[k];
+
+			/* blend the corners of the cell */
+			for (i = 0; i < (1 << srcn); i++)
+			{
+				unsigned short *p = base;
+				float w = 1;
+				for (j = 0; j < srcn; j++)
+				{
+					if (i & (1 << j))
+					{
+						w *= frac[s[j]];
+						p += table->stride[j];
+					}
+					else
+						w *= 256 - frac[s[j]];
+				}
+				if (w == 0)
+					continue;
+				for (k = 0; k < dstn; k++)
+					acc[k] += w * p[k];
+			}
+
+			for (k = 0; k < dstn; k++)
+			{
+				v = acc[k] * scale;
+				d[k] = CLAMP(v, 0, 255);
+			}
+		}
+		last = s;
+		s += srcn;
+		d += dstn;
+		*d++ = *s++;
+	}
+}
+
 static void
 fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
 {
 	float srcv[FZ_MAX_COLORS];
 	float dstv[FZ_MAX_COLORS];
-	int srcn, dstn;
-	int y, x, k, i;
+	fz_color_table *table;
+	int srcn, dstn, owned;
+	int y, x, k;
 
 	fz_colorspace *ss = src->colorspace;
 	fz_colorspace *ds = dst->colorspace;
@@ -392,25 +824,12 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
 	srcn = ss->n;
 	dstn = ds->n;
 
-	/* Special case for Lab colorspace (scaling of components to float) */
-	if (!strcmp(ss->name, "Lab") && srcn == 3)
+	table = fz_find_color_table(ctx, ss, ds, src->w * src->h, &owned);
+	if (table)
 	{
-		for (y = 0; y < src->h; y++)
-		{
-			for (x = 0; x < src->w; x++)
-			{
-				srcv[0] = *s++ / 255.0f * 100;
-				srcv[1] = *s++ - 128;
-				srcv[2] = *s++ - 128;
-
-				fz_convert_color(ctx, ss, srcv, ds, dstv);
-
-				for (k = 0; k < dstn; k++)
-					*d++ = dstv[k] * 255;
-
-				*d++ = *s++;
-			}
-		}
+		fz_convert_pixmap_with_table(table, src, dst);
+		if (owned)
+			fz_free_color_tables(ctx, table);
 	}
 
 	/* Brute-force for small images */
@@ -421,7 +840,7 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
 			for (x = 0; x < src->w; x++)
 			{
 				for (k = 0; k < srcn; k++)
-					srcv[k] = *s++ / 255.0f;
+					fz_sample_to_float(ss, *s++, k, srcv);
 
 				fz_convert_color(ctx, ss, srcv, ds, dstv);
 
@@ -433,31 +852,6 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
 		}
 	}
 
-	/* 1-d lookup table for separation and similar colorspaces */
-	else if (srcn == 1)
-	{
-		unsigned char lookup[FZ_MAX_COLORS * 256];
-
-		for (i = 0; i < 256; i++)
-		{
-			srcv[0] = i / 255.0f;
-			fz_convert_color(ctx, ss, srcv, ds, dstv);
-			for (k = 0; k < dstn; k++)
-				lookup[i * dstn + k] = dstv[k] * 255;
-		}
-
-		for (y = 0; y < src->h; y++)
-		{
-			for (x = 0; x < src->w; x++)
-			{
-				i = *s++;
-				for (k = 0; k < dstn; k++)
-					*d++ = lookup[i * dstn + k];
-				*d++ = *s++;
-			}
-		}
-	}
-
 	/* Memoize colors using a hash table for the general case */
 	else
 	{
@@ -481,7 +875,7 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
 				else
 				{
 					for (k = 0; k < srcn; k++)
-						srcv[k] = *s++ / 255.0f;
+						fz_sample_to_float(ss, *s++, k, srcv);
 					fz_convert_color(ctx, ss, srcv, ds, dstv);
 					for (k = 0; k < dstn; k++)
 						*d++ = dstv[k] * 255;
@@ -497,51 +891,78 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *dst)
 	}
 }
 
-void
-fz_convert_pixmap(fz_context *ctx, fz_pixmap *sp, fz_pixmap *dp)
+/*
+ * Returns a function that converts samples with alpha between two device
+ * colorspaces, or NULL if there is no fast conversion between them.
+ */
+fz_sample_converter *
+fz_find_fast_converter(fz_colorspace *ss, fz_colorspace *ds)
 {
-	fz_colorspace *ss = sp->colorspace;
-	fz_colorspace *ds = dp->colorspace;
-
-	assert(ss && ds);
-
-	if (sp->mask)
-		dp->mask = fz_keep_pixmap(sp->mask);
-	dp->interpolate = sp->interpolate;
-
 	if (ss == fz_device_gray)
 	{
-		if (ds == fz_device_rgb) fast_gray_to_rgb(sp, dp);
-		else if (ds == fz_device_bgr) fast_gray_to_rgb(sp, dp); /* bgr == rgb here */
-		else if (ds == fz_device_cmyk) fast_gray_to_cmyk(sp, dp);
-		else fz_std_conv_pixmap(ctx, sp, dp);
+		if (ds == fz_device_rgb) return fast_gray_to_rgb;
+		if (ds == fz_device_bgr) return fast_gray_to_rgb; /* bgr == rgb here */
+		if (ds == fz_device_cmyk) return fast_gray_to_cmyk;
 	}
 
 	else if (ss == fz_device_rgb)
 	{
-		if (ds == fz_device_gray) fast_rgb_to_gray(sp, dp);
-		else if (ds == fz_device_bgr) fast_rgb_to_bgr(sp, dp);
-		else if (ds == fz_device_cmyk) fast_rgb_to_cmyk(sp, dp);
-		else fz_std_conv_pixmap(ctx, sp, dp);
+		if (ds == fz_device_gray) return fast_rgb_to_gray;
+		if (ds == fz_device_bgr) return fast_rgb_to_bgr;
+		if (ds == fz_device_cmyk) return fast_rgb_to_cmyk;
 	}
 
 	else if (ss == fz_device_bgr)
 	{
-		if (ds == fz_device_gray) fast_bgr_to_gray(sp, dp);
-		else if (ds == fz_device_rgb) fast_rgb_to_bgr(sp, dp); /* bgr = rgb here */
-		else if (ds == fz_device_cmyk) fast_bgr_to_cmyk(sp, dp);
-		else fz_std_conv_pixmap(ctx, sp, dp);
+		if (ds == fz_device_gray) return fast_bgr_to_gray;
+		if (ds == fz_device_rgb) return fast_rgb_to_bgr; /* bgr = rgb here */
+		if (ds == fz_device_cmyk) return fast_bgr_to_cmyk;
 	}
 
 	else if (ss == fz_device_cmyk)
 	{
-		if (ds == fz_device_gray) fast_cmyk_to_gray(sp, dp);
-		else if (ds == fz_device_bgr) fast_cmyk_to_bgr(ctx, sp, dp);
-		else if (ds == fz_device_rgb) fast_cmyk_to_rgb(ctx, sp, dp);
-		else fz_std_conv_pixmap(ctx, sp, dp);
+		if (ds == fz_device_gray) return fast_cmyk_to_gray;
+		if (ds == fz_device_bgr) return fast_cmyk_to_bgr;
+		if (ds == fz_device_rgb) return fast_cmyk_to_rgb;
 	}
 
-	else fz_std_conv_pixmap(ctx, sp, dp);
+	return NULL;
+}
+
+/*
+ * Some fast converters build their tables the first time they run. Call
+ * this before running one on several threads at once.
+ */
+void
+fz_prepare_fast_converter(fz_context *ctx, fz_sample_converter *convert)
+{
+#ifdef SLOWCMYK
+	if (convert == fast_cmyk_to_rgb || convert == fast_cmyk_to_bgr)
+	{
+		if (!ctx->fz_exact_cmyk && !ctx->cmyk_lut)
+			ctx->cmyk_lut = fz_new_cmyk_lut(ctx);
+	}
+#endif
+}
+
+void
+fz_convert_pixmap(fz_context *ctx, fz_pixmap *sp, fz_pixmap *dp)
+{
+	fz_colorspace *ss = sp->colorspace;
+	fz_colorspace *ds = dp->colorspace;
+	fz_sample_converter *convert;
+
+	assert(ss && ds);
+
+	if (sp->mask)
+		dp->mask = fz_keep_pixmap(sp->mask);
+	dp->interpolate = sp->interpolate;
+
+	convert = fz_find_fast_converter(ss, ds);
+	if (convert)
+		convert(ctx, sp->samples, dp->samples, sp->w * sp->h);
+	else
+		fz_std_conv_pixmap(ctx, sp, dp);
 }
 
 /* Convert a single color */
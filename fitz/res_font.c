@@ -3,12 +3,51 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_STROKER_H
+#include FT_OUTLINE_H
+#include FT_SIZES_H
+
+#define FT_SIZE_SLOTS 4
+#define MAX_IDLE_FACES 16
 
 static void fz_finalize_freetype(fz_context *);
 
+typedef struct fz_ft_face_s fz_ft_face;
+
+/*
+ * FreeType faces are pooled in the font context and shared by all the
+ * fonts loaded from the same font program: the same file, the same
+ * memory, or a buffer with the same contents. Faces loaded from files
+ * and buffers stay in the pool for a while after their last font is
+ * dropped, so that the next document using them can pick them up again.
+ *
+ * Each face also keeps a few size objects, one per character size in
+ * use, so that switching between sizes does not recompute the scaling
+ * (and rerun the hinting setup) every time.
+ */
+struct fz_ft_face_s
+{
+	FT_Face face;
+	int refs;
+	fz_ft_face *next;
+
+	/* what the face was loaded from */
+	char *path;
+	unsigned char *data;
+	int len;
+	int index;
+	fz_buffer *buf;
+	unsigned char digest[16];
+
+	FT_Size sizes[FT_SIZE_SLOTS];
+	int char_size[FT_SIZE_SLOTS];
+	int next_size;
+};
+
 struct fz_font_context {
     FT_Library ftlib;
     int refs;
+    fz_ft_face *faces;
+    int idle;
 };
 
 void
@@ -19,13 +58,26 @@ fz_new_font_context(fz_context *ctx)
 	ft = fz_malloc(ctx, sizeof(fz_font_context));
 	ft->ftlib = NULL;
 	ft->refs = 0;
+	ft->faces = NULL;
+	ft->idle = 0;
 	
 	ctx->ft = ft;
 }
 
+static void fz_free_ft_face(fz_context *ctx, fz_ft_face *entry);
+
 void
 fz_free_font_context(fz_context *ctx)
 {
+	fz_ft_face *entry, *next;
+
+	/* only idle faces should be left */
+	for (entry = ctx->ft->faces; entry; entry = next)
+	{
+		next = entry->next;
+		fz_free_ft_face(ctx, entry);
+	}
+
 	fz_finalize_freetype(ctx);
 
 	fz_free(ctx, ctx->ft);
@@ -79,10 +131,11 @@ fz_keep_font(fz_font *font)
 	return font;
 }
 
+static void fz_drop_ft_face(fz_context *ctx, fz_ft_face *entry);
+
 void
 fz_drop_font(fz_context *ctx, fz_font *font)
 {
-	int fterr;
 	int i;
 
 	if (font && --font->refs == 0)
@@ -100,10 +153,10 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 
 		if (font->ft_face)
 		{
-			fterr = FT_Done_Face((FT_Face)font->ft_face);
-			if (fterr)
-				fz_warn(ctx, "freetype finalizing face: %s", ft_error_string(fterr));
-			fz_finalize_freetype(ctx);
+			fz_ft_face *entry = ((FT_Face)font->ft_face)->generic.data;
+			if (entry->buf)
+				font->ft_data = NULL; /* owned by the face */
+			fz_drop_ft_face(ctx, entry);
 		}
 
 		if (font->ft_file)
@@ -231,26 +284,128 @@ fz_check_font_dimensions(FT_Face face)
 	}
 }
 
-fz_error
-fz_new_font_from_file(fz_context *ctx, fz_font **fontp, char *path, int index)
+static void
+fz_free_ft_face(fz_context *ctx, fz_ft_face *entry)
+{
+	fz_ft_face **prev;
+	int fterr;
+
+	for (prev = &ctx->ft->faces; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == entry)
+		{
+			*prev = entry->next;
+			break;
+		}
+	}
+
+	/* this also frees the size objects */
+	fterr = FT_Done_Face(entry->face);
+	if (fterr)
+		fz_warn(ctx, "freetype finalizing face: %s", ft_error_string(fterr));
+	fz_finalize_freetype(ctx);
+
+	if (entry->buf)
+		fz_drop_buffer(ctx, entry->buf);
+	if (entry->path)
+		fz_free(ctx, entry->path);
+	fz_free(ctx, entry);
+}
+
+static void
+fz_drop_ft_face(fz_context *ctx, fz_ft_face *entry)
+{
+	fz_ft_face *last, *e;
+
+	if (--entry->refs > 0)
+		return;
+
+	/* the memory of a face not loaded from a file or buffer belongs to the caller */
+	if (!entry->path && !entry->buf)
+	{
+		fz_free_ft_face(ctx, entry);
+		return;
+	}
+
+	if (++ctx->ft->idle > MAX_IDLE_FACES)
+	{
+		last = NULL;
+		for (e = ctx->ft->faces; e; e = e->next)
+			if (e->refs == 0 && e != entry)
+				last = e;
+		if (last)
+		{
+			fz_free_ft_face(ctx, last);
+			ctx->ft->idle--;
+		}
+	}
+}
+
+static fz_ft_face *
+fz_keep_ft_face(fz_context *ctx, fz_ft_face *entry)
 {
+	fz_ft_face **prev;
+
+	if (entry->refs++ == 0)
+		ctx->ft->idle--;
+
+	/* move to the front, so that idle faces are evicted oldest first */
+	for (prev = &ctx->ft->faces; *prev != entry; prev = &(*prev)->next)
+		;
+	*prev = entry->next;
+	entry->next = ctx->ft->faces;
+	ctx->ft->faces = entry;
+
+	return entry;
+}
+
+static fz_error
+fz_new_ft_face(fz_context *ctx, fz_ft_face **entryp, char *path, unsigned char *data, int len, int index)
+{
+	fz_ft_face *entry;
 	FT_Face face;
 	fz_error error;
-	fz_font *font;
 	int fterr;
 
 	error = fz_init_freetype(ctx);
 	if (error)
 		return fz_error_note(ctx, error, "cannot init freetype library");
 
-	fterr = FT_New_Face(ctx->ft->ftlib, path, index, &face);
+	if (path)
+		fterr = FT_New_Face(ctx->ft->ftlib, path, index, &face);
+	else
+		fterr = FT_New_Memory_Face(ctx->ft->ftlib, data, len, index, &face);
 	if (fterr)
 	{
 		fz_finalize_freetype(ctx); /* SumatraPDF: fix memory leak */
 		return fz_error_make(ctx, "freetype: cannot load font: %s", ft_error_string(fterr));
-}
+	}
 	fz_check_font_dimensions(face);
 
+	entry = fz_malloc(ctx, sizeof(fz_ft_face));
+	memset(entry, 0, sizeof(fz_ft_face));
+	entry->face = face;
+	entry->refs = 1;
+	entry->path = path ? fz_strdup(ctx, path) : NULL;
+	entry->data = data;
+	entry->len = len;
+	entry->index = index;
+	face->generic.data = entry;
+	face->generic.finalizer = NULL;
+
+	entry->next = ctx->ft->faces;
+	ctx->ft->faces = entry;
+
+	*entryp = entry;
+	return fz_okay;
+}
+
+static fz_font *
+fz_new_font_with_face(fz_context *ctx, fz_ft_face *entry)
+{
+	FT_Face face = entry->face;
+	fz_font *font;
+
 	font = fz_new_font(ctx, face->family_name);
 	font->ft_face = face;
 	font->bbox.x0 = face->bbox.xMin * 1000 / face->units_per_EM;
@@ -258,41 +413,134 @@ fz_new_font_from_file(fz_context *ctx, fz_font **fontp, char *path, int index)
 	font->bbox.x1 = face->bbox.xMax * 1000 / face->units_per_EM;
 	font->bbox.y1 = face->bbox.yMax * 1000 / face->units_per_EM;
 
-	*fontp = font;
+	return font;
+}
+
+fz_error
+fz_new_font_from_file(fz_context *ctx, fz_font **fontp, char *path, int index)
+{
+	fz_ft_face *entry;
+	fz_error error;
+
+	for (entry = ctx->ft->faces; entry; entry = entry->next)
+		if (entry->path && !strcmp(entry->path, path) && entry->index == index)
+			break;
+
+	if (entry)
+		fz_keep_ft_face(ctx, entry);
+	else
+	{
+		error = fz_new_ft_face(ctx, &entry, path, NULL, 0, index);
+		if (error)
+			return error;
+	}
+
+	*fontp = fz_new_font_with_face(ctx, entry);
 	return fz_okay;
 }
 
+/* The memory must stay valid until the font is dropped. */
 fz_error
 fz_new_font_from_memory(fz_context *ctx, fz_font **fontp, unsigned char *data, int len, int index)
 {
-	FT_Face face;
+	fz_ft_face *entry;
 	fz_error error;
-	fz_font *font;
-	int fterr;
 
-	error = fz_init_freetype(ctx);
-	if (error)
-		return fz_error_note(ctx, error, "cannot init freetype library");
+	for (entry = ctx->ft->faces; entry; entry = entry->next)
+		if (!entry->path && !entry->buf && entry->data == data && entry->len == len && entry->index == index)
+			break;
 
-	fterr = FT_New_Memory_Face(ctx->ft->ftlib, data, len, index, &face);
-	if (fterr)
+	if (entry)
+		fz_keep_ft_face(ctx, entry);
+	else
 	{
-		fz_finalize_freetype(ctx); /* SumatraPDF: fix memory leak */
-		return fz_error_make(ctx, "freetype: cannot load font: %s", ft_error_string(fterr));
+		error = fz_new_ft_face(ctx, &entry, NULL, data, len, index);
+		if (error)
+			return error;
 	}
-	fz_check_font_dimensions(face);
 
-	font = fz_new_font(ctx, face->family_name);
-	font->ft_face = face;
-	font->bbox.x0 = face->bbox.xMin * 1000 / face->units_per_EM;
-	font->bbox.y0 = face->bbox.yMin * 1000 / face->units_per_EM;
-	font->bbox.x1 = face->bbox.xMax * 1000 / face->units_per_EM;
-	font->bbox.y1 = face->bbox.yMax * 1000 / face->units_per_EM;
+	*fontp = fz_new_font_with_face(ctx, entry);
+	return fz_okay;
+}
+
+/*
+ * Fonts from buffers are pooled by their contents, so that a font program
+ * embedded in many documents is only loaded once. The face keeps its own
+ * reference to the buffer; ft_data points into it.
+ */
+fz_error
+fz_new_font_from_buffer(fz_context *ctx, fz_font **fontp, fz_buffer *buf, int index)
+{
+	unsigned char digest[16];
+	fz_ft_face *entry;
+	fz_error error;
+	fz_md5 md5;
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, buf->data, buf->len);
+	fz_md5_final(&md5, digest);
 
-	*fontp = font;
+	for (entry = ctx->ft->faces; entry; entry = entry->next)
+		if (entry->buf && entry->len == buf->len && entry->index == index && !memcmp(entry->digest, digest, 16))
+			break;
+
+	if (entry)
+		fz_keep_ft_face(ctx, entry);
+	else
+	{
+		error = fz_new_ft_face(ctx, &entry, NULL, buf->data, buf->len, index);
+		if (error)
+			return error;
+		entry->buf = fz_keep_buffer(buf);
+		memcpy(entry->digest, digest, 16);
+	}
+
+	*fontp = fz_new_font_with_face(ctx, entry);
+	(*fontp)->ft_data = entry->buf->data;
+	(*fontp)->ft_size = entry->buf->len;
 	return fz_okay;
 }
 
+/*
+ * Set the character size of the face of a font, in 26.6 points at 72 dpi,
+ * reusing the size object from an earlier call with the same size.
+ */
+int
+fz_set_ft_char_size(fz_context *ctx, fz_font *font, int size)
+{
+	FT_Face face = font->ft_face;
+	fz_ft_face *entry = face->generic.data;
+	int i, fterr;
+
+	for (i = 0; i < FT_SIZE_SLOTS; i++)
+		if (entry->sizes[i] && entry->char_size[i] == size)
+			return FT_Activate_Size(entry->sizes[i]);
+
+	i = entry->next_size;
+	entry->next_size = (i + 1) % FT_SIZE_SLOTS;
+	if (entry->sizes[i])
+	{
+		FT_Done_Size(entry->sizes[i]);
+		entry->sizes[i] = NULL;
+	}
+
+	fterr = FT_New_Size(face, &entry->sizes[i]);
+	if (fterr)
+		return fterr;
+	FT_Activate_Size(entry->sizes[i]);
+
+	fterr = FT_Set_Char_Size(face, size, size, 72, 72);
+	if (fterr)
+	{
+		FT_Done_Size(entry->sizes[i]);
+		entry->sizes[i] = NULL;
+		return fterr;
+	}
+	entry->char_size[i] = size;
+
+	return 0;
+}
+
 static fz_matrix
 fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
@@ -305,7 +553,7 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 		float scale;
 
 		/* TODO: use FT_Get_Advance */
-		fterr = FT_Set_Char_Size(font->ft_face, 1000, 1000, 72, 72);
+		fterr = fz_set_ft_char_size(ctx, font, 1000);
 		if (fterr)
 			fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
 
@@ -398,7 +646,7 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
+	fterr = fz_set_ft_char_size(ctx, font, 65536); /* should be 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
 	FT_Set_Transform(face, &m, &v);
@@ -414,7 +662,7 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 		v.x = 0;
 		v.y = 0;
 
-		fterr = FT_Set_Char_Size(face, 64 * scale, 64 * scale, 72, 72);
+		fterr = fz_set_ft_char_size(ctx, font, 64 * scale);
 		if (fterr)
 			fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
 		FT_Set_Transform(face, &m, &v);
@@ -488,7 +736,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
+	fterr = fz_set_ft_char_size(ctx, font, 65536); /* should be 64 */
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Set_Char_Size: %s", ft_error_string(fterr));
@@ -547,6 +795,133 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	return pixmap;
 }
 
+/*
+ * Glyph outlines, in glyph space at a size of one unit.
+ */
+
+struct outline_ctx
+{
+	fz_path *path;
+	fz_matrix m;
+	fz_point last;
+};
+
+static fz_point
+outline_point(struct outline_ctx *oc, const FT_Vector *v)
+{
+	fz_point p;
+	p.x = v->x;
+	p.y = v->y;
+	return fz_transform_point(oc->m, p);
+}
+
+static int
+outline_moveto(const FT_Vector *p, void *user)
+{
+	struct outline_ctx *oc = user;
+	fz_point pt = outline_point(oc, p);
+	if (oc->path->cmd_len > 0)
+		fz_closepath(oc->path);
+	fz_moveto(oc->path, pt.x, pt.y);
+	oc->last = pt;
+	return 0;
+}
+
+static int
+outline_lineto(const FT_Vector *p, void *user)
+{
+	struct outline_ctx *oc = user;
+	fz_point pt = outline_point(oc, p);
+	fz_lineto(oc->path, pt.x, pt.y);
+	oc->last = pt;
+	return 0;
+}
+
+static int
+outline_conicto(const FT_Vector *c, const FT_Vector *p, void *user)
+{
+	struct outline_ctx *oc = user;
+	fz_point ct = outline_point(oc, c);
+	fz_point pt = outline_point(oc, p);
+	fz_curveto(oc->path,
+		(oc->last.x + 2 * ct.x) / 3, (oc->last.y + 2 * ct.y) / 3,
+		(pt.x + 2 * ct.x) / 3, (pt.y + 2 * ct.y) / 3,
+		pt.x, pt.y);
+	oc->last = pt;
+	return 0;
+}
+
+static int
+outline_cubicto(const FT_Vector *c1, const FT_Vector *c2, const FT_Vector *p, void *user)
+{
+	struct outline_ctx *oc = user;
+	fz_point a = outline_point(oc, c1);
+	fz_point b = outline_point(oc, c2);
+	fz_point pt = outline_point(oc, p);
+	fz_curveto(oc->path, a.x, a.y, b.x, b.y, pt.x, pt.y);
+	oc->last = pt;
+	return 0;
+}
+
+static const FT_Outline_Funcs outline_funcs =
+{
+	outline_moveto, outline_lineto, outline_conicto, outline_cubicto, 0, 0
+};
+
+/*
+ * The outline is loaded at a large size, like the bitmaps, and scaled
+ * down to one unit. The substitute font width adjustment, fake italic
+ * and fake bold are applied so that it fills the same area as the
+ * bitmap from fz_render_ft_glyph would.
+ */
+fz_path *
+fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid)
+{
+	FT_Face face = font->ft_face;
+	FT_Error fterr;
+	struct outline_ctx oc;
+	fz_matrix m;
+
+	m = fz_adjust_ft_glyph_width(ctx, font, gid, fz_identity);
+	if (font->ft_italic)
+		m = fz_concat(fz_shear(0.3f, 0), m);
+
+	fterr = fz_set_ft_char_size(ctx, font, 65536);
+	if (fterr)
+		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
+	FT_Set_Transform(face, NULL, NULL);
+
+	fterr = FT_Load_Glyph(face, gid, font->ft_hint ? FT_LOAD_NO_BITMAP : FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING);
+	if (fterr)
+	{
+		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
+		return NULL;
+	}
+
+	if (font->ft_bold)
+	{
+		float strength = 65536 * 0.04f;
+		FT_Outline_Embolden(&face->glyph->outline, strength);
+		FT_Outline_Translate(&face->glyph->outline, -strength / 2, -strength / 2);
+	}
+
+	oc.path = fz_new_path(ctx);
+	oc.m = fz_concat(fz_scale(1 / 65536.0f, 1 / 65536.0f), m);
+	oc.last.x = 0;
+	oc.last.y = 0;
+	fterr = FT_Outline_Decompose(&face->glyph->outline, &outline_funcs, &oc);
+	if (fterr)
+	{
+		fz_warn(ctx, "freetype decompose glyph (gid %d): %s", gid, ft_error_string(fterr));
+		fz_free_path(oc.path);
+		return NULL;
+	}
+	if (oc.path->cmd_len > 0)
+		fz_closepath(oc.path);
+
+	return oc.path;
+}
+
 /*
  * Type 3 fonts...
  */
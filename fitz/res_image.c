@@ -0,0 +1,302 @@
+#include "fitz.h"
+
+#define MAX_IMAGE_CACHE_SIZE (64<<20)
+#define MAX_CACHED_IMAGE_SIZE (16<<20)
+#define MAX_L2FACTOR 6
+
+typedef struct fz_image_key_s fz_image_key;
+typedef struct fz_image_entry_s fz_image_entry;
+
+struct fz_image_cache
+{
+	fz_hash_table *hash;
+	int total;
+};
+
+struct fz_image_key_s
+{
+	fz_image *image;
+	int l2factor;
+	fz_bbox subarea; /* as requested */
+};
+
+struct fz_image_entry_s
+{
+	fz_pixmap *pixmap;
+	fz_bbox subarea; /* as decoded */
+};
+
+fz_image *
+fz_new_image_from_pixmap(fz_context *ctx, fz_pixmap *pixmap)
+{
+	fz_image *image;
+
+	image = fz_malloc(ctx, sizeof(fz_image));
+	memset(image, 0, sizeof(fz_image));
+	image->refs = 1;
+	image->w = pixmap->w;
+	image->h = pixmap->h;
+	image->xres = pixmap->xres;
+	image->yres = pixmap->yres;
+	if (pixmap->colorspace)
+		image->colorspace = fz_keep_colorspace(pixmap->colorspace);
+	if (pixmap->mask)
+		image->mask = fz_new_image_from_pixmap(ctx, pixmap->mask);
+	image->tile = fz_keep_pixmap(pixmap);
+	image->tile->cached = 1;
+
+	return image;
+}
+
+fz_image *
+fz_keep_image(fz_image *image)
+{
+	image->refs++;
+	return image;
+}
+
+static void fz_uncache_image(fz_context *ctx, fz_image *image);
+
+void
+fz_drop_image(fz_context *ctx, fz_image *image)
+{
+	if (!image)
+		return;
+
+	/* nobody but the cache can ask for this image any more */
+	if (--image->refs > 0 && image->refs == image->cached)
+		fz_uncache_image(ctx, image);
+
+	if (image->refs == 0)
+	{
+		if (image->free_image)
+			image->free_image(ctx, image);
+		if (image->tile)
+			fz_drop_pixmap(ctx, image->tile);
+		if (image->mask)
+			fz_drop_image(ctx, image->mask);
+		if (image->colorspace)
+			fz_drop_colorspace(ctx, image->colorspace);
+		fz_free(ctx, image);
+	}
+}
+
+void
+fz_new_image_cache(fz_context *ctx)
+{
+	fz_image_cache *cache;
+
+	cache = fz_malloc(ctx, sizeof(fz_image_cache));
+	cache->hash = fz_new_hash_table(ctx, 61, sizeof(fz_image_key));
+	cache->total = 0;
+
+	ctx->image_cache = cache;
+}
+
+static void
+fz_evict_image_cache(fz_context *ctx, fz_image_cache *cache)
+{
+	fz_image_key *key;
+	fz_image_entry *entry;
+	fz_image **images;
+	int i, len, count = 0;
+
+	/* empty the table before dropping the images, which looks in it */
+	len = fz_hash_len(cache->hash);
+	images = fz_calloc(ctx, len, sizeof(fz_image *));
+	for (i = 0; i < len; i++)
+	{
+		key = fz_hash_get_key(cache->hash, i);
+		entry = fz_hash_get_val(cache->hash, i);
+		if (entry)
+		{
+			images[count++] = key->image;
+			entry->pixmap->cached = 0;
+			fz_drop_pixmap(ctx, entry->pixmap);
+			fz_free(ctx, entry);
+		}
+	}
+
+	cache->total = 0;
+
+	fz_empty_hash(cache->hash);
+
+	for (i = 0; i < count; i++)
+	{
+		images[i]->cached--;
+		fz_drop_image(ctx, images[i]);
+	}
+	fz_free(ctx, images);
+}
+
+/*
+ * Remove the entries of an image from the cache of this context once
+ * they are the only references left to it. They can never be found
+ * again, and would otherwise keep the image and its compressed samples
+ * until the cache is flushed.
+ */
+static void
+fz_uncache_image(fz_context *ctx, fz_image *image)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_key keys[MAX_L2FACTOR * 4];
+	fz_image_key *key;
+	fz_image_entry *entry;
+	int i, len, count;
+
+	if (!cache)
+		return;
+
+	do
+	{
+		/* removing entries moves others, so look up the keys afterwards */
+		count = 0;
+		len = fz_hash_len(cache->hash);
+		for (i = 0; i < len && count < nelem(keys); i++)
+		{
+			key = fz_hash_get_key(cache->hash, i);
+			if (fz_hash_get_val(cache->hash, i) && key->image == image)
+				keys[count++] = *key;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			entry = fz_hash_find(cache->hash, &keys[i]);
+			if (!entry)
+				continue;
+			cache->total -= entry->pixmap->w * entry->pixmap->h * entry->pixmap->n;
+			entry->pixmap->cached = 0;
+			fz_drop_pixmap(ctx, entry->pixmap);
+			fz_free(ctx, entry);
+			fz_hash_remove(cache->hash, &keys[i]);
+			image->cached--;
+			image->refs--;
+		}
+	} while (count == nelem(keys));
+}
+
+void
+fz_free_image_cache(fz_context *ctx)
+{
+	fz_image_cache *cache = ctx->image_cache;
+
+	if (!cache)
+		return;
+	fz_evict_image_cache(ctx, cache);
+	fz_free_hash(ctx, cache->hash);
+	fz_free(ctx, cache);
+	ctx->image_cache = NULL;
+}
+
+/*
+ * The largest power of two reduction of an image that still leaves at
+ * least w by h pixels. A zero size asks for the full image.
+ */
+static int
+fz_image_l2factor(fz_image *image, int w, int h)
+{
+	int l2factor = 0;
+
+	if (w <= 0 || h <= 0)
+		return 0;
+	while (l2factor < MAX_L2FACTOR && (image->w >> (l2factor + 1)) >= w && (image->h >> (l2factor + 1)) >= h)
+		l2factor++;
+	return l2factor;
+}
+
+/*
+ * Returns a new reference to the image decoded at a size suitable for
+ * drawing it at w by h pixels, or NULL if it cannot be decoded.
+ */
+fz_pixmap *
+fz_image_to_pixmap(fz_context *ctx, fz_image *image, int w, int h)
+{
+	fz_bbox subarea;
+
+	subarea.x0 = 0;
+	subarea.y0 = 0;
+	subarea.x1 = image->w;
+	subarea.y1 = image->h;
+	return fz_image_to_pixmap_subarea(ctx, image, &subarea, w, h);
+}
+
+/*
+ * As above, but only the subarea needs to be decoded. The whole image
+ * would be drawn at w by h pixels.
+ */
+fz_pixmap *
+fz_image_to_pixmap_subarea(fz_context *ctx, fz_image *image, fz_bbox *subarea, int w, int h)
+{
+	fz_image_cache *cache = ctx->image_cache;
+	fz_image_entry *entry;
+	fz_image_key key;
+	fz_pixmap *tile;
+	fz_bbox full;
+	int size;
+
+	full.x0 = 0;
+	full.y0 = 0;
+	full.x1 = image->w;
+	full.y1 = image->h;
+
+	if (image->tile)
+	{
+		*subarea = full;
+		return fz_keep_pixmap(image->tile);
+	}
+
+	*subarea = fz_intersect_bbox(*subarea, full);
+	if (fz_is_empty_bbox(*subarea))
+		*subarea = full;
+
+	memset(&key, 0, sizeof key);
+	key.image = image;
+	key.l2factor = fz_image_l2factor(image, w, h);
+
+	if (cache)
+	{
+		/* a larger or more complete decoded copy will do as well */
+		int l2factor = key.l2factor;
+		for (; key.l2factor >= 0; key.l2factor--)
+		{
+			key.subarea = full;
+			entry = fz_hash_find(cache->hash, &key);
+			if (!entry)
+			{
+				key.subarea = *subarea;
+				entry = fz_hash_find(cache->hash, &key);
+			}
+			if (entry)
+			{
+				*subarea = entry->subarea;
+				return fz_keep_pixmap(entry->pixmap);
+			}
+		}
+		key.l2factor = l2factor;
+		key.subarea = *subarea;
+	}
+
+	tile = image->get_pixmap(ctx, image, subarea, key.l2factor);
+	if (!tile || !cache)
+		return tile;
+
+	if (subarea->x0 == 0 && subarea->y0 == 0 && subarea->x1 == image->w && subarea->y1 == image->h)
+		key.subarea = full;
+
+	size = tile->w * tile->h * tile->n;
+	if (size <= MAX_CACHED_IMAGE_SIZE)
+	{
+		if (cache->total + size > MAX_IMAGE_CACHE_SIZE)
+			fz_evict_image_cache(ctx, cache);
+		entry = fz_malloc(ctx, sizeof(fz_image_entry));
+		entry->pixmap = fz_keep_pixmap(tile);
+		entry->pixmap->cached = 1;
+		entry->subarea = *subarea;
+		fz_keep_image(image);
+		image->cached++;
+		fz_hash_insert(ctx, cache->hash, &key, entry);
+		cache->total += size;
+	}
+
+	return tile;
+}
@@ -6,9 +6,12 @@ fz_new_path(fz_context *ctx)
 	fz_path *path;
 
 	path = fz_malloc(ctx, sizeof(fz_path));
-	path->len = 0;
-	path->cap = 0;
-	path->items = NULL;
+	path->cmd_len = 0;
+	path->cmd_cap = 0;
+	path->cmds = NULL;
+	path->coord_len = 0;
+	path->coord_cap = 0;
+	path->coords = NULL;
 	path->ctx = ctx;
 
 	return path;
@@ -20,11 +23,15 @@ fz_clone_path(fz_path *old)
 	fz_path *path;
 
 	path = fz_malloc(old->ctx, sizeof(fz_path));
-	path->len = old->len;
-	path->cap = old->len;
+	path->cmd_len = old->cmd_len;
+	path->cmd_cap = old->cmd_len;
+	path->coord_len = old->coord_len;
+	path->coord_cap = old->coord_len;
 	path->ctx = old->ctx;
-	path->items = fz_calloc(path->ctx, path->cap, sizeof(fz_path_item));
-	memcpy(path->items, old->items, sizeof(fz_path_item) * path->len);
+	path->cmds = fz_calloc(path->ctx, path->cmd_cap, sizeof(unsigned char));
+	memcpy(path->cmds, old->cmds, path->cmd_len);
+	path->coords = fz_calloc(path->ctx, path->coord_cap, sizeof(float));
+	memcpy(path->coords, old->coords, sizeof(float) * path->coord_len);
 
 	return path;
 }
@@ -32,41 +39,48 @@ fz_clone_path(fz_path *old)
 void
 fz_free_path(fz_path *path)
 {
-	fz_free(path->ctx, path->items);
+	fz_free(path->ctx, path->cmds);
+	fz_free(path->ctx, path->coords);
 	fz_free(path->ctx, path);
 }
 
+/* grow geometrically, as paths from CAD drawings run to millions of points */
 static void
-grow_path(fz_path *path, int n)
+grow_path(fz_path *path, int ncoords)
 {
-	if (path->len + n < path->cap)
-		return;
-	while (path->len + n > path->cap)
-		path->cap = path->cap + 36;
-	path->items = fz_realloc(path->ctx, path->items, path->cap * sizeof(fz_path_item));
+	if (path->cmd_len == path->cmd_cap)
+	{
+		path->cmd_cap = MAX(path->cmd_cap * 2, 16);
+		path->cmds = fz_realloc(path->ctx, path->cmds, path->cmd_cap);
+	}
+	if (path->coord_len + ncoords > path->coord_cap)
+	{
+		path->coord_cap = MAX(path->coord_cap * 2, 32);
+		path->coords = fz_realloc(path->ctx, path->coords, path->coord_cap * sizeof(float));
+	}
 }
 
 void
 fz_moveto(fz_path *path, float x, float y)
 {
-	grow_path(path, 3);
-	path->items[path->len++].k = FZ_MOVETO;
-	path->items[path->len++].v = x;
-	path->items[path->len++].v = y;
+	grow_path(path, 2);
+	path->cmds[path->cmd_len++] = FZ_MOVETO;
+	path->coords[path->coord_len++] = x;
+	path->coords[path->coord_len++] = y;
 }
 
 void
 fz_lineto(fz_path *path, float x, float y)
 {
-	if (path->len == 0)
+	if (path->cmd_len == 0)
 	{
 		fz_warn(path->ctx, "lineto with no current point");
 		return;
 	}
-	grow_path(path, 3);
-	path->items[path->len++].k = FZ_LINETO;
-	path->items[path->len++].v = x;
-	path->items[path->len++].v = y;
+	grow_path(path, 2);
+	path->cmds[path->cmd_len++] = FZ_LINETO;
+	path->coords[path->coord_len++] = x;
+	path->coords[path->coord_len++] = y;
 }
 
 void
@@ -75,32 +89,32 @@ fz_curveto(fz_path *path,
 	float x2, float y2,
 	float x3, float y3)
 {
-	if (path->len == 0)
+	if (path->cmd_len == 0)
 	{
 		fz_warn(path->ctx, "curveto with no current point");
 		return;
 	}
-	grow_path(path, 7);
-	path->items[path->len++].k = FZ_CURVETO;
-	path->items[path->len++].v = x1;
-	path->items[path->len++].v = y1;
-	path->items[path->len++].v = x2;
-	path->items[path->len++].v = y2;
-	path->items[path->len++].v = x3;
-	path->items[path->len++].v = y3;
+	grow_path(path, 6);
+	path->cmds[path->cmd_len++] = FZ_CURVETO;
+	path->coords[path->coord_len++] = x1;
+	path->coords[path->coord_len++] = y1;
+	path->coords[path->coord_len++] = x2;
+	path->coords[path->coord_len++] = y2;
+	path->coords[path->coord_len++] = x3;
+	path->coords[path->coord_len++] = y3;
 }
 
 void
 fz_curvetov(fz_path *path, float x2, float y2, float x3, float y3)
 {
 	float x1, y1;
-	if (path->len == 0)
+	if (path->cmd_len == 0)
 	{
 		fz_warn(path->ctx, "curvetov with no current point");
 		return;
 	}
-	x1 = path->items[path->len-2].v;
-	y1 = path->items[path->len-1].v;
+	x1 = path->coords[path->coord_len-2];
+	y1 = path->coords[path->coord_len-1];
 	fz_curveto(path, x1, y1, x2, y2, x3, y3);
 }
 
@@ -113,13 +127,13 @@ fz_curvetoy(fz_path *path, float x1, float y1, float x3, float y3)
 void
 fz_closepath(fz_path *path)
 {
-	if (path->len == 0)
+	if (path->cmd_len == 0)
 	{
 		fz_warn(path->ctx, "closepath with no current point");
 		return;
 	}
-	grow_path(path, 1);
-	path->items[path->len++].k = FZ_CLOSE_PATH;
+	grow_path(path, 0);
+	path->cmds[path->cmd_len++] = FZ_CLOSE_PATH;
 }
 
 static inline fz_rect bound_expand(fz_rect r, fz_point p)
@@ -136,45 +150,24 @@ fz_bound_path(fz_path *path, fz_stroke_state *stroke, fz_matrix ctm)
 {
 	fz_point p;
 	fz_rect r = fz_empty_rect;
-	int i = 0;
+	int i;
 
 	/* cf. http://code.google.com/p/sumatrapdf/issues/detail?id=1732 */
-	if (path->len == 0)
+	if (path->coord_len == 0)
 		return fz_empty_rect;
 
-	if (path->len)
-	{
-		p.x = path->items[1].v;
-		p.y = path->items[2].v;
-		p = fz_transform_point(ctm, p);
-		r.x0 = r.x1 = p.x;
-		r.y0 = r.y1 = p.y;
-	}
+	p.x = path->coords[0];
+	p.y = path->coords[1];
+	p = fz_transform_point(ctm, p);
+	r.x0 = r.x1 = p.x;
+	r.y0 = r.y1 = p.y;
 
-	while (i < path->len)
+	/* every coordinate pair is a point or a control point */
+	for (i = 2; i < path->coord_len; i += 2)
 	{
-		switch (path->items[i++].k)
-		{
-		case FZ_CURVETO:
-			p.x = path->items[i++].v;
-			p.y = path->items[i++].v;
-			r = bound_expand(r, fz_transform_point(ctm, p));
-			p.x = path->items[i++].v;
-			p.y = path->items[i++].v;
-			r = bound_expand(r, fz_transform_point(ctm, p));
-			p.x = path->items[i++].v;
-			p.y = path->items[i++].v;
-			r = bound_expand(r, fz_transform_point(ctm, p));
-			break;
-		case FZ_MOVETO:
-		case FZ_LINETO:
-			p.x = path->items[i++].v;
-			p.y = path->items[i++].v;
-			r = bound_expand(r, fz_transform_point(ctm, p));
-			break;
-		case FZ_CLOSE_PATH:
-			break;
-		}
+		p.x = path->coords[i];
+		p.y = path->coords[i + 1];
+		r = bound_expand(r, fz_transform_point(ctm, p));
 	}
 
 	if (stroke)
@@ -191,73 +184,119 @@ fz_bound_path(fz_path *path, fz_stroke_state *stroke, fz_matrix ctm)
 	return r;
 }
 
-void
-fz_transform_path(fz_path *path, fz_matrix ctm)
+/*
+ * Recognise the path built by the 're' operator (or an equivalent
+ * moveto + 3 or 4 linetos + optional closepath) that maps to an
+ * axis-aligned rectangle in device space. Returns the device space
+ * rectangle in *rect.
+ */
+int
+fz_is_rect_path(fz_path *path, fz_matrix ctm, fz_rect *rect)
 {
-	fz_point p;
-	int k, i = 0;
+	fz_point p[5];
+	int i = 0, k = 0, n = 0;
 
-	while (i < path->len)
+	if (!fz_is_rectilinear(ctm))
+		return 0;
+
+	if (path->cmd_len < 4 || path->cmds[0] != FZ_MOVETO)
+		return 0;
+
+	while (i < path->cmd_len)
 	{
-		switch (path->items[i++].k)
+		switch (path->cmds[i++])
 		{
-		case FZ_CURVETO:
-			for (k = 0; k < 3; k++)
-			{
-				p.x = path->items[i].v;
-				p.y = path->items[i+1].v;
-				p = fz_transform_point(ctm, p);
-				path->items[i].v = p.x;
-				path->items[i+1].v = p.y;
-				i += 2;
-			}
-			break;
 		case FZ_MOVETO:
+			if (n != 0)
+				return 0;
+			/* fallthrough */
 		case FZ_LINETO:
-			p.x = path->items[i].v;
-			p.y = path->items[i+1].v;
-			p = fz_transform_point(ctm, p);
-			path->items[i].v = p.x;
-			path->items[i+1].v = p.y;
-			i += 2;
+			if (n == 5)
+				return 0;
+			p[n].x = path->coords[k++];
+			p[n].y = path->coords[k++];
+			p[n] = fz_transform_point(ctm, p[n]);
+			n++;
 			break;
 		case FZ_CLOSE_PATH:
+			if (i != path->cmd_len)
+				return 0;
 			break;
+		default:
+			return 0;
 		}
 	}
+
+	if (n == 5)
+	{
+		if (p[4].x != p[0].x || p[4].y != p[0].y)
+			return 0;
+	}
+	else if (n != 4)
+		return 0;
+
+	/* edges must alternate between horizontal and vertical */
+	if (p[0].x == p[1].x && p[1].y == p[2].y && p[2].x == p[3].x && p[3].y == p[0].y)
+		;
+	else if (p[0].y == p[1].y && p[1].x == p[2].x && p[2].y == p[3].y && p[3].x == p[0].x)
+		;
+	else
+		return 0;
+
+	rect->x0 = MIN(p[0].x, p[2].x);
+	rect->y0 = MIN(p[0].y, p[2].y);
+	rect->x1 = MAX(p[0].x, p[2].x);
+	rect->y1 = MAX(p[0].y, p[2].y);
+	return 1;
+}
+
+void
+fz_transform_path(fz_path *path, fz_matrix ctm)
+{
+	fz_point p;
+	int i;
+
+	for (i = 0; i < path->coord_len; i += 2)
+	{
+		p.x = path->coords[i];
+		p.y = path->coords[i + 1];
+		p = fz_transform_point(ctm, p);
+		path->coords[i] = p.x;
+		path->coords[i + 1] = p.y;
+	}
 }
 
 void
 fz_debug_path(fz_path *path, int indent)
 {
 	float x, y;
-	int i = 0;
+	int i, k = 0;
 	int n;
-	while (i < path->len)
+	for (i = 0; i < path->cmd_len; i++)
 	{
 		for (n = 0; n < indent; n++)
 			putchar(' ');
-		switch (path->items[i++].k)
+		switch (path->cmds[i])
 		{
 		case FZ_MOVETO:
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("%g %g m\n", x, y);
 			break;
 		case FZ_LINETO:
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("%g %g l\n", x, y);
 			break;
 		case FZ_CURVETO:
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("%g %g ", x, y);
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("%g %g ", x, y);
-			x = path->items[i++].v;
-			y = path->items[i++].v;
+			x = path->coords[k++];
+			y = path->coords[k++];
 			printf("%g %g c\n", x, y);
 			break;
 		case FZ_CLOSE_PATH:
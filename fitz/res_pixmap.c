@@ -22,6 +22,7 @@ fz_new_pixmap_with_data2(fz_context *ctx, fz_colorspace *colorspace, int w, int
 	pix->colorspace = NULL;
 	pix->n = 1;
 	pix->has_alpha = 1; /* SumatraPDF: allow optimizing non-alpha pixmaps */
+	pix->cached = 0;
 
 	if (colorspace)
 	{
@@ -104,6 +105,21 @@ fz_new_pixmap_with_rect_and_data(fz_context *ctx, fz_colorspace *colorspace, fz_
 	return pixmap;
 }
 
+/*
+ * Let a pixmap created around caller supplied samples free them when it
+ * is dropped. The samples are counted as pixmap memory from now on.
+ */
+void
+fz_pixmap_own_samples(fz_pixmap *pix)
+{
+	if (pix->free_samples)
+		return;
+	fz_synchronize_begin();
+	fz_memory_used += pix->w * pix->h * pix->n;
+	fz_synchronize_end();
+	pix->free_samples = 1;
+}
+
 fz_pixmap *
 fz_keep_pixmap(fz_pixmap *pix)
 {
@@ -116,7 +132,8 @@ fz_drop_pixmap(fz_context *ctx, fz_pixmap *pix)
 {
 	if (pix && --pix->refs == 0)
 	{
-		fz_memory_used -= pix->w * pix->h * pix->n;
+		if (pix->free_samples)
+			fz_memory_used -= pix->w * pix->h * pix->n;
 		if (pix->mask)
 			fz_drop_pixmap(ctx, pix->mask);
 		if (pix->colorspace)
@@ -127,6 +144,62 @@ fz_drop_pixmap(fz_context *ctx, fz_pixmap *pix)
 	}
 }
 
+/*
+ * Shrink a pixmap in place by averaging blocks of 2^factor by 2^factor
+ * pixels. Blocks along the right and bottom edges may be partial.
+ */
+void
+fz_subsample_pixmap(fz_context *ctx, fz_pixmap *pix, int factor)
+{
+	unsigned char *s, *d;
+	int f, n, w, h, x, y, k, xx, yy;
+	int dst_w, dst_h;
+
+	if (factor <= 0)
+		return;
+
+	f = 1 << factor;
+	n = pix->n;
+	w = pix->w;
+	h = pix->h;
+	dst_w = (w + f - 1) >> factor;
+	dst_h = (h + f - 1) >> factor;
+
+	/* The destination never overtakes the blocks still to be read */
+	d = pix->samples;
+	for (y = 0; y < h; y += f)
+	{
+		int bh = MIN(f, h - y);
+		for (x = 0; x < w; x += f)
+		{
+			int bw = MIN(f, w - x);
+			int div = bw * bh;
+			for (k = 0; k < n; k++)
+			{
+				int v = 0;
+				s = pix->samples + (y * w + x) * n + k;
+				for (yy = 0; yy < bh; yy++)
+				{
+					for (xx = 0; xx < bw; xx++)
+						v += s[xx * n];
+					s += w * n;
+				}
+				*d++ = (v + (div >> 1)) / div;
+			}
+		}
+	}
+
+	if (pix->free_samples)
+	{
+		fz_synchronize_begin();
+		fz_memory_used -= (w * h - dst_w * dst_h) * n;
+		fz_synchronize_end();
+		pix->samples = fz_realloc(ctx, pix->samples, dst_w * dst_h * n);
+	}
+	pix->w = dst_w;
+	pix->h = dst_h;
+}
+
 fz_bbox
 fz_bound_pixmap(fz_pixmap *pix)
 {
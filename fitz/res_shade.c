@@ -1,5 +1,72 @@
 #include "fitz.h"
 
+/* values holds 256 samples of n components each */
+fz_shade_function *
+fz_new_shade_function(fz_context *ctx, float *values, int n)
+{
+	fz_shade_function *func;
+	float max[FZ_MAX_COLORS + 1];
+	int i, k;
+
+	func = fz_malloc(ctx, sizeof(fz_shade_function));
+	func->refs = 1;
+	func->n = n;
+	func->samples = fz_calloc(ctx, 256 * n, sizeof(unsigned short));
+
+	for (k = 0; k < n; k++)
+		func->min[k] = max[k] = values[k];
+	for (i = 1; i < 256; i++)
+	{
+		for (k = 0; k < n; k++)
+		{
+			func->min[k] = MIN(func->min[k], values[i * n + k]);
+			max[k] = MAX(max[k], values[i * n + k]);
+		}
+	}
+	for (k = 0; k < n; k++)
+		func->scale[k] = (max[k] - func->min[k]) / 65535;
+
+	for (i = 0; i < 256; i++)
+	{
+		for (k = 0; k < n; k++)
+		{
+			float v = 0;
+			if (func->scale[k] > 0)
+				v = (values[i * n + k] - func->min[k]) / func->scale[k] + 0.5f;
+			func->samples[i * n + k] = CLAMP(v, 0, 65535);
+		}
+	}
+
+	return func;
+}
+
+fz_shade_function *
+fz_keep_shade_function(fz_shade_function *func)
+{
+	func->refs ++;
+	return func;
+}
+
+void
+fz_drop_shade_function(fz_context *ctx, fz_shade_function *func)
+{
+	if (func && --func->refs == 0)
+	{
+		fz_free(ctx, func->samples);
+		fz_free(ctx, func);
+	}
+}
+
+void
+fz_shade_function_value(fz_shade_function *func, int i, float *value)
+{
+	unsigned short *s = func->samples + i * func->n;
+	int k;
+
+	for (k = 0; k < func->n; k++)
+		value[k] = func->min[k] + s[k] * func->scale[k];
+}
+
 fz_shade *
 fz_keep_shade(fz_shade *shade)
 {
@@ -14,11 +81,45 @@ fz_drop_shade(fz_context *ctx, fz_shade *shade)
 	{
 		if (shade->colorspace)
 			fz_drop_colorspace(ctx, shade->colorspace);
+		fz_drop_shade_function(ctx, shade->function);
 		fz_free(ctx, shade->mesh);
 		fz_free(ctx, shade);
 	}
 }
 
+/* A patch lies within the convex hull of its control points */
+static fz_rect
+fz_bound_patches(fz_shade *shade, fz_matrix ctm)
+{
+	int size = 32 + 4 * (shade->use_function ? 1 : shade->colorspace->n);
+	fz_rect r = fz_empty_rect;
+	fz_point p;
+	float *v;
+	int i, k;
+
+	for (i = 0; i + size <= shade->mesh_len; i += size)
+	{
+		v = shade->mesh + i;
+		for (k = 0; k < 16; k++)
+		{
+			p.x = v[k * 2];
+			p.y = v[k * 2 + 1];
+			p = fz_transform_point(ctm, p);
+			if (i == 0 && k == 0)
+			{
+				r.x0 = r.x1 = p.x;
+				r.y0 = r.y1 = p.y;
+			}
+			if (p.x < r.x0) r.x0 = p.x;
+			if (p.y < r.y0) r.y0 = p.y;
+			if (p.x > r.x1) r.x1 = p.x;
+			if (p.y > r.y1) r.y1 = p.y;
+		}
+	}
+
+	return r;
+}
+
 fz_rect
 fz_bound_shade(fz_shade *shade, fz_matrix ctm)
 {
@@ -36,6 +137,8 @@ fz_bound_shade(fz_shade *shade, fz_matrix ctm)
 		return fz_infinite_rect;
 	if (shade->type == FZ_RADIAL)
 		return fz_infinite_rect;
+	if (shade->type == FZ_PATCH)
+		return fz_bound_patches(shade, ctm);
 
 	if (nvert == 0)
 		return fz_empty_rect;
@@ -76,6 +179,7 @@ fz_debug_shade(fz_shade *shade)
 	case FZ_LINEAR: printf("\ttype linear\n"); break;
 	case FZ_RADIAL: printf("\ttype radial\n"); break;
 	case FZ_MESH: printf("\ttype mesh\n"); break;
+	case FZ_PATCH: printf("\ttype patch\n"); break;
 	}
 
 	printf("\tbbox [%g %g %g %g]\n",
@@ -104,6 +208,13 @@ fz_debug_shade(fz_shade *shade)
 	else
 		n = 2 + shade->colorspace->n;
 
+	if (shade->type == FZ_PATCH)
+	{
+		printf("\tpatches: %d\n", shade->mesh_len / (32 + 4 * (n - 2)));
+		printf("}\n");
+		return;
+	}
+
 	printf("\tvertices: %d\n", shade->mesh_len);
 
 	vertex = shade->mesh;
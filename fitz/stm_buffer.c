@@ -16,6 +16,21 @@ fz_new_buffer(fz_context *ctx, int size)
 	return b;
 }
 
+/* Takes ownership of data, which must have been allocated with fz_malloc. */
+fz_buffer *
+fz_new_buffer_from_data(fz_context *ctx, unsigned char *data, int size)
+{
+	fz_buffer *b;
+
+	b = fz_malloc(ctx, sizeof(fz_buffer));
+	b->refs = 1;
+	b->data = data;
+	b->cap = size;
+	b->len = size;
+
+	return b;
+}
+
 fz_buffer *
 fz_keep_buffer(fz_buffer *buf)
 {
@@ -117,6 +117,7 @@ void pdf_update_object( pdf_xref *xref, int num, int gen, fz_obj *newobj);
 
 int pdf_is_stream(pdf_xref *xref, int num, int gen);
 fz_stream *pdf_open_inline_stream(fz_stream *chain, pdf_xref *xref, fz_obj *stmobj, int length);
+fz_stream *pdf_open_image_decomp_stream(fz_context *ctx, fz_buffer *buffer, fz_obj *filters, fz_obj *params, int *l2factor);
 fz_error pdf_load_raw_stream(fz_buffer **bufp, pdf_xref *xref, int num, int gen);
 fz_error pdf_load_stream(fz_buffer **bufp, pdf_xref *xref, int num, int gen);
 fz_error pdf_open_raw_stream(fz_stream **stmp, pdf_xref *, int num, int gen);
@@ -193,14 +194,15 @@ fz_error pdf_load_function(pdf_function **func, pdf_xref *xref, fz_obj *ref);
 void pdf_eval_function(fz_context *ctx, pdf_function *func, float *in, int inlen, float *out, int outlen);
 pdf_function *pdf_keep_function(pdf_function *func);
 void pdf_drop_function(fz_context *ctx, pdf_function *func);
+fz_shade_function *pdf_sample_shade_function_table(fz_context *ctx, pdf_function *func, float t0, float t1, int n);
 
 fz_error pdf_load_colorspace(fz_colorspace **csp, pdf_xref *xref, fz_obj *obj);
 fz_pixmap *pdf_expand_indexed_pixmap(fz_context *ctx, fz_pixmap *src);
 
 fz_error pdf_load_shading(fz_shade **shadep, pdf_xref *xref, fz_obj *obj);
 
-fz_error pdf_load_inline_image(fz_pixmap **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict, fz_stream *file);
-fz_error pdf_load_image(fz_pixmap **imgp, pdf_xref *xref, fz_obj *obj);
+fz_error pdf_load_inline_image(fz_image **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict, fz_stream *file);
+fz_error pdf_load_image(fz_image **imgp, pdf_xref *xref, fz_obj *obj);
 int pdf_is_jpx_image(fz_context *ctx, fz_obj *dict);
 
 /*
@@ -126,8 +126,12 @@ static int ft_cid_to_gid(pdf_font_desc *fontdesc, int cid)
 {
 	if (fontdesc->to_ttf_cmap)
 	{
+		FT_Face face = fontdesc->font->ft_face;
+		/* the face may be shared with a font that selected another cmap */
+		if (!face->charmap || face->charmap->encoding != FT_ENCODING_UNICODE)
+			FT_Select_Charmap(face, ft_encoding_unicode);
 		cid = pdf_lookup_cmap(fontdesc->to_ttf_cmap, cid);
-		return ft_char_index(fontdesc->font->ft_face, cid);
+		return ft_char_index(face, cid);
 	}
 
 	if (fontdesc->cid_to_gid)
@@ -336,17 +340,11 @@ pdf_load_embedded_font(pdf_font_desc *fontdesc, pdf_xref *xref, fz_obj *stmref)
 	if (error)
 		return fz_error_note(ctx, error, "cannot load font stream (%d %d R)", fz_to_num(stmref), fz_to_gen(stmref));
 
-	error = fz_new_font_from_memory(ctx, &fontdesc->font, buf->data, buf->len, 0);
+	/* the font keeps its own reference to the buffer */
+	error = fz_new_font_from_buffer(ctx, &fontdesc->font, buf, 0);
+	fz_drop_buffer(ctx, buf);
 	if (error)
-	{
-		fz_drop_buffer(ctx, buf);
 		return fz_error_note(ctx, error, "cannot load embedded font (%d %d R)", fz_to_num(stmref), fz_to_gen(stmref));
-	}
-
-	/* save the buffer so we can free it later */
-	fontdesc->font->ft_data = buf->data;
-	fontdesc->font->ft_size = buf->len;
-	fz_free(ctx, buf); /* only free the fz_buffer struct, not the contained data */
 
 	fontdesc->is_embedded = 1;
 
@@ -758,7 +756,7 @@ skip_encoding:
 			if (!wid && i >= fz_array_len(ctx, widths))
 			{
 				fz_warn(ctx, "font width missing for glyph %d (%d %d R)", i + first, fz_to_num(dict), fz_to_gen(dict));
-				FT_Set_Char_Size(face, 1000, 1000, 72, 72);
+				fz_set_ft_char_size(ctx, fontdesc->font, 1000);
 				wid = ft_width(ctx, fontdesc, i + first);
 			}
 			pdf_add_hmtx(ctx, fontdesc, i + first, i + first, wid);
@@ -766,7 +764,7 @@ skip_encoding:
 	}
 	else
 	{
-		fterr = FT_Set_Char_Size(face, 1000, 1000, 72, 72);
+		fterr = fz_set_ft_char_size(ctx, fontdesc->font, 1000);
 		if (fterr)
 			fz_warn(ctx, "freetype set character size: %s", ft_error_string(fterr));
 		for (i = 0; i < 256; i++)
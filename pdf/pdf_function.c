@@ -8,6 +8,7 @@ enum
 };
 
 typedef struct psobj_s psobj;
+typedef struct psc_instr_s psc_instr;
 
 enum
 {
@@ -27,6 +28,10 @@ struct pdf_function_s
 	float range[MAXN][2];	/* even index : min value, odd index : max value */
 	int has_range;
 
+	/* sampled for shadings, and shared by all that use this function */
+	fz_shade_function *table;
+	float table_t0, table_t1;
+
 	fz_context *ctx;
 
 	union
@@ -55,6 +60,9 @@ struct pdf_function_s
 		struct {
 			psobj *code;
 			int cap;
+			psc_instr *prog; /* compiled code, or NULL */
+			int nregs;
+			int out[MAXN]; /* registers holding the results */
 		} p;
 	} u;
 };
@@ -825,6 +833,713 @@ parse_code(pdf_function *func, fz_stream *stream, int *codeptr)
 	}
 }
 
+/*
+ * The calculator code is compiled into a flat program working on
+ * registers. The types of the stack entries are tracked while compiling,
+ * so there are no type checks left at run time, constant operands are
+ * folded, and stack operations only rename registers. Stack slot i is
+ * kept in register i wherever the two branches of an if meet; other
+ * values are only written once. Functions whose meaning depends on
+ * something only known at run time (such as the count of a copy or roll,
+ * or the interpreter's handling of stack errors) are left to ps_run.
+ */
+
+enum
+{
+	PSC_END, PSC_JMP, PSC_JZ, PSC_MOVE, PSC_LOADK, PSC_I2F, PSC_F2I,
+	PSC_ABS_I, PSC_ABS_F, PSC_NEG_I, PSC_NEG_F, PSC_NOT_B, PSC_NOT_I,
+	PSC_CEILING, PSC_FLOOR, PSC_ROUND, PSC_TRUNCATE, PSC_SQRT,
+	PSC_SIN, PSC_COS, PSC_LN, PSC_LOG,
+	PSC_ADD_I, PSC_ADD_F, PSC_SUB_I, PSC_SUB_F, PSC_MUL_I, PSC_MUL_F,
+	PSC_DIV, PSC_IDIV, PSC_MOD, PSC_EXP, PSC_ATAN, PSC_BITSHIFT,
+	PSC_AND, PSC_OR, PSC_XOR,
+	PSC_EQ_I, PSC_EQ_F, PSC_NE_I, PSC_NE_F, PSC_GE_I, PSC_GE_F,
+	PSC_GT_I, PSC_GT_F, PSC_LE_I, PSC_LE_F, PSC_LT_I, PSC_LT_F
+};
+
+enum { PSC_STACK = 100, PSC_MAX_REGS = 1024, PSC_MAX_CODE = 4096 };
+
+typedef union
+{
+	int i; /* integers and booleans */
+	float f;
+} psc_value;
+
+struct psc_instr_s
+{
+	int op;
+	int dst, a, b; /* registers, or a jump target in a */
+	psc_value k;
+};
+
+static void
+psc_run(psc_instr *code, psc_value *r)
+{
+	psc_instr *ins = code;
+	float r1;
+
+	while (1)
+	{
+		switch (ins->op)
+		{
+		case PSC_END: return;
+		case PSC_JMP: ins = code + ins->a; continue;
+		case PSC_JZ: ins = r[ins->b].i ? ins + 1 : code + ins->a; continue;
+		case PSC_MOVE: r[ins->dst] = r[ins->a]; break;
+		case PSC_LOADK: r[ins->dst] = ins->k; break;
+		case PSC_I2F: r[ins->dst].f = r[ins->a].i; break;
+		case PSC_F2I: r[ins->dst].i = r[ins->a].f; break;
+
+		case PSC_ABS_I: r[ins->dst].i = abs(r[ins->a].i); break;
+		case PSC_ABS_F: r[ins->dst].f = fabsf(r[ins->a].f); break;
+		case PSC_NEG_I: r[ins->dst].i = -r[ins->a].i; break;
+		case PSC_NEG_F: r[ins->dst].f = -r[ins->a].f; break;
+		case PSC_NOT_B: r[ins->dst].i = !r[ins->a].i; break;
+		case PSC_NOT_I: r[ins->dst].i = ~r[ins->a].i; break;
+		case PSC_CEILING: r[ins->dst].f = ceilf(r[ins->a].f); break;
+		case PSC_FLOOR: r[ins->dst].f = floorf(r[ins->a].f); break;
+		case PSC_ROUND:
+			r1 = r[ins->a].f;
+			r[ins->dst].f = (r1 >= 0) ? floorf(r1 + 0.5f) : ceilf(r1 - 0.5f);
+			break;
+		case PSC_TRUNCATE:
+			r1 = r[ins->a].f;
+			r[ins->dst].f = (r1 >= 0) ? floorf(r1) : ceilf(r1);
+			break;
+		case PSC_SQRT: r[ins->dst].f = sqrtf(r[ins->a].f); break;
+		case PSC_SIN: r[ins->dst].f = sinf(r[ins->a].f/RADIAN); break;
+		case PSC_COS: r[ins->dst].f = cosf(r[ins->a].f/RADIAN); break;
+		case PSC_LN: r[ins->dst].f = logf(r[ins->a].f); break;
+		case PSC_LOG: r[ins->dst].f = log10f(r[ins->a].f); break;
+
+		case PSC_ADD_I: r[ins->dst].i = r[ins->a].i + r[ins->b].i; break;
+		case PSC_ADD_F: r[ins->dst].f = r[ins->a].f + r[ins->b].f; break;
+		case PSC_SUB_I: r[ins->dst].i = r[ins->a].i - r[ins->b].i; break;
+		case PSC_SUB_F: r[ins->dst].f = r[ins->a].f - r[ins->b].f; break;
+		case PSC_MUL_I: r[ins->dst].i = r[ins->a].i * r[ins->b].i; break;
+		case PSC_MUL_F: r[ins->dst].f = r[ins->a].f * r[ins->b].f; break;
+		case PSC_DIV: r[ins->dst].f = r[ins->a].f / r[ins->b].f; break;
+		case PSC_IDIV: r[ins->dst].i = r[ins->b].i ? r[ins->a].i / r[ins->b].i : 0; break;
+		case PSC_MOD: r[ins->dst].i = r[ins->b].i ? r[ins->a].i % r[ins->b].i : 0; break;
+		case PSC_EXP: r[ins->dst].f = powf(r[ins->a].f, r[ins->b].f); break;
+		case PSC_ATAN:
+			r1 = atan2f(r[ins->a].f, r[ins->b].f) * RADIAN;
+			if (r1 < 0)
+				r1 += 360;
+			r[ins->dst].f = r1;
+			break;
+		case PSC_BITSHIFT:
+			if (r[ins->b].i > 0)
+				r[ins->dst].i = r[ins->a].i << r[ins->b].i;
+			else if (r[ins->b].i < 0)
+				r[ins->dst].i = (int)((unsigned int)r[ins->a].i >> r[ins->b].i);
+			else
+				r[ins->dst].i = r[ins->a].i;
+			break;
+		case PSC_AND: r[ins->dst].i = r[ins->a].i & r[ins->b].i; break;
+		case PSC_OR: r[ins->dst].i = r[ins->a].i | r[ins->b].i; break;
+		case PSC_XOR: r[ins->dst].i = r[ins->a].i ^ r[ins->b].i; break;
+
+		case PSC_EQ_I: r[ins->dst].i = r[ins->a].i == r[ins->b].i; break;
+		case PSC_EQ_F: r[ins->dst].i = r[ins->a].f == r[ins->b].f; break;
+		case PSC_NE_I: r[ins->dst].i = r[ins->a].i != r[ins->b].i; break;
+		case PSC_NE_F: r[ins->dst].i = r[ins->a].f != r[ins->b].f; break;
+		case PSC_GE_I: r[ins->dst].i = r[ins->a].i >= r[ins->b].i; break;
+		case PSC_GE_F: r[ins->dst].i = r[ins->a].f >= r[ins->b].f; break;
+		case PSC_GT_I: r[ins->dst].i = r[ins->a].i > r[ins->b].i; break;
+		case PSC_GT_F: r[ins->dst].i = r[ins->a].f > r[ins->b].f; break;
+		case PSC_LE_I: r[ins->dst].i = r[ins->a].i <= r[ins->b].i; break;
+		case PSC_LE_F: r[ins->dst].i = r[ins->a].f <= r[ins->b].f; break;
+		case PSC_LT_I: r[ins->dst].i = r[ins->a].i < r[ins->b].i; break;
+		case PSC_LT_F: r[ins->dst].i = r[ins->a].f < r[ins->b].f; break;
+		}
+		ins++;
+	}
+}
+
+/*
+ * A stack entry while compiling: a constant, or the register holding it.
+ * Where one branch of an if leaves an integer and the other a real, the
+ * value is kept as a real and marked as mixed; it may then only be used
+ * where an integer would give the same result.
+ */
+typedef struct psc_entry_s
+{
+	int type; /* PS_BOOL, PS_INT or PS_REAL */
+	int reg; /* -1 for constants */
+	int mixed;
+	psc_value k;
+} psc_entry;
+
+typedef struct psc_state_s
+{
+	fz_context *ctx;
+	psobj *code;
+	psc_instr *prog;
+	int len, cap;
+	int nregs;
+	psc_entry stack[PSC_STACK];
+	int sp;
+} psc_state;
+
+static int
+psc_emit(psc_state *c, int op, int dst, int a, int b)
+{
+	psc_instr *ins;
+	if (c->len == PSC_MAX_CODE)
+		return -1;
+	if (c->len == c->cap)
+	{
+		c->cap += 64;
+		c->prog = fz_realloc(c->ctx, c->prog, c->cap * sizeof(psc_instr));
+	}
+	ins = &c->prog[c->len];
+	ins->op = op;
+	ins->dst = dst;
+	ins->a = a;
+	ins->b = b;
+	ins->k.i = 0;
+	return c->len++;
+}
+
+static int
+psc_new_reg(psc_state *c)
+{
+	if (c->nregs == PSC_MAX_REGS)
+		return -1;
+	return c->nregs++;
+}
+
+static int
+psc_push(psc_state *c, int type, int reg, psc_value k)
+{
+	/* the interpreter silently drops values that do not fit */
+	if (c->sp >= PSC_STACK - 1)
+		return -1;
+	c->stack[c->sp].type = type;
+	c->stack[c->sp].reg = reg;
+	c->stack[c->sp].mixed = 0;
+	c->stack[c->sp].k = k;
+	c->sp++;
+	return 0;
+}
+
+static int
+psc_push_const_int(psc_state *c, int type, int i)
+{
+	psc_value k;
+	k.i = i;
+	return psc_push(c, type, -1, k);
+}
+
+static int
+psc_push_const_real(psc_state *c, float f)
+{
+	psc_value k;
+	k.f = f;
+	return psc_push(c, PS_REAL, -1, k);
+}
+
+/* Returns the register holding the entry, loading constants into one */
+static int
+psc_reg(psc_state *c, psc_entry *e)
+{
+	int reg;
+	if (e->reg >= 0)
+		return e->reg;
+	reg = psc_new_reg(c);
+	if (reg < 0 || psc_emit(c, PSC_LOADK, reg, 0, 0) < 0)
+		return -1;
+	c->prog[c->len - 1].k = e->k;
+	e->reg = reg;
+	return reg;
+}
+
+/* Convert an entry to the given numeric type, as ps_pop_int and ps_pop_real do */
+static int
+psc_convert(psc_state *c, psc_entry *e, int type)
+{
+	int reg;
+	if (e->type == type)
+		return 0;
+	if (e->type == PS_BOOL || type == PS_BOOL)
+		return -1;
+	if (e->reg < 0)
+	{
+		if (type == PS_REAL)
+			e->k.f = e->k.i;
+		else
+			e->k.i = e->k.f;
+	}
+	else
+	{
+		reg = psc_new_reg(c);
+		if (reg < 0 || psc_emit(c, type == PS_REAL ? PSC_I2F : PSC_F2I, reg, e->reg, 0) < 0)
+			return -1;
+		e->reg = reg;
+	}
+	e->type = type;
+	return 0;
+}
+
+/*
+ * Pop n operands of the given type and push the result of op. Constant
+ * operands are folded by running the instruction on them at once. mixed
+ * says what to do with mixed operands: 0 to give up, 1 to allow them,
+ * and 2 to allow them and mark the result as mixed too.
+ */
+static int
+psc_op(psc_state *c, int op, int n, int argtype, int type, int mixed)
+{
+	psc_entry a, b;
+	int reg, is_mixed;
+
+	if (c->sp < n)
+		return -1;
+	is_mixed = c->stack[c->sp - 1].mixed || (n == 2 && c->stack[c->sp - 2].mixed);
+	if (is_mixed && !mixed)
+		return -1;
+	b = c->stack[c->sp - 1];
+	if (argtype == PS_BOOL ? b.type != PS_BOOL : psc_convert(c, &b, argtype) < 0)
+		return -1;
+	a = b;
+	if (n == 2)
+	{
+		a = c->stack[c->sp - 2];
+		if (argtype == PS_BOOL ? a.type != PS_BOOL : psc_convert(c, &a, argtype) < 0)
+			return -1;
+	}
+	c->sp -= n;
+
+	if (a.reg < 0 && b.reg < 0)
+	{
+		psc_instr fold[2];
+		psc_value r[3];
+		fold[0].op = op;
+		fold[0].dst = 2;
+		fold[0].a = 0;
+		fold[0].b = 1;
+		fold[1].op = PSC_END;
+		r[0] = a.k;
+		r[1] = b.k;
+		psc_run(fold, r);
+		return psc_push(c, type, -1, r[2]);
+	}
+
+	if (psc_reg(c, &a) < 0 || psc_reg(c, &b) < 0)
+		return -1;
+	reg = psc_new_reg(c);
+	if (reg < 0 || psc_emit(c, op, reg, a.reg, b.reg) < 0)
+		return -1;
+	if (psc_push(c, type, reg, a.k) < 0)
+		return -1;
+	c->stack[c->sp - 1].mixed = is_mixed && mixed == 2;
+	return 0;
+}
+
+/* Arithmetic on two integers stays integer, otherwise it is done on reals */
+static int
+psc_arith(psc_state *c, int op_i, int op_f, int result_is_bool)
+{
+	psc_entry *a, *b;
+	if (c->sp < 2)
+		return -1;
+	a = &c->stack[c->sp - 2];
+	b = &c->stack[c->sp - 1];
+	if (a->type == PS_INT && b->type == PS_INT)
+		return psc_op(c, op_i, 2, PS_INT, result_is_bool ? PS_BOOL : PS_INT, 0);
+	/* with a plain real on the other side it is done on reals either way */
+	if ((a->mixed && (b->mixed || b->type != PS_REAL)) || (b->mixed && a->type != PS_REAL))
+		return -1;
+	return psc_op(c, op_f, 2, PS_REAL, result_is_bool ? PS_BOOL : PS_REAL, 1);
+}
+
+static int
+psc_is_type2(psc_state *c, int type)
+{
+	return c->sp >= 2 && c->stack[c->sp - 1].type == type && c->stack[c->sp - 2].type == type;
+}
+
+/* Pop a constant count for copy, index or roll */
+static int
+psc_pop_count(psc_state *c, int *n)
+{
+	psc_entry *e;
+	if (c->sp < 1)
+		return -1;
+	e = &c->stack[c->sp - 1];
+	if (e->reg >= 0 || e->type == PS_BOOL)
+		return -1;
+	*n = e->type == PS_INT ? e->k.i : (int)e->k.f;
+	c->sp--;
+	return 0;
+}
+
+/*
+ * Move every stack entry into the register of its slot. Integers in the
+ * slots marked in promote are made mixed reals.
+ */
+static int
+psc_settle(psc_state *c, int *promote)
+{
+	int tmp[PSC_STACK];
+	int i;
+
+	for (i = 0; i < c->sp; i++)
+	{
+		if (promote[i])
+		{
+			if (psc_convert(c, &c->stack[i], PS_REAL) < 0)
+				return -1;
+			c->stack[i].mixed = 1;
+		}
+	}
+
+	while (c->nregs < c->sp)
+		c->nregs++;
+
+	/* read every value before writing any slot register */
+	for (i = 0; i < c->sp; i++)
+	{
+		psc_entry *e = &c->stack[i];
+		tmp[i] = -1;
+		if (e->reg >= 0 && e->reg != i)
+		{
+			tmp[i] = psc_new_reg(c);
+			if (tmp[i] < 0 || psc_emit(c, PSC_MOVE, tmp[i], e->reg, 0) < 0)
+				return -1;
+		}
+	}
+	for (i = 0; i < c->sp; i++)
+	{
+		psc_entry *e = &c->stack[i];
+		if (e->reg < 0)
+		{
+			if (psc_emit(c, PSC_LOADK, i, 0, 0) < 0)
+				return -1;
+			c->prog[c->len - 1].k = e->k;
+		}
+		else if (tmp[i] >= 0)
+		{
+			if (psc_emit(c, PSC_MOVE, i, tmp[i], 0) < 0)
+				return -1;
+		}
+		e->reg = i;
+	}
+	return 0;
+}
+
+static int psc_block(psc_state *c, int pc);
+
+static int
+psc_branch(psc_state *c, int ifpc, int elsepc)
+{
+	psc_entry saved[PSC_STACK], ifstack[PSC_STACK];
+	int promote[PSC_STACK];
+	int savedsp, savedlen, savednregs;
+	int cond, jz, jmp, sp, i, pass, retry;
+	psc_entry *e;
+
+	if (c->sp < 1 || c->stack[c->sp - 1].type != PS_BOOL)
+		return -1;
+	e = &c->stack[--c->sp];
+
+	/* a known condition selects the branch now */
+	if (e->reg < 0)
+	{
+		if (e->k.i)
+			return psc_block(c, ifpc);
+		if (elsepc >= 0)
+			return psc_block(c, elsepc);
+		return 0;
+	}
+
+	cond = e->reg;
+	savedsp = c->sp;
+	savedlen = c->len;
+	savednregs = c->nregs;
+	memcpy(saved, c->stack, savedsp * sizeof(psc_entry));
+	memset(promote, 0, sizeof promote);
+
+	/* compile again with integers made real if the branches disagree */
+	for (pass = 0; pass < 2; pass++)
+	{
+		c->len = savedlen;
+		c->nregs = savednregs;
+		c->sp = savedsp;
+		memcpy(c->stack, saved, savedsp * sizeof(psc_entry));
+
+		jz = psc_emit(c, PSC_JZ, 0, 0, cond);
+		if (jz < 0 || psc_block(c, ifpc) < 0 || psc_settle(c, promote) < 0)
+			return -1;
+		sp = c->sp;
+		memcpy(ifstack, c->stack, sp * sizeof(psc_entry));
+		jmp = psc_emit(c, PSC_JMP, 0, 0, 0);
+		if (jmp < 0)
+			return -1;
+
+		c->prog[jz].a = c->len;
+		c->sp = savedsp;
+		memcpy(c->stack, saved, savedsp * sizeof(psc_entry));
+		if (elsepc >= 0 && psc_block(c, elsepc) < 0)
+			return -1;
+		if (c->sp != sp || psc_settle(c, promote) < 0)
+			return -1;
+		c->prog[jmp].a = c->len;
+
+		/* both branches must leave the same kind of stack */
+		retry = 0;
+		for (i = 0; i < sp; i++)
+		{
+			if (c->stack[i].type == ifstack[i].type)
+				continue;
+			if (c->stack[i].type == PS_BOOL || ifstack[i].type == PS_BOOL || promote[i])
+				return -1;
+			promote[i] = 1;
+			retry = 1;
+		}
+		if (!retry)
+		{
+			for (i = 0; i < sp; i++)
+				c->stack[i].mixed |= ifstack[i].mixed;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int
+psc_roll(psc_state *c, int n, int j)
+{
+	psc_entry tmp[PSC_STACK];
+	int i;
+
+	if (n < 0 || c->sp - n < 0 || j == 0 || n == 0)
+		return 0;
+	if (j >= 0)
+		j %= n;
+	else
+	{
+		j = -j % n;
+		if (j != 0)
+			j = n - j;
+	}
+	for (i = 0; i < n; i++)
+		tmp[(i + j) % n] = c->stack[c->sp - n + i];
+	memcpy(c->stack + c->sp - n, tmp, n * sizeof(psc_entry));
+	return 0;
+}
+
+static int
+psc_block(psc_state *c, int pc)
+{
+	psobj *code = c->code;
+	int err, n, j;
+
+	while (1)
+	{
+		switch (code[pc].type)
+		{
+		case PS_INT:
+			if (psc_push_const_int(c, PS_INT, code[pc++].u.i) < 0)
+				return -1;
+			break;
+
+		case PS_REAL:
+			if (psc_push_const_real(c, code[pc++].u.f) < 0)
+				return -1;
+			break;
+
+		case PS_OPERATOR:
+			err = 0;
+			switch (code[pc++].u.op)
+			{
+			case PS_OP_ABS:
+				if (c->sp >= 1 && c->stack[c->sp - 1].type == PS_INT)
+					err = psc_op(c, PSC_ABS_I, 1, PS_INT, PS_INT, 0);
+				else
+					err = psc_op(c, PSC_ABS_F, 1, PS_REAL, PS_REAL, 2);
+				break;
+			case PS_OP_ADD: err = psc_arith(c, PSC_ADD_I, PSC_ADD_F, 0); break;
+			case PS_OP_AND:
+				if (psc_is_type2(c, PS_INT))
+					err = psc_op(c, PSC_AND, 2, PS_INT, PS_INT, 0);
+				else
+					err = psc_op(c, PSC_AND, 2, PS_BOOL, PS_BOOL, 0);
+				break;
+			case PS_OP_ATAN: err = psc_op(c, PSC_ATAN, 2, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_BITSHIFT: err = psc_op(c, PSC_BITSHIFT, 2, PS_INT, PS_INT, 0); break;
+			case PS_OP_CEILING: err = psc_op(c, PSC_CEILING, 1, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_COPY:
+				if (psc_pop_count(c, &j) < 0)
+					return -1;
+				if (j < 0 || c->sp - j < 0)
+					break;
+				if (c->sp + j >= PSC_STACK - 1)
+					return -1;
+				memcpy(c->stack + c->sp, c->stack + c->sp - j, j * sizeof(psc_entry));
+				c->sp += j;
+				break;
+			case PS_OP_COS: err = psc_op(c, PSC_COS, 1, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_CVI:
+				err = c->sp < 1 || c->stack[c->sp - 1].mixed ? -1 : psc_convert(c, &c->stack[c->sp - 1], PS_INT);
+				break;
+			case PS_OP_CVR:
+				err = c->sp < 1 ? -1 : psc_convert(c, &c->stack[c->sp - 1], PS_REAL);
+				if (c->sp >= 1)
+					c->stack[c->sp - 1].mixed = 0;
+				break;
+			case PS_OP_DIV: err = psc_op(c, PSC_DIV, 2, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_DUP:
+				if (c->sp < 1)
+					break;
+				if (c->sp + 1 >= PSC_STACK - 1)
+					return -1;
+				c->stack[c->sp] = c->stack[c->sp - 1];
+				c->sp++;
+				break;
+			case PS_OP_EQ:
+				if (psc_is_type2(c, PS_BOOL))
+					err = psc_op(c, PSC_EQ_I, 2, PS_BOOL, PS_BOOL, 0);
+				else
+					err = psc_arith(c, PSC_EQ_I, PSC_EQ_F, 1);
+				break;
+			case PS_OP_EXCH: psc_roll(c, 2, 1); break;
+			case PS_OP_EXP: err = psc_op(c, PSC_EXP, 2, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_FALSE: err = psc_push_const_int(c, PS_BOOL, 0); break;
+			case PS_OP_FLOOR: err = psc_op(c, PSC_FLOOR, 1, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_GE: err = psc_arith(c, PSC_GE_I, PSC_GE_F, 1); break;
+			case PS_OP_GT: err = psc_arith(c, PSC_GT_I, PSC_GT_F, 1); break;
+			case PS_OP_IDIV: err = psc_op(c, PSC_IDIV, 2, PS_INT, PS_INT, 0); break;
+			case PS_OP_INDEX:
+				if (psc_pop_count(c, &j) < 0)
+					return -1;
+				/* the interpreter reads below the stack for j == sp */
+				if (j < 0 || j >= c->sp || c->sp + 1 >= PSC_STACK - 1)
+					return -1;
+				c->stack[c->sp] = c->stack[c->sp - j - 1];
+				c->sp++;
+				break;
+			case PS_OP_LE: err = psc_arith(c, PSC_LE_I, PSC_LE_F, 1); break;
+			case PS_OP_LN: err = psc_op(c, PSC_LN, 1, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_LOG: err = psc_op(c, PSC_LOG, 1, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_LT: err = psc_arith(c, PSC_LT_I, PSC_LT_F, 1); break;
+			case PS_OP_MOD: err = psc_op(c, PSC_MOD, 2, PS_INT, PS_INT, 0); break;
+			case PS_OP_MUL: err = psc_arith(c, PSC_MUL_I, PSC_MUL_F, 0); break;
+			case PS_OP_NE:
+				if (psc_is_type2(c, PS_BOOL))
+					err = psc_op(c, PSC_NE_I, 2, PS_BOOL, PS_BOOL, 0);
+				else
+					err = psc_arith(c, PSC_NE_I, PSC_NE_F, 1);
+				break;
+			case PS_OP_NEG:
+				if (c->sp >= 1 && c->stack[c->sp - 1].type == PS_INT)
+					err = psc_op(c, PSC_NEG_I, 1, PS_INT, PS_INT, 0);
+				else
+					err = psc_op(c, PSC_NEG_F, 1, PS_REAL, PS_REAL, 2);
+				break;
+			case PS_OP_NOT:
+				if (c->sp >= 1 && c->stack[c->sp - 1].type == PS_BOOL)
+					err = psc_op(c, PSC_NOT_B, 1, PS_BOOL, PS_BOOL, 0);
+				else
+					err = psc_op(c, PSC_NOT_I, 1, PS_INT, PS_INT, 0);
+				break;
+			case PS_OP_OR:
+				if (psc_is_type2(c, PS_BOOL))
+					err = psc_op(c, PSC_OR, 2, PS_BOOL, PS_BOOL, 0);
+				else
+					err = psc_op(c, PSC_OR, 2, PS_INT, PS_INT, 0);
+				break;
+			case PS_OP_POP:
+				if (c->sp >= 1)
+					c->sp--;
+				break;
+			case PS_OP_ROLL:
+				if (psc_pop_count(c, &j) < 0 || psc_pop_count(c, &n) < 0)
+					return -1;
+				psc_roll(c, n, j);
+				break;
+			case PS_OP_ROUND:
+				if (c->sp < 1 || c->stack[c->sp - 1].type != PS_INT)
+					err = psc_op(c, PSC_ROUND, 1, PS_REAL, PS_REAL, 2);
+				break;
+			case PS_OP_SIN: err = psc_op(c, PSC_SIN, 1, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_SQRT: err = psc_op(c, PSC_SQRT, 1, PS_REAL, PS_REAL, 1); break;
+			case PS_OP_SUB: err = psc_arith(c, PSC_SUB_I, PSC_SUB_F, 0); break;
+			case PS_OP_TRUE: err = psc_push_const_int(c, PS_BOOL, 1); break;
+			case PS_OP_TRUNCATE:
+				if (c->sp < 1 || c->stack[c->sp - 1].type != PS_INT)
+					err = psc_op(c, PSC_TRUNCATE, 1, PS_REAL, PS_REAL, 2);
+				break;
+			case PS_OP_XOR:
+				if (psc_is_type2(c, PS_BOOL))
+					err = psc_op(c, PSC_XOR, 2, PS_BOOL, PS_BOOL, 0);
+				else
+					err = psc_op(c, PSC_XOR, 2, PS_INT, PS_INT, 0);
+				break;
+			case PS_OP_IF:
+				err = psc_branch(c, code[pc + 1].u.block, -1);
+				pc = code[pc + 2].u.block;
+				break;
+			case PS_OP_IFELSE:
+				err = psc_branch(c, code[pc + 1].u.block, code[pc + 0].u.block);
+				pc = code[pc + 2].u.block;
+				break;
+			case PS_OP_RETURN:
+				return 0;
+			default:
+				return -1;
+			}
+			if (err < 0)
+				return -1;
+			break;
+
+		default:
+			return -1;
+		}
+	}
+}
+
+static void
+compile_postscript_func(fz_context *ctx, pdf_function *func)
+{
+	psc_state c;
+	int i;
+
+	memset(&c, 0, sizeof c);
+	c.ctx = ctx;
+	c.code = func->u.p.code;
+
+	/* the inputs start out in the registers of their slots */
+	for (i = 0; i < func->m; i++)
+	{
+		c.stack[i].type = PS_REAL;
+		c.stack[i].reg = i;
+	}
+	c.sp = func->m;
+	c.nregs = func->m;
+
+	if (psc_block(&c, 0) < 0 || c.sp < func->n)
+		goto fail;
+	for (i = 0; i < func->n; i++)
+	{
+		psc_entry *e = &c.stack[c.sp - func->n + i];
+		if (psc_convert(&c, e, PS_REAL) < 0 || psc_reg(&c, e) < 0)
+			goto fail;
+		func->u.p.out[i] = e->reg;
+	}
+	if (psc_emit(&c, PSC_END, 0, 0, 0) < 0)
+		goto fail;
+
+	func->u.p.prog = c.prog;
+	func->u.p.nregs = c.nregs;
+	return;
+
+fail:
+	fz_free(ctx, c.prog);
+}
+
 static fz_error
 load_postscript_func(pdf_function *func, pdf_xref *xref, fz_obj *dict, int num, int gen)
 {
@@ -854,6 +1569,7 @@ load_postscript_func(pdf_function *func, pdf_xref *xref, fz_obj *dict, int num,
 
 	func->u.p.code = NULL;
 	func->u.p.cap = 0;
+	func->u.p.prog = NULL;
 
 	codeptr = 0;
 	error = parse_code(func, stream, &codeptr);
@@ -864,6 +1580,8 @@ load_postscript_func(pdf_function *func, pdf_xref *xref, fz_obj *dict, int num,
 	}
 
 	fz_close(stream);
+
+	compile_postscript_func(xref->ctx, func);
 	return fz_okay;
 }
 
@@ -874,6 +1592,20 @@ eval_postscript_func(fz_context *ctx, pdf_function *func, float *in, float *out)
 	float x;
 	int i;
 
+	if (func->u.p.prog)
+	{
+		psc_value r[PSC_MAX_REGS];
+		for (i = 0; i < func->m; i++)
+			r[i].f = CLAMP(in[i], func->domain[i][0], func->domain[i][1]);
+		psc_run(func->u.p.prog, r);
+		for (i = 0; i < func->n; i++)
+		{
+			x = r[func->u.p.out[i]].f;
+			out[i] = CLAMP(x, func->range[i][0], func->range[i][1]);
+		}
+		return;
+	}
+
 	ps_init_stack(&st);
 
 	for (i = 0; i < func->m; i++)
@@ -1317,6 +2049,36 @@ eval_stitching_func(fz_context *ctx, pdf_function *func, float in, float *out)
  * Common
  */
 
+/*
+ * Sample a function of one input at 256 points from t0 to t1, with n
+ * outputs and an opaque alpha, for a shading. The table is kept with the
+ * function so that other shadings using it can share it.
+ */
+fz_shade_function *
+pdf_sample_shade_function_table(fz_context *ctx, pdf_function *func, float t0, float t1, int n)
+{
+	float values[256 * (FZ_MAX_COLORS + 1)];
+	float t;
+	int i;
+
+	if (func->table && func->table->n == n + 1 && func->table_t0 == t0 && func->table_t1 == t1)
+		return fz_keep_shade_function(func->table);
+
+	for (i = 0; i < 256; i++)
+	{
+		t = t0 + (i / 255.0f) * (t1 - t0);
+		pdf_eval_function(ctx, func, &t, 1, values + i * (n + 1), n);
+		values[i * (n + 1) + n] = 1;
+	}
+
+	fz_drop_shade_function(ctx, func->table);
+	func->table = fz_new_shade_function(ctx, values, n + 1);
+	func->table_t0 = t0;
+	func->table_t1 = t1;
+
+	return fz_keep_shade_function(func->table);
+}
+
 pdf_function *
 pdf_keep_function(pdf_function *func)
 {
@@ -1346,8 +2108,10 @@ pdf_drop_function(fz_context *ctx, pdf_function *func)
 			break;
 		case POSTSCRIPT:
 			fz_free(ctx, func->u.p.code);
+			fz_free(ctx, func->u.p.prog);
 			break;
 		}
+		fz_drop_shade_function(ctx, func->table);
 		fz_free(ctx, func);
 	}
 }
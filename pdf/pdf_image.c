@@ -1,10 +1,27 @@
 #include "fitz.h"
 #include "mupdf.h"
 
-/* TODO: store JPEG compressed samples */
-/* TODO: store flate compressed samples */
+typedef struct pdf_image_s pdf_image;
+
+/*
+ * An image whose samples are kept compressed, or failing that packed,
+ * and only decoded when a device asks for a pixmap. It holds no
+ * references to the xref, so it can outlive the document.
+ */
+struct pdf_image_s
+{
+	fz_image base;
+	int n, bpc;
+	int indexed, imagemask, interpolate;
+	int usecolorkey;
+	int colorkey[FZ_MAX_COLORS * 2];
+	float decode[FZ_MAX_COLORS * 2];
+	fz_buffer *buffer;
+	fz_obj *filters; /* NULL if buffer holds the decoded samples */
+	fz_obj *params;
+};
 
-static fz_error pdf_load_jpx_image(fz_pixmap **imgp, pdf_xref *xref, fz_obj *dict);
+static fz_error pdf_load_jpx_image(fz_image **imgp, pdf_xref *xref, fz_obj *dict);
 
 static void
 pdf_mask_color_key(fz_pixmap *pix, int n, int *colorkey)
@@ -26,11 +43,411 @@ pdf_mask_color_key(fz_pixmap *pix, int n, int *colorkey)
 	pix->has_alpha = pix->n > n; /* SumatraPDF: allow optimizing non-alpha pixmaps */
 }
 
-static fz_error
-pdf_load_image_imp(fz_pixmap **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict, fz_stream *cstm, int forcemask)
+static fz_pixmap *
+pdf_decode_image_tile(fz_context *ctx, fz_pixmap *tile, unsigned char *samples, int stride,
+	int n, int bpc, int indexed, float *decode, int usecolorkey, int *colorkey)
+{
+	/* the color key applies to the samples before they are decoded */
+	if (usecolorkey)
+	{
+		fz_unpack_tile(tile, samples, n, bpc, stride, indexed);
+		pdf_mask_color_key(tile, n, colorkey);
+		if (indexed)
+			fz_decode_indexed_tile(tile, decode, (1 << bpc) - 1);
+		else
+			fz_decode_tile(tile, decode);
+	}
+	else
+	{
+		fz_unpack_tile_with_decode(tile, samples, n, bpc, stride, indexed, decode);
+	}
+
+	if (indexed)
+	{
+		fz_pixmap *conv;
+		conv = pdf_expand_indexed_pixmap(ctx, tile);
+		fz_drop_pixmap(ctx, tile);
+		tile = conv;
+	}
+
+	return tile;
+}
+
+/*
+ * Decode the samples 2^factor rows at a time, and reduce each band as
+ * soon as it is decoded, so the full size pixmap never exists.
+ */
+static fz_pixmap *
+pdf_decode_subsampled_tile(fz_context *ctx, fz_colorspace *colorspace, int w, int h, int factor,
+	unsigned char *samples, int stride, int n, int bpc, int indexed, float *decode, int usecolorkey, int *colorkey)
+{
+	fz_pixmap *tile = NULL;
+	fz_pixmap *band;
+	int y, bh, span;
+
+	for (y = 0; y < h; y += bh)
+	{
+		bh = MIN(1 << factor, h - y);
+		band = fz_new_pixmap_with_limit(ctx, colorspace, w, bh);
+		if (!band)
+		{
+			if (tile)
+				fz_drop_pixmap(ctx, tile);
+			return NULL;
+		}
+		band = pdf_decode_image_tile(ctx, band, samples + y * stride, stride,
+			n, bpc, indexed, decode, usecolorkey, colorkey);
+		fz_subsample_pixmap(ctx, band, factor);
+
+		if (!tile)
+		{
+			tile = fz_new_pixmap_with_limit(ctx, band->colorspace, band->w, (h + (1 << factor) - 1) >> factor);
+			if (!tile)
+			{
+				fz_drop_pixmap(ctx, band);
+				return NULL;
+			}
+		}
+
+		span = band->w * band->n;
+		memcpy(tile->samples + (y >> factor) * span, band->samples, span);
+		fz_drop_pixmap(ctx, band);
+	}
+
+	return tile;
+}
+
+
+static fz_pixmap *
+pdf_get_image_pixmap(fz_context *ctx, fz_image *image_, fz_bbox *subarea, int l2factor)
 {
+	pdf_image *image = (pdf_image *)image_;
 	fz_stream *stm;
 	fz_pixmap *tile;
+	unsigned char *samples, *sp;
+	int w, h, stride, len, skip, i;
+	int x0, y0, x1, y1;
+	int factor, reduced, align;
+
+	factor = l2factor;
+	if (image->filters)
+		stm = pdf_open_image_decomp_stream(ctx, image->buffer, image->filters, image->params, &factor);
+	else
+		stm = fz_open_buffer(ctx, image->buffer);
+
+	/* the decoder has done part of the reduction itself */
+	reduced = l2factor - factor;
+	w = (image->base.w + (1 << reduced) - 1) >> reduced;
+	h = (image->base.h + (1 << reduced) - 1) >> reduced;
+	stride = (w * image->n * image->bpc + 7) / 8;
+
+	/* Widen the subarea to whole blocks of the reduction, starting on a
+	 * byte boundary, and find it in the decoded samples. */
+	align = MAX(8, 1 << l2factor);
+	x0 = (subarea->x0 / align * align) >> reduced;
+	y0 = (subarea->y0 >> l2factor << l2factor) >> reduced;
+	x1 = MIN(w, ((subarea->x1 + (1 << l2factor) - 1) >> l2factor << l2factor) >> reduced);
+	y1 = MIN(h, ((subarea->y1 + (1 << l2factor) - 1) >> l2factor << l2factor) >> reduced);
+	if ((x0 * image->n * image->bpc) & 7)
+		x0 = 0;
+
+	subarea->x0 = x0 << reduced;
+	subarea->y0 = y0 << reduced;
+	subarea->x1 = MIN(image->base.w, x1 << reduced);
+	subarea->y1 = MIN(image->base.h, y1 << reduced);
+	w = x1 - x0;
+	h = y1 - y0;
+
+	/* SumatraPDF: don't crash on OOM */
+	samples = fz_calloc_no_abort(ctx, h, stride);
+	if (!samples)
+	{
+		fz_close(stm);
+		return NULL;
+	}
+
+	/* The rows above the subarea must still be decoded, but we can stop
+	 * decoding once we have the last row we need. */
+	len = 0;
+	skip = y0 * stride;
+	while (skip > 0)
+	{
+		len = fz_read(stm, samples, MIN(skip, h * stride));
+		if (len <= 0)
+			break;
+		skip -= len;
+	}
+	if (len >= 0 && skip <= 0)
+		len = fz_read(stm, samples, h * stride);
+	fz_close(stm);
+	if (len < 0)
+	{
+		fz_error_handle(ctx, len, "cannot read image data");
+		fz_free(ctx, samples);
+		return NULL;
+	}
+
+	/* Pad truncated images */
+	if (len < stride * h)
+	{
+		fz_warn(ctx, "padding truncated image");
+		memset(samples + len, 0, stride * h - len);
+	}
+
+	/* Invert 1-bit image masks */
+	if (image->imagemask)
+	{
+		/* 0=opaque and 1=transparent so we need to invert */
+		len = h * stride;
+		for (i = 0; i < len; i++)
+			samples[i] = ~samples[i];
+	}
+
+	sp = samples + x0 * image->n * image->bpc / 8;
+	if (factor == 0)
+	{
+		tile = fz_new_pixmap_with_limit(ctx, image->base.colorspace, w, h);
+		if (tile)
+			tile = pdf_decode_image_tile(ctx, tile, sp, stride, image->n, image->bpc,
+				image->indexed, image->decode, image->usecolorkey, image->colorkey);
+	}
+	else
+	{
+		tile = pdf_decode_subsampled_tile(ctx, image->base.colorspace, w, h, factor, sp, stride,
+			image->n, image->bpc, image->indexed, image->decode, image->usecolorkey, image->colorkey);
+	}
+
+	fz_free(ctx, samples);
+
+	if (!tile)
+	{
+		fz_error_handle(ctx, fz_error_make(ctx, "out of memory"), "cannot allocate image pixmap");
+		return NULL;
+	}
+
+	tile->interpolate = image->interpolate;
+	return tile;
+}
+
+static void
+pdf_free_image(fz_context *ctx, fz_image *image_)
+{
+	pdf_image *image = (pdf_image *)image_;
+
+	fz_drop_buffer(ctx, image->buffer);
+	if (image->filters)
+		fz_drop_obj(ctx, image->filters);
+	if (image->params)
+		fz_drop_obj(ctx, image->params);
+}
+
+/*
+ * Copy a filter name or parameter object, resolving indirect references,
+ * so that it can be used without the xref. Returns NULL for objects that
+ * cannot be copied.
+ */
+static fz_obj *
+pdf_copy_filter_obj(fz_context *ctx, fz_obj *obj)
+{
+	fz_obj *copy, *val;
+	int i;
+
+	if (fz_is_null(ctx, obj))
+		return fz_new_null(ctx);
+	if (fz_is_bool(ctx, obj))
+		return fz_new_bool(ctx, fz_to_bool(ctx, obj));
+	if (fz_is_int(ctx, obj))
+		return fz_new_int(ctx, fz_to_int(ctx, obj));
+	if (fz_is_real(ctx, obj))
+		return fz_new_real(ctx, fz_to_real(ctx, obj));
+	if (fz_is_name(ctx, obj))
+		return fz_new_name(ctx, fz_to_name(ctx, obj));
+
+	if (fz_is_array(ctx, obj))
+	{
+		copy = fz_new_array(ctx, fz_array_len(ctx, obj));
+		for (i = 0; i < fz_array_len(ctx, obj); i++)
+		{
+			val = pdf_copy_filter_obj(ctx, fz_array_get(ctx, obj, i));
+			if (!val)
+			{
+				fz_drop_obj(ctx, copy);
+				return NULL;
+			}
+			fz_array_push(ctx, copy, val);
+			fz_drop_obj(ctx, val);
+		}
+		return copy;
+	}
+
+	if (fz_is_dict(ctx, obj))
+	{
+		copy = fz_new_dict(ctx, fz_dict_len(ctx, obj));
+		for (i = 0; i < fz_dict_len(ctx, obj); i++)
+		{
+			val = pdf_copy_filter_obj(ctx, fz_dict_get_val(ctx, obj, i));
+			if (!val)
+			{
+				fz_drop_obj(ctx, copy);
+				return NULL;
+			}
+			fz_dict_put(ctx, copy, fz_dict_get_key(ctx, obj, i), val);
+			fz_drop_obj(ctx, val);
+		}
+		return copy;
+	}
+
+	return NULL;
+}
+
+/*
+ * Filters that need nothing but their parameters to decode. JBIG2 may
+ * need a globals stream and Crypt filters the document's keys.
+ */
+static int
+pdf_is_self_contained_filter(fz_context *ctx, fz_obj *f)
+{
+	static const char *names[] = {
+		"ASCIIHexDecode", "AHx", "ASCII85Decode", "A85",
+		"CCITTFaxDecode", "CCF", "DCTDecode", "DCT",
+		"RunLengthDecode", "RL", "FlateDecode", "Fl",
+		"LZWDecode", "LZW",
+	};
+	char *s = fz_to_name(ctx, f);
+	int i;
+
+	for (i = 0; i < nelem(names); i++)
+		if (!strcmp(s, names[i]))
+			return 1;
+	return 0;
+}
+
+/*
+ * Keep the raw stream data and a copy of its filters, if all of them can
+ * be run again later without the xref. Returns 0 if the samples must be
+ * decoded now instead.
+ */
+static int
+pdf_load_compressed_image(pdf_image *image, pdf_xref *xref, fz_obj *dict)
+{
+	fz_context *ctx = xref->ctx;
+	fz_obj *filters, *params;
+	fz_error error;
+	int i;
+
+	filters = fz_dict_getsa(ctx, dict, "Filter", "F");
+	params = fz_dict_getsa(ctx, dict, "DecodeParms", "DP");
+
+	if (fz_is_name(ctx, filters))
+	{
+		if (!pdf_is_self_contained_filter(ctx, filters))
+			return 0;
+	}
+	else if (fz_array_len(ctx, filters) > 0)
+	{
+		for (i = 0; i < fz_array_len(ctx, filters); i++)
+			if (!pdf_is_self_contained_filter(ctx, fz_array_get(ctx, filters, i)))
+				return 0;
+	}
+	else
+		return 0;
+
+	image->filters = pdf_copy_filter_obj(ctx, filters);
+	image->params = params ? pdf_copy_filter_obj(ctx, params) : NULL;
+	if (!image->filters || (params && !image->params))
+	{
+		if (image->filters)
+			fz_drop_obj(ctx, image->filters);
+		if (image->params)
+			fz_drop_obj(ctx, image->params);
+		image->filters = image->params = NULL;
+		return 0;
+	}
+
+	error = pdf_load_raw_stream(&image->buffer, xref, fz_to_num(dict), fz_to_gen(dict));
+	if (error)
+	{
+		fz_drop_obj(ctx, image->filters);
+		if (image->params)
+			fz_drop_obj(ctx, image->params);
+		image->filters = image->params = NULL;
+		fz_error_handle(ctx, error, "cannot load compressed image data, decoding it now");
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Decode the samples now, but keep them packed.
+ */
+static fz_error
+pdf_load_decoded_image(pdf_image *image, pdf_xref *xref, fz_obj *dict, fz_stream *cstm)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm;
+	fz_error error;
+	unsigned char *samples;
+	int stride, len;
+
+	stride = (image->base.w * image->n * image->bpc + 7) / 8;
+
+	if (cstm)
+	{
+		stm = pdf_open_inline_stream(cstm, xref, dict, stride * image->base.h);
+	}
+	else
+	{
+		error = pdf_open_stream(&stm, xref, fz_to_num(dict), fz_to_gen(dict));
+		if (error)
+			return fz_error_note(ctx, error, "cannot open image data stream (%d 0 R)", fz_to_num(dict));
+	}
+
+	/* SumatraPDF: don't crash on OOM */
+	samples = fz_calloc_no_abort(ctx, image->base.h, stride);
+	if (!samples)
+	{
+		fz_close(stm);
+		return fz_error_make(ctx, "out of memory");
+	}
+
+	len = fz_read(stm, samples, image->base.h * stride);
+	if (len < 0)
+	{
+		fz_close(stm);
+		fz_free(ctx, samples);
+		return fz_error_note(ctx, len, "cannot read image data");
+	}
+
+	/* Make sure we read the EOF marker (for inline images only) */
+	if (cstm)
+	{
+		unsigned char tbuf[512];
+		int tlen = fz_read(stm, tbuf, sizeof tbuf);
+		if (tlen < 0)
+			fz_error_handle(ctx, tlen, "ignoring error at end of image");
+		if (tlen > 0)
+			fz_warn(ctx, "ignoring garbage at end of image");
+	}
+
+	fz_close(stm);
+
+	/* Pad truncated images */
+	if (len < stride * image->base.h)
+	{
+		fz_warn(ctx, "padding truncated image (%d 0 R)", fz_to_num(dict));
+		memset(samples + len, 0, stride * image->base.h - len);
+	}
+
+	image->buffer = fz_new_buffer_from_data(ctx, samples, stride * image->base.h);
+
+	return fz_okay;
+}
+
+static fz_error
+pdf_load_image_imp(fz_image **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict, fz_stream *cstm, int forcemask)
+{
+	pdf_image *image;
 	fz_obj *obj, *res;
 	fz_error error;
 
@@ -39,36 +456,33 @@ pdf_load_image_imp(fz_pixmap **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict,
 	int interpolate;
 	int indexed;
 	fz_colorspace *colorspace;
-	fz_pixmap *mask; /* explicit mask/softmask image */
+	fz_image *mask; /* explicit mask/softmask image */
 	int usecolorkey;
-	int colorkey[FZ_MAX_COLORS * 2];
-	float decode[FZ_MAX_COLORS * 2];
-
-	int stride;
-	unsigned char *samples;
-	int i, len;
+	int i;
 	fz_context *ctx = xref->ctx;
 
 	/* special case for JPEG2000 images */
 	if (pdf_is_jpx_image(ctx, dict))
 	{
-		tile = NULL;
-		error = pdf_load_jpx_image(&tile, xref, dict);
+		fz_image *jpx = NULL;
+		fz_pixmap *tile;
+		error = pdf_load_jpx_image(&jpx, xref, dict);
 		if (error)
 			return fz_error_note(ctx, error, "cannot load jpx image");
 		if (forcemask)
 		{
-			if (tile->n != 2)
+			if (jpx->tile->n != 2)
 			{
-				fz_drop_pixmap(ctx, tile);
+				fz_drop_image(ctx, jpx);
 				return fz_error_make(ctx, "softmask must be grayscale");
 			}
-			mask = fz_alpha_from_gray(ctx, tile, 1);
+			tile = fz_alpha_from_gray(ctx, jpx->tile, 1);
+			fz_drop_image(ctx, jpx);
+			*imgp = fz_new_image_from_pixmap(ctx, tile);
 			fz_drop_pixmap(ctx, tile);
-			*imgp = mask;
 			return fz_okay;
 		}
-		*imgp = tile;
+		*imgp = jpx;
 		return fz_okay;
 	}
 
@@ -124,17 +538,33 @@ pdf_load_image_imp(fz_pixmap **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict,
 		n = 1;
 	}
 
+	image = fz_malloc(ctx, sizeof(pdf_image));
+	memset(image, 0, sizeof(pdf_image));
+	image->base.refs = 1;
+	image->base.w = w;
+	image->base.h = h;
+	image->base.xres = 96;
+	image->base.yres = 96;
+	image->base.colorspace = colorspace;
+	image->base.get_pixmap = pdf_get_image_pixmap;
+	image->base.free_image = pdf_free_image;
+	image->n = n;
+	image->bpc = bpc;
+	image->indexed = indexed;
+	image->imagemask = imagemask;
+	image->interpolate = interpolate;
+
 	obj = fz_dict_getsa(ctx, dict, "Decode", "D");
 	if (obj)
 	{
 		for (i = 0; i < n * 2; i++)
-			decode[i] = fz_to_real(ctx, fz_array_get(ctx, obj, i));
+			image->decode[i] = fz_to_real(ctx, fz_array_get(ctx, obj, i));
 	}
 	else
 	{
 		float maxval = indexed ? (1 << bpc) - 1 : 1;
 		for (i = 0; i < n * 2; i++)
-			decode[i] = i & 1 ? maxval : 0;
+			image->decode[i] = i & 1 ? maxval : 0;
 	}
 
 	obj = fz_dict_getsa(ctx, dict, "SMask", "Mask");
@@ -146,10 +576,12 @@ pdf_load_image_imp(fz_pixmap **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict,
 			error = pdf_load_image_imp(&mask, xref, rdb, obj, NULL, 1);
 			if (error)
 			{
+				fz_free(ctx, image);
 				if (colorspace)
 					fz_drop_colorspace(ctx, colorspace);
 				return fz_error_note(ctx, error, "cannot load image mask/softmask");
 			}
+			image->base.mask = mask;
 		}
 	}
 	else if (fz_is_array(ctx, obj))
@@ -162,121 +594,35 @@ pdf_load_image_imp(fz_pixmap **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict,
 				fz_warn(ctx, "invalid value in color key mask");
 				usecolorkey = 0;
 			}
-			colorkey[i] = fz_to_int(ctx, fz_array_get(ctx, obj, i));
+			image->colorkey[i] = fz_to_int(ctx, fz_array_get(ctx, obj, i));
 		}
 	}
+	image->usecolorkey = usecolorkey;
 
-	/* Allocate now, to fail early if we run out of memory */
-	tile = fz_new_pixmap_with_limit(ctx, colorspace, w, h);
-	if (!tile)
-	{
-		if (colorspace)
-			fz_drop_colorspace(ctx, colorspace);
-		if (mask)
-			fz_drop_pixmap(ctx, mask);
-		return fz_error_make(ctx, "out of memory");
-	}
-
-	if (colorspace)
-		fz_drop_colorspace(ctx, colorspace);
-
-	tile->mask = mask;
-	tile->interpolate = interpolate;
-
-	stride = (w * n * bpc + 7) / 8;
-
-	if (cstm)
-	{
-		stm = pdf_open_inline_stream(cstm, xref, dict, stride * h);
-	}
-	else
+	if (cstm || !pdf_load_compressed_image(image, xref, dict))
 	{
-		error = pdf_open_stream(&stm, xref, fz_to_num(dict), fz_to_gen(dict));
+		error = pdf_load_decoded_image(image, xref, dict, cstm);
 		if (error)
 		{
-			fz_drop_pixmap(ctx, tile);
-			return fz_error_note(ctx, error, "cannot open image data stream (%d 0 R)", fz_to_num(dict));
+			if (mask)
+				fz_drop_image(ctx, mask);
+			if (colorspace)
+				fz_drop_colorspace(ctx, colorspace);
+			fz_free(ctx, image);
+			return error;
 		}
 	}
 
-	/* SumatraPDF: don't crash on OOM */
-	samples = fz_calloc_no_abort(ctx, h, stride);
-	if (!samples)
-	{
-		fz_close(stm);
-		fz_drop_pixmap(ctx, tile);
-		return fz_error_make(ctx, "out of memory");
-	}
-
-	len = fz_read(stm, samples, h * stride);
-	if (len < 0)
-	{
-		fz_close(stm);
-		fz_free(ctx, samples);
-		fz_drop_pixmap(ctx, tile);
-		return fz_error_note(ctx, len, "cannot read image data");
-	}
-
-	/* Make sure we read the EOF marker (for inline images only) */
-	if (cstm)
-	{
-		unsigned char tbuf[512];
-		int tlen = fz_read(stm, tbuf, sizeof tbuf);
-		if (tlen < 0)
-			fz_error_handle(ctx, tlen, "ignoring error at end of image");
-		if (tlen > 0)
-			fz_warn(ctx, "ignoring garbage at end of image");
-	}
-
-	fz_close(stm);
-
-	/* Pad truncated images */
-	if (len < stride * h)
-	{
-		fz_warn(ctx, "padding truncated image (%d 0 R)", fz_to_num(dict));
-		memset(samples + len, 0, stride * h - len);
-	}
-
-	/* Invert 1-bit image masks */
-	if (imagemask)
-	{
-		/* 0=opaque and 1=transparent so we need to invert */
-		unsigned char *p = samples;
-		len = h * stride;
-		for (i = 0; i < len; i++)
-			p[i] = ~p[i];
-	}
-
-	fz_unpack_tile(tile, samples, n, bpc, stride, indexed);
-
-	fz_free(ctx, samples);
-
-	if (usecolorkey)
-		pdf_mask_color_key(tile, n, colorkey);
-
-	if (indexed)
-	{
-		fz_pixmap *conv;
-		fz_decode_indexed_tile(tile, decode, (1 << bpc) - 1);
-		conv = pdf_expand_indexed_pixmap(ctx, tile);
-		fz_drop_pixmap(ctx, tile);
-		tile = conv;
-	}
-	else
-	{
-		fz_decode_tile(tile, decode);
-	}
-
-	*imgp = tile;
+	*imgp = &image->base;
 	return fz_okay;
 }
 
 fz_error
-pdf_load_inline_image(fz_pixmap **pixp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict, fz_stream *file)
+pdf_load_inline_image(fz_image **imgp, pdf_xref *xref, fz_obj *rdb, fz_obj *dict, fz_stream *file)
 {
 	fz_error error;
 
-	error = pdf_load_image_imp(pixp, xref, rdb, dict, file, 0);
+	error = pdf_load_image_imp(imgp, xref, rdb, dict, file, 0);
 	if (error)
 		return fz_error_note(xref->ctx, error, "cannot load inline image");
 
@@ -299,12 +645,13 @@ pdf_is_jpx_image(fz_context *ctx, fz_obj *dict)
 }
 
 static fz_error
-pdf_load_jpx_image(fz_pixmap **imgp, pdf_xref *xref, fz_obj *dict)
+pdf_load_jpx_image(fz_image **imgp, pdf_xref *xref, fz_obj *dict)
 {
 	fz_error error;
 	fz_buffer *buf;
 	fz_colorspace *colorspace;
 	fz_pixmap *img;
+	fz_image *image;
 	fz_obj *obj;
 	fz_context *ctx = xref->ctx;
 
@@ -335,17 +682,6 @@ pdf_load_jpx_image(fz_pixmap **imgp, pdf_xref *xref, fz_obj *dict)
 		fz_drop_colorspace(ctx, colorspace);
 	fz_drop_buffer(ctx, buf);
 
-	obj = fz_dict_getsa(ctx, dict, "SMask", "Mask");
-	if (fz_is_dict(ctx, obj))
-	{
-		error = pdf_load_image_imp(&img->mask, xref, NULL, obj, NULL, 1);
-		if (error)
-		{
-			fz_drop_pixmap(ctx, img);
-			return fz_error_note(ctx, error, "cannot load image mask/softmask");
-		}
-	}
-
 	obj = fz_dict_getsa(ctx, dict, "Decode", "D");
 	/* http://code.google.com/p/sumatrapdf/issues/detail?id=1610 */
 	if (obj && (!colorspace || strcmp(colorspace->name, "Indexed") != 0))
@@ -359,27 +695,42 @@ pdf_load_jpx_image(fz_pixmap **imgp, pdf_xref *xref, fz_obj *dict)
 		fz_decode_tile(img, decode);
 	}
 
-	*imgp = img;
+	/* the decoder cannot stop early, so keep the decoded pixmap */
+	image = fz_new_image_from_pixmap(ctx, img);
+	fz_drop_pixmap(ctx, img);
+
+	obj = fz_dict_getsa(ctx, dict, "SMask", "Mask");
+	if (fz_is_dict(ctx, obj))
+	{
+		error = pdf_load_image_imp(&image->mask, xref, NULL, obj, NULL, 1);
+		if (error)
+		{
+			fz_drop_image(ctx, image);
+			return fz_error_note(ctx, error, "cannot load image mask/softmask");
+		}
+	}
+
+	*imgp = image;
 	return fz_okay;
 }
 
 fz_error
-pdf_load_image(fz_pixmap **pixp, pdf_xref *xref, fz_obj *dict)
+pdf_load_image(fz_image **imgp, pdf_xref *xref, fz_obj *dict)
 {
 	fz_error error;
 	fz_context *ctx = xref->ctx;
 
-	if ((*pixp = pdf_find_item(ctx, xref->store, fz_drop_pixmap, dict)))
+	if ((*imgp = pdf_find_item(ctx, xref->store, fz_drop_image, dict)))
 	{
-		fz_keep_pixmap(*pixp);
+		fz_keep_image(*imgp);
 		return fz_okay;
 	}
 
-	error = pdf_load_image_imp(pixp, xref, NULL, dict, NULL, 0);
+	error = pdf_load_image_imp(imgp, xref, NULL, dict, NULL, 0);
 	if (error)
 		return fz_error_note(ctx, error, "cannot load image (%d 0 R)", fz_to_num(dict));
 
-	pdf_store_item(ctx, xref->store, fz_keep_pixmap, fz_drop_pixmap, dict, *pixp);
+	pdf_store_item(ctx, xref->store, fz_keep_image, fz_drop_image, dict, *imgp);
 
 	return fz_okay;
 }
@@ -361,7 +361,7 @@ pdf_show_shade(pdf_csi *csi, fz_shade *shd)
 }
 
 static void
-pdf_show_image(pdf_csi *csi, fz_pixmap *image)
+pdf_show_image(pdf_csi *csi, fz_image *image)
 {
 	pdf_gstate *gstate = csi->gstate + csi->gtop;
 	fz_rect bbox;
@@ -465,7 +465,8 @@ pdf_show_path(pdf_csi *csi, int doclose, int dofill, int dostroke, int even_odd)
 			break;
 		case PDF_MAT_COLOR:
 			// cf. http://code.google.com/p/sumatrapdf/issues/detail?id=966
-			if (6 <= path->len && path->len <= 7 && path->items[0].k == FZ_MOVETO && path->items[3].k == FZ_LINETO)
+			if ((path->cmd_len == 2 || (path->cmd_len == 3 && path->cmds[2] == FZ_CLOSE_PATH)) &&
+				path->cmds[0] == FZ_MOVETO && path->cmds[1] == FZ_LINETO)
 			{
 				fz_stroke_state state = { 0 };
 				state.linewidth = 0.1f / fz_matrix_expansion(gstate->ctm);
@@ -1523,7 +1524,7 @@ static fz_error pdf_run_BI(pdf_csi *csi, fz_obj *rdb, fz_stream *file)
 	fz_error error;
 	char *buf = csi->xref->scratch;
 	int buflen = sizeof(csi->xref->scratch);
-	fz_pixmap *img;
+	fz_image *img;
 	fz_obj *obj;
 	fz_context *ctx = csi->dev->ctx;
 
@@ -1544,7 +1545,7 @@ static fz_error pdf_run_BI(pdf_csi *csi, fz_obj *rdb, fz_stream *file)
 
 	pdf_show_image(csi, img);
 
-	fz_drop_pixmap(ctx, img);
+	fz_drop_image(ctx, img);
 
 	/* find EI */
 	ch = fz_read_byte(file);
@@ -1703,12 +1704,12 @@ static fz_error pdf_run_Do(pdf_csi *csi, fz_obj *rdb)
 	{
 		if ((csi->dev->hints & FZ_IGNORE_IMAGE) == 0)
 		{
-			fz_pixmap *img;
+			fz_image *img;
 			error = pdf_load_image(&img, csi->xref, obj);
 			if (error)
 				return fz_error_note(ctx, error, "cannot load image (%d %d R)", fz_to_num(obj), fz_to_gen(obj));
 			pdf_show_image(csi, img);
-			fz_drop_pixmap(ctx, img);
+			fz_drop_image(ctx, img);
 		}
 	}
 
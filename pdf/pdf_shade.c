@@ -4,7 +4,6 @@
 #define HUGENUM 32000 /* how far to extend axial/radial shadings */
 #define FUNSEGS 32 /* size of sampled mesh for function-based shadings */
 #define RADSEGS 32 /* how many segments to generate for radial meshes */
-#define SUBDIV 3 /* how many levels to subdivide patches */
 
 struct vertex
 {
@@ -61,7 +60,7 @@ pdf_add_quad(fz_context *ctx, fz_shade *shade,
 	pdf_add_triangle(ctx, shade, v1, v3, v2);
 }
 
-/* Subdivide and tesselate tensor-patches */
+/* Tensor-patches are stored whole, and subdivided when they are drawn */
 
 typedef struct pdf_tensor_patch_s pdf_tensor_patch;
 
@@ -72,164 +71,22 @@ struct pdf_tensor_patch_s
 };
 
 static void
-triangulate_patch(fz_context *ctx, pdf_tensor_patch p, fz_shade *shade)
+pdf_add_patch(fz_context *ctx, fz_shade *shade, pdf_tensor_patch *p, int ncomp)
 {
-	struct vertex v0, v1, v2, v3;
-
-	v0.x = p.pole[0][0].x;
-	v0.y = p.pole[0][0].y;
-	memcpy(v0.c, p.color[0], sizeof(v0.c));
-
-	v1.x = p.pole[0][3].x;
-	v1.y = p.pole[0][3].y;
-	memcpy(v1.c, p.color[1], sizeof(v1.c));
-
-	v2.x = p.pole[3][3].x;
-	v2.y = p.pole[3][3].y;
-	memcpy(v2.c, p.color[2], sizeof(v2.c));
-
-	v3.x = p.pole[3][0].x;
-	v3.y = p.pole[3][0].y;
-	memcpy(v3.c, p.color[3], sizeof(v3.c));
-
-	pdf_add_quad(ctx, shade, &v0, &v1, &v2, &v3);
-}
-
-static inline void midcolor(float *c, float *c1, float *c2)
-{
-	int i;
-	for (i = 0; i < FZ_MAX_COLORS; i++)
-		c[i] = (c1[i] + c2[i]) * 0.5f;
-}
-
-static void
-split_curve(fz_point *pole, fz_point *q0, fz_point *q1, int polestep)
-{
-	/*
-	split bezier curve given by control points pole[0]..pole[3]
-	using de casteljau algo at midpoint and build two new
-	bezier curves q0[0]..q0[3] and q1[0]..q1[3]. all indices
-	should be multiplies by polestep == 1 for vertical bezier
-	curves in patch and == 4 for horizontal bezier curves due
-	to C's multi-dimensional matrix memory layout.
-	*/
-
-	float x12 = (pole[1 * polestep].x + pole[2 * polestep].x) * 0.5f;
-	float y12 = (pole[1 * polestep].y + pole[2 * polestep].y) * 0.5f;
-
-	q0[1 * polestep].x = (pole[0 * polestep].x + pole[1 * polestep].x) * 0.5f;
-	q0[1 * polestep].y = (pole[0 * polestep].y + pole[1 * polestep].y) * 0.5f;
-	q1[2 * polestep].x = (pole[2 * polestep].x + pole[3 * polestep].x) * 0.5f;
-	q1[2 * polestep].y = (pole[2 * polestep].y + pole[3 * polestep].y) * 0.5f;
-
-	q0[2 * polestep].x = (q0[1 * polestep].x + x12) * 0.5f;
-	q0[2 * polestep].y = (q0[1 * polestep].y + y12) * 0.5f;
-	q1[1 * polestep].x = (x12 + q1[2 * polestep].x) * 0.5f;
-	q1[1 * polestep].y = (y12 + q1[2 * polestep].y) * 0.5f;
-
-	q0[3 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
-	q0[3 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
-	q1[0 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
-	q1[0 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
-
-	q0[0 * polestep].x = pole[0 * polestep].x;
-	q0[0 * polestep].y = pole[0 * polestep].y;
-	q1[3 * polestep].x = pole[3 * polestep].x;
-	q1[3 * polestep].y = pole[3 * polestep].y;
-}
-
-static void
-split_stripe(pdf_tensor_patch *p, pdf_tensor_patch *s0, pdf_tensor_patch *s1)
-{
-	/*
-	split all horizontal bezier curves in patch,
-	creating two new patches with half the width.
-	*/
-	split_curve(&p->pole[0][0], &s0->pole[0][0], &s1->pole[0][0], 4);
-	split_curve(&p->pole[0][1], &s0->pole[0][1], &s1->pole[0][1], 4);
-	split_curve(&p->pole[0][2], &s0->pole[0][2], &s1->pole[0][2], 4);
-	split_curve(&p->pole[0][3], &s0->pole[0][3], &s1->pole[0][3], 4);
-
-	/* interpolate the colors for the two new patches. */
-	memcpy(s0->color[0], p->color[0], sizeof(s0->color[0]));
-	memcpy(s0->color[1], p->color[1], sizeof(s0->color[1]));
-	midcolor(s0->color[2], p->color[1], p->color[2]);
-	midcolor(s0->color[3], p->color[0], p->color[3]);
-
-	memcpy(s1->color[0], s0->color[3], sizeof(s1->color[0]));
-	memcpy(s1->color[1], s0->color[2], sizeof(s1->color[1]));
-	memcpy(s1->color[2], p->color[2], sizeof(s1->color[2]));
-	memcpy(s1->color[3], p->color[3], sizeof(s1->color[3]));
-}
-
-static void
-draw_stripe(fz_context *ctx, pdf_tensor_patch *p, fz_shade *shade, int depth)
-{
-	pdf_tensor_patch s0, s1;
-
-	/* split patch into two half-height patches */
-	split_stripe(p, &s0, &s1);
-
-	depth--;
-	if (depth == 0)
-	{
-		/* if no more subdividing, draw two new patches... */
-		triangulate_patch(ctx, s0, shade);
-		triangulate_patch(ctx, s1, shade);
-	}
-	else
-	{
-		/* ...otherwise, continue subdividing. */
-		draw_stripe(ctx, &s0, shade, depth);
-		draw_stripe(ctx, &s1, shade, depth);
-	}
-}
-
-static void
-split_patch(pdf_tensor_patch *p, pdf_tensor_patch *s0, pdf_tensor_patch *s1)
-{
-	/*
-	split all vertical bezier curves in patch,
-	creating two new patches with half the height.
-	*/
-	split_curve(p->pole[0], s0->pole[0], s1->pole[0], 1);
-	split_curve(p->pole[1], s0->pole[1], s1->pole[1], 1);
-	split_curve(p->pole[2], s0->pole[2], s1->pole[2], 1);
-	split_curve(p->pole[3], s0->pole[3], s1->pole[3], 1);
-
-	/* interpolate the colors for the two new patches. */
-	memcpy(s0->color[0], p->color[0], sizeof(s0->color[0]));
-	midcolor(s0->color[1], p->color[0], p->color[1]);
-	midcolor(s0->color[2], p->color[2], p->color[3]);
-	memcpy(s0->color[3], p->color[3], sizeof(s0->color[3]));
-
-	memcpy(s1->color[0], s0->color[1], sizeof(s1->color[0]));
-	memcpy(s1->color[1], p->color[1], sizeof(s1->color[1]));
-	memcpy(s1->color[2], p->color[2], sizeof(s1->color[2]));
-	memcpy(s1->color[3], s0->color[2], sizeof(s1->color[3]));
-}
-
-static void
-draw_patch(fz_context *ctx, fz_shade *shade, pdf_tensor_patch *p, int depth, int origdepth)
-{
-	pdf_tensor_patch s0, s1;
-
-	/* split patch into two half-width patches */
-	split_patch(p, &s0, &s1);
+	int i, k;
 
-	depth--;
-	if (depth == 0)
-	{
-		/* if no more subdividing, draw two new patches... */
-		draw_stripe(ctx, &s0, shade, origdepth);
-		draw_stripe(ctx, &s1, shade, origdepth);
-	}
-	else
+	pdf_grow_mesh(ctx, shade, 32 + 4 * ncomp);
+	for (i = 0; i < 4; i++)
 	{
-		/* ...otherwise, continue subdividing. */
-		draw_patch(ctx, shade, &s0, depth, origdepth);
-		draw_patch(ctx, shade, &s1, depth, origdepth);
+		for (k = 0; k < 4; k++)
+		{
+			shade->mesh[shade->mesh_len++] = p->pole[i][k].x;
+			shade->mesh[shade->mesh_len++] = p->pole[i][k].y;
+		}
 	}
+	for (i = 0; i < 4; i++)
+		for (k = 0; k < ncomp; k++)
+			shade->mesh[shade->mesh_len++] = p->color[i][k];
 }
 
 static fz_point
@@ -321,23 +178,10 @@ pdf_make_tensor_patch(pdf_tensor_patch *p, int type, fz_point *pt)
 
 /* Sample various functions into lookup tables */
 
-static void
-pdf_sample_composite_shade_function(fz_context *ctx, fz_shade *shade, pdf_function *func, float t0, float t1)
-{
-	int i;
-	float t;
-
-	for (i = 0; i < 256; i++)
-	{
-		t = t0 + (i / 255.0f) * (t1 - t0);
-		pdf_eval_function(ctx, func, &t, 1, shade->function[i], shade->colorspace->n);
-		shade->function[i][shade->colorspace->n] = 1;
-	}
-}
-
 static void
 pdf_sample_component_shade_function(fz_context *ctx, fz_shade *shade, int funcs, pdf_function **func, float t0, float t1)
 {
+	float values[256 * (FZ_MAX_COLORS + 1)];
 	int i, k;
 	float t;
 
@@ -345,9 +189,11 @@ pdf_sample_component_shade_function(fz_context *ctx, fz_shade *shade, int funcs,
 	{
 		t = t0 + (i / 255.0f) * (t1 - t0);
 		for (k = 0; k < funcs; k++)
-			pdf_eval_function(ctx, func[k], &t, 1, &shade->function[i][k], 1);
-		shade->function[i][k] = 1;
+			pdf_eval_function(ctx, func[k], &t, 1, &values[i * (funcs + 1) + k], 1);
+		values[i * (funcs + 1) + k] = 1;
 	}
+
+	shade->function = fz_new_shade_function(ctx, values, funcs + 1);
 }
 
 static void
@@ -355,7 +201,7 @@ pdf_sample_shade_function(fz_context *ctx, fz_shade *shade, int funcs, pdf_funct
 {
 	shade->use_function = 1;
 	if (funcs == 1)
-		pdf_sample_composite_shade_function(ctx, shade, func[0], t0, t1);
+		shade->function = pdf_sample_shade_function_table(ctx, func[0], t0, t1, shade->colorspace->n);
 	else
 		pdf_sample_component_shade_function(ctx, shade, funcs, func, t0, t1);
 }
@@ -741,6 +587,7 @@ pdf_load_type6_shade(fz_shade *shade, pdf_xref *xref, fz_obj *dict,
 	else
 		ncomp = shade->colorspace->n;
 
+	shade->type = FZ_PATCH;
 	hasprevpatch = 0;
 
 	while (!fz_is_eof_bits(stream))
@@ -825,7 +672,7 @@ pdf_load_type6_shade(fz_shade *shade, pdf_xref *xref, fz_obj *dict,
 			for (i = 0; i < 4; i++)
 				memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-			draw_patch(ctx, shade, &patch, SUBDIV, SUBDIV);
+			pdf_add_patch(ctx, shade, &patch, ncomp);
 
 			for (i = 0; i < 12; i++)
 				prevp[i] = v[i];
@@ -860,6 +707,7 @@ pdf_load_type7_shade(fz_shade *shade, pdf_xref *xref, fz_obj *dict,
 	else
 		ncomp = shade->colorspace->n;
 
+	shade->type = FZ_PATCH;
 	hasprevpatch = 0;
 
 	while (!fz_is_eof_bits(stream))
@@ -944,7 +792,7 @@ pdf_load_type7_shade(fz_shade *shade, pdf_xref *xref, fz_obj *dict,
 			for (i = 0; i < 4; i++)
 				memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-			draw_patch(ctx, shade, &patch, SUBDIV, SUBDIV);
+			pdf_add_patch(ctx, shade, &patch, ncomp);
 
 			for (i = 0; i < 16; i++)
 				prevp[i] = v[i];
@@ -977,6 +825,7 @@ pdf_load_shading_dict(fz_shade **shadep, pdf_xref *xref, fz_obj *dict, fz_matrix
 	shade->type = FZ_MESH;
 	shade->use_background = 0;
 	shade->use_function = 0;
+	shade->function = NULL;
 	shade->matrix = transform;
 	shade->bbox = fz_infinite_rect;
 	shade->extend[0] = 0;
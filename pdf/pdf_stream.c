@@ -52,9 +52,11 @@ pdf_stream_has_crypt(fz_context *ctx, fz_obj *stm)
 
 /*
  * Create a filter given a name and param dictionary.
+ * If l2factor is given, the filter may decode at a reduced size and
+ * subtract what it did from *l2factor.
  */
 static fz_stream *
-build_filter(fz_stream *chain, pdf_xref * xref, fz_obj * f, fz_obj * p, int num, int gen)
+build_filter(fz_stream *chain, pdf_xref * xref, fz_obj * f, fz_obj * p, int num, int gen, int *l2factor)
 {
 	fz_error error;
 	char *s;
@@ -72,7 +74,15 @@ build_filter(fz_stream *chain, pdf_xref * xref, fz_obj * f, fz_obj * p, int num,
 		return fz_open_faxd(chain, p);
 
 	else if (!strcmp(s, "DCTDecode") || !strcmp(s, "DCT"))
+	{
+		if (l2factor && *l2factor > 0)
+		{
+			int factor = MIN(*l2factor, 3);
+			*l2factor -= factor;
+			return fz_open_resized_dctd(chain, p, factor);
+		}
 		return fz_open_dctd(chain, p);
+	}
 
 	else if (!strcmp(s, "RunLengthDecode") || !strcmp(s, "RL"))
 		return fz_open_rld(chain);
@@ -139,17 +149,20 @@ build_filter(fz_stream *chain, pdf_xref * xref, fz_obj * f, fz_obj * p, int num,
  * Assume ownership of head.
  */
 static fz_stream *
-build_filter_chain(fz_stream *chain, pdf_xref *xref, fz_obj *fs, fz_obj *ps, int num, int gen)
+build_filter_chain(fz_stream *chain, pdf_xref *xref, fz_obj *fs, fz_obj *ps, int num, int gen, int *l2factor)
 {
 	fz_obj *f;
 	fz_obj *p;
-	int i;
+	int i, n;
+	fz_context *ctx = chain->ctx;
 
-	for (i = 0; i < fz_array_len(xref->ctx, fs); i++)
+	n = fz_array_len(ctx, fs);
+	for (i = 0; i < n; i++)
 	{
-		f = fz_array_get(xref->ctx, fs, i);
-		p = fz_array_get(xref->ctx, ps, i);
-		chain = build_filter(chain, xref, f, p, num, gen);
+		f = fz_array_get(ctx, fs, i);
+		p = fz_array_get(ctx, ps, i);
+		/* only the last filter produces the samples */
+		chain = build_filter(chain, xref, f, p, num, gen, i == n - 1 ? l2factor : NULL);
 	}
 
 	return chain;
@@ -197,9 +210,9 @@ pdf_open_filter(fz_stream *chain, pdf_xref *xref, fz_obj *stmobj, int num, int g
 	chain = pdf_open_raw_filter(chain, xref, stmobj, num, gen);
 
 	if (fz_is_name(ctx, filters))
-		return build_filter(chain, xref, filters, params, num, gen);
+		return build_filter(chain, xref, filters, params, num, gen, NULL);
 	if (fz_array_len(ctx, filters) > 0)
-		return build_filter_chain(chain, xref, filters, params, num, gen);
+		return build_filter_chain(chain, xref, filters, params, num, gen, NULL);
 
 	return chain;
 }
@@ -222,13 +235,31 @@ pdf_open_inline_stream(fz_stream *chain, pdf_xref *xref, fz_obj *stmobj, int len
 	fz_keep_stream(chain);
 
 	if (fz_is_name(ctx, filters))
-		return build_filter(chain, xref, filters, params, 0, 0);
+		return build_filter(chain, xref, filters, params, 0, 0, NULL);
 	if (fz_array_len(ctx, filters) > 0)
-		return build_filter_chain(chain, xref, filters, params, 0, 0);
+		return build_filter_chain(chain, xref, filters, params, 0, 0, NULL);
 
 	return fz_open_null(chain, length);
 }
 
+/*
+ * Construct a filter to decode image samples that were kept compressed
+ * in a buffer. The filters and params must not need the xref, so
+ * JBIG2 and Crypt filters cannot be used here.
+ */
+fz_stream *
+pdf_open_image_decomp_stream(fz_context *ctx, fz_buffer *buffer, fz_obj *filters, fz_obj *params, int *l2factor)
+{
+	fz_stream *chain = fz_open_buffer(ctx, buffer);
+
+	if (fz_is_name(ctx, filters))
+		return build_filter(chain, NULL, filters, params, 0, 0, l2factor);
+	if (fz_array_len(ctx, filters) > 0)
+		return build_filter_chain(chain, NULL, filters, params, 0, 0, l2factor);
+
+	return chain;
+}
+
 /*
  * Open a stream for reading the raw (compressed but decrypted) data.
  * Using xref->file while this is open is a bad idea.
@@ -24,6 +24,15 @@
 #include "../pdf/pdf_cmap.c"
 #include "../pdf/pdf_cmap_parse.c"
 
+/* The context sets up caches that cmapdump never uses */
+void fz_new_scale_cache(fz_context *ctx) { }
+void fz_free_scale_cache(fz_context *ctx) { }
+void fz_new_image_cache(fz_context *ctx) { }
+void fz_free_image_cache(fz_context *ctx) { }
+void fz_new_path_cache(fz_context *ctx) { }
+void fz_free_path_cache(fz_context *ctx) { }
+void fz_free_cmyk_lut(fz_context *ctx) { }
+
 static void
 clean(char *p)
 {
@@ -123,6 +123,8 @@ xps_target *xps_find_link_target_obj(xps_context *ctx, char *target_uri);
 int xps_decode_jpeg(fz_context *ctx, fz_pixmap **imagep, byte *rbuf, int rlen);
 int xps_decode_png(fz_context *ctx, fz_pixmap **imagep, byte *rbuf, int rlen);
 int xps_decode_tiff(fz_context *ctx, fz_pixmap **imagep, byte *rbuf, int rlen);
+int xps_decode_tiff_subarea(fz_context *ctx, fz_pixmap **imagep, byte *rbuf, int rlen, fz_bbox *subarea);
+int xps_decode_tiff_info(fz_context *ctx, byte *rbuf, int rlen, int *wp, int *hp, int *xresp, int *yresp, fz_colorspace **csp);
 
 typedef struct xps_font_cache_s xps_font_cache;
 
@@ -59,7 +59,7 @@ xps_measure_font_glyph(xps_context *ctx, fz_font *font, int gid, xps_glyph_metri
 	FT_Face face = font->ft_face;
 	FT_Fixed hadv, vadv;
 
-	FT_Set_Char_Size(face, 64, 64, 72, 72);
+	fz_set_ft_char_size(ctx->ctx, font, 64);
 	FT_Get_Advance(face, gid, mask, &hadv);
 	FT_Get_Advance(face, gid, mask | FT_LOAD_VERTICAL_LAYOUT, &vadv);
 
@@ -174,8 +174,9 @@ xps_parse_gradient_stops(xps_context *ctx, char *base_uri, xml_element *node,
 }
 
 static void
-xps_sample_gradient_stops(fz_shade *shade, struct stop *stops, int count)
+xps_sample_gradient_stops(fz_context *ctx, fz_shade *shade, struct stop *stops, int count)
 {
+	float values[256][4];
 	float offset, d;
 	int i, k;
 
@@ -188,11 +189,13 @@ xps_sample_gradient_stops(fz_shade *shade, struct stop *stops, int count)
 
 		d = (offset - stops[k].offset) / (stops[k+1].offset - stops[k].offset);
 
-		shade->function[i][0] = lerp(stops[k].r, stops[k+1].r, d);
-		shade->function[i][1] = lerp(stops[k].g, stops[k+1].g, d);
-		shade->function[i][2] = lerp(stops[k].b, stops[k+1].b, d);
-		shade->function[i][3] = lerp(stops[k].a, stops[k+1].a, d);
+		values[i][0] = lerp(stops[k].r, stops[k+1].r, d);
+		values[i][1] = lerp(stops[k].g, stops[k+1].g, d);
+		values[i][2] = lerp(stops[k].b, stops[k+1].b, d);
+		values[i][3] = lerp(stops[k].a, stops[k+1].a, d);
 	}
+
+	shade->function = fz_new_shade_function(ctx, values[0], 4);
 }
 
 /*
@@ -223,7 +226,7 @@ xps_draw_one_radial_gradient(xps_context *ctx, fz_matrix ctm,
 	shade->extend[0] = extend;
 	shade->extend[1] = extend;
 
-	xps_sample_gradient_stops(shade, stops, count);
+	xps_sample_gradient_stops(ctx->ctx, shade, stops, count);
 
 	shade->mesh_len = 6;
 	shade->mesh_cap = 6;
@@ -264,7 +267,7 @@ xps_draw_one_linear_gradient(xps_context *ctx, fz_matrix ctm,
 	shade->extend[0] = extend;
 	shade->extend[1] = extend;
 
-	xps_sample_gradient_stops(shade, stops, count);
+	xps_sample_gradient_stops(ctx->ctx, shade, stops, count);
 
 	shade->mesh_len = 6;
 	shade->mesh_cap = 6;
@@ -1,6 +1,73 @@
 #include "fitz.h"
 #include "muxps.h"
 
+typedef struct xps_tiff_image_s xps_tiff_image;
+
+/* TIFF images are kept compressed and decoded when drawn */
+struct xps_tiff_image_s
+{
+	fz_image base;
+	fz_buffer *buffer;
+};
+
+static fz_pixmap *
+xps_get_tiff_pixmap(fz_context *ctx, fz_image *image_, fz_bbox *subarea, int l2factor)
+{
+	xps_tiff_image *image = (xps_tiff_image *)image_;
+	fz_pixmap *pixmap;
+	int error;
+
+	error = xps_decode_tiff_subarea(ctx, &pixmap, image->buffer->data, image->buffer->len, subarea);
+	if (error)
+	{
+		fz_error_handle(ctx, error, "cannot decode TIFF image");
+		return NULL;
+	}
+
+	fz_subsample_pixmap(ctx, pixmap, l2factor);
+	return pixmap;
+}
+
+static void
+xps_free_tiff_image(fz_context *ctx, fz_image *image_)
+{
+	xps_tiff_image *image = (xps_tiff_image *)image_;
+
+	fz_drop_buffer(ctx, image->buffer);
+}
+
+static int
+xps_load_tiff_image(fz_context *ctx, fz_image **imagep, xps_part *part)
+{
+	xps_tiff_image *image;
+	fz_colorspace *colorspace;
+	int w, h, xres, yres;
+	int error;
+
+	error = xps_decode_tiff_info(ctx, part->data, part->size, &w, &h, &xres, &yres, &colorspace);
+	if (error)
+		return fz_error_note(ctx, error, "cannot decode TIFF image");
+
+	image = fz_malloc(ctx, sizeof(xps_tiff_image));
+	memset(image, 0, sizeof(xps_tiff_image));
+	image->base.refs = 1;
+	image->base.w = w;
+	image->base.h = h;
+	image->base.xres = xres;
+	image->base.yres = yres;
+	image->base.colorspace = fz_keep_colorspace(colorspace);
+	image->base.get_pixmap = xps_get_tiff_pixmap;
+	image->base.free_image = xps_free_tiff_image;
+
+	/* take over the part data */
+	image->buffer = fz_new_buffer_from_data(ctx, part->data, part->size);
+	part->data = NULL;
+	part->size = 0;
+
+	*imagep = &image->base;
+	return fz_okay;
+}
+
 static int
 xps_decode_image(fz_context *ctx, fz_pixmap **imagep, byte *buf, int len)
 {
@@ -41,16 +108,16 @@ static void
 xps_paint_image_brush(xps_context *ctx, fz_matrix ctm, fz_rect area, char *base_uri, xps_resource *dict,
 	xml_element *root, void *vimage)
 {
-	fz_pixmap *pixmap = vimage;
+	fz_image *image = vimage;
 	/* SumatraPDF: prevent a potential division by zero */
-	if (pixmap->xres != 0 && pixmap->yres != 0)
+	if (image->xres != 0 && image->yres != 0)
 	{
-		float xs = pixmap->w * 96 / pixmap->xres;
-		float ys = pixmap->h * 96 / pixmap->yres;
+		float xs = image->w * 96 / image->xres;
+		float ys = image->h * 96 / image->yres;
 		fz_matrix im = fz_scale(xs, -ys);
 		im.f = ys;
 		ctm = fz_concat(im, ctm);
-		fz_fill_image(ctx->dev, pixmap, ctm, ctx->opacity[ctx->opacity_top]);
+		fz_fill_image(ctx->dev, image, ctm, ctx->opacity[ctx->opacity_top]);
 	}
 }
 
@@ -109,7 +176,8 @@ xps_parse_image_brush(xps_context *ctx, fz_matrix ctm, fz_rect area,
 	char *base_uri, xps_resource *dict, xml_element *root)
 {
 	xps_part *part;
-	fz_pixmap *image;
+	fz_pixmap *pixmap;
+	fz_image *image = NULL;
 	int code;
 
 	part = xps_find_image_brush_source_part(ctx, base_uri, root);
@@ -118,7 +186,20 @@ xps_parse_image_brush(xps_context *ctx, fz_matrix ctm, fz_rect area,
 		return;
 	}
 
-	code = xps_decode_image(ctx->ctx, &image, part->data, part->size);
+	if (part->size >= 8 && (memcmp(part->data, "MM", 2) == 0 ||
+		(memcmp(part->data, "II", 2) == 0 && part->data[2] != 0xBC)))
+	{
+		code = xps_load_tiff_image(ctx->ctx, &image, part);
+	}
+	else
+	{
+		code = xps_decode_image(ctx->ctx, &pixmap, part->data, part->size);
+		if (code == fz_okay)
+		{
+			image = fz_new_image_from_pixmap(ctx->ctx, pixmap);
+			fz_drop_pixmap(ctx->ctx, pixmap);
+		}
+	}
 	if (code < 0) {
 		xps_free_part(ctx, part);
 		fz_error_handle(ctx->ctx, -1, "cannot decode image resource");
@@ -127,6 +208,6 @@ xps_parse_image_brush(xps_context *ctx, fz_matrix ctm, fz_rect area,
 
 	xps_parse_tiling_brush(ctx, ctm, area, base_uri, dict, root, xps_paint_image_brush, image);
 
-	fz_drop_pixmap(ctx->ctx, image);
+	fz_drop_image(ctx->ctx, image);
 	xps_free_part(ctx, part);
 }
@@ -5,27 +5,27 @@ static fz_point
 fz_currentpoint(fz_path *path)
 {
 	fz_point c, m;
-	int i;
+	int i, k;
 
 	c.x = c.y = m.x = m.y = 0;
-	i = 0;
+	k = 0;
 
-	while (i < path->len)
+	for (i = 0; i < path->cmd_len; i++)
 	{
-		switch (path->items[i++].k)
+		switch (path->cmds[i])
 		{
 		case FZ_MOVETO:
-			m.x = c.x = path->items[i++].v;
-			m.y = c.y = path->items[i++].v;
+			m.x = c.x = path->coords[k++];
+			m.y = c.y = path->coords[k++];
 			break;
 		case FZ_LINETO:
-			c.x = path->items[i++].v;
-			c.y = path->items[i++].v;
+			c.x = path->coords[k++];
+			c.y = path->coords[k++];
 			break;
 		case FZ_CURVETO:
-			i += 4;
-			c.x = path->items[i++].v;
-			c.y = path->items[i++].v;
+			k += 4;
+			c.x = path->coords[k++];
+			c.y = path->coords[k++];
 			break;
 		case FZ_CLOSE_PATH:
 			c = m;
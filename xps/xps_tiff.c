@@ -7,6 +7,7 @@
  * Limited bit depths (1,2,4,8).
  * Limited planar configurations (1=chunky).
  * No tiles (easy fix if necessary).
+ * Only the strips that hold the requested rows are decoded.
  * TODO: RGBPal images
  */
 
@@ -52,10 +53,11 @@ struct tiff
 	byte *profile;
 	int profilesize;
 
-	/* decoded data */
+	/* decoded data, rows firstrow to firstrow + rows */
 	fz_colorspace *colorspace;
 	byte *samples;
 	int stride;
+	unsigned firstrow, rows;
 	fz_context *ctx;
 };
 
@@ -320,9 +322,9 @@ xps_expand_tiff_colormap(struct tiff *tiff)
 
 	stride = tiff->imagewidth * (tiff->samplesperpixel + 2);
 
-	samples = fz_malloc(tiff->ctx, stride * tiff->imagelength);
+	samples = fz_malloc(tiff->ctx, stride * tiff->rows);
 
-	for (y = 0; y < tiff->imagelength; y++)
+	for (y = 0; y < tiff->rows; y++)
 	{
 		src = tiff->samples + (tiff->stride * y);
 		dst = samples + (stride * y);
@@ -351,30 +353,15 @@ xps_expand_tiff_colormap(struct tiff *tiff)
 	tiff->samplesperpixel += 2;
 	tiff->bitspersample = 8;
 	tiff->stride = stride;
+	fz_free(tiff->ctx, tiff->samples);
 	tiff->samples = samples;
 	return fz_okay;
 }
 
 static int
-xps_decode_tiff_strips(struct tiff *tiff)
+xps_read_tiff_info(struct tiff *tiff)
 {
-	fz_stream *stm;
 	fz_context *ctx = tiff->ctx;
-	int error;
-
-	/* switch on compression to create a filter */
-	/* feed each strip to the filter */
-	/* read out the data and pack the samples into an xps_image */
-
-	/* type 32773 / packbits -- nothing special (same row-padding as PDF) */
-	/* type 2 / ccitt rle -- no EOL, no RTC, rows are byte-aligned */
-	/* type 3 and 4 / g3 and g4 -- each strip starts new section */
-	/* type 5 / lzw -- each strip is handled separately */
-
-	byte *wp;
-	unsigned row;
-	unsigned strip;
-	unsigned i;
 
 	if (!tiff->rowsperstrip || !tiff->stripoffsets || !tiff->rowsperstrip)
 		return fz_error_make(ctx, "no image data in tiff; maybe it is tiled");
@@ -382,6 +369,9 @@ xps_decode_tiff_strips(struct tiff *tiff)
 	if (tiff->planar != 1)
 		return fz_error_make(ctx, "image data is not in chunky format");
 
+	if (tiff->rowsperstrip > tiff->imagelength)
+		tiff->rowsperstrip = tiff->imagelength;
+
 	tiff->stride = (tiff->imagewidth * tiff->samplesperpixel * tiff->bitspersample + 7) / 8;
 
 	switch (tiff->photometric)
@@ -431,28 +421,62 @@ xps_decode_tiff_strips(struct tiff *tiff)
 		tiff->yresolution = 96;
 	}
 
-	tiff->samples = fz_calloc(tiff->ctx, tiff->imagelength, tiff->stride);
-	memset(tiff->samples, 0x55, tiff->imagelength * tiff->stride);
+	return fz_okay;
+}
+
+static int
+xps_decode_tiff_strips(struct tiff *tiff, unsigned y0, unsigned y1)
+{
+	fz_stream *stm;
+	fz_context *ctx = tiff->ctx;
+	int error;
+
+	/* switch on compression to create a filter */
+	/* feed each strip to the filter */
+	/* read out the data and pack the samples into an xps_image */
+
+	/* type 32773 / packbits -- nothing special (same row-padding as PDF) */
+	/* type 2 / ccitt rle -- no EOL, no RTC, rows are byte-aligned */
+	/* type 3 and 4 / g3 and g4 -- each strip starts new section */
+	/* type 5 / lzw -- each strip is handled separately */
+
+	byte *wp, *rp, *copy;
+	unsigned row;
+	unsigned strip;
+	unsigned i;
+
+	/* decode only the strips that hold rows y0 to y1 */
+	tiff->firstrow = y0 / tiff->rowsperstrip * tiff->rowsperstrip;
+	tiff->rows = MIN(tiff->imagelength, (y1 + tiff->rowsperstrip - 1) / tiff->rowsperstrip * tiff->rowsperstrip) - tiff->firstrow;
+
+	tiff->samples = fz_calloc(tiff->ctx, tiff->rows, tiff->stride);
+	memset(tiff->samples, 0x55, tiff->rows * tiff->stride);
 	wp = tiff->samples;
 
-	strip = 0;
-	for (row = 0; row < tiff->imagelength; row += tiff->rowsperstrip)
+	strip = tiff->firstrow / tiff->rowsperstrip;
+	for (row = tiff->firstrow; row < tiff->firstrow + tiff->rows; row += tiff->rowsperstrip)
 	{
 		unsigned offset = tiff->stripoffsets[strip];
 		unsigned rlen = tiff->stripbytecounts[strip];
 		unsigned wlen = tiff->stride * tiff->rowsperstrip;
-		byte *rp = tiff->bp + offset;
 
-		if (wp + wlen > tiff->samples + tiff->stride * tiff->imagelength)
-			wlen = tiff->samples + tiff->stride * tiff->imagelength - wp;
+		if (wp + wlen > tiff->samples + tiff->stride * tiff->rows)
+			wlen = tiff->samples + tiff->stride * tiff->rows - wp;
 
-		if (rp + rlen > tiff->ep)
+		if (offset > tiff->ep - tiff->bp || rlen > tiff->ep - tiff->bp - offset)
 			return fz_error_make(ctx, "strip extends beyond the end of the file");
 
-		/* the bits are in un-natural order */
+		/* the bits are in un-natural order; leave the file data untouched
+		 * as other threads may be decoding it too */
+		copy = NULL;
+		rp = tiff->bp + offset;
 		if (tiff->fillorder == 2)
+		{
+			copy = fz_malloc(ctx, rlen);
 			for (i = 0; i < rlen; i++)
-				rp[i] = bitrev[rp[i]];
+				copy[i] = bitrev[rp[i]];
+			rp = copy;
+		}
 
 		/* the strip decoders will close this */
 		stm = fz_open_memory(tiff->ctx, rp, rlen);
@@ -490,14 +514,12 @@ xps_decode_tiff_strips(struct tiff *tiff)
 			error = fz_error_make(ctx, "unknown TIFF compression: %d", tiff->compression);
 		}
 
+		if (copy)
+			fz_free(ctx, copy);
+
 		if (error)
 			return fz_error_note(ctx, error, "cannot decode strip %d", row / tiff->rowsperstrip);
 
-		/* scramble the bits back into original order */
-		if (tiff->fillorder == 2)
-			for (i = 0; i < rlen; i++)
-				rp[i] = bitrev[rp[i]];
-
 		wp += tiff->stride * tiff->rowsperstrip;
 		strip ++;
 	}
@@ -506,7 +528,7 @@ xps_decode_tiff_strips(struct tiff *tiff)
 	if ((tiff->compression == 5 || tiff->compression == 8) && tiff->predictor == 2)
 	{
 		byte *p = tiff->samples;
-		for (i = 0; i < tiff->imagelength; i++)
+		for (i = 0; i < tiff->rows; i++)
 		{
 			xps_unpredict_tiff(p, tiff->imagewidth, tiff->samplesperpixel, tiff->bitspersample);
 			p += tiff->stride;
@@ -525,7 +547,7 @@ xps_decode_tiff_strips(struct tiff *tiff)
 	if (tiff->photometric == 0)
 	{
 		byte *p = tiff->samples;
-		for (i = 0; i < tiff->imagelength; i++)
+		for (i = 0; i < tiff->rows; i++)
 		{
 			xps_invert_tiff(p, tiff->imagewidth, tiff->samplesperpixel, tiff->bitspersample, tiff->extrasamples);
 			p += tiff->stride;
@@ -738,8 +760,10 @@ xps_decode_tiff_header(struct tiff *tiff, byte *buf, int len)
 	unsigned count;
 	unsigned i;
 	int error;
+	fz_context *ctx = tiff->ctx;
 
 	memset(tiff, 0, sizeof(struct tiff));
+	tiff->ctx = ctx;
 
 	tiff->bp = buf;
 	tiff->rp = buf;
@@ -796,43 +820,115 @@ xps_decode_tiff_header(struct tiff *tiff, byte *buf, int len)
 	return fz_okay;
 }
 
+static void
+xps_free_tiff(struct tiff *tiff)
+{
+	fz_context *ctx = tiff->ctx;
+
+	if (tiff->colormap) fz_free(ctx, tiff->colormap);
+	if (tiff->stripoffsets) fz_free(ctx, tiff->stripoffsets);
+	if (tiff->stripbytecounts) fz_free(ctx, tiff->stripbytecounts);
+	if (tiff->samples) fz_free(ctx, tiff->samples);
+}
+
+int
+xps_decode_tiff_info(fz_context *ctx, byte *buf, int len, int *wp, int *hp, int *xresp, int *yresp, fz_colorspace **csp)
+{
+	int error;
+	struct tiff tiff;
+
+	tiff.ctx = ctx;
+	error = xps_decode_tiff_header(&tiff, buf, len);
+	if (!error)
+		error = xps_read_tiff_info(&tiff);
+	if (error)
+	{
+		xps_free_tiff(&tiff);
+		return fz_error_note(ctx, error, "cannot decode tiff header");
+	}
+
+	*wp = tiff.imagewidth;
+	*hp = tiff.imagelength;
+	*xresp = tiff.xresolution;
+	*yresp = tiff.yresolution;
+	/* alpha in CMYK images is premultiplied in RGB */
+	*csp = tiff.extrasamples && tiff.colorspace == fz_device_cmyk ? fz_device_rgb : tiff.colorspace;
+
+	xps_free_tiff(&tiff);
+	return fz_okay;
+}
+
 int
 xps_decode_tiff(fz_context *ctx, fz_pixmap **imagep, byte *buf, int len)
+{
+	return xps_decode_tiff_subarea(ctx, imagep, buf, len, NULL);
+}
+
+/*
+ * Decode the strips that cover the rows of subarea, which is updated to
+ * the part of the image that the returned pixmap holds.
+ */
+int
+xps_decode_tiff_subarea(fz_context *ctx, fz_pixmap **imagep, byte *buf, int len, fz_bbox *subarea)
 {
 	int error;
 	fz_pixmap *image;
 	struct tiff tiff;
+	unsigned y0, y1;
 
 	tiff.ctx = ctx;
 	error = xps_decode_tiff_header(&tiff, buf, len);
 	if (error)
+	{
+		xps_free_tiff(&tiff);
+		return fz_error_note(ctx, error, "cannot decode tiff header");
+	}
+
+	error = xps_read_tiff_info(&tiff);
+	if (error)
+	{
+		xps_free_tiff(&tiff);
 		return fz_error_note(ctx, error, "cannot decode tiff header");
+	}
 
 	/* Decode the image strips */
 
-	if (tiff.rowsperstrip > tiff.imagelength)
-		tiff.rowsperstrip = tiff.imagelength;
+	y0 = 0;
+	y1 = tiff.imagelength;
+	if (subarea)
+	{
+		y0 = CLAMP(subarea->y0, 0, (int)tiff.imagelength);
+		y1 = CLAMP(subarea->y1, (int)y0, (int)tiff.imagelength);
+	}
 
-	error = xps_decode_tiff_strips(&tiff);
+	error = xps_decode_tiff_strips(&tiff, y0, y1);
 	if (error)
+	{
+		xps_free_tiff(&tiff);
 		return fz_error_note(ctx, error, "cannot decode image data");
+	}
+
+	if (subarea)
+	{
+		subarea->x0 = 0;
+		subarea->y0 = tiff.firstrow;
+		subarea->x1 = tiff.imagewidth;
+		subarea->y1 = tiff.firstrow + tiff.rows;
+	}
 
 	/* Byte swap 16-bit images to big endian if necessary */
 	if (tiff.bitspersample == 16)
 	{
 		if (tiff.order == TII)
-			xps_swap_byte_order(tiff.samples, tiff.imagewidth * tiff.imagelength * tiff.samplesperpixel);
+			xps_swap_byte_order(tiff.samples, tiff.imagewidth * tiff.rows * tiff.samplesperpixel);
 	}
 
 	/* Expand into fz_pixmap struct */
 
-	image = fz_new_pixmap_with_limit(tiff.ctx, tiff.colorspace, tiff.imagewidth, tiff.imagelength);
+	image = fz_new_pixmap_with_limit(tiff.ctx, tiff.colorspace, tiff.imagewidth, tiff.rows);
 	if (!image)
 	{
-		if (tiff.colormap) fz_free(ctx, tiff.colormap);
-		if (tiff.stripoffsets) fz_free(ctx, tiff.stripoffsets);
-		if (tiff.stripbytecounts) fz_free(ctx, tiff.stripbytecounts);
-		if (tiff.samples) fz_free(ctx, tiff.samples);
+		xps_free_tiff(&tiff);
 		return fz_error_make(ctx, "out of memory");
 	}
 
@@ -859,10 +955,7 @@ xps_decode_tiff(fz_context *ctx, fz_pixmap **imagep, byte *buf, int len)
 
 	/* Clean up scratch memory */
 
-	if (tiff.colormap) fz_free(ctx, tiff.colormap);
-	if (tiff.stripoffsets) fz_free(ctx, tiff.stripoffsets);
-	if (tiff.stripbytecounts) fz_free(ctx, tiff.stripbytecounts);
-	if (tiff.samples) fz_free(ctx, tiff.samples);
+	xps_free_tiff(&tiff);
 
 	*imagep = image;
 	return fz_okay;